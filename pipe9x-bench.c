@@ -0,0 +1,476 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Benchmarks for comparing pipe9x buffer options.
+ *
+ * Usage: pipe9x-bench [total MiB per run]
+ *
+ * The transfer and polling benchmarks are run with each backend available,
+ * so the overlapped and threaded paths can be compared on the same machine.
+ *
+ * The polling benchmark is meant for comparing builds of pipe9x.c with and
+ * without PIPE9X_NO_CACHE_ALIGN defined.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe9x.h"
+
+#define DEFAULT_TOTAL_MIB 256
+
+#define STAGE_WORKING_SET (512 * 1024)  /* Producer data expected to stay in cache. */
+#define STAGE_ITERATIONS  20
+
+#define POLL_ITERATIONS 200
+
+static double now_seconds(void)
+{
+	static LARGE_INTEGER frequency;
+	if(frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	
+	return (double)(counter.QuadPart) / (double)(frequency.QuadPart);
+}
+
+static const struct { PipeBackend backend; const char *name; } backends[] = {
+	{ PIPE9X_BACKEND_OVERLAPPED, "overlapped" },
+	{ PIPE9X_BACKEND_THREADED,   "threaded" },
+};
+
+/* Check if a backend can be used on this system. */
+static BOOL backend_available(PipeBackend backend)
+{
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.backend = backend;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	if(pipe9x_create_ex(&prh, 1, FALSE, &pwh, 1, FALSE, &options) != ERROR_SUCCESS)
+	{
+		return FALSE;
+	}
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return TRUE;
+}
+
+/* Push total_bytes through a pipe with buf_size buffers created using the
+ * given flags and backend. Returns the throughput in MiB/s, or a negative
+ * value on error.
+*/
+static double bench_transfer(size_t buf_size, DWORD flags, PipeBackend backend, size_t total_bytes)
+{
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.flags = flags;
+	options.backend = backend;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	DWORD error = pipe9x_create_ex(&prh, buf_size, FALSE, &pwh, buf_size, FALSE, &options);
+	if(error != ERROR_SUCCESS)
+	{
+		fprintf(stderr, "pipe9x_create_ex: error %u\n", (unsigned)(error));
+		return -1.0;
+	}
+	
+	unsigned char *src = malloc(buf_size);
+	if(src == NULL)
+	{
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		return -1.0;
+	}
+	
+	for(size_t i = 0; i < buf_size; ++i)
+	{
+		src[i] = (unsigned char)(i);
+	}
+	
+	size_t sent = 0, received = 0;
+	
+	double start = now_seconds();
+	
+	while(error == ERROR_SUCCESS && received < total_bytes)
+	{
+		if(!pipe9x_write_pending(pwh) && sent < total_bytes)
+		{
+			size_t chunk = (total_bytes - sent) < buf_size ? (total_bytes - sent) : buf_size;
+			
+			error = pipe9x_write_initiate(pwh, src, chunk);
+			if(error == ERROR_IO_PENDING)
+			{
+				error = ERROR_SUCCESS;
+			}
+		}
+		
+		if(error == ERROR_SUCCESS && !pipe9x_read_pending(prh))
+		{
+			error = pipe9x_read_initiate(prh);
+			if(error == ERROR_IO_PENDING)
+			{
+				error = ERROR_SUCCESS;
+			}
+		}
+		
+		void *data;
+		size_t data_size;
+		
+		if(error == ERROR_SUCCESS)
+		{
+			error = pipe9x_read_result(prh, &data, &data_size, TRUE);
+			if(error == ERROR_SUCCESS)
+			{
+				received += data_size;
+			}
+		}
+		
+		if(error == ERROR_SUCCESS && pipe9x_write_pending(pwh))
+		{
+			size_t data_written;
+			
+			DWORD w_error = pipe9x_write_result(pwh, &data_written, FALSE);
+			if(w_error == ERROR_SUCCESS)
+			{
+				sent += data_written;
+			}
+			else if(w_error != ERROR_IO_INCOMPLETE)
+			{
+				error = w_error;
+			}
+		}
+	}
+	
+	double elapsed = now_seconds() - start;
+	
+	if(error != ERROR_SUCCESS)
+	{
+		fprintf(stderr, "transfer: error %u\n", (unsigned)(error));
+	}
+	
+	free(src);
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	if(error != ERROR_SUCCESS)
+	{
+		return -1.0;
+	}
+	
+	return ((double)(total_bytes) / (1024.0 * 1024.0)) / elapsed;
+}
+
+/* Drain a write of data_size bytes through the pipe. */
+static DWORD drain(PipeReadHandle prh, PipeWriteHandle pwh, size_t data_size)
+{
+	size_t received = 0;
+	
+	while(received < data_size)
+	{
+		DWORD error = pipe9x_read_initiate(prh);
+		if(error != ERROR_IO_PENDING)
+		{
+			return error;
+		}
+		
+		void *data;
+		size_t read_size;
+		
+		error = pipe9x_read_result(prh, &data, &read_size, TRUE);
+		if(error != ERROR_SUCCESS)
+		{
+			return error;
+		}
+		
+		received += read_size;
+	}
+	
+	size_t data_written;
+	return pipe9x_write_result(pwh, &data_written, TRUE);
+}
+
+/* Measure staging a payload_size write with the given non-temporal copy
+ * threshold: the throughput of the copy in pipe9x_write_initiate() and how
+ * long the producer then takes to read back a working set which was in the
+ * cache beforehand (more cache misses = slower).
+*/
+static BOOL bench_stage(size_t payload_size, size_t nt_threshold, double *copy_mib_per_sec_out, double *reread_us_out)
+{
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	if(pipe9x_create(&prh, payload_size, FALSE, &pwh, payload_size, FALSE) != ERROR_SUCCESS)
+	{
+		return FALSE;
+	}
+	
+	unsigned char *payload = malloc(payload_size);
+	unsigned char *working_set = malloc(STAGE_WORKING_SET);
+	
+	if(payload == NULL || working_set == NULL)
+	{
+		free(working_set);
+		free(payload);
+		
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		return FALSE;
+	}
+	
+	memset(payload, 0xAA, payload_size);
+	memset(working_set, 0x55, STAGE_WORKING_SET);
+	
+	size_t old_threshold = pipe9x_set_nt_copy_threshold(nt_threshold);
+	
+	double copy_time = 0.0, reread_time = 0.0;
+	unsigned int checksum = 0;
+	BOOL ok = TRUE;
+	
+	for(int i = 0; ok && i < STAGE_ITERATIONS; ++i)
+	{
+		/* Bring the working set into the cache. */
+		for(size_t j = 0; j < STAGE_WORKING_SET; j += 64)
+		{
+			checksum += working_set[j];
+		}
+		
+		double t0 = now_seconds();
+		
+		ok = (pipe9x_write_initiate(pwh, payload, payload_size) == ERROR_IO_PENDING);
+		
+		double t1 = now_seconds();
+		
+		for(size_t j = 0; j < STAGE_WORKING_SET; j += 64)
+		{
+			checksum += working_set[j];
+		}
+		
+		double t2 = now_seconds();
+		
+		copy_time += t1 - t0;
+		reread_time += t2 - t1;
+		
+		ok = ok && drain(prh, pwh, payload_size) == ERROR_SUCCESS;
+	}
+	
+	pipe9x_set_nt_copy_threshold(old_threshold);
+	
+	free(working_set);
+	free(payload);
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	/* Stop the compiler from optimising out the working set reads. */
+	if(checksum == 1)
+	{
+		printf(" ");
+	}
+	
+	*copy_mib_per_sec_out = ((double)(payload_size) * STAGE_ITERATIONS / (1024.0 * 1024.0)) / copy_time;
+	*reread_us_out = (reread_time / STAGE_ITERATIONS) * 1000000.0;
+	
+	return ok;
+}
+
+static DWORD WINAPI poll_writer_thread(LPVOID lpParameter)
+{
+	PipeWriteHandle pwh = (PipeWriteHandle)(lpParameter);
+	
+	for(int i = 0; i < POLL_ITERATIONS; ++i)
+	{
+		Sleep(1);
+		
+		size_t data_written;
+		if(pipe9x_write_initiate(pwh, "x", 1) != ERROR_IO_PENDING
+			|| pipe9x_write_result(pwh, &data_written, TRUE) != ERROR_SUCCESS)
+		{
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/* Measure the cost of polling a pending read with pipe9x_read_result() while
+ * another thread completes it. Returns the average nanoseconds per poll, or a
+ * negative value on error.
+*/
+static double bench_poll(PipeBackend backend)
+{
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.backend = backend;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	if(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options) != ERROR_SUCCESS)
+	{
+		return -1.0;
+	}
+	
+	DWORD thread_id;
+	HANDLE thread = CreateThread(NULL, 0, &poll_writer_thread, pwh, 0, &thread_id);
+	if(thread == NULL)
+	{
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		return -1.0;
+	}
+	
+	unsigned long long polls = 0;
+	double poll_time = 0.0;
+	
+	DWORD error = ERROR_SUCCESS;
+	
+	for(int i = 0; error == ERROR_SUCCESS && i < POLL_ITERATIONS; ++i)
+	{
+		error = pipe9x_read_initiate(prh);
+		if(error != ERROR_IO_PENDING)
+		{
+			break;
+		}
+		
+		void *data;
+		size_t data_size;
+		
+		double start = now_seconds();
+		
+		do {
+			error = pipe9x_read_result(prh, &data, &data_size, FALSE);
+			++polls;
+		} while(error == ERROR_IO_INCOMPLETE);
+		
+		poll_time += now_seconds() - start;
+	}
+	
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	if(error != ERROR_SUCCESS)
+	{
+		return -1.0;
+	}
+	
+	return (poll_time / (double)(polls)) * 1000000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t total_mib = DEFAULT_TOTAL_MIB;
+	if(argc > 1)
+	{
+		total_mib = strtoul(argv[1], NULL, 10);
+	}
+	
+	static const size_t buf_sizes[] = { 64 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+	
+	static const struct { DWORD flags; const char *name; } buf_types[] = {
+		{ 0,                   "allocator" },
+		{ PIPE9X_PAGE_BUFFERS, "VirtualAlloc" },
+		{ PIPE9X_LARGE_PAGES,  "large pages" },
+	};
+	
+	printf("Transfer throughput (%u MiB per run)\n\n", (unsigned)(total_mib));
+	printf("%-10s %-14s %-12s %10s\n", "Buf (KiB)", "Allocation", "Backend", "MiB/s");
+	
+	for(size_t i = 0; i < (sizeof(buf_sizes) / sizeof(*buf_sizes)); ++i)
+	{
+		for(size_t j = 0; j < (sizeof(buf_types) / sizeof(*buf_types)); ++j)
+		{
+			for(size_t k = 0; k < (sizeof(backends) / sizeof(*backends)); ++k)
+			{
+				if(!backend_available(backends[k].backend))
+				{
+					continue;
+				}
+				
+				/* Start from fresh handles rather than ones kept from the last run. */
+				pipe9x_flush_free_lists();
+				
+				double mib_per_sec = bench_transfer(buf_sizes[i], buf_types[j].flags, backends[k].backend, total_mib * 1024 * 1024);
+				
+				printf("%-10u %-14s %-12s %10.1f\n", (unsigned)(buf_sizes[i] / 1024), buf_types[j].name, backends[k].name, mib_per_sec);
+			}
+		}
+	}
+	
+	static const size_t payload_sizes[] = { 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024 };
+	
+	printf("\nWrite staging copy (%u KiB producer working set)\n\n", (unsigned)(STAGE_WORKING_SET / 1024));
+	printf("%-10s %-14s %10s %14s\n", "Data (KiB)", "Copy", "MiB/s", "Re-read (us)");
+	
+	for(size_t i = 0; i < (sizeof(payload_sizes) / sizeof(*payload_sizes)); ++i)
+	{
+		double copy_mib_per_sec, reread_us;
+		
+		if(bench_stage(payload_sizes[i], (size_t)(-1), &copy_mib_per_sec, &reread_us))
+		{
+			printf("%-10u %-14s %10.1f %14.1f\n", (unsigned)(payload_sizes[i] / 1024), "memcpy", copy_mib_per_sec, reread_us);
+		}
+		
+		if(bench_stage(payload_sizes[i], 0, &copy_mib_per_sec, &reread_us))
+		{
+			printf("%-10u %-14s %10.1f %14.1f\n", (unsigned)(payload_sizes[i] / 1024), "non-temporal", copy_mib_per_sec, reread_us);
+		}
+	}
+	
+	printf("\nPolling a pending read\n\n");
+	
+	for(size_t k = 0; k < (sizeof(backends) / sizeof(*backends)); ++k)
+	{
+		if(backend_available(backends[k].backend))
+		{
+			printf("%-12s %.1f ns per pipe9x_read_result() call\n", backends[k].name, bench_poll(backends[k].backend));
+		}
+	}
+	
+	return 0;
+}
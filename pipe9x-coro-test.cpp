@@ -0,0 +1,244 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Tests for pipe9x-coro.hpp, built with pipe9x.c as a C++20 program. */
+
+#include <coroutine>
+#include <exception>
+#include <stdio.h>
+#include <string.h>
+
+#include "pipe9x.h"
+#include "pipe9x-coro.hpp"
+
+#define ASSERT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		return ++num_failures; \
+	}
+
+#define EXPECT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		++num_failures; \
+	}
+
+/* Minimal coroutine type which runs until its first suspension when called
+ * and stays suspended at the end, so the caller can tell when it has finished
+ * and destroy it.
+*/
+struct test_task
+{
+	struct promise_type
+	{
+		test_task get_return_object()
+		{
+			return test_task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+	
+	std::coroutine_handle<promise_type> coroutine;
+	
+	explicit test_task(std::coroutine_handle<promise_type> coroutine): coroutine(coroutine) {}
+	
+	test_task(const test_task&) = delete;
+	test_task &operator=(const test_task&) = delete;
+	
+	~test_task()
+	{
+		coroutine.destroy();
+	}
+	
+	/* Run completion callbacks until the coroutine finishes, or give up after
+	 * timeout_ms without one.
+	*/
+	bool run(DWORD timeout_ms)
+	{
+		while(!coroutine.done())
+		{
+			if(SleepEx(timeout_ms, TRUE) != WAIT_IO_COMPLETION)
+			{
+				return false;
+			}
+		}
+		
+		return true;
+	}
+};
+
+struct round_trip_state
+{
+	pipe9x::coro::write_result wrote;
+	pipe9x::coro::read_result read;
+	char data[16];
+};
+
+static test_task round_trip(PipeReadHandle prh, PipeWriteHandle pwh, round_trip_state *state)
+{
+	state->wrote = co_await pipe9x::coro::write(pwh, "coroutine", 9);
+	
+	state->read = co_await pipe9x::coro::read(prh);
+	
+	if(state->read.error == ERROR_SUCCESS && state->read.data_size <= sizeof(state->data))
+	{
+		/* Only valid until the next read is initiated. */
+		memcpy(state->data, state->read.data, state->read.data_size);
+	}
+}
+
+static int test_round_trip(PipeBackend backend, const char *backend_name)
+{
+	int num_failures = 0;
+	
+	fprintf(stderr, "Testing round trip on %s backend\n", backend_name);
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.backend = backend;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	DWORD error = pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options);
+	
+	if(error == ERROR_CALL_NOT_IMPLEMENTED)
+	{
+		fprintf(stderr, "SKIP: %s backend not supported\n", backend_name);
+		return num_failures;
+	}
+	
+	ASSERT_TRUE(error == ERROR_SUCCESS, "pipe9x_create_ex() returns ERROR_SUCCESS");
+	
+	round_trip_state state = {};
+	
+	{
+		test_task task = round_trip(prh, pwh, &state);
+		
+		EXPECT_TRUE(!task.coroutine.done(),
+			"Coroutine is suspended while the write is pending");
+		
+		EXPECT_TRUE(task.run(5000),
+			"Coroutine is resumed by completion callbacks until it finishes");
+	}
+	
+	EXPECT_TRUE(state.wrote.error == ERROR_SUCCESS && state.wrote.data_written == 9,
+		"co_await pipe9x::coro::write() gives the result of the write");
+	
+	EXPECT_TRUE(state.read.error == ERROR_SUCCESS && state.read.data_size == 9 && memcmp(state.data, "coroutine", 9) == 0,
+		"co_await pipe9x::coro::read() gives the data written");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+struct error_state
+{
+	pipe9x::coro::write_result wrote;
+	pipe9x::coro::read_result read;
+};
+
+static test_task fail_to_start(PipeReadHandle prh, PipeWriteHandle pwh, error_state *state)
+{
+	static char too_big[8192];
+	state->wrote = co_await pipe9x::coro::write(pwh, too_big, sizeof(too_big));
+	
+	state->read = co_await pipe9x::coro::read(prh);
+}
+
+static int test_initiate_error(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 4096, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	/* A read already pending makes the awaited read fail to start too. */
+	
+	ASSERT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() returns ERROR_IO_PENDING");
+	
+	error_state state = {};
+	
+	{
+		test_task task = fail_to_start(prh, pwh, &state);
+		
+		/* Neither operation started, so the coroutine should have carried on
+		 * to the end without ever waiting for a callback.
+		*/
+		EXPECT_TRUE(task.coroutine.done(),
+			"Coroutine resumes straight away when operations fail to start");
+	}
+	
+	EXPECT_TRUE(state.wrote.error == ERROR_FILE_TOO_LARGE && state.wrote.data_written == 0,
+		"co_await pipe9x::coro::write() gives the error from starting the write");
+	
+	EXPECT_TRUE(state.read.error == ERROR_IO_INCOMPLETE && state.read.data == NULL && state.read.data_size == 0,
+		"co_await pipe9x::coro::read() gives the error from starting the read");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+int main()
+{
+	int num_failures = 0;
+	
+	num_failures += test_round_trip(PIPE9X_BACKEND_OVERLAPPED, "overlapped");
+	num_failures += test_round_trip(PIPE9X_BACKEND_THREADED, "threaded");
+	num_failures += test_initiate_error();
+	
+	if(num_failures == 0)
+	{
+		fprintf(stderr, "\nAll tests passed!\n");
+	}
+	
+	return num_failures;
+}
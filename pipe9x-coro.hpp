@@ -0,0 +1,250 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file pipe9x-coro.hpp
+ *
+ * C++20 coroutine support for pipe9x.
+ *
+ * The awaitables in this file start an operation using
+ * pipe9x_read_initiate_ex() or pipe9x_write_initiate_ex() when awaited and
+ * resume the awaiting coroutine from the completion callback, so the same
+ * rules apply: the operation completes on the thread which awaited it, from
+ * within an alertable wait (e.g. SleepEx() or WaitForSingleObjectEx() with
+ * bAlertable set to TRUE), and the handle must not be used by anything else
+ * while the operation is pending.
+ *
+ * The awaitable holds all the state for the operation, so when awaited
+ * directly (e.g. `co_await pipe9x::coro::read(prh)`) it lives in the
+ * coroutine frame and nothing is allocated per operation.
+ *
+ * If the handle is closed while an operation is pending, the coroutine is
+ * never resumed and must be destroyed by its owner.
+*/
+
+#ifndef PIPE9X_CORO_HPP
+#define PIPE9X_CORO_HPP
+
+#include <coroutine>
+#include <stddef.h>
+
+#include "pipe9x.h"
+
+namespace pipe9x
+{
+	namespace coro
+	{
+		/**
+		 * @brief Executor which resumes the coroutine straight away.
+		 *
+		 * This is the default, the coroutine runs on the completing thread
+		 * from within the completion callback until it next suspends.
+		 *
+		 * Any other executor type passed to read() or write() must provide an
+		 * equivalent post() method which arranges for the coroutine to be
+		 * resumed, e.g. by queueing it to a thread pool.
+		*/
+		struct inline_executor
+		{
+			void post(std::coroutine_handle<> coroutine) const noexcept
+			{
+				coroutine.resume();
+			}
+		};
+		
+		/**
+		 * @brief Result of an awaited read operation.
+		*/
+		struct read_result
+		{
+			DWORD error;       /**< ERROR_SUCCESS, or a win32 error code. */
+			void *data;        /**< Pointer to read data (NULL on error). */
+			size_t data_size;  /**< Number of bytes read (zero on error). */
+		};
+		
+		/**
+		 * @brief Result of an awaited write operation.
+		*/
+		struct write_result
+		{
+			DWORD error;          /**< ERROR_SUCCESS, or a win32 error code. */
+			size_t data_written;  /**< Number of bytes written (zero on error). */
+		};
+		
+		/**
+		 * @brief Awaitable read operation, see read().
+		*/
+		template<typename Executor = inline_executor> class read_awaitable
+		{
+			private:
+				PipeReadHandle prh;
+				Executor executor;
+				
+				std::coroutine_handle<> coroutine;
+				read_result result;
+				
+				static void callback(PipeReadHandle, DWORD error, void *data, size_t data_size, void *context)
+				{
+					read_awaitable *self = static_cast<read_awaitable*>(context);
+					
+					self->result.error = error;
+					self->result.data = data;
+					self->result.data_size = data_size;
+					
+					self->executor.post(self->coroutine);
+				}
+			
+			public:
+				read_awaitable(PipeReadHandle prh, Executor executor) noexcept:
+					prh(prh), executor(executor), result{ ERROR_SUCCESS, NULL, 0 } {}
+				
+				read_awaitable(const read_awaitable&) = delete;
+				read_awaitable &operator=(const read_awaitable&) = delete;
+				
+				bool await_ready() const noexcept
+				{
+					return false;
+				}
+				
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<> coroutine) noexcept
+				{
+					this->coroutine = coroutine;
+					
+					DWORD error = pipe9x_read_initiate_ex(prh, &callback, this);
+					if(error != ERROR_IO_PENDING)
+					{
+						/* The callback won't be invoked, so transfer straight
+						 * back to the awaiting coroutine with the error.
+						*/
+						
+						result.error = error;
+						return coroutine;
+					}
+					
+					return std::noop_coroutine();
+				}
+				
+				read_result await_resume() const noexcept
+				{
+					return result;
+				}
+		};
+		
+		/**
+		 * @brief Awaitable write operation, see write().
+		*/
+		template<typename Executor = inline_executor> class write_awaitable
+		{
+			private:
+				PipeWriteHandle pwh;
+				const void *data;
+				size_t data_size;
+				Executor executor;
+				
+				std::coroutine_handle<> coroutine;
+				write_result result;
+				
+				static void callback(PipeWriteHandle, DWORD error, size_t data_written, void *context)
+				{
+					write_awaitable *self = static_cast<write_awaitable*>(context);
+					
+					self->result.error = error;
+					self->result.data_written = data_written;
+					
+					self->executor.post(self->coroutine);
+				}
+			
+			public:
+				write_awaitable(PipeWriteHandle pwh, const void *data, size_t data_size, Executor executor) noexcept:
+					pwh(pwh), data(data), data_size(data_size), executor(executor), result{ ERROR_SUCCESS, 0 } {}
+				
+				write_awaitable(const write_awaitable&) = delete;
+				write_awaitable &operator=(const write_awaitable&) = delete;
+				
+				bool await_ready() const noexcept
+				{
+					return false;
+				}
+				
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<> coroutine) noexcept
+				{
+					this->coroutine = coroutine;
+					
+					DWORD error = pipe9x_write_initiate_ex(pwh, data, data_size, &callback, this);
+					if(error != ERROR_IO_PENDING)
+					{
+						result.error = error;
+						return coroutine;
+					}
+					
+					return std::noop_coroutine();
+				}
+				
+				write_result await_resume() const noexcept
+				{
+					return result;
+				}
+		};
+		
+		/**
+		 * @brief Read from a pipe.
+		 *
+		 * @param prh       PipeReadHandle to read from.
+		 * @param executor  Executor to resume the coroutine using.
+		 *
+		 * Returns an awaitable which reads from the pipe and gives a
+		 * read_result. The data remains valid until the PipeReadHandle object
+		 * is destroyed or another read is initiated.
+		*/
+		template<typename Executor = inline_executor> read_awaitable<Executor> read(PipeReadHandle prh, Executor executor = Executor()) noexcept
+		{
+			return read_awaitable<Executor>(prh, executor);
+		}
+		
+		/**
+		 * @brief Write to a pipe.
+		 *
+		 * @param pwh        PipeWriteHandle to write to.
+		 * @param data       Data to be written.
+		 * @param data_size  Length of data.
+		 * @param executor   Executor to resume the coroutine using.
+		 *
+		 * Returns an awaitable which writes to the pipe and gives a
+		 * write_result. The data is copied when the write is started, as with
+		 * pipe9x_write_initiate_ex().
+		*/
+		template<typename Executor = inline_executor> write_awaitable<Executor> write(PipeWriteHandle pwh, const void *data, size_t data_size, Executor executor = Executor()) noexcept
+		{
+			return write_awaitable<Executor>(pwh, data, data_size, executor);
+		}
+	}
+}
+
+#endif /* !PIPE9X_CORO_HPP */
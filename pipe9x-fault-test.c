@@ -0,0 +1,309 @@
+/* Pipe9x - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Throughput and integrity tests with faults injected into pipe9x's I/O.
+ *
+ * Usage: pipe9x-fault-test [seed]
+ *
+ * pipe9x.c and this file must both be built with PIPE9X_FAULT_INJECTION
+ * defined. Each scenario streams a known byte pattern through a pipe with
+ * each backend available and checks every byte arrives intact and in order,
+ * despite short reads and writes, ERROR_MORE_DATA and slow completions.
+ * When broken pipes are being injected, the transfer may stop early, but
+ * only with ERROR_BROKEN_PIPE and never with corrupted data.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe9x.h"
+
+#ifndef PIPE9X_FAULT_INJECTION
+#error pipe9x-fault-test must be built with PIPE9X_FAULT_INJECTION defined
+#endif
+
+#define ASSERT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		return ++num_failures; \
+	}
+
+#define EXPECT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		++num_failures; \
+	}
+
+#define TRANSFER_SIZE (8 * 1024 * 1024)
+#define CHUNK_SIZE    (16 * 1024)
+
+struct Scenario
+{
+	const char *name;
+	PipeFaultConfig faults;
+};
+
+static const struct Scenario scenarios[] = {
+	/*                   seed  short_read  short_write  more_data  broken_pipe  delay  max_delay_ms */
+	{ "none",         { 0,    0.0,        0.0,         0.0,       0.0,         0.0,   0 } },
+	{ "short writes", { 0,    0.0,        0.5,         0.0,       0.0,         0.0,   0 } },
+	{ "short reads",  { 0,    0.5,        0.0,         0.0,       0.0,         0.0,   0 } },
+	{ "more data",    { 0,    0.0,        0.0,         0.3,       0.0,         0.0,   0 } },
+	{ "delays",       { 0,    0.0,        0.0,         0.0,       0.0,         0.02,  5 } },
+	{ "broken pipe",  { 0,    0.0,        0.0,         0.0,       0.001,       0.0,   0 } },
+	{ "combined",     { 0,    0.2,        0.2,         0.1,       0.0005,      0.01,  5 } },
+};
+
+static const struct { PipeBackend backend; const char *name; } backends[] = {
+	{ PIPE9X_BACKEND_OVERLAPPED, "overlapped" },
+	{ PIPE9X_BACKEND_THREADED,   "threaded" },
+};
+
+static unsigned char pattern_byte(size_t offset)
+{
+	return (unsigned char)((offset * 131) + (offset >> 11));
+}
+
+/* Streams TRANSFER_SIZE bytes through a pipe, polling both ends from this
+ * thread, and checks what arrives against the pattern.
+*/
+static int run_scenario(const struct Scenario *scenario, PipeBackend backend, const char *backend_name, DWORD seed)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.backend = backend;
+	
+	DWORD error = pipe9x_create_ex(&prh, (64 * 1024), FALSE, &pwh, (64 * 1024), FALSE, &options);
+	
+	if(error == ERROR_CALL_NOT_IMPLEMENTED && backend == PIPE9X_BACKEND_OVERLAPPED)
+	{
+		fprintf(stderr, "SKIP: %s backend (not supported)\n", backend_name);
+		return num_failures;
+	}
+	
+	ASSERT_TRUE(error == ERROR_SUCCESS, "pipe9x_create_ex() returns ERROR_SUCCESS");
+	
+	static unsigned char send_buf[TRANSFER_SIZE];
+	for(size_t i = 0; i < TRANSFER_SIZE; ++i)
+	{
+		send_buf[i] = pattern_byte(i);
+	}
+	
+	PipeFaultConfig faults = scenario->faults;
+	faults.seed = seed;
+	pipe9x_set_faults(&faults);
+	
+	/* The reader can see the bytes of a write before its completion has been
+	 * collected, so they are checked against the end of the furthest write
+	 * initiated rather than what has been sent.
+	*/
+	size_t sent = 0, initiated = 0, received = 0;
+	DWORD write_error = ERROR_SUCCESS, read_error = ERROR_SUCCESS;
+	
+	BOOL writing = FALSE, reading = FALSE, intact = TRUE;
+	
+	DWORD start = GetTickCount();
+	
+	while(read_error == ERROR_SUCCESS)
+	{
+		BOOL progress = FALSE;
+		
+		if(pwh != NULL && !writing)
+		{
+			if(sent < TRANSFER_SIZE && write_error == ERROR_SUCCESS)
+			{
+				size_t size = TRANSFER_SIZE - sent;
+				if(size > CHUNK_SIZE)
+				{
+					size = CHUNK_SIZE;
+				}
+				
+				/* Partial writes are resumed from the first unwritten byte. */
+				
+				error = pipe9x_write_initiate(pwh, send_buf + sent, size);
+				if(error == ERROR_IO_PENDING)
+				{
+					writing = TRUE;
+					initiated = sent + size;
+				}
+				else{
+					write_error = error;
+				}
+			}
+			else{
+				/* Finished (or failed), closing gives the reader EOF. */
+				
+				pipe9x_write_close(pwh);
+				pwh = NULL;
+			}
+			
+			progress = TRUE;
+		}
+		
+		if(writing)
+		{
+			size_t written;
+			error = pipe9x_write_result(pwh, &written, FALSE);
+			
+			if(error != ERROR_IO_INCOMPLETE)
+			{
+				if(error == ERROR_SUCCESS)
+				{
+					sent += written;
+				}
+				else{
+					write_error = error;
+				}
+				
+				writing = FALSE;
+				progress = TRUE;
+			}
+		}
+		
+		if(!reading)
+		{
+			error = pipe9x_read_initiate(prh);
+			if(error == ERROR_IO_PENDING)
+			{
+				reading = TRUE;
+			}
+			else{
+				read_error = error;
+			}
+			
+			progress = TRUE;
+		}
+		
+		if(reading)
+		{
+			void *data;
+			size_t data_size;
+			
+			error = pipe9x_read_result(prh, &data, &data_size, FALSE);
+			
+			if(error != ERROR_IO_INCOMPLETE)
+			{
+				if(error == ERROR_SUCCESS)
+				{
+					for(size_t i = 0; i < data_size && intact; ++i)
+					{
+						intact = (received + i) < initiated
+							&& ((unsigned char*)(data))[i] == pattern_byte(received + i);
+					}
+					
+					received += data_size;
+				}
+				else{
+					read_error = error;
+				}
+				
+				reading = FALSE;
+				progress = TRUE;
+			}
+		}
+		
+		if(!progress)
+		{
+			Sleep(0);
+		}
+	}
+	
+	DWORD elapsed = GetTickCount() - start;
+	
+	pipe9x_set_faults(NULL);
+	
+	if(pwh != NULL)
+	{
+		pipe9x_write_close(pwh);
+	}
+	
+	pipe9x_read_close(prh);
+	
+	fprintf(stderr, "%s/%s: %lu/%u bytes in %lu ms (%.1f MiB/s)\n",
+		scenario->name, backend_name,
+		(unsigned long)(received), (unsigned)(TRANSFER_SIZE), (unsigned long)(elapsed),
+		(elapsed > 0 ? ((double)(received) / (1024.0 * 1024.0)) / ((double)(elapsed) / 1000.0) : 0.0));
+	
+	EXPECT_TRUE(intact, "Every byte read matches the byte written at that offset");
+	
+	/* EOF on an anonymous pipe reads as ERROR_BROKEN_PIPE. */
+	
+	EXPECT_TRUE(read_error == ERROR_BROKEN_PIPE,
+		"Reads end with ERROR_BROKEN_PIPE");
+	
+	if(scenario->faults.broken_pipe > 0.0)
+	{
+		EXPECT_TRUE((write_error == ERROR_SUCCESS || write_error == ERROR_BROKEN_PIPE || write_error == ERROR_NO_DATA),
+			"Writes fail with nothing but a broken pipe");
+	}
+	else{
+		EXPECT_TRUE(write_error == ERROR_SUCCESS && sent == TRANSFER_SIZE && received == TRANSFER_SIZE,
+			"All data is transferred");
+	}
+	
+	return num_failures;
+}
+
+int main(int argc, char **argv)
+{
+	int num_failures = 0;
+	
+	DWORD seed = (argc > 1) ? (DWORD)(strtoul(argv[1], NULL, 0)) : GetTickCount();
+	fprintf(stderr, "Seed: %lu\n", (unsigned long)(seed));
+	
+	for(size_t i = 0; i < (sizeof(scenarios) / sizeof(*scenarios)); ++i)
+	{
+		for(size_t j = 0; j < (sizeof(backends) / sizeof(*backends)); ++j)
+		{
+			num_failures += run_scenario(&scenarios[i], backends[j].backend, backends[j].name, seed);
+		}
+	}
+	
+	if(num_failures > 0)
+	{
+		fprintf(stderr, "%d failures (seed %lu)\n", num_failures, (unsigned long)(seed));
+	}
+	
+	return num_failures;
+}
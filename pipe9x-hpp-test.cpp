@@ -0,0 +1,308 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Tests for pipe9x.hpp, built with pipe9x.c as a C++20 program. */
+
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+
+#include "pipe9x.hpp"
+
+#define ASSERT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		return ++num_failures; \
+	}
+
+#define EXPECT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		++num_failures; \
+	}
+
+/* Write a string and read it back out of the other end. */
+static bool round_trip(pipe9x::write_pipe &wp, pipe9x::read_pipe &rp, const char *text)
+{
+	size_t len = strlen(text);
+	
+	if(wp.initiate(text, len))
+	{
+		return false;
+	}
+	
+	pipe9x::write_result wrote = wp.result(true);
+	if(wrote.error || wrote.data_written != len)
+	{
+		return false;
+	}
+	
+	if(rp.initiate())
+	{
+		return false;
+	}
+	
+	pipe9x::read_result read = rp.result(true);
+	
+	return !read.error && read.data.size() == len && memcmp(read.data.data(), text, len) == 0;
+}
+
+/* Check the write end of a pipe has been closed. The read may fail straight
+ * away or once it is pending.
+*/
+static bool reads_broken_pipe(pipe9x::read_pipe &rp)
+{
+	std::error_code error = rp.initiate();
+	
+	if(!error)
+	{
+		error = rp.result(true).error;
+	}
+	
+	return error == pipe9x::make_error_code(ERROR_BROKEN_PIPE);
+}
+
+static int test_round_trip(void)
+{
+	int num_failures = 0;
+	
+	pipe9x::read_pipe rp;
+	pipe9x::write_pipe wp;
+	
+	EXPECT_TRUE(!rp && !wp, "Default constructed wrappers are empty");
+	
+	ASSERT_TRUE(!pipe9x::create(rp, 4096, false, wp, 4096, false),
+		"pipe9x::create() succeeds");
+	
+	ASSERT_TRUE(rp && wp, "pipe9x::create() initialises both wrappers");
+	
+	EXPECT_TRUE(round_trip(wp, rp, "wrapper"), "Data written to write_pipe is read from read_pipe");
+	
+	/* Starting a write uses the same span as the data in read_result. */
+	
+	const std::byte bytes[] = { std::byte(1), std::byte(2), std::byte(3) };
+	
+	EXPECT_TRUE(!wp.initiate(std::span<const std::byte>(bytes)) && wp.result(true).data_written == 3,
+		"write_pipe::initiate() accepts a span");
+	
+	EXPECT_TRUE(!rp.initiate() && rp.pending(), "read_pipe::pending() is true while a read is pending");
+	
+	pipe9x::read_result read = rp.result(true);
+	
+	EXPECT_TRUE(!read.error && read.data.size() == 3 && memcmp(read.data.data(), bytes, 3) == 0 && !rp.pending(),
+		"read_pipe::result() gives a span over the data read");
+	
+	/* Failing to create a pipe leaves the wrappers alone. The simulated
+	 * backend isn't provided by pipe9x.c, so it always fails.
+	*/
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.backend = PIPE9X_BACKEND_SIMULATED;
+	
+	PipeReadHandle prh = rp.get();
+	PipeWriteHandle pwh = wp.get();
+	
+	EXPECT_TRUE(pipe9x::create(rp, 4096, false, wp, 4096, false, &options) == pipe9x::make_error_code(ERROR_CALL_NOT_IMPLEMENTED),
+		"pipe9x::create() returns the error from pipe9x_create_ex()");
+	
+	EXPECT_TRUE(rp.get() == prh && wp.get() == pwh, "pipe9x::create() doesn't touch the wrappers on error");
+	
+	return num_failures;
+}
+
+static int test_move(void)
+{
+	int num_failures = 0;
+	
+	pipe9x::read_pipe rp1, rp2;
+	pipe9x::write_pipe wp1, wp2;
+	
+	ASSERT_TRUE(!pipe9x::create(rp1, 4096, false, wp1, 4096, false) && !pipe9x::create(rp2, 4096, false, wp2, 4096, false),
+		"pipe9x::create() succeeds");
+	
+	/* Move construction takes the handle and leaves the source empty. */
+	
+	PipeWriteHandle pwh1 = wp1.get();
+	pipe9x::write_pipe moved(std::move(wp1));
+	
+	EXPECT_TRUE(moved.get() == pwh1 && !wp1, "write_pipe move constructor takes ownership");
+	
+	PipeReadHandle prh2 = rp2.get();
+	pipe9x::read_pipe moved_rp(std::move(rp2));
+	
+	EXPECT_TRUE(moved_rp.get() == prh2 && !rp2, "read_pipe move constructor takes ownership");
+	
+	/* Move assignment closes the handle it replaces, breaking the first pipe. */
+	
+	PipeWriteHandle pwh2 = wp2.get();
+	moved = std::move(wp2);
+	
+	EXPECT_TRUE(moved.get() == pwh2 && !wp2, "write_pipe move assignment takes ownership");
+	
+	EXPECT_TRUE(reads_broken_pipe(rp1), "write_pipe move assignment closes the replaced handle");
+	
+	EXPECT_TRUE(round_trip(moved, moved_rp, "moved"), "Moved wrappers still work");
+	
+	/* Self-assignment is a no-op. */
+	
+	pipe9x::write_pipe &self = moved;
+	moved = std::move(self);
+	
+	EXPECT_TRUE(moved.get() == pwh2, "write_pipe move assignment to itself keeps the handle");
+	
+	rp1 = std::move(moved_rp);
+	
+	EXPECT_TRUE(rp1.get() == prh2 && !moved_rp, "read_pipe move assignment takes ownership");
+	
+	EXPECT_TRUE(round_trip(moved, rp1, "again"), "Move assigned read_pipe still works");
+	
+	return num_failures;
+}
+
+static int test_close(void)
+{
+	int num_failures = 0;
+	
+	pipe9x::read_pipe rp;
+	
+	{
+		pipe9x::write_pipe wp;
+		
+		ASSERT_TRUE(!pipe9x::create(rp, 4096, false, wp, 4096, false),
+			"pipe9x::create() succeeds");
+	}
+	
+	EXPECT_TRUE(reads_broken_pipe(rp), "write_pipe closes its handle when destroyed");
+	
+	pipe9x::write_pipe wp;
+	
+	ASSERT_TRUE(!pipe9x::create(rp, 4096, false, wp, 4096, false),
+		"pipe9x::create() succeeds over existing handles");
+	
+	/* A released handle outlives the wrapper. */
+	
+	PipeWriteHandle pwh = wp.release();
+	
+	EXPECT_TRUE(pwh != NULL && !wp, "write_pipe::release() gives up the handle");
+	
+	{
+		pipe9x::write_pipe temp(pwh);
+		EXPECT_TRUE(round_trip(temp, rp, "released"), "Released handle is still open");
+		
+		temp.release();
+	}
+	
+	wp.reset(pwh);
+	wp.reset();
+	
+	EXPECT_TRUE(!wp && reads_broken_pipe(rp), "write_pipe::reset() closes the handle");
+	
+	return num_failures;
+}
+
+static int test_connect(void)
+{
+	int num_failures = 0;
+	
+	const char *PIPE_NAME = "\\\\.\\pipe\\pipe9x_hpp_test_connect";
+	
+	HANDLE server = CreateNamedPipe(
+		PIPE_NAME,
+		PIPE_ACCESS_DUPLEX,
+		(PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT),
+		1,
+		4096,
+		4096,
+		0,
+		NULL);
+	
+	if(server == INVALID_HANDLE_VALUE && GetLastError() == ERROR_CALL_NOT_IMPLEMENTED)
+	{
+		fprintf(stderr, "SKIP: pipe9x::connect() tests (named pipe servers not supported)\n");
+		return num_failures;
+	}
+	
+	ASSERT_TRUE(server != INVALID_HANDLE_VALUE, "CreateNamedPipe() creates a server pipe");
+	
+	pipe9x::read_pipe rp;
+	pipe9x::write_pipe wp;
+	
+	EXPECT_TRUE(!pipe9x::connect(PIPE_NAME, 1000, &rp, 4096, &wp, 4096, false),
+		"pipe9x::connect() succeeds when pipe is available");
+	
+	EXPECT_TRUE(rp && wp, "pipe9x::connect() initialises both wrappers");
+	
+	EXPECT_TRUE(!wp.initiate("ping", 4) && wp.result(true).data_written == 4,
+		"Data can be written to a connected write_pipe");
+	
+	char buf[4];
+	DWORD bytes_read;
+	
+	EXPECT_TRUE(ReadFile(server, buf, sizeof(buf), &bytes_read, NULL) && bytes_read == 4 && memcmp(buf, "ping", 4) == 0,
+		"Server receives data written to connected write_pipe");
+	
+	pipe9x::read_pipe rp2;
+	
+	EXPECT_TRUE(pipe9x::connect(PIPE_NAME, 0, &rp2, 4096, NULL, 0, false) == pipe9x::make_error_code(ERROR_PIPE_BUSY) && !rp2,
+		"pipe9x::connect() returns the error from pipe9x_connect()");
+	
+	rp.reset();
+	wp.reset();
+	
+	CloseHandle(server);
+	
+	return num_failures;
+}
+
+int main()
+{
+	int num_failures = 0;
+	
+	num_failures += test_round_trip();
+	num_failures += test_move();
+	num_failures += test_close();
+	num_failures += test_connect();
+	
+	if(num_failures == 0)
+	{
+		fprintf(stderr, "\nAll tests passed!\n");
+	}
+	
+	return num_failures;
+}
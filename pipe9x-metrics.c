@@ -0,0 +1,281 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Samples the metrics published by a process using pipe9x_metrics_open().
+ *
+ * Usage: pipe9x-metrics [-i milliseconds] [-n samples] <process ID>
+ *
+ * Prints the counters of every open handle in the process, and the rate of
+ * operations and bytes since the previous sample, every second (or -i
+ * milliseconds), until interrupted or -n samples have been taken.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe9x.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/* Stop loads being moved across this point. Loads aren't reordered with other
+ * loads on x86, so there it only needs to stop the compiler from doing it.
+*/
+static void read_barrier(void)
+{
+#if defined(__GNUC__)
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+#elif defined(_M_IX86) || defined(_M_X64)
+	_ReadWriteBarrier();
+#else
+	MemoryBarrier();
+#endif
+}
+
+/* Take a consistent copy of a slot, returning FALSE if it kept changing. The
+ * section is mapped read-only, so this can't use interlocked operations.
+*/
+static BOOL read_slot(const volatile PipeMetricsSlot *slot, PipeMetricsSlot *copy)
+{
+	for(int attempt = 0; attempt < 1000; ++attempt)
+	{
+		LONG before = slot->sequence;
+		read_barrier();
+		
+		if(before & 1)
+		{
+			/* Being updated, which only takes a few instructions. */
+			continue;
+		}
+		
+		copy->handle_id = slot->handle_id;
+		copy->type = slot->type;
+		copy->backend = slot->backend;
+		copy->buf_size = slot->buf_size;
+		copy->pending = slot->pending;
+		copy->queue_depth = slot->queue_depth;
+		copy->last_error = slot->last_error;
+		copy->ops = slot->ops;
+		copy->bytes = slot->bytes;
+		copy->errors = slot->errors;
+		copy->stall_ms = slot->stall_ms;
+		
+		read_barrier();
+		
+		if(slot->sequence == before)
+		{
+			copy->sequence = before;
+			return TRUE;
+		}
+	}
+	
+	return FALSE;
+}
+
+static const char *backend_name(DWORD backend)
+{
+	switch(backend)
+	{
+		case PIPE9X_BACKEND_OVERLAPPED: return "overlapped";
+		case PIPE9X_BACKEND_THREADED:   return "threaded";
+		default:                        return "-";
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: pipe9x-metrics [-i milliseconds] [-n samples] <process ID>\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	DWORD interval = 1000;
+	DWORD num_samples = 0;
+	const char *pid = NULL;
+	
+	for(int i = 1; i < argc; ++i)
+	{
+		const char *arg = argv[i];
+		
+		if(arg[0] != '-')
+		{
+			if(pid != NULL)
+			{
+				usage();
+			}
+			
+			pid = arg;
+			continue;
+		}
+		
+		if((i + 1) >= argc)
+		{
+			usage();
+		}
+		
+		const char *value = argv[++i];
+		
+		if(strcmp(arg, "-i") == 0)
+		{
+			interval = strtoul(value, NULL, 10);
+		}
+		else if(strcmp(arg, "-n") == 0)
+		{
+			num_samples = strtoul(value, NULL, 10);
+		}
+		else{
+			usage();
+		}
+	}
+	
+	if(pid == NULL || interval == 0)
+	{
+		usage();
+	}
+	
+	char name[64];
+	snprintf(name, sizeof(name), "%s%lu", PIPE9X_METRICS_PREFIX, strtoul(pid, NULL, 10));
+	
+	HANDLE mapping = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+	if(mapping == NULL)
+	{
+		fprintf(stderr, "Unable to open %s (error %u), is the process publishing metrics?\n",
+			name, (unsigned)(GetLastError()));
+		return EXIT_FAILURE;
+	}
+	
+	/* Zero maps the whole section, whatever size the process made it. */
+	
+	const volatile PipeMetricsHeader *header = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(header == NULL)
+	{
+		fprintf(stderr, "Unable to map %s (error %u)\n", name, (unsigned)(GetLastError()));
+		return EXIT_FAILURE;
+	}
+	
+	DWORD magic = header->magic;
+	read_barrier();
+	
+	if(magic != PIPE9X_METRICS_MAGIC || header->version != PIPE9X_METRICS_VERSION
+		|| header->slot_size < sizeof(PipeMetricsSlot))
+	{
+		fprintf(stderr, "%s doesn't contain pipe9x metrics this program understands\n", name);
+		return EXIT_FAILURE;
+	}
+	
+	DWORD num_slots = header->num_slots;
+	const volatile char *slots = (const volatile char*)(header) + header->header_size;
+	DWORD slot_size = header->slot_size;
+	
+	/* Previous sample of each slot, for the rates. */
+	
+	PipeMetricsSlot *prev = calloc(num_slots, sizeof(PipeMetricsSlot));
+	if(prev == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+	
+	DWORD prev_time = GetTickCount();
+	
+	for(DWORD sample = 0; num_samples == 0 || sample < num_samples; ++sample)
+	{
+		if(sample > 0)
+		{
+			Sleep(interval);
+		}
+		
+		DWORD now = GetTickCount();
+		double seconds = (now - prev_time) / 1000.0;
+		prev_time = now;
+		
+		printf("%8s %-5s %-10s %8s %7s %10s %12s %14s %8s %10s %10s %12s\n",
+			"handle", "type", "backend", "buffer", "pending", "queued",
+			"ops", "bytes", "errors", "stall ms", "ops/s", "MiB/s");
+		
+		DWORD live = 0;
+		
+		for(DWORD i = 0; i < num_slots; ++i)
+		{
+			PipeMetricsSlot slot;
+			
+			if(!read_slot((const volatile PipeMetricsSlot*)(slots + (i * slot_size)), &slot))
+			{
+				continue;
+			}
+			
+			if(slot.handle_id == 0)
+			{
+				prev[i].handle_id = 0;
+				continue;
+			}
+			
+			/* Rates are only meaningful if the slot held the same handle last time. */
+			
+			double ops_rate = 0.0, byte_rate = 0.0;
+			
+			if(prev[i].handle_id == slot.handle_id && sample > 0 && seconds > 0.0)
+			{
+				ops_rate = (double)(slot.ops - prev[i].ops) / seconds;
+				byte_rate = (double)(slot.bytes - prev[i].bytes) / seconds;
+			}
+			
+			printf("%8u %-5s %-10s %8u %7s %10u %12llu %14llu %8llu %10llu %10.1f %12.2f\n",
+				(unsigned)(slot.handle_id),
+				(slot.type == PIPE9X_METRICS_READ ? "read" : "write"),
+				backend_name(slot.backend),
+				(unsigned)(slot.buf_size),
+				(slot.pending ? "yes" : "no"),
+				(unsigned)(slot.queue_depth),
+				(unsigned long long)(slot.ops),
+				(unsigned long long)(slot.bytes),
+				(unsigned long long)(slot.errors),
+				(unsigned long long)(slot.stall_ms),
+				ops_rate,
+				byte_rate / (1024.0 * 1024.0));
+			
+			prev[i] = slot;
+			++live;
+		}
+		
+		printf("%u of %u slots in use\n\n", (unsigned)(live), (unsigned)(num_slots));
+		fflush(stdout);
+	}
+	
+	free(prev);
+	
+	UnmapViewOfFile((const void*)(header));
+	CloseHandle(mapping);
+	
+	return EXIT_SUCCESS;
+}
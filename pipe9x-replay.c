@@ -0,0 +1,767 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Replays a trace recorded with pipe9x_trace_open() through new pipes.
+ *
+ * Usage: pipe9x-replay [-b auto|overlapped|threaded] [-x speed] <trace file>
+ *
+ * Each handle in the trace is replayed on a pipe of its own with the same
+ * buffer size, reproducing the recorded sizes and timing of its operations:
+ *
+ * - For a write handle, writes are initiated at the recorded times and with
+ *   the recorded sizes (and data, if recorded), and the other end of the
+ *   pipe is drained as fast as possible.
+ *
+ * - For a read handle, reads are initiated at the recorded times, and the
+ *   data they returned is written into the other end of the pipe at the time
+ *   it was read.
+ *
+ * An operation due while the previous one on the same handle is still
+ * pending waits for it. -x scales the recorded timing (2 replays twice as
+ * fast), 0 replays every operation as soon as the previous one completes.
+ *
+ * Throughput and latency percentiles are reported for the replay, alongside
+ * the latencies in the trace for comparison.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe9x.h"
+
+struct ReplayRecord
+{
+	unsigned type;
+	DWORD id;
+	double time;    /* Seconds since the start of the trace. */
+	DWORD error;
+	size_t size;
+	const unsigned char *payload;  /* NULL unless recorded. */
+};
+
+struct ReplayHandle
+{
+	unsigned kind;      /* PIPE9X_TRACE_ATTACH_READ or PIPE9X_TRACE_ATTACH_WRITE, 0 if unused. */
+	size_t buf_size;
+	
+	size_t *recs;       /* Indices of this handle's records. */
+	size_t num_recs;
+	
+	size_t next_op;     /* Next record to look at for initiating operations. */
+	size_t next_feed;   /* Next record to look at for feeding reads. */
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	BOOL op_pending;    /* Replayed operation pending. */
+	double op_started;
+	BOOL peer_pending;  /* Feeding write or draining read pending on the other end. */
+	
+	BOOL done;
+};
+
+struct Latencies
+{
+	double *samples;
+	size_t count;
+	size_t capacity;
+};
+
+static struct ReplayRecord *records;
+static size_t num_records;
+
+static struct ReplayHandle *handles;
+static size_t num_handles;  /* Highest handle ID + 1. */
+
+static struct Latencies replay_read, replay_write, trace_read, trace_write;
+
+static unsigned char *pattern;
+static size_t pattern_size;
+
+static double now_seconds(void)
+{
+	static LARGE_INTEGER frequency;
+	if(frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	
+	return (double)(counter.QuadPart) / (double)(frequency.QuadPart);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: pipe9x-replay [-b auto|overlapped|threaded] [-x speed] <trace file>\n");
+	exit(2);
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size > 0 ? size : 1);
+	if(p == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	return p;
+}
+
+static void add_latency(struct Latencies *l, double seconds)
+{
+	if(l->count == l->capacity)
+	{
+		l->capacity = (l->capacity > 0) ? (l->capacity * 2) : 1024;
+		
+		double *samples = realloc(l->samples, l->capacity * sizeof(double));
+		if(samples == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		
+		l->samples = samples;
+	}
+	
+	l->samples[(l->count)++] = seconds;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double*)(a), y = *(const double*)(b);
+	return (x > y) - (x < y);
+}
+
+static void print_latencies(const char *name, struct Latencies *l)
+{
+	if(l->count == 0)
+	{
+		return;
+	}
+	
+	qsort(l->samples, l->count, sizeof(double), &compare_double);
+	
+	double total = 0.0;
+	for(size_t i = 0; i < l->count; ++i)
+	{
+		total += l->samples[i];
+	}
+	
+	printf("%-14s %10lu %10.1f %10.1f %10.1f %10.1f\n",
+		name, (unsigned long)(l->count),
+		(total / l->count) * 1000000.0,
+		l->samples[l->count / 2] * 1000000.0,
+		l->samples[(l->count * 99) / 100] * 1000000.0,
+		l->samples[l->count - 1] * 1000000.0);
+}
+
+/* Read an unsigned LEB128 integer, returning FALSE if it runs off the end. */
+static BOOL read_leb128(const unsigned char **p, const unsigned char *end, unsigned long long *value_out)
+{
+	unsigned long long value = 0;
+	int shift = 0;
+	
+	while(*p < end && shift < 64)
+	{
+		unsigned char byte = *((*p)++);
+		value |= (unsigned long long)(byte & 0x7F) << shift;
+		
+		if(!(byte & 0x80))
+		{
+			*value_out = value;
+			return TRUE;
+		}
+		
+		shift += 7;
+	}
+	
+	return FALSE;
+}
+
+static unsigned long long get_le(const unsigned char *p, int bytes)
+{
+	unsigned long long value = 0;
+	
+	for(int i = 0; i < bytes; ++i)
+	{
+		value |= (unsigned long long)(p[i]) << (i * 8);
+	}
+	
+	return value;
+}
+
+/* Parse a whole trace file, which is kept in memory for the payloads. */
+static void load_trace(const char *path)
+{
+	FILE *fh = fopen(path, "rb");
+	if(fh == NULL)
+	{
+		fprintf(stderr, "Unable to open %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	
+	size_t size = 0, capacity = 1024 * 1024;
+	unsigned char *data = xmalloc(capacity);
+	
+	size_t got;
+	while((got = fread(data + size, 1, capacity - size, fh)) > 0)
+	{
+		size += got;
+		
+		if(size == capacity)
+		{
+			capacity *= 2;
+			
+			unsigned char *new_data = realloc(data, capacity);
+			if(new_data == NULL)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+			
+			data = new_data;
+		}
+	}
+	
+	fclose(fh);
+	
+	if(size < 24 || memcmp(data, "P9XTRACE", 8) != 0 || get_le(data + 8, 4) != 1)
+	{
+		fprintf(stderr, "%s is not a pipe9x trace\n", path);
+		exit(EXIT_FAILURE);
+	}
+	
+	DWORD flags = (DWORD)(get_le(data + 12, 4));
+	double frequency = (double)(get_le(data + 16, 8));
+	
+	/* Every record is at least 5 bytes. */
+	
+	records = xmalloc((size / 5) * sizeof(struct ReplayRecord));
+	num_records = 0;
+	
+	const unsigned char *p = data + 24, *end = data + size;
+	unsigned long long ticks = 0;
+	
+	while(p < end)
+	{
+		struct ReplayRecord *r = &(records[num_records]);
+		unsigned long long id, elapsed, error, rec_size;
+		
+		r->type = *(p++);
+		
+		if(!read_leb128(&p, end, &id)
+			|| !read_leb128(&p, end, &elapsed)
+			|| !read_leb128(&p, end, &error)
+			|| !read_leb128(&p, end, &rec_size))
+		{
+			fprintf(stderr, "Warning: %s is truncated\n", path);
+			break;
+		}
+		
+		ticks += elapsed;
+		
+		r->id = (DWORD)(id);
+		r->time = (double)(ticks) / frequency;
+		r->error = (DWORD)(error);
+		r->size = (size_t)(rec_size);
+		r->payload = NULL;
+		
+		if((flags & PIPE9X_TRACE_PAYLOAD) && r->error == ERROR_SUCCESS
+			&& (r->type == PIPE9X_TRACE_WRITE_INITIATE || r->type == PIPE9X_TRACE_READ_COMPLETE))
+		{
+			if((size_t)(end - p) < r->size)
+			{
+				fprintf(stderr, "Warning: %s is truncated\n", path);
+				break;
+			}
+			
+			r->payload = p;
+			p += r->size;
+		}
+		
+		if(r->id >= num_handles)
+		{
+			num_handles = r->id + 1;
+		}
+		
+		++num_records;
+	}
+	
+	/* Group the records by handle. */
+	
+	handles = xmalloc(num_handles * sizeof(struct ReplayHandle));
+	memset(handles, 0, num_handles * sizeof(struct ReplayHandle));
+	
+	for(size_t i = 0; i < num_records; ++i)
+	{
+		++(handles[records[i].id].num_recs);
+	}
+	
+	for(size_t i = 0; i < num_handles; ++i)
+	{
+		handles[i].recs = xmalloc(handles[i].num_recs * sizeof(size_t));
+		handles[i].num_recs = 0;
+	}
+	
+	for(size_t i = 0; i < num_records; ++i)
+	{
+		struct ReplayRecord *r = &(records[i]);
+		struct ReplayHandle *h = &(handles[r->id]);
+		
+		h->recs[(h->num_recs)++] = i;
+		
+		if(r->type == PIPE9X_TRACE_ATTACH_READ || r->type == PIPE9X_TRACE_ATTACH_WRITE)
+		{
+			h->kind = r->type;
+			h->buf_size = r->size;
+		}
+		
+		if(r->size > pattern_size)
+		{
+			pattern_size = r->size;
+		}
+	}
+	
+	/* Latencies as recorded, from each initiate to the following completion. */
+	
+	for(size_t i = 0; i < num_handles; ++i)
+	{
+		struct ReplayHandle *h = &(handles[i]);
+		double initiated = -1.0;
+		
+		for(size_t j = 0; j < h->num_recs; ++j)
+		{
+			struct ReplayRecord *r = &(records[h->recs[j]]);
+			
+			if(r->type == PIPE9X_TRACE_READ_INITIATE || r->type == PIPE9X_TRACE_WRITE_INITIATE)
+			{
+				initiated = r->time;
+			}
+			else if(initiated >= 0.0 && r->error == ERROR_SUCCESS
+				&& (r->type == PIPE9X_TRACE_READ_COMPLETE || r->type == PIPE9X_TRACE_WRITE_COMPLETE))
+			{
+				add_latency((r->type == PIPE9X_TRACE_READ_COMPLETE ? &trace_read : &trace_write), (r->time - initiated));
+				initiated = -1.0;
+			}
+		}
+	}
+	
+	pattern = xmalloc(pattern_size);
+	for(size_t i = 0; i < pattern_size; ++i)
+	{
+		pattern[i] = (unsigned char)(i);
+	}
+}
+
+static BOOL is_eof(DWORD error)
+{
+	return error == ERROR_BROKEN_PIPE || error == ERROR_HANDLE_EOF;
+}
+
+/* Find the next successful record of the given type, returning NULL if there are none left. */
+static struct ReplayRecord *next_record(struct ReplayHandle *h, size_t *pos, unsigned type)
+{
+	for(; *pos < h->num_recs; ++(*pos))
+	{
+		struct ReplayRecord *r = &(records[h->recs[*pos]]);
+		
+		if(r->type == type && r->error == ERROR_SUCCESS)
+		{
+			return r;
+		}
+	}
+	
+	return NULL;
+}
+
+/* Replay the next operations of a handle recorded as writing, returning TRUE if anything happened. */
+static BOOL step_write_handle(struct ReplayHandle *h, double elapsed, double speed, unsigned long long *bytes)
+{
+	BOOL progress = FALSE;
+	
+	if(h->pwh != NULL && h->op_pending)
+	{
+		size_t written;
+		DWORD error = pipe9x_write_result(h->pwh, &written, FALSE);
+		
+		if(error != ERROR_IO_INCOMPLETE)
+		{
+			if(error == ERROR_SUCCESS)
+			{
+				add_latency(&replay_write, (now_seconds() - h->op_started));
+				*bytes += written;
+			}
+			else{
+				fprintf(stderr, "Write failed with error %u\n", (unsigned)(error));
+			}
+			
+			h->op_pending = FALSE;
+			progress = TRUE;
+		}
+	}
+	
+	if(h->pwh != NULL && !h->op_pending)
+	{
+		struct ReplayRecord *r = next_record(h, &(h->next_op), PIPE9X_TRACE_WRITE_INITIATE);
+		
+		if(r == NULL)
+		{
+			/* Out of writes, closing gives the drain EOF. */
+			pipe9x_write_close(h->pwh);
+			h->pwh = NULL;
+			
+			progress = TRUE;
+		}
+		else if(speed == 0.0 || (r->time - records[0].time) / speed <= elapsed)
+		{
+			size_t size = (r->size < h->buf_size) ? r->size : h->buf_size;
+			
+			h->op_started = now_seconds();
+			DWORD error = pipe9x_write_initiate(h->pwh, (r->payload != NULL ? r->payload : pattern), size);
+			
+			if(error == ERROR_IO_PENDING)
+			{
+				h->op_pending = TRUE;
+			}
+			else{
+				fprintf(stderr, "Write initiate failed with error %u\n", (unsigned)(error));
+			}
+			
+			++(h->next_op);
+			progress = TRUE;
+		}
+	}
+	
+	if(h->prh != NULL)
+	{
+		if(!h->peer_pending)
+		{
+			pipe9x_read_initiate(h->prh);
+			h->peer_pending = TRUE;
+		}
+		
+		void *data;
+		size_t data_size;
+		DWORD error = pipe9x_read_result(h->prh, &data, &data_size, FALSE);
+		
+		if(error != ERROR_IO_INCOMPLETE)
+		{
+			h->peer_pending = FALSE;
+			
+			if(error != ERROR_SUCCESS)
+			{
+				if(!is_eof(error))
+				{
+					fprintf(stderr, "Drain read failed with error %u\n", (unsigned)(error));
+				}
+				
+				pipe9x_read_close(h->prh);
+				h->prh = NULL;
+			}
+			
+			progress = TRUE;
+		}
+	}
+	
+	return progress;
+}
+
+/* Replay the next operations of a handle recorded as reading, returning TRUE if anything happened. */
+static BOOL step_read_handle(struct ReplayHandle *h, double elapsed, double speed, unsigned long long *bytes)
+{
+	BOOL progress = FALSE;
+	
+	if(h->prh != NULL && h->op_pending)
+	{
+		void *data;
+		size_t data_size;
+		DWORD error = pipe9x_read_result(h->prh, &data, &data_size, FALSE);
+		
+		if(error != ERROR_IO_INCOMPLETE)
+		{
+			h->op_pending = FALSE;
+			
+			if(error == ERROR_SUCCESS)
+			{
+				add_latency(&replay_read, (now_seconds() - h->op_started));
+				*bytes += data_size;
+			}
+			else{
+				if(!is_eof(error))
+				{
+					fprintf(stderr, "Read failed with error %u\n", (unsigned)(error));
+				}
+				
+				pipe9x_read_close(h->prh);
+				h->prh = NULL;
+			}
+			
+			progress = TRUE;
+		}
+	}
+	
+	if(h->prh != NULL && !h->op_pending)
+	{
+		struct ReplayRecord *r = next_record(h, &(h->next_op), PIPE9X_TRACE_READ_INITIATE);
+		
+		if(r == NULL)
+		{
+			pipe9x_read_close(h->prh);
+			h->prh = NULL;
+			
+			progress = TRUE;
+		}
+		else if(speed == 0.0 || (r->time - records[0].time) / speed <= elapsed)
+		{
+			h->op_started = now_seconds();
+			DWORD error = pipe9x_read_initiate(h->prh);
+			
+			if(error == ERROR_IO_PENDING)
+			{
+				h->op_pending = TRUE;
+			}
+			else{
+				fprintf(stderr, "Read initiate failed with error %u\n", (unsigned)(error));
+			}
+			
+			++(h->next_op);
+			progress = TRUE;
+		}
+	}
+	
+	/* Feed the data each read returned at the time it returned it. */
+	
+	if(h->pwh != NULL && h->peer_pending)
+	{
+		size_t written;
+		DWORD error = pipe9x_write_result(h->pwh, &written, FALSE);
+		
+		if(error != ERROR_IO_INCOMPLETE)
+		{
+			h->peer_pending = FALSE;
+			progress = TRUE;
+			
+			if(error != ERROR_SUCCESS)
+			{
+				/* The reader is gone. */
+				pipe9x_write_close(h->pwh);
+				h->pwh = NULL;
+			}
+		}
+	}
+	
+	if(h->pwh != NULL && !h->peer_pending)
+	{
+		struct ReplayRecord *r = next_record(h, &(h->next_feed), PIPE9X_TRACE_READ_COMPLETE);
+		
+		if(r == NULL)
+		{
+			pipe9x_write_close(h->pwh);
+			h->pwh = NULL;
+			
+			progress = TRUE;
+		}
+		else if(speed == 0.0 || (r->time - records[0].time) / speed <= elapsed)
+		{
+			if(r->size > 0)
+			{
+				DWORD error = pipe9x_write_initiate(h->pwh, (r->payload != NULL ? r->payload : pattern), r->size);
+				h->peer_pending = (error == ERROR_IO_PENDING);
+			}
+			
+			++(h->next_feed);
+			progress = TRUE;
+		}
+	}
+	
+	return progress;
+}
+
+int main(int argc, char **argv)
+{
+	double speed = 1.0;
+	const char *path = NULL;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	
+	for(int i = 1; i < argc; ++i)
+	{
+		const char *arg = argv[i];
+		
+		if(arg[0] != '-')
+		{
+			if(path != NULL)
+			{
+				usage();
+			}
+			
+			path = arg;
+			continue;
+		}
+		
+		if((i + 1) >= argc)
+		{
+			usage();
+		}
+		
+		const char *value = argv[++i];
+		
+		if(strcmp(arg, "-x") == 0)
+		{
+			speed = strtod(value, NULL);
+		}
+		else if(strcmp(arg, "-b") == 0)
+		{
+			if(strcmp(value, "auto") == 0)
+			{
+				options.backend = PIPE9X_BACKEND_AUTO;
+			}
+			else if(strcmp(value, "overlapped") == 0)
+			{
+				options.backend = PIPE9X_BACKEND_OVERLAPPED;
+			}
+			else if(strcmp(value, "threaded") == 0)
+			{
+				options.backend = PIPE9X_BACKEND_THREADED;
+			}
+			else{
+				usage();
+			}
+		}
+		else{
+			usage();
+		}
+	}
+	
+	if(path == NULL || speed < 0.0)
+	{
+		usage();
+	}
+	
+	load_trace(path);
+	
+	if(num_records == 0)
+	{
+		fprintf(stderr, "%s contains no records\n", path);
+		return EXIT_FAILURE;
+	}
+	
+	/* Create all the pipes up front so creation isn't part of the timing. */
+	
+	size_t active = 0;
+	
+	for(size_t i = 0; i < num_handles; ++i)
+	{
+		struct ReplayHandle *h = &(handles[i]);
+		
+		if(h->kind == 0 || h->buf_size == 0)
+		{
+			continue;
+		}
+		
+		/* The peer end of a read handle must fit any read the trace recorded. */
+		size_t peer_size = (h->kind == PIPE9X_TRACE_ATTACH_READ && pattern_size > h->buf_size)
+			? pattern_size
+			: h->buf_size;
+		
+		DWORD error = (h->kind == PIPE9X_TRACE_ATTACH_READ)
+			? pipe9x_create_ex(&(h->prh), h->buf_size, FALSE, &(h->pwh), peer_size, FALSE, &options)
+			: pipe9x_create_ex(&(h->prh), peer_size, FALSE, &(h->pwh), h->buf_size, FALSE, &options);
+		
+		if(error != ERROR_SUCCESS)
+		{
+			fprintf(stderr, "Unable to create pipe (error %u)\n", (unsigned)(error));
+			return EXIT_FAILURE;
+		}
+		
+		++active;
+	}
+	
+	printf("Replaying %lu records on %lu pipes\n", (unsigned long)(num_records), (unsigned long)(active));
+	
+	unsigned long long bytes = 0;
+	double start = now_seconds();
+	
+	while(active > 0)
+	{
+		double elapsed = now_seconds() - start;
+		BOOL progress = FALSE;
+		
+		for(size_t i = 0; i < num_handles; ++i)
+		{
+			struct ReplayHandle *h = &(handles[i]);
+			
+			if(h->kind == 0 || h->done)
+			{
+				continue;
+			}
+			
+			if(h->kind == PIPE9X_TRACE_ATTACH_READ)
+			{
+				progress |= step_read_handle(h, elapsed, speed, &bytes);
+			}
+			else{
+				progress |= step_write_handle(h, elapsed, speed, &bytes);
+			}
+			
+			if(h->prh == NULL && h->pwh == NULL)
+			{
+				h->done = TRUE;
+				--active;
+			}
+		}
+		
+		if(!progress)
+		{
+			/* Nothing completed or came due, don't spin a whole core waiting. */
+			Sleep(0);
+		}
+	}
+	
+	double elapsed = now_seconds() - start;
+	
+	printf("Elapsed:    %.3f seconds (%.3f recorded)\n", elapsed, (records[num_records - 1].time - records[0].time));
+	printf("Bytes:      %llu\n", bytes);
+	printf("Throughput: %.2f MiB/s\n", (elapsed > 0.0 ? ((double)(bytes) / (1024.0 * 1024.0)) / elapsed : 0.0));
+	printf("\n");
+	
+	printf("%-14s %10s %10s %10s %10s %10s\n", "Latency (us)", "count", "mean", "p50", "p99", "max");
+	print_latencies("read", &replay_read);
+	print_latencies("read (trace)", &trace_read);
+	print_latencies("write", &replay_write);
+	print_latencies("write (trace)", &trace_write);
+	
+	return EXIT_SUCCESS;
+}
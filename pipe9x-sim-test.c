@@ -0,0 +1,379 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Tests for the simulated backend, which run on any system.
+ *
+ *   cc -o pipe9x-sim-test pipe9x-sim.c pipe9x-sim-test.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe9x-sim.h"
+
+#define ASSERT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		return ++num_failures; \
+	}
+
+#define EXPECT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		++num_failures; \
+	}
+
+static int test_basic(void)
+{
+	int num_failures = 0;
+	
+	PipeSimConfig config;
+	memset(&config, 0, sizeof(config));
+	config.op_latency = 1000;
+	config.byte_latency = 1.0;
+	
+	pipe9x_sim_reset(&config);
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.backend = PIPE9X_BACKEND_OVERLAPPED;
+	
+	EXPECT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options) == ERROR_CALL_NOT_IMPLEMENTED,
+		"pipe9x_create_ex() returns ERROR_CALL_NOT_IMPLEMENTED for a real backend");
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 4096, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	EXPECT_TRUE(pipe9x_read_backend(prh) == PIPE9X_BACKEND_SIMULATED && pipe9x_write_backend(pwh) == PIPE9X_BACKEND_SIMULATED,
+		"pipe9x_read_backend() and pipe9x_write_backend() return PIPE9X_BACKEND_SIMULATED");
+	
+	void *data;
+	size_t data_size;
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "hello", 5) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() returns ERROR_IO_PENDING");
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() returns ERROR_IO_PENDING");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, FALSE) == ERROR_IO_INCOMPLETE,
+		"pipe9x_read_result() returns ERROR_IO_INCOMPLETE before the operation latency has passed");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+		&& data_size == 5 && memcmp(data, "hello", 5) == 0,
+		"pipe9x_read_result() returns the written data");
+	
+	EXPECT_TRUE(pipe9x_sim_now() == 1005,
+		"Waiting advances the clock by the operation latency and the copy time");
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, FALSE) == ERROR_SUCCESS && data_size == 5,
+		"pipe9x_write_result() returns the size of the write");
+	
+	/* Time passing while the caller does something else. */
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+		&& pipe9x_write_initiate(pwh, "world", 5) == ERROR_IO_PENDING,
+		"Operations can be initiated again");
+	
+	pipe9x_sim_advance(2000);
+	
+	EXPECT_TRUE(pipe9x_sim_now() == 3005,
+		"pipe9x_sim_advance() advances the clock");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, FALSE) == ERROR_SUCCESS
+		&& data_size == 5 && memcmp(data, "world", 5) == 0,
+		"Operations complete while pipe9x_sim_advance() runs");
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, FALSE) == ERROR_SUCCESS && data_size == 5,
+		"pipe9x_write_result() returns the size of the write");
+	
+	/* Nothing to read and nothing else going on. */
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+		&& pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_POSSIBLE_DEADLOCK,
+		"pipe9x_read_result() returns ERROR_POSSIBLE_DEADLOCK when the read can never complete");
+	
+	pipe9x_write_close(pwh);
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_BROKEN_PIPE,
+		"pipe9x_read_result() returns ERROR_BROKEN_PIPE once the write end is closed");
+	
+	pipe9x_read_close(prh);
+	
+	/* Writing with the read end closed. */
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 4096, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	pipe9x_read_close(prh);
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "hello", 5) == ERROR_IO_PENDING
+		&& pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_NO_DATA,
+		"pipe9x_write_result() returns ERROR_NO_DATA when the read end is closed");
+	
+	pipe9x_write_close(pwh);
+	
+	return num_failures;
+}
+
+static int test_capacity(void)
+{
+	int num_failures = 0;
+	
+	PipeSimConfig config;
+	memset(&config, 0, sizeof(config));
+	config.capacity = 64;
+	config.op_latency = 100;
+	config.byte_latency = 1.0;
+	
+	pipe9x_sim_reset(&config);
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 32, FALSE, &pwh, 256, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	unsigned char out[256];
+	for(size_t i = 0; i < sizeof(out); ++i)
+	{
+		out[i] = (unsigned char)(i * 7);
+	}
+	
+	/* A write bigger than the pipe only completes once the reader has made
+	 * room for all of it.
+	*/
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, out, sizeof(out)) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() returns ERROR_IO_PENDING");
+	
+	size_t data_size;
+	
+	pipe9x_sim_advance(1000);
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, FALSE) == ERROR_IO_INCOMPLETE,
+		"A write bigger than the pipe doesn't complete without a reader");
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_POSSIBLE_DEADLOCK,
+		"Waiting for a write bigger than the pipe without a reader returns ERROR_POSSIBLE_DEADLOCK");
+	
+	unsigned char in[256];
+	size_t received = 0;
+	
+	int ok = 1;
+	
+	while(ok && received < sizeof(in))
+	{
+		void *data;
+		
+		ok = pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+			&& pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+			&& data_size > 0 && data_size <= 32 && (received + data_size) <= sizeof(in);
+		
+		if(ok)
+		{
+			memcpy(in + received, data, data_size);
+			received += data_size;
+		}
+	}
+	
+	EXPECT_TRUE(ok && memcmp(in, out, sizeof(out)) == 0,
+		"Data is read in order, no more than the read buffer size at a time");
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS && data_size == sizeof(out),
+		"A write bigger than the pipe completes once it has all been buffered");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+#define WORKLOAD_PIPES 16
+#define WORKLOAD_BYTES (64 * 1024)
+#define WORKLOAD_CHUNK 4096
+
+/* Pump data through many pipes from a single polling loop, returning the
+ * simulated time taken, or 0 if anything went wrong.
+*/
+static PipeSimTime run_workload(DWORD seed)
+{
+	PipeSimConfig config;
+	memset(&config, 0, sizeof(config));
+	config.capacity = 8192;
+	config.op_latency = 2000;
+	config.op_jitter = 500;
+	config.byte_latency = 0.5;
+	config.seed = seed;
+	
+	pipe9x_sim_reset(&config);
+	
+	PipeReadHandle prh[WORKLOAD_PIPES];
+	PipeWriteHandle pwh[WORKLOAD_PIPES];
+	PipeCreateSpec specs[WORKLOAD_PIPES];
+	
+	for(int i = 0; i < WORKLOAD_PIPES; ++i)
+	{
+		specs[i].read_size = WORKLOAD_CHUNK;
+		specs[i].read_inherit = FALSE;
+		specs[i].write_size = WORKLOAD_CHUNK;
+		specs[i].write_inherit = FALSE;
+	}
+	
+	if(pipe9x_create_many(prh, pwh, specs, WORKLOAD_PIPES, NULL) != ERROR_SUCCESS)
+	{
+		return 0;
+	}
+	
+	static unsigned char out[WORKLOAD_CHUNK];
+	for(size_t i = 0; i < sizeof(out); ++i)
+	{
+		out[i] = (unsigned char)(i);
+	}
+	
+	size_t sent[WORKLOAD_PIPES] = { 0 }, received[WORKLOAD_PIPES] = { 0 };
+	int done = 0, ok = 1;
+	
+	while(ok && done < WORKLOAD_PIPES)
+	{
+		BOOL progress = FALSE;
+		
+		for(int i = 0; i < WORKLOAD_PIPES && ok; ++i)
+		{
+			size_t data_size;
+			void *data;
+			
+			if(!pipe9x_write_pending(pwh[i]) && sent[i] < WORKLOAD_BYTES)
+			{
+				ok = pipe9x_write_initiate(pwh[i], out, WORKLOAD_CHUNK) == ERROR_IO_PENDING;
+				progress = TRUE;
+			}
+			else if(pipe9x_write_pending(pwh[i]) && pipe9x_write_result(pwh[i], &data_size, FALSE) == ERROR_SUCCESS)
+			{
+				sent[i] += data_size;
+				progress = TRUE;
+			}
+			
+			if(received[i] < WORKLOAD_BYTES)
+			{
+				if(!pipe9x_read_pending(prh[i]))
+				{
+					ok = ok && pipe9x_read_initiate(prh[i]) == ERROR_IO_PENDING;
+					progress = TRUE;
+				}
+				else if(pipe9x_read_result(prh[i], &data, &data_size, FALSE) == ERROR_SUCCESS)
+				{
+					/* Every chunk is the same, so each byte's value is its
+					 * offset within the chunk.
+					*/
+					for(size_t j = 0; j < data_size && ok; ++j)
+					{
+						ok = ((unsigned char*)(data))[j] == (unsigned char)((received[i] + j) % WORKLOAD_CHUNK);
+					}
+					
+					received[i] += data_size;
+					
+					if(received[i] == WORKLOAD_BYTES)
+					{
+						++done;
+					}
+					
+					progress = TRUE;
+				}
+			}
+		}
+		
+		if(!progress && !pipe9x_sim_step())
+		{
+			ok = 0;
+		}
+	}
+	
+	PipeSimTime elapsed = pipe9x_sim_now();
+	
+	for(int i = 0; i < WORKLOAD_PIPES; ++i)
+	{
+		pipe9x_write_close(pwh[i]);
+		pipe9x_read_close(prh[i]);
+	}
+	
+	return ok ? elapsed : 0;
+}
+
+static int test_workload(void)
+{
+	int num_failures = 0;
+	
+	PipeSimTime a = run_workload(1234);
+	PipeSimTime b = run_workload(1234);
+	
+	ASSERT_TRUE(a != 0, "Data is transferred intact through many pipes");
+	
+	fprintf(stderr, "%d pipes x %d bytes in %.3f simulated ms (%.1f MiB/s)\n",
+		WORKLOAD_PIPES, WORKLOAD_BYTES, (double)(a) / 1000000.0,
+		((double)(WORKLOAD_PIPES) * WORKLOAD_BYTES / (1024.0 * 1024.0)) / ((double)(a) / 1000000000.0));
+	
+	EXPECT_TRUE(a == b, "The same workload and seed take the same simulated time");
+	
+	/* Each writer copies all of its data at 0.5ns per byte. */
+	
+	EXPECT_TRUE(a >= (PipeSimTime)(WORKLOAD_BYTES / 2),
+		"The workload takes at least as long as copying the data");
+	
+	return num_failures;
+}
+
+int main()
+{
+	int num_failures = 0;
+	
+	num_failures += test_basic();
+	num_failures += test_capacity();
+	num_failures += test_workload();
+	
+	if(num_failures == 0)
+	{
+		fprintf(stderr, "\nAll tests passed!\n");
+	}
+	
+	return num_failures;
+}
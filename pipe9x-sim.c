@@ -0,0 +1,670 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Simulated pipes with a virtual clock, see pipe9x-sim.h.
+ *
+ * Build in place of pipe9x.c, on any system:
+ *
+ *   cc -o pipe9x-sim-test pipe9x-sim.c pipe9x-sim-test.c
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe9x-sim.h"
+
+struct PipeSimPipe
+{
+	struct PipeSimPipe *prev;
+	struct PipeSimPipe *next;
+	
+	unsigned char *buf;  /* Ring buffer of capacity bytes. */
+	size_t capacity;
+	size_t head;         /* Offset of the oldest byte in buf. */
+	size_t used;
+	
+	PipeReadHandle prh;   /* NULL once closed. */
+	PipeWriteHandle pwh;  /* NULL once closed. */
+};
+
+/* State of the operation pending on a handle. */
+struct PipeSimOp
+{
+	BOOL pending;
+	PipeSimTime active_at;  /* Time the operation can start moving data. */
+	PipeSimTime busy_until; /* Time the data moved so far is copied by. */
+	
+	BOOL done;              /* Result is decided, reported from busy_until. */
+	DWORD result;
+	size_t bytes;           /* Bytes moved so far. */
+};
+
+struct _PipeReadHandle
+{
+	struct PipeSimPipe *pipe;
+	struct PipeSimOp op;
+	
+	unsigned char *rw_buf;
+	size_t rw_buf_size;
+};
+
+struct _PipeWriteHandle
+{
+	struct PipeSimPipe *pipe;
+	struct PipeSimOp op;
+	
+	unsigned char *rw_buf;
+	size_t rw_buf_size;
+	size_t size;            /* Size of the pending write. */
+};
+
+static PipeSimConfig _pipe9x_sim_config;
+static PipeSimTime _pipe9x_sim_now = 0;
+static DWORD _pipe9x_sim_random = 1;
+
+static struct PipeSimPipe *_pipe9x_sim_pipes = NULL;
+
+void pipe9x_sim_reset(const PipeSimConfig *config)
+{
+	assert(_pipe9x_sim_pipes == NULL);
+	
+	if(config != NULL)
+	{
+		_pipe9x_sim_config = *config;
+	}
+	else{
+		memset(&_pipe9x_sim_config, 0, sizeof(_pipe9x_sim_config));
+	}
+	
+	_pipe9x_sim_now = 0;
+	_pipe9x_sim_random = (_pipe9x_sim_config.seed != 0) ? _pipe9x_sim_config.seed : 1;
+}
+
+PipeSimTime pipe9x_sim_now(void)
+{
+	return _pipe9x_sim_now;
+}
+
+static PipeSimTime _pipe9x_sim_copy_time(size_t bytes)
+{
+	return (PipeSimTime)(((double)(bytes) * _pipe9x_sim_config.byte_latency) + 0.5);
+}
+
+static void _pipe9x_sim_op_start(struct PipeSimOp *op)
+{
+	PipeSimTime jitter = 0;
+	
+	if(_pipe9x_sim_config.op_jitter > 0)
+	{
+		/* xorshift32, so the sequence is the same everywhere. */
+		
+		_pipe9x_sim_random ^= _pipe9x_sim_random << 13;
+		_pipe9x_sim_random ^= _pipe9x_sim_random >> 17;
+		_pipe9x_sim_random ^= _pipe9x_sim_random << 5;
+		
+		jitter = _pipe9x_sim_random % (_pipe9x_sim_config.op_jitter + 1);
+	}
+	
+	op->pending = TRUE;
+	op->active_at = _pipe9x_sim_now + _pipe9x_sim_config.op_latency + jitter;
+	op->busy_until = op->active_at;
+	op->done = FALSE;
+	op->result = ERROR_SUCCESS;
+	op->bytes = 0;
+}
+
+static BOOL _pipe9x_sim_op_active(const struct PipeSimOp *op)
+{
+	return op->pending && !op->done && op->active_at <= _pipe9x_sim_now;
+}
+
+static BOOL _pipe9x_sim_op_complete(const struct PipeSimOp *op)
+{
+	return op->done && op->busy_until <= _pipe9x_sim_now;
+}
+
+/* Record data being copied by an operation, which is busy until it's done. */
+static void _pipe9x_sim_op_copy(struct PipeSimOp *op, size_t bytes)
+{
+	if(op->busy_until < _pipe9x_sim_now)
+	{
+		op->busy_until = _pipe9x_sim_now;
+	}
+	
+	op->busy_until += _pipe9x_sim_copy_time(bytes);
+	op->bytes += bytes;
+}
+
+static void _pipe9x_sim_op_finish(struct PipeSimOp *op, DWORD result)
+{
+	if(op->busy_until < _pipe9x_sim_now)
+	{
+		op->busy_until = _pipe9x_sim_now;
+	}
+	
+	op->done = TRUE;
+	op->result = result;
+}
+
+/* Move as much data through a pipe as its active operations can at the
+ * current time.
+*/
+static void _pipe9x_sim_pump(struct PipeSimPipe *pipe)
+{
+	BOOL progress = TRUE;
+	
+	while(progress)
+	{
+		progress = FALSE;
+		
+		PipeWriteHandle pwh = pipe->pwh;
+		
+		if(pwh != NULL && _pipe9x_sim_op_active(&(pwh->op)))
+		{
+			if(pipe->prh == NULL)
+			{
+				_pipe9x_sim_op_finish(&(pwh->op), ERROR_NO_DATA);
+				progress = TRUE;
+			}
+			else if(pipe->used < pipe->capacity || pwh->op.bytes == pwh->size)
+			{
+				size_t size = pwh->size - pwh->op.bytes;
+				if(size > (pipe->capacity - pipe->used))
+				{
+					size = pipe->capacity - pipe->used;
+				}
+				
+				for(size_t i = 0; i < size; ++i)
+				{
+					pipe->buf[(pipe->head + pipe->used + i) % pipe->capacity] = pwh->rw_buf[pwh->op.bytes + i];
+				}
+				
+				pipe->used += size;
+				_pipe9x_sim_op_copy(&(pwh->op), size);
+				
+				if(pwh->op.bytes == pwh->size)
+				{
+					_pipe9x_sim_op_finish(&(pwh->op), ERROR_SUCCESS);
+				}
+				
+				progress = TRUE;
+			}
+		}
+		
+		PipeReadHandle prh = pipe->prh;
+		
+		if(prh != NULL && _pipe9x_sim_op_active(&(prh->op)))
+		{
+			if(pipe->used > 0)
+			{
+				size_t size = pipe->used;
+				if(size > prh->rw_buf_size)
+				{
+					size = prh->rw_buf_size;
+				}
+				
+				for(size_t i = 0; i < size; ++i)
+				{
+					prh->rw_buf[i] = pipe->buf[(pipe->head + i) % pipe->capacity];
+				}
+				
+				pipe->head = (pipe->head + size) % pipe->capacity;
+				pipe->used -= size;
+				
+				_pipe9x_sim_op_copy(&(prh->op), size);
+				_pipe9x_sim_op_finish(&(prh->op), ERROR_SUCCESS);
+				
+				progress = TRUE;
+			}
+			else if(pipe->pwh == NULL)
+			{
+				_pipe9x_sim_op_finish(&(prh->op), ERROR_BROKEN_PIPE);
+				progress = TRUE;
+			}
+		}
+	}
+}
+
+static void _pipe9x_sim_pump_all(void)
+{
+	for(struct PipeSimPipe *pipe = _pipe9x_sim_pipes; pipe != NULL; pipe = pipe->next)
+	{
+		_pipe9x_sim_pump(pipe);
+	}
+}
+
+/* Find the next time after now an operation becomes active or complete. */
+static BOOL _pipe9x_sim_next_event(PipeSimTime *time_out)
+{
+	BOOL found = FALSE;
+	
+	for(struct PipeSimPipe *pipe = _pipe9x_sim_pipes; pipe != NULL; pipe = pipe->next)
+	{
+		const struct PipeSimOp *ops[2] = {
+			(pipe->prh != NULL ? &(pipe->prh->op) : NULL),
+			(pipe->pwh != NULL ? &(pipe->pwh->op) : NULL),
+		};
+		
+		for(int i = 0; i < 2; ++i)
+		{
+			const struct PipeSimOp *op = ops[i];
+			
+			if(op == NULL || !op->pending)
+			{
+				continue;
+			}
+			
+			PipeSimTime time;
+			
+			if(op->active_at > _pipe9x_sim_now)
+			{
+				time = op->active_at;
+			}
+			else if(op->done && op->busy_until > _pipe9x_sim_now)
+			{
+				time = op->busy_until;
+			}
+			else{
+				continue;
+			}
+			
+			if(!found || time < *time_out)
+			{
+				*time_out = time;
+				found = TRUE;
+			}
+		}
+	}
+	
+	return found;
+}
+
+BOOL pipe9x_sim_step(void)
+{
+	_pipe9x_sim_pump_all();
+	
+	PipeSimTime next;
+	if(!_pipe9x_sim_next_event(&next))
+	{
+		return FALSE;
+	}
+	
+	_pipe9x_sim_now = next;
+	_pipe9x_sim_pump_all();
+	
+	return TRUE;
+}
+
+void pipe9x_sim_advance(PipeSimTime duration)
+{
+	PipeSimTime until = _pipe9x_sim_now + duration;
+	
+	_pipe9x_sim_pump_all();
+	
+	PipeSimTime next;
+	while(_pipe9x_sim_next_event(&next) && next <= until)
+	{
+		_pipe9x_sim_now = next;
+		_pipe9x_sim_pump_all();
+	}
+	
+	_pipe9x_sim_now = until;
+	_pipe9x_sim_pump_all();
+}
+
+/* Wait for an operation to complete, advancing the clock. */
+static DWORD _pipe9x_sim_wait(struct PipeSimPipe *pipe, const struct PipeSimOp *op, BOOL wait)
+{
+	_pipe9x_sim_pump(pipe);
+	
+	while(!_pipe9x_sim_op_complete(op))
+	{
+		if(!wait)
+		{
+			return ERROR_IO_INCOMPLETE;
+		}
+		
+		if(!pipe9x_sim_step())
+		{
+			return ERROR_POSSIBLE_DEADLOCK;
+		}
+	}
+	
+	return ERROR_SUCCESS;
+}
+
+static void _pipe9x_sim_release(struct PipeSimPipe *pipe)
+{
+	if(pipe->prh != NULL || pipe->pwh != NULL)
+	{
+		/* The other end may be waiting for this one to close. */
+		_pipe9x_sim_pump(pipe);
+		return;
+	}
+	
+	if(pipe->prev != NULL)
+	{
+		pipe->prev->next = pipe->next;
+	}
+	else{
+		_pipe9x_sim_pipes = pipe->next;
+	}
+	
+	if(pipe->next != NULL)
+	{
+		pipe->next->prev = pipe->prev;
+	}
+	
+	free(pipe->buf);
+	free(pipe);
+}
+
+DWORD pipe9x_create(
+	PipeReadHandle *prh_out,
+	size_t read_size,
+	BOOL read_inherit,
+	PipeWriteHandle *pwh_out,
+	size_t write_size,
+	BOOL write_inherit)
+{
+	return pipe9x_create_ex(prh_out, read_size, read_inherit, pwh_out, write_size, write_inherit, NULL);
+}
+
+DWORD pipe9x_create_ex(
+	PipeReadHandle *prh_out,
+	size_t read_size,
+	BOOL read_inherit,
+	PipeWriteHandle *pwh_out,
+	size_t write_size,
+	BOOL write_inherit,
+	const PipeCreateOptions *options)
+{
+	(void)(read_inherit);
+	(void)(write_inherit);
+	
+	if(options != NULL
+		&& options->backend != PIPE9X_BACKEND_AUTO
+		&& options->backend != PIPE9X_BACKEND_SIMULATED)
+	{
+		return ERROR_CALL_NOT_IMPLEMENTED;
+	}
+	
+	if(read_size == 0)
+	{
+		/* Reads would never take any data. */
+		return ERROR_INVALID_PARAMETER;
+	}
+	
+	struct PipeSimPipe *pipe = calloc(1, sizeof(struct PipeSimPipe));
+	PipeReadHandle prh = calloc(1, sizeof(struct _PipeReadHandle));
+	PipeWriteHandle pwh = calloc(1, sizeof(struct _PipeWriteHandle));
+	
+	if(pipe != NULL)
+	{
+		/* A pipe's buffer is sized from the read end, like the real thing. */
+		pipe->capacity = (_pipe9x_sim_config.capacity > 0) ? _pipe9x_sim_config.capacity : read_size;
+		pipe->buf = malloc(pipe->capacity);
+	}
+	
+	if(prh != NULL)
+	{
+		prh->rw_buf_size = read_size;
+		prh->rw_buf = malloc(read_size);
+	}
+	
+	if(pwh != NULL)
+	{
+		pwh->rw_buf_size = write_size;
+		pwh->rw_buf = malloc(write_size > 0 ? write_size : 1);
+	}
+	
+	if(pipe == NULL || pipe->buf == NULL
+		|| prh == NULL || prh->rw_buf == NULL
+		|| pwh == NULL || pwh->rw_buf == NULL)
+	{
+		if(pwh != NULL)
+		{
+			free(pwh->rw_buf);
+			free(pwh);
+		}
+		
+		if(prh != NULL)
+		{
+			free(prh->rw_buf);
+			free(prh);
+		}
+		
+		if(pipe != NULL)
+		{
+			free(pipe->buf);
+			free(pipe);
+		}
+		
+		return ERROR_OUTOFMEMORY;
+	}
+	
+	pipe->prh = prh;
+	pipe->pwh = pwh;
+	prh->pipe = pipe;
+	pwh->pipe = pipe;
+	
+	pipe->next = _pipe9x_sim_pipes;
+	if(pipe->next != NULL)
+	{
+		pipe->next->prev = pipe;
+	}
+	
+	_pipe9x_sim_pipes = pipe;
+	
+	*prh_out = prh;
+	*pwh_out = pwh;
+	
+	return ERROR_SUCCESS;
+}
+
+DWORD pipe9x_create_many(
+	PipeReadHandle *prh_out,
+	PipeWriteHandle *pwh_out,
+	const PipeCreateSpec *specs,
+	size_t count,
+	const PipeCreateOptions *options)
+{
+	for(size_t i = 0; i < count; ++i)
+	{
+		DWORD error = pipe9x_create_ex(
+			&(prh_out[i]), specs[i].read_size, specs[i].read_inherit,
+			&(pwh_out[i]), specs[i].write_size, specs[i].write_inherit,
+			options);
+		
+		if(error != ERROR_SUCCESS)
+		{
+			while(i > 0)
+			{
+				--i;
+				
+				pipe9x_write_close(pwh_out[i]);
+				pwh_out[i] = NULL;
+				
+				pipe9x_read_close(prh_out[i]);
+				prh_out[i] = NULL;
+			}
+			
+			return error;
+		}
+	}
+	
+	return ERROR_SUCCESS;
+}
+
+void pipe9x_read_close(PipeReadHandle prh)
+{
+	if(prh == NULL)
+	{
+		return;
+	}
+	
+	struct PipeSimPipe *pipe = prh->pipe;
+	pipe->prh = NULL;
+	
+	free(prh->rw_buf);
+	free(prh);
+	
+	_pipe9x_sim_release(pipe);
+}
+
+DWORD pipe9x_read_initiate(PipeReadHandle prh)
+{
+	assert(prh != NULL);
+	
+	if(prh->op.pending)
+	{
+		return ERROR_IO_INCOMPLETE;
+	}
+	
+	_pipe9x_sim_op_start(&(prh->op));
+	_pipe9x_sim_pump(prh->pipe);
+	
+	return ERROR_IO_PENDING;
+}
+
+DWORD pipe9x_read_result(PipeReadHandle prh, void **data_out, size_t *data_size_out, BOOL wait)
+{
+	assert(prh != NULL);
+	
+	if(!prh->op.pending)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	
+	DWORD error = _pipe9x_sim_wait(prh->pipe, &(prh->op), wait);
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	prh->op.pending = FALSE;
+	
+	if(prh->op.result == ERROR_SUCCESS)
+	{
+		*data_out = prh->rw_buf;
+		*data_size_out = prh->op.bytes;
+	}
+	
+	return prh->op.result;
+}
+
+BOOL pipe9x_read_pending(PipeReadHandle prh)
+{
+	assert(prh != NULL);
+	return prh->op.pending;
+}
+
+PipeBackend pipe9x_read_backend(PipeReadHandle prh)
+{
+	assert(prh != NULL);
+	return PIPE9X_BACKEND_SIMULATED;
+}
+
+void pipe9x_write_close(PipeWriteHandle pwh)
+{
+	if(pwh == NULL)
+	{
+		return;
+	}
+	
+	struct PipeSimPipe *pipe = pwh->pipe;
+	pipe->pwh = NULL;
+	
+	free(pwh->rw_buf);
+	free(pwh);
+	
+	_pipe9x_sim_release(pipe);
+}
+
+DWORD pipe9x_write_initiate(PipeWriteHandle pwh, const void *data, size_t data_size)
+{
+	assert(pwh != NULL);
+	
+	if(pwh->op.pending)
+	{
+		return ERROR_IO_INCOMPLETE;
+	}
+	
+	if(data_size > pwh->rw_buf_size)
+	{
+		return ERROR_FILE_TOO_LARGE;
+	}
+	
+	memcpy(pwh->rw_buf, data, data_size);
+	pwh->size = data_size;
+	
+	_pipe9x_sim_op_start(&(pwh->op));
+	_pipe9x_sim_pump(pwh->pipe);
+	
+	return ERROR_IO_PENDING;
+}
+
+DWORD pipe9x_write_result(PipeWriteHandle pwh, size_t *data_written_out, BOOL wait)
+{
+	assert(pwh != NULL);
+	
+	if(!pwh->op.pending)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	
+	DWORD error = _pipe9x_sim_wait(pwh->pipe, &(pwh->op), wait);
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	pwh->op.pending = FALSE;
+	
+	if(pwh->op.result == ERROR_SUCCESS)
+	{
+		*data_written_out = pwh->op.bytes;
+	}
+	
+	return pwh->op.result;
+}
+
+BOOL pipe9x_write_pending(PipeWriteHandle pwh)
+{
+	assert(pwh != NULL);
+	return pwh->op.pending;
+}
+
+PipeBackend pipe9x_write_backend(PipeWriteHandle pwh)
+{
+	assert(pwh != NULL);
+	return PIPE9X_BACKEND_SIMULATED;
+}
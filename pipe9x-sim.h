@@ -0,0 +1,140 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file pipe9x-sim.h
+ * @brief Simulated pipes with a virtual clock.
+ *
+ * pipe9x-sim.c can be built in place of pipe9x.c to run code written against
+ * the pipe9x API on simulated pipes, on any system (pipe9x-win32.h provides
+ * the Win32 definitions elsewhere). Time only passes when the simulation is
+ * told to advance, so a workload over many pipes runs as fast as the host can
+ * execute it and gives the same results every time, making it possible to
+ * regression test throughput and scheduling behaviour without real timing
+ * noise.
+ *
+ * Each pipe has a buffer of fixed capacity. An operation becomes active after
+ * the per-operation latency (plus any jitter) has passed since it was
+ * initiated, then moves as much data as it can: a read completes as soon as
+ * it has taken any data from the buffer, a write once all of its data is in
+ * the buffer. Copying n bytes in or out of the buffer takes n times the
+ * per-byte latency, after which the operation is reported as complete.
+ * Pipes don't compete with each other for time.
+ *
+ * The following functions are provided, behaving as documented in pipe9x.h
+ * except where noted:
+ *
+ * - pipe9x_create(), pipe9x_create_ex() and pipe9x_create_many(). Flags and
+ *   allocators are ignored, the backend must be PIPE9X_BACKEND_AUTO or
+ *   PIPE9X_BACKEND_SIMULATED.
+ *
+ * - pipe9x_read_close(), pipe9x_read_initiate(), pipe9x_read_result(),
+ *   pipe9x_read_pending() and pipe9x_read_backend().
+ *
+ * - pipe9x_write_close(), pipe9x_write_initiate(), pipe9x_write_result(),
+ *   pipe9x_write_pending() and pipe9x_write_backend().
+ *
+ * Waiting for an operation using pipe9x_read_result() or pipe9x_write_result()
+ * advances the clock (as if by pipe9x_sim_step()) until it completes. If it
+ * can never complete because nothing else is scheduled to happen, the wait
+ * returns ERROR_POSSIBLE_DEADLOCK rather than hanging.
+ *
+ * The simulation is not thread safe.
+*/
+
+#ifndef PIPE9X_SIM_H
+#define PIPE9X_SIM_H
+
+#include "pipe9x.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Simulated time, in nanoseconds.
+*/
+typedef unsigned long long PipeSimTime;
+
+/**
+ * @brief Model used for simulated pipes.
+*/
+typedef struct PipeSimConfig
+{
+	size_t capacity;           /**< Bytes buffered by each pipe, 0 to use the read buffer size. */
+	
+	PipeSimTime op_latency;    /**< Time from initiating an operation until it becomes active. */
+	PipeSimTime op_jitter;     /**< Maximum random time added to op_latency. */
+	double byte_latency;       /**< Time to copy each byte into or out of a pipe's buffer. */
+	
+	DWORD seed;                /**< Seed for the jitter. */
+} PipeSimConfig;
+
+/**
+ * @brief Reset the simulation.
+ *
+ * @param config  Model for pipes created from now on (NULL for no latency).
+ *
+ * Resets the clock to zero and restarts the jitter sequence. Must not be
+ * called while any simulated pipe handles are open.
+*/
+void pipe9x_sim_reset(const PipeSimConfig *config);
+
+/**
+ * @brief Get the current simulated time.
+*/
+PipeSimTime pipe9x_sim_now(void);
+
+/**
+ * @brief Advance the clock to the next time anything happens.
+ *
+ * @return FALSE if nothing is scheduled to happen.
+ *
+ * Operations which are waiting for a pipe buffer to fill or drain are only
+ * progressed by other operations, so this returns FALSE if those are all
+ * that is left.
+*/
+BOOL pipe9x_sim_step(void);
+
+/**
+ * @brief Advance the clock by a fixed amount of time.
+ *
+ * @param duration  Time to advance by.
+ *
+ * Anything scheduled in between happens at the appropriate time, as if the
+ * caller spent the time doing other work.
+*/
+void pipe9x_sim_advance(PipeSimTime duration);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !PIPE9X_SIM_H */
@@ -0,0 +1,391 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Tests for pipe9x-streambuf.hpp, built with pipe9x.c as a C++ program. If
+ * both are built with PIPE9X_FAULT_INJECTION, short writes are tested too.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "pipe9x-streambuf.hpp"
+
+#define ASSERT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		return ++num_failures; \
+	}
+
+#define EXPECT_TRUE(expr, msg) \
+	if(expr) \
+	{ \
+		fprintf(stderr, "PASS: %s\n", msg); \
+	} \
+	else{ \
+		fprintf(stderr, "FAIL: %s (%s:%d)\n", msg, __FILE__, __LINE__); \
+		++num_failures; \
+	}
+
+/* Exposes the get and put areas so the tests can see where they point. */
+class test_streambuf: public pipe9x::pipe_streambuf
+{
+	public:
+		using pipe9x::pipe_streambuf::pipe_streambuf;
+		
+		char *get_base() const { return eback(); }
+		char *put_base() const { return pbase(); }
+		char *put_end() const { return epptr(); }
+};
+
+static bool write_all(PipeWriteHandle pwh, const char *text)
+{
+	size_t data_written;
+	
+	return pipe9x_write_initiate(pwh, text, strlen(text)) == ERROR_IO_PENDING
+		&& pipe9x_write_result(pwh, &data_written, TRUE) == ERROR_SUCCESS
+		&& data_written == strlen(text);
+}
+
+/* Read from the pipe directly until len bytes have arrived. */
+static std::string read_all(PipeReadHandle prh, size_t len)
+{
+	std::string data;
+	
+	while(data.size() < len)
+	{
+		void *buf;
+		size_t buf_size;
+		
+		DWORD error = pipe9x_read_initiate(prh);
+		
+		if((error != ERROR_IO_PENDING && error != ERROR_SUCCESS)
+			|| pipe9x_read_result(prh, &buf, &buf_size, TRUE) != ERROR_SUCCESS)
+		{
+			break;
+		}
+		
+		data.append((const char*)(buf), buf_size);
+	}
+	
+	return data;
+}
+
+/* 200 bytes, more than the 64 byte write buffers used below. */
+static std::string long_text()
+{
+	std::string text;
+	
+	for(int i = 0; i < 200; ++i)
+	{
+		text += (char)('a' + (i % 26));
+	}
+	
+	return text;
+}
+
+static int test_read(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 4096, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	/* Find the internal buffer of the read handle. */
+	
+	void *rw_buf = NULL;
+	size_t data_size;
+	
+	EXPECT_TRUE(write_all(pwh, "x")
+		&& pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+		&& pipe9x_read_result(prh, &rw_buf, &data_size, TRUE) == ERROR_SUCCESS,
+		"pipe9x_read_result() returns ERROR_SUCCESS");
+	
+	{
+		test_streambuf sb(prh, NULL);
+		
+		EXPECT_TRUE(write_all(pwh, "hello"), "pipe9x_write_initiate() can write to a pipe with a streambuf");
+		
+		EXPECT_TRUE(sb.sgetc() == 'h', "underflow() returns the first byte read");
+		
+		EXPECT_TRUE(sb.get_base() == rw_buf, "underflow() points the get area at the internal buffer");
+		
+		char buf[8];
+		
+		EXPECT_TRUE(sb.sgetn(buf, 5) == 5 && memcmp(buf, "hello", 5) == 0,
+			"pipe_streambuf returns the data read from the pipe");
+		
+		EXPECT_TRUE(sb.sputc('x') == EOF, "overflow() returns EOF without a PipeWriteHandle");
+		
+		pipe9x_write_close(pwh);
+		
+		EXPECT_TRUE(sb.sgetc() == EOF, "underflow() returns EOF once the pipe is broken");
+	}
+	
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+static int test_read_ahead(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 4096, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	{
+		test_streambuf sb(prh, NULL, true);
+		
+		EXPECT_TRUE(pipe9x_read_pending(prh), "pipe_streambuf starts a read when constructed with read_ahead");
+		
+		EXPECT_TRUE(write_all(pwh, "ahead"), "pipe9x_write_initiate() can write to a pipe with a streambuf");
+		
+		EXPECT_TRUE(sb.sgetc() == 'a', "underflow() returns the first byte read with read_ahead");
+		
+		EXPECT_TRUE(pipe9x_read_pending(prh), "underflow() starts the next read with read_ahead");
+		
+		EXPECT_TRUE(write_all(pwh, "again"), "pipe9x_write_initiate() can write while the next read is pending");
+		
+		char buf[16];
+		
+		EXPECT_TRUE(sb.sgetn(buf, 10) == 10 && memcmp(buf, "aheadagain", 10) == 0,
+			"pipe_streambuf returns the data of consecutive reads with read_ahead");
+		
+		pipe9x_write_close(pwh);
+		
+		EXPECT_TRUE(sb.sgetc() == EOF, "underflow() returns EOF once the pipe is broken with read_ahead");
+	}
+	
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+static int test_write(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 64, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	std::string text = long_text();
+	
+	{
+		test_streambuf sb(NULL, pwh);
+		
+		size_t buf_size;
+		
+		EXPECT_TRUE(sb.put_base() == pipe9x_write_buffer(pwh, &buf_size) && (size_t)(sb.put_end() - sb.put_base()) == buf_size,
+			"pipe_streambuf uses the internal buffer as the put area");
+		
+		EXPECT_TRUE(sb.sputn("sync", 4) == 4 && sb.pubsync() == 0,
+			"sync() returns 0 after writing to the pipe");
+		
+		EXPECT_TRUE(read_all(prh, 4) == "sync", "sync() writes the put area to the pipe");
+		
+		/* Overflows the put area a few times. */
+		
+		EXPECT_TRUE(sb.sputn(text.data(), text.size()) == (std::streamsize)(text.size()) && sb.pubsync() == 0,
+			"overflow() writes out the put area when it is full");
+		
+		EXPECT_TRUE(read_all(prh, text.size()) == text, "overflow() writes the data in order");
+		
+		EXPECT_TRUE(sb.sgetc() == EOF, "underflow() returns EOF without a PipeReadHandle");
+
+#ifdef PIPE9X_FAULT_INJECTION
+
+		/* Every write of more than a byte is cut short, so the rest of the put
+		 * area has to be moved down and written again.
+		*/
+		
+		PipeFaultConfig faults;
+		memset(&faults, 0, sizeof(faults));
+		faults.seed = 1;
+		faults.short_write = 1.0;
+		
+		pipe9x_set_faults(&faults);
+		
+		bool written = sb.sputn(text.data(), text.size()) == (std::streamsize)(text.size()) && sb.pubsync() == 0;
+		
+		pipe9x_set_faults(NULL);
+		
+		EXPECT_TRUE(written, "sync() returns 0 after short writes");
+		
+		EXPECT_TRUE(read_all(prh, text.size()) == text, "Short writes are resumed from the first unwritten byte");
+
+#else
+
+		printf("Skipping short write tests (needs PIPE9X_FAULT_INJECTION)\n");
+
+#endif
+
+		EXPECT_TRUE(sb.sputn("tail", 4) == 4, "sputn() can fill the put area");
+	}
+	
+	EXPECT_TRUE(read_all(prh, 4) == "tail", "pipe_streambuf writes out the put area when destroyed");
+	
+	/* Writing to a broken pipe. */
+	
+	pipe9x_read_close(prh);
+	
+	{
+		test_streambuf sb(NULL, pwh);
+		
+		EXPECT_TRUE(sb.sputn("lost", 4) == 4 && sb.pubsync() == -1,
+			"sync() returns -1 once the pipe is broken");
+	}
+	
+	pipe9x_write_close(pwh);
+	
+	return num_failures;
+}
+
+static int test_write_behind(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	/* Write-behind mode is only used by the threaded backend. */
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.flags = PIPE9X_WRITE_BEHIND;
+	options.backend = PIPE9X_BACKEND_THREADED;
+	
+	ASSERT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 64, FALSE, &options) == ERROR_SUCCESS,
+		"pipe9x_create_ex() returns ERROR_SUCCESS with PIPE9X_WRITE_BEHIND");
+	
+	std::string text = long_text();
+	
+	{
+		test_streambuf sb(NULL, pwh);
+		
+		EXPECT_TRUE(pipe9x_write_buffer(pwh, NULL) == NULL && sb.put_base() != NULL && (sb.put_end() - sb.put_base()) == 64,
+			"pipe_streambuf uses its own put area for a write-behind handle");
+		
+		EXPECT_TRUE(sb.sputn(text.data(), text.size()) == (std::streamsize)(text.size()) && sb.pubsync() == 0,
+			"sync() returns 0 on a write-behind handle");
+		
+		EXPECT_TRUE(read_all(prh, text.size()) == text, "pipe_streambuf writes the data in order on a write-behind handle");
+		
+		EXPECT_TRUE(sb.sputn("tail", 4) == 4, "sputn() can fill the put area on a write-behind handle");
+	}
+	
+	EXPECT_TRUE(read_all(prh, 4) == "tail", "pipe_streambuf writes out the put area when destroyed on a write-behind handle");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+static int test_sync_completion(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.flags = PIPE9X_SYNC_COMPLETION;
+	options.backend = PIPE9X_BACKEND_OVERLAPPED;
+	
+	DWORD error = pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 64, FALSE, &options);
+	
+	if(error == ERROR_CALL_NOT_IMPLEMENTED)
+	{
+		printf("Skipping PIPE9X_SYNC_COMPLETION tests (overlapped backend not supported by system)\n");
+		return num_failures;
+	}
+	
+	ASSERT_TRUE(error == ERROR_SUCCESS, "pipe9x_create_ex() returns ERROR_SUCCESS with PIPE9X_SYNC_COMPLETION");
+	
+	/* There is room in the pipe for every write and the data is there before
+	 * each read, so initiating them returns ERROR_SUCCESS.
+	*/
+	
+	std::string text = long_text();
+	
+	{
+		test_streambuf sb(prh, pwh);
+		
+		EXPECT_TRUE(sb.sputn(text.data(), text.size()) == (std::streamsize)(text.size()) && sb.pubsync() == 0,
+			"sync() returns 0 when writes complete inline");
+		
+		std::string data;
+		
+		for(int c; data.size() < text.size() && (c = sb.sbumpc()) != EOF;)
+		{
+			data += (char)(c);
+		}
+		
+		EXPECT_TRUE(data == text, "pipe_streambuf returns the data when reads complete inline");
+	}
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+int main()
+{
+	int num_failures = 0;
+	
+	num_failures += test_read();
+	num_failures += test_read_ahead();
+	num_failures += test_write();
+	num_failures += test_write_behind();
+	num_failures += test_sync_completion();
+	
+	if(num_failures == 0)
+	{
+		fprintf(stderr, "\nAll tests passed!\n");
+	}
+	
+	return num_failures;
+}
@@ -0,0 +1,235 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file pipe9x-streambuf.hpp
+ *
+ * std::streambuf adapter for pipe9x.
+*/
+
+#ifndef PIPE9X_STREAMBUF_HPP
+#define PIPE9X_STREAMBUF_HPP
+
+#include <streambuf>
+#include <string.h>
+#include <vector>
+
+#include "pipe9x.h"
+
+namespace pipe9x
+{
+	/**
+	 * @brief std::streambuf which reads from and/or writes to a pipe.
+	 *
+	 * The get area points directly at the internal buffer of the
+	 * PipeReadHandle after each read, and the put area is the internal buffer
+	 * of the PipeWriteHandle (see pipe9x_write_buffer()), so data isn't
+	 * copied between the pipe and a second buffer in either direction.
+	 * Handles in write-behind mode (PIPE9X_WRITE_BEHIND) have no internal
+	 * buffer to lend out, so the put area is a buffer owned by the streambuf
+	 * of the same size instead.
+	 *
+	 * underflow() starts a read (unless one is already pending) and waits for
+	 * it, overflow() and sync() write out the put area and wait for the write
+	 * to complete. End of file is returned once the pipe is broken or any
+	 * other error occurs.
+	 *
+	 * If read_ahead is enabled, the next read is started as soon as the
+	 * previous one completes, so it can proceed while the stream is being
+	 * read from. The get area can't point at the internal buffer while the
+	 * next read is filling it, so in this mode each read is copied into a
+	 * buffer owned by the streambuf.
+	 *
+	 * The handles aren't owned by the streambuf and must not be used for
+	 * anything else while it is in use. Either may be NULL.
+	*/
+	class pipe_streambuf: public std::streambuf
+	{
+		private:
+			PipeReadHandle prh;
+			PipeWriteHandle pwh;
+			
+			bool read_ahead;
+			std::vector<char> read_ahead_buf;
+			std::vector<char> write_buf;
+			
+			bool write_out()
+			{
+				char *buf = pbase();
+				size_t buf_used = pptr() - pbase();
+				
+				while(buf_used > 0)
+				{
+					size_t data_written;
+					
+					/* ERROR_SUCCESS if it completed inline (PIPE9X_SYNC_COMPLETION). */
+					DWORD error = pipe9x_write_initiate(pwh, buf, buf_used);
+					
+					if((error != ERROR_IO_PENDING && error != ERROR_SUCCESS)
+						|| pipe9x_write_result(pwh, &data_written, TRUE) != ERROR_SUCCESS)
+					{
+						return false;
+					}
+					
+					/* Move anything which didn't get written to the start of
+					 * the buffer so it can be written without another copy.
+					*/
+					
+					buf_used -= data_written;
+					memmove(buf, buf + data_written, buf_used);
+				}
+				
+				setp(buf, epptr());
+				
+				return true;
+			}
+		
+		public:
+			/**
+			 * @brief Construct a pipe_streambuf.
+			 *
+			 * @param prh         PipeReadHandle to read from (may be NULL).
+			 * @param pwh         PipeWriteHandle to write to (may be NULL).
+			 * @param read_ahead  Start the next read before it is needed.
+			*/
+			pipe_streambuf(PipeReadHandle prh, PipeWriteHandle pwh, bool read_ahead = false):
+				prh(prh), pwh(pwh), read_ahead(read_ahead)
+			{
+				if(pwh != NULL)
+				{
+					size_t buf_size;
+					char *buf = (char*)(pipe9x_write_buffer(pwh, &buf_size));
+					
+					if(buf == NULL)
+					{
+						/* Write-behind mode, or the internal buffer couldn't
+						 * be allocated. Either way, write from our own.
+						*/
+						write_buf.resize(buf_size);
+						buf = write_buf.data();
+					}
+					
+					setp(buf, buf + buf_size);
+				}
+				
+				if(prh != NULL && read_ahead && !pipe9x_read_pending(prh))
+				{
+					pipe9x_read_initiate(prh);
+				}
+			}
+			
+			pipe_streambuf(const pipe_streambuf&) = delete;
+			pipe_streambuf &operator=(const pipe_streambuf&) = delete;
+			
+			virtual ~pipe_streambuf()
+			{
+				if(pwh != NULL)
+				{
+					write_out();
+				}
+			}
+		
+		protected:
+			virtual int_type underflow() override
+			{
+				if(prh == NULL)
+				{
+					return traits_type::eof();
+				}
+				
+				if(!pipe9x_read_pending(prh))
+				{
+					DWORD error = pipe9x_read_initiate(prh);
+					if(error != ERROR_IO_PENDING && error != ERROR_SUCCESS)
+					{
+						return traits_type::eof();
+					}
+				}
+				
+				void *data;
+				size_t data_size;
+				
+				if(pipe9x_read_result(prh, &data, &data_size, TRUE) != ERROR_SUCCESS || data_size == 0)
+				{
+					return traits_type::eof();
+				}
+				
+				char *get_buf = (char*)(data);
+				
+				if(read_ahead)
+				{
+					if(read_ahead_buf.size() < data_size)
+					{
+						read_ahead_buf.resize(data_size);
+					}
+					
+					memcpy(read_ahead_buf.data(), data, data_size);
+					get_buf = read_ahead_buf.data();
+					
+					/* An error here will come back from the next underflow(). */
+					pipe9x_read_initiate(prh);
+				}
+				
+				setg(get_buf, get_buf, get_buf + data_size);
+				
+				return traits_type::to_int_type(*get_buf);
+			}
+			
+			virtual int_type overflow(int_type ch = traits_type::eof()) override
+			{
+				if(pwh == NULL || !write_out() || pptr() == epptr())
+				{
+					return traits_type::eof();
+				}
+				
+				if(traits_type::eq_int_type(ch, traits_type::eof()))
+				{
+					return traits_type::not_eof(ch);
+				}
+				
+				*pptr() = traits_type::to_char_type(ch);
+				pbump(1);
+				
+				return ch;
+			}
+			
+			virtual int sync() override
+			{
+				if(pwh != NULL && !write_out())
+				{
+					return -1;
+				}
+				
+				return 0;
+			}
+	};
+}
+
+#endif /* !PIPE9X_STREAMBUF_HPP */
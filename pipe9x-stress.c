@@ -0,0 +1,673 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Stress test driving many pipes concurrently from several threads.
+ *
+ * Usage: pipe9x-stress [-n pipes] [-t threads] [-d seconds] [-s buffer size]
+ *                      [-b auto|overlapped|threaded] [-m] [-r seed]
+ *
+ * Each thread owns an equal share of the pipes and polls all of them in turn,
+ * keeping a write of random size and a read pending on each. Every write is a
+ * record with a sequence number and a payload derived from it, which the
+ * reading side checks.
+ *
+ * -m creates the pipes using pipe9x_create_many() rather than one at a time.
+ *
+ * The threaded backend has two threads per pipe, so the number of pipes which
+ * can be created is limited by address space for their stacks.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe9x.h"
+
+#define DEFAULT_PIPES    1000
+#define DEFAULT_THREADS  4
+#define DEFAULT_SECONDS  10
+#define DEFAULT_BUF_SIZE 4096
+
+#define HEADER_SIZE 8  /* Sequence number and payload length, little endian. */
+
+#define DRAIN_TIMEOUT_MS 30000
+
+struct StressPipe
+{
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	DWORD write_seq;        /* Sequence number of next record to write. */
+	unsigned long long sent;
+	
+	/* Parser state for the read side. */
+	unsigned char header[HEADER_SIZE];
+	size_t header_have;
+	DWORD read_seq;         /* Sequence number of record being read. */
+	DWORD payload_left;
+	DWORD payload_pos;
+	unsigned long long received;
+	
+	DWORD error;            /* First error on this pipe. */
+	const char *error_op;
+};
+
+struct StressThread
+{
+	size_t first, end;  /* Range of pipes owned by this thread. */
+	DWORD rng;
+	unsigned char *record;
+};
+
+static struct StressPipe *pipes;
+static size_t num_pipes = DEFAULT_PIPES;
+static size_t buf_size = DEFAULT_BUF_SIZE;
+
+static LONG volatile stop_writing = FALSE;
+
+static double now_seconds(void)
+{
+	static LARGE_INTEGER frequency;
+	if(frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	
+	return (double)(counter.QuadPart) / (double)(frequency.QuadPart);
+}
+
+static DWORD xorshift(DWORD *state)
+{
+	DWORD x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	
+	return *state = x;
+}
+
+static unsigned char payload_byte(size_t pipe, DWORD seq, DWORD offset)
+{
+	return (unsigned char)(seq * 131 + offset + pipe * 17);
+}
+
+static void put_le32(unsigned char *p, DWORD value)
+{
+	p[0] = (unsigned char)(value);
+	p[1] = (unsigned char)(value >> 8);
+	p[2] = (unsigned char)(value >> 16);
+	p[3] = (unsigned char)(value >> 24);
+}
+
+static DWORD get_le32(const unsigned char *p)
+{
+	return (DWORD)(p[0]) | ((DWORD)(p[1]) << 8) | ((DWORD)(p[2]) << 16) | ((DWORD)(p[3]) << 24);
+}
+
+static void pipe_failed(struct StressPipe *sp, const char *op, DWORD error)
+{
+	if(sp->error == ERROR_SUCCESS)
+	{
+		sp->error = error;
+		sp->error_op = op;
+	}
+}
+
+/* Check data read from a pipe against the records written to it. */
+static BOOL consume(size_t index, const unsigned char *data, size_t size)
+{
+	struct StressPipe *sp = &(pipes[index]);
+	
+	while(size > 0)
+	{
+		if(sp->header_have < HEADER_SIZE)
+		{
+			size_t take = HEADER_SIZE - sp->header_have;
+			if(take > size)
+			{
+				take = size;
+			}
+			
+			memcpy(sp->header + sp->header_have, data, take);
+			sp->header_have += take;
+			
+			data += take;
+			size -= take;
+			
+			if(sp->header_have == HEADER_SIZE)
+			{
+				if(get_le32(sp->header) != sp->read_seq)
+				{
+					return FALSE;
+				}
+				
+				sp->payload_left = get_le32(sp->header + 4);
+				sp->payload_pos = 0;
+			}
+		}
+		else{
+			DWORD take = sp->payload_left;
+			if(take > size)
+			{
+				take = (DWORD)(size);
+			}
+			
+			for(DWORD i = 0; i < take; ++i)
+			{
+				if(data[i] != payload_byte(index, sp->read_seq, sp->payload_pos + i))
+				{
+					return FALSE;
+				}
+			}
+			
+			sp->payload_pos += take;
+			sp->payload_left -= take;
+			
+			data += take;
+			size -= take;
+		}
+		
+		if(sp->header_have == HEADER_SIZE && sp->payload_left == 0)
+		{
+			sp->header_have = 0;
+			++(sp->read_seq);
+		}
+	}
+	
+	return TRUE;
+}
+
+static DWORD WINAPI stress_thread(LPVOID lpParameter)
+{
+	struct StressThread *st = (struct StressThread*)(lpParameter);
+	
+	for(;;)
+	{
+		BOOL writing = !stop_writing;
+		BOOL progress = FALSE;
+		BOOL busy = FALSE;
+		
+		for(size_t i = st->first; i < st->end; ++i)
+		{
+			struct StressPipe *sp = &(pipes[i]);
+			
+			if(sp->error != ERROR_SUCCESS)
+			{
+				continue;
+			}
+			
+			DWORD error;
+			
+			/* Write side. */
+			
+			if(pipe9x_write_pending(sp->pwh))
+			{
+				size_t data_written;
+				
+				error = pipe9x_write_result(sp->pwh, &data_written, FALSE);
+				if(error == ERROR_SUCCESS)
+				{
+					sp->sent += data_written;
+					progress = TRUE;
+				}
+				else if(error != ERROR_IO_INCOMPLETE)
+				{
+					pipe_failed(sp, "pipe9x_write_result", error);
+					continue;
+				}
+			}
+			
+			if(writing && !pipe9x_write_pending(sp->pwh))
+			{
+				DWORD payload_size = xorshift(&(st->rng)) % (DWORD)(buf_size - HEADER_SIZE + 1);
+				
+				put_le32(st->record, sp->write_seq);
+				put_le32(st->record + 4, payload_size);
+				
+				for(DWORD j = 0; j < payload_size; ++j)
+				{
+					st->record[HEADER_SIZE + j] = payload_byte(i, sp->write_seq, j);
+				}
+				
+				error = pipe9x_write_initiate(sp->pwh, st->record, HEADER_SIZE + payload_size);
+				if(error != ERROR_IO_PENDING)
+				{
+					pipe_failed(sp, "pipe9x_write_initiate", error);
+					continue;
+				}
+				
+				++(sp->write_seq);
+			}
+			
+			/* Read side. */
+			
+			if(pipe9x_read_pending(sp->prh))
+			{
+				void *data;
+				size_t data_size;
+				
+				error = pipe9x_read_result(sp->prh, &data, &data_size, FALSE);
+				if(error == ERROR_SUCCESS)
+				{
+					if(!consume(i, data, data_size))
+					{
+						pipe_failed(sp, "integrity check", ERROR_INVALID_DATA);
+						continue;
+					}
+					
+					sp->received += data_size;
+					progress = TRUE;
+				}
+				else if(error != ERROR_IO_INCOMPLETE)
+				{
+					pipe_failed(sp, "pipe9x_read_result", error);
+					continue;
+				}
+			}
+			
+			if(sp->received < sp->sent || pipe9x_write_pending(sp->pwh))
+			{
+				busy = TRUE;
+				
+				if(!pipe9x_read_pending(sp->prh))
+				{
+					error = pipe9x_read_initiate(sp->prh);
+					if(error != ERROR_IO_PENDING)
+					{
+						pipe_failed(sp, "pipe9x_read_initiate", error);
+						continue;
+					}
+				}
+			}
+		}
+		
+		if(!writing && !busy)
+		{
+			/* Everything written has been read back. */
+			break;
+		}
+		
+		if(!progress)
+		{
+			Sleep(1);
+		}
+	}
+	
+	return 0;
+}
+
+typedef BOOL (WINAPI *GetProcessHandleCount_t)(HANDLE, LPDWORD);
+
+typedef struct
+{
+	DWORD cb;
+	DWORD PageFaultCount;
+	SIZE_T PeakWorkingSetSize;
+	SIZE_T WorkingSetSize;
+	SIZE_T QuotaPeakPagedPoolUsage;
+	SIZE_T QuotaPagedPoolUsage;
+	SIZE_T QuotaPeakNonPagedPoolUsage;
+	SIZE_T QuotaNonPagedPoolUsage;
+	SIZE_T PagefileUsage;
+	SIZE_T PeakPagefileUsage;
+} StressMemoryCounters;  /* PROCESS_MEMORY_COUNTERS from psapi.h */
+
+typedef BOOL (WINAPI *GetProcessMemoryInfo_t)(HANDLE, StressMemoryCounters*, DWORD);
+
+/* Print the handle count and memory usage of the process, where the system
+ * can tell us (not on Windows 9x).
+*/
+static void print_footprint(const char *when)
+{
+	static GetProcessHandleCount_t GetProcessHandleCount_p = NULL;
+	static GetProcessMemoryInfo_t GetProcessMemoryInfo_p = NULL;
+	static BOOL looked_up = FALSE;
+	
+	if(!looked_up)
+	{
+		GetProcessHandleCount_p = (GetProcessHandleCount_t)(GetProcAddress(GetModuleHandle("kernel32.dll"), "GetProcessHandleCount"));
+		
+		HMODULE psapi = LoadLibrary("psapi.dll");
+		if(psapi != NULL)
+		{
+			GetProcessMemoryInfo_p = (GetProcessMemoryInfo_t)(GetProcAddress(psapi, "GetProcessMemoryInfo"));
+		}
+		
+		looked_up = TRUE;
+	}
+	
+	printf("%-16s", when);
+	
+	DWORD handles;
+	if(GetProcessHandleCount_p != NULL && GetProcessHandleCount_p(GetCurrentProcess(), &handles))
+	{
+		printf(" %8u handles", (unsigned)(handles));
+	}
+	
+	StressMemoryCounters counters;
+	counters.cb = sizeof(counters);
+	
+	if(GetProcessMemoryInfo_p != NULL && GetProcessMemoryInfo_p(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		printf(" %10u KiB working set %10u KiB committed",
+			(unsigned)(counters.WorkingSetSize / 1024), (unsigned)(counters.PagefileUsage / 1024));
+	}
+	
+	printf("\n");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: pipe9x-stress [-n pipes] [-t threads] [-d seconds] [-s buffer size]\n");
+	fprintf(stderr, "                     [-b auto|overlapped|threaded] [-m] [-r seed]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	size_t num_threads = DEFAULT_THREADS;
+	DWORD seconds = DEFAULT_SECONDS;
+	DWORD seed = GetTickCount();
+	BOOL use_create_many = FALSE;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	
+	for(int i = 1; i < argc; ++i)
+	{
+		const char *arg = argv[i];
+		
+		if(strcmp(arg, "-m") == 0)
+		{
+			use_create_many = TRUE;
+			continue;
+		}
+		
+		if((i + 1) >= argc)
+		{
+			usage();
+		}
+		
+		const char *value = argv[++i];
+		
+		if(strcmp(arg, "-n") == 0)
+		{
+			num_pipes = strtoul(value, NULL, 10);
+		}
+		else if(strcmp(arg, "-t") == 0)
+		{
+			num_threads = strtoul(value, NULL, 10);
+		}
+		else if(strcmp(arg, "-d") == 0)
+		{
+			seconds = strtoul(value, NULL, 10);
+		}
+		else if(strcmp(arg, "-s") == 0)
+		{
+			buf_size = strtoul(value, NULL, 10);
+		}
+		else if(strcmp(arg, "-r") == 0)
+		{
+			seed = strtoul(value, NULL, 10);
+		}
+		else if(strcmp(arg, "-b") == 0)
+		{
+			if(strcmp(value, "auto") == 0)
+			{
+				options.backend = PIPE9X_BACKEND_AUTO;
+			}
+			else if(strcmp(value, "overlapped") == 0)
+			{
+				options.backend = PIPE9X_BACKEND_OVERLAPPED;
+			}
+			else if(strcmp(value, "threaded") == 0)
+			{
+				options.backend = PIPE9X_BACKEND_THREADED;
+			}
+			else{
+				usage();
+			}
+		}
+		else{
+			usage();
+		}
+	}
+	
+	if(num_pipes == 0 || num_threads == 0 || buf_size <= HEADER_SIZE)
+	{
+		usage();
+	}
+	
+	if(num_threads > num_pipes)
+	{
+		num_threads = num_pipes;
+	}
+	
+	if(seed == 0)
+	{
+		seed = 1;  /* xorshift gets stuck on zero. */
+	}
+	
+	printf("%u pipes, %u threads, %u seconds, %u byte buffers, seed %u\n\n",
+		(unsigned)(num_pipes), (unsigned)(num_threads), (unsigned)(seconds), (unsigned)(buf_size), (unsigned)(seed));
+	
+	pipes = calloc(num_pipes, sizeof(*pipes));
+	struct StressThread *threads = calloc(num_threads, sizeof(*threads));
+	HANDLE *thread_handles = calloc(num_threads, sizeof(*thread_handles));
+	
+	if(pipes == NULL || threads == NULL || thread_handles == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	
+	print_footprint("Before create:");
+	
+	/* Create the pipes. */
+	
+	double start = now_seconds();
+	DWORD error = ERROR_SUCCESS;
+	
+	if(use_create_many)
+	{
+		PipeReadHandle *prhs = calloc(num_pipes, sizeof(*prhs));
+		PipeWriteHandle *pwhs = calloc(num_pipes, sizeof(*pwhs));
+		PipeCreateSpec *specs = calloc(num_pipes, sizeof(*specs));
+		
+		if(prhs == NULL || pwhs == NULL || specs == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		
+		for(size_t i = 0; i < num_pipes; ++i)
+		{
+			specs[i].read_size = buf_size;
+			specs[i].write_size = buf_size;
+		}
+		
+		error = pipe9x_create_many(prhs, pwhs, specs, num_pipes, &options);
+		
+		for(size_t i = 0; error == ERROR_SUCCESS && i < num_pipes; ++i)
+		{
+			pipes[i].prh = prhs[i];
+			pipes[i].pwh = pwhs[i];
+		}
+		
+		free(specs);
+		free(pwhs);
+		free(prhs);
+	}
+	else{
+		for(size_t i = 0; error == ERROR_SUCCESS && i < num_pipes; ++i)
+		{
+			error = pipe9x_create_ex(&(pipes[i].prh), buf_size, FALSE, &(pipes[i].pwh), buf_size, FALSE, &options);
+			
+			if(error != ERROR_SUCCESS)
+			{
+				fprintf(stderr, "Failed after creating %u pipes\n", (unsigned)(i));
+			}
+		}
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		fprintf(stderr, "Unable to create pipes: error %u\n", (unsigned)(error));
+		return 1;
+	}
+	
+	printf("Created %u pipes in %.1f ms (%s backend)\n",
+		(unsigned)(num_pipes), (now_seconds() - start) * 1000.0,
+		(pipe9x_read_backend(pipes[0].prh) == PIPE9X_BACKEND_THREADED ? "threaded" : "overlapped"));
+	
+	print_footprint("After create:");
+	
+	/* Run the threads, each with its own share of the pipes. */
+	
+	start = now_seconds();
+	
+	for(size_t i = 0; i < num_threads; ++i)
+	{
+		threads[i].first = (num_pipes * i) / num_threads;
+		threads[i].end = (num_pipes * (i + 1)) / num_threads;
+		threads[i].rng = seed + (DWORD)(i) * 2654435761u;
+		threads[i].record = malloc(buf_size);
+		
+		if(threads[i].rng == 0)
+		{
+			threads[i].rng = 1;
+		}
+		
+		DWORD thread_id;
+		
+		if(threads[i].record == NULL
+			|| (thread_handles[i] = CreateThread(NULL, 0, &stress_thread, &(threads[i]), 0, &thread_id)) == NULL)
+		{
+			fprintf(stderr, "Unable to start thread %u\n", (unsigned)(i));
+			return 1;
+		}
+	}
+	
+	Sleep(seconds * 1000);
+	
+	print_footprint("While running:");
+	
+	InterlockedExchange(&stop_writing, TRUE);
+	
+	/* Wait for everything written to be read back. */
+	
+	for(size_t i = 0; i < num_threads; ++i)
+	{
+		if(WaitForSingleObject(thread_handles[i], DRAIN_TIMEOUT_MS) != WAIT_OBJECT_0)
+		{
+			fprintf(stderr, "Thread %u didn't finish draining its pipes, giving up\n", (unsigned)(i));
+			return 1;
+		}
+		
+		CloseHandle(thread_handles[i]);
+		free(threads[i].record);
+	}
+	
+	double elapsed = now_seconds() - start;
+	
+	/* Results. */
+	
+	unsigned long long total = 0, records = 0;
+	unsigned long long min_bytes = (unsigned long long)(-1), max_bytes = 0;
+	double sum_squares = 0.0;
+	size_t num_failed = 0;
+	
+	for(size_t i = 0; i < num_pipes; ++i)
+	{
+		struct StressPipe *sp = &(pipes[i]);
+		
+		if(sp->error != ERROR_SUCCESS)
+		{
+			if(num_failed < 10)
+			{
+				fprintf(stderr, "Pipe %u: %s failed: error %u\n", (unsigned)(i), sp->error_op, (unsigned)(sp->error));
+			}
+			
+			++num_failed;
+		}
+		
+		total += sp->received;
+		records += sp->read_seq;
+		sum_squares += (double)(sp->received) * (double)(sp->received);
+		
+		if(sp->received < min_bytes)
+		{
+			min_bytes = sp->received;
+		}
+		
+		if(sp->received > max_bytes)
+		{
+			max_bytes = sp->received;
+		}
+	}
+	
+	double mean_bytes = (double)(total) / (double)(num_pipes);
+	
+	/* Jain's fairness index: 1.0 when every pipe moved the same amount,
+	 * 1/n when a single pipe moved everything.
+	*/
+	double fairness = (sum_squares > 0.0)
+		? ((double)(total) * (double)(total)) / ((double)(num_pipes) * sum_squares)
+		: 0.0;
+	
+	printf("\n");
+	printf("Transferred:     %.1f MiB in %.0f records over %.1f s\n", (double)(total) / (1024.0 * 1024.0), (double)(records), elapsed);
+	printf("Throughput:      %.1f MiB/s, %.0f records/s\n", ((double)(total) / (1024.0 * 1024.0)) / elapsed, (double)(records) / elapsed);
+	printf("Per pipe:        min %.1f KiB, mean %.1f KiB, max %.1f KiB\n",
+		(double)(min_bytes) / 1024.0, mean_bytes / 1024.0, (double)(max_bytes) / 1024.0);
+	printf("Fairness index:  %.3f\n", fairness);
+	printf("Failed pipes:    %u\n\n", (unsigned)(num_failed));
+	
+	/* Closing the write ends first fails any reads still pending. */
+	
+	for(size_t i = 0; i < num_pipes; ++i)
+	{
+		pipe9x_write_close(pipes[i].pwh);
+		pipe9x_read_close(pipes[i].prh);
+	}
+	
+	pipe9x_flush_free_lists();
+	
+	print_footprint("After close:");
+	
+	free(thread_handles);
+	free(threads);
+	free(pipes);
+	
+	return num_failed == 0 ? 0 : 1;
+}
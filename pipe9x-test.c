@@ -29,6 +29,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "pipe9x.h"
 
@@ -52,6 +53,1355 @@
 		++num_failures; \
 	}
 
+static int test_connect(void)
+{
+	int num_failures = 0;
+	
+	const char *PIPE_NAME = "\\\\.\\pipe\\pipe9x_test_connect";
+	
+	/* Set up a single-instance server pipe to connect to. */
+	
+	HANDLE server = CreateNamedPipe(
+		PIPE_NAME,
+		PIPE_ACCESS_DUPLEX,
+		(PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT),
+		1,
+		4096,
+		4096,
+		0,
+		NULL);
+	
+	if(server == INVALID_HANDLE_VALUE && GetLastError() == ERROR_CALL_NOT_IMPLEMENTED)
+	{
+		fprintf(stderr, "SKIP: pipe9x_connect() tests (named pipe servers not supported)\n");
+		return num_failures;
+	}
+	
+	ASSERT_TRUE(server != INVALID_HANDLE_VALUE, "CreateNamedPipe() creates a server pipe");
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	PipeConnectStats stats;
+	
+	ASSERT_TRUE(pipe9x_connect(PIPE_NAME, 1000, &prh, 4096, &pwh, 4096, FALSE, &stats) == ERROR_SUCCESS,
+		"pipe9x_connect() returns ERROR_SUCCESS when pipe is available");
+	
+	ASSERT_TRUE(prh != NULL && pwh != NULL, "pipe9x_connect() initialises PipeReadHandle and PipeWriteHandle");
+	
+	EXPECT_TRUE(stats.attempts == 1 && stats.busy_retries == 0,
+		"pipe9x_connect() connects on the first attempt when pipe is available");
+	
+	/* The only instance is in use now, so another client should be retried
+	 * until the timeout and then turned away.
+	*/
+	
+	{
+		PipeReadHandle prh2;
+		
+		EXPECT_TRUE(pipe9x_connect(PIPE_NAME, 100, &prh2, 4096, NULL, 0, FALSE, &stats) == ERROR_PIPE_BUSY,
+			"pipe9x_connect() returns ERROR_PIPE_BUSY when pipe remains busy");
+		
+		EXPECT_TRUE(prh2 == NULL, "pipe9x_connect() initialises PipeReadHandle to NULL on error");
+		
+		EXPECT_TRUE(stats.attempts > 1 && stats.busy_retries > 0 && stats.elapsed_ms >= 100,
+			"pipe9x_connect() retries a busy pipe until the timeout");
+	}
+	
+	/* Pass some data in each direction. */
+	
+	size_t data_size;
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "ping", 4) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() can initiate a write on a connected pipe");
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS && data_size == 4,
+		"pipe9x_write_result() returns ERROR_SUCCESS on a connected pipe");
+	
+	{
+		char buf[4];
+		DWORD bytes_read;
+		
+		EXPECT_TRUE(ReadFile(server, buf, sizeof(buf), &bytes_read, NULL) && bytes_read == 4 && memcmp(buf, "ping", 4) == 0,
+			"Server receives data written to connected pipe");
+		
+		DWORD bytes_written;
+		
+		EXPECT_TRUE(WriteFile(server, "pong", 4, &bytes_written, NULL) && bytes_written == 4,
+			"Server can write to connected pipe");
+	}
+	
+	void *data;
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read on a connected pipe");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS && data_size == 4 && memcmp(data, "pong", 4) == 0,
+		"pipe9x_read_result() returns data written by server");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	CloseHandle(server);
+	
+	return num_failures;
+}
+
+static int test_duplex(void)
+{
+	int num_failures = 0;
+	
+	PipeDuplexEnd a, b;
+	
+	ASSERT_TRUE(pipe9x_create_duplex(&a, FALSE, &b, FALSE, 4096) == ERROR_SUCCESS,
+		"pipe9x_create_duplex() returns ERROR_SUCCESS");
+	
+	ASSERT_TRUE(a.read != NULL && a.write != NULL && b.read != NULL && b.write != NULL,
+		"pipe9x_create_duplex() initialises both ends");
+	
+	void *data;
+	size_t data_size;
+	
+	/* Start reads on both ends so data is crossing in both directions. */
+	
+	EXPECT_TRUE(pipe9x_read_initiate(a.read) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read on first end of duplex pipe");
+	
+	EXPECT_TRUE(pipe9x_read_initiate(b.read) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read on second end of duplex pipe");
+	
+	EXPECT_TRUE(pipe9x_write_initiate(a.write, "a to b", 6) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() can initiate a write on first end of duplex pipe");
+	
+	EXPECT_TRUE(pipe9x_write_initiate(b.write, "b to a", 6) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() can initiate a write on second end of duplex pipe");
+	
+	EXPECT_TRUE(pipe9x_write_result(a.write, &data_size, TRUE) == ERROR_SUCCESS && data_size == 6,
+		"pipe9x_write_result() returns ERROR_SUCCESS on first end of duplex pipe");
+	
+	EXPECT_TRUE(pipe9x_write_result(b.write, &data_size, TRUE) == ERROR_SUCCESS && data_size == 6,
+		"pipe9x_write_result() returns ERROR_SUCCESS on second end of duplex pipe");
+	
+	EXPECT_TRUE(pipe9x_read_result(b.read, &data, &data_size, TRUE) == ERROR_SUCCESS && data_size == 6 && memcmp(data, "a to b", 6) == 0,
+		"Second end of duplex pipe receives data written to first end");
+	
+	EXPECT_TRUE(pipe9x_read_result(a.read, &data, &data_size, TRUE) == ERROR_SUCCESS && data_size == 6 && memcmp(data, "b to a", 6) == 0,
+		"First end of duplex pipe receives data written to second end");
+	
+	/* Closing the write half of an end shouldn't disturb a read pending on
+	 * its read half, even though they share the pipe.
+	*/
+	
+	EXPECT_TRUE(pipe9x_read_initiate(a.read) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read on first end of duplex pipe");
+	
+	pipe9x_write_close(a.write);
+	a.write = NULL;
+	
+	pipe9x_write_initiate(b.write, "still here", 10);
+	pipe9x_write_result(b.write, &data_size, TRUE);
+	
+	EXPECT_TRUE(pipe9x_read_result(a.read, &data, &data_size, TRUE) == ERROR_SUCCESS && data_size == 10 && memcmp(data, "still here", 10) == 0,
+		"Read pending on duplex pipe completes after closing the write half of the same end");
+	
+	/* Closing one end should break the pipe for the other. */
+	
+	pipe9x_duplex_close(&a);
+	
+	EXPECT_TRUE(a.read == NULL && a.write == NULL, "pipe9x_duplex_close() resets handles to NULL");
+	
+	{
+		DWORD error = pipe9x_read_initiate(b.read);
+		
+		if(error == ERROR_IO_PENDING)
+		{
+			error = pipe9x_read_result(b.read, &data, &data_size, TRUE);
+		}
+		
+		EXPECT_TRUE(error == ERROR_BROKEN_PIPE || error == ERROR_PIPE_NOT_CONNECTED,
+			"Reading from duplex pipe fails when other end is closed");
+	}
+	
+	pipe9x_duplex_close(&b);
+	
+	return num_failures;
+}
+
+struct CallbackResult
+{
+	int calls;
+	DWORD error;
+	char data[16];
+	size_t data_size;
+};
+
+static void read_callback(PipeReadHandle prh, DWORD error, void *data, size_t data_size, void *context)
+{
+	struct CallbackResult *result = (struct CallbackResult*)(context);
+	
+	++(result->calls);
+	result->error = error;
+	result->data_size = data_size;
+	
+	if(data != NULL && data_size <= sizeof(result->data))
+	{
+		memcpy(result->data, data, data_size);
+	}
+}
+
+static void write_callback(PipeWriteHandle pwh, DWORD error, size_t data_written, void *context)
+{
+	struct CallbackResult *result = (struct CallbackResult*)(context);
+	
+	++(result->calls);
+	result->error = error;
+	result->data_size = data_written;
+}
+
+static int test_callbacks(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.flags = PIPE9X_NO_EVENT;
+	
+	ASSERT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options) == ERROR_SUCCESS,
+		"pipe9x_create_ex() returns ERROR_SUCCESS with PIPE9X_NO_EVENT");
+	
+	struct CallbackResult read_result = { 0 };
+	struct CallbackResult write_result = { 0 };
+	
+	DWORD error = pipe9x_read_initiate_ex(prh, &read_callback, &read_result);
+	if(error == ERROR_CALL_NOT_IMPLEMENTED)
+	{
+		fprintf(stderr, "SKIP: completion callback tests (QueueUserAPC() not available)\n");
+		
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		return num_failures;
+	}
+	
+	EXPECT_TRUE(error == ERROR_IO_PENDING,
+		"pipe9x_read_initiate_ex() can initiate a read");
+	
+	EXPECT_TRUE(pipe9x_read_pending(prh) == TRUE,
+		"PipeReadHandle has a read pending after initiating a callback read");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, NULL, NULL, FALSE) == ERROR_INVALID_PARAMETER,
+		"pipe9x_read_result() returns ERROR_INVALID_PARAMETER when a callback read is pending");
+	
+	EXPECT_TRUE(pipe9x_write_initiate_ex(pwh, "callback", 8, &write_callback, &write_result) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate_ex() can initiate a write");
+	
+	/* Completion callbacks are only delivered during alertable waits. */
+	
+	EXPECT_TRUE(read_result.calls == 0 && write_result.calls == 0,
+		"Callbacks are not invoked outside of an alertable wait");
+	
+	DWORD start = GetTickCount();
+	while((read_result.calls == 0 || write_result.calls == 0) && (GetTickCount() - start) < 5000)
+	{
+		SleepEx(100, TRUE);
+	}
+	
+	EXPECT_TRUE(write_result.calls == 1 && write_result.error == ERROR_SUCCESS && write_result.data_size == 8,
+		"Write callback is invoked once with the result of the write");
+	
+	EXPECT_TRUE(read_result.calls == 1 && read_result.error == ERROR_SUCCESS && read_result.data_size == 8 && memcmp(read_result.data, "callback", 8) == 0,
+		"Read callback is invoked once with the data read");
+	
+	EXPECT_TRUE(pipe9x_read_pending(prh) == FALSE && pipe9x_write_pending(pwh) == FALSE,
+		"No operations are pending after callbacks are invoked");
+	
+	/* Closing a handle with a callback pending shouldn't invoke it. */
+	
+	EXPECT_TRUE(pipe9x_read_initiate_ex(prh, &read_callback, &read_result) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate_ex() can initiate a read after a callback read completes");
+	
+	pipe9x_read_close(prh);
+	
+	EXPECT_TRUE(read_result.calls == 1,
+		"Read callback is not invoked when handle is closed with a read pending");
+	
+	pipe9x_write_close(pwh);
+	
+	return num_failures;
+}
+
+static int test_no_event(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.flags = PIPE9X_NO_EVENT;
+	
+	ASSERT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options) == ERROR_SUCCESS,
+		"pipe9x_create_ex() returns ERROR_SUCCESS with PIPE9X_NO_EVENT");
+	
+	void *data;
+	size_t data_size;
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read on a handle without an event");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, FALSE) == ERROR_IO_INCOMPLETE,
+		"pipe9x_read_result() returns ERROR_IO_INCOMPLETE on a handle without an event");
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "polled", 6) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() can initiate a write on a handle without an event");
+	
+	/* Poll for the write to finish. */
+	
+	DWORD error;
+	DWORD start = GetTickCount();
+	
+	while((error = pipe9x_write_result(pwh, &data_size, FALSE)) == ERROR_IO_INCOMPLETE && (GetTickCount() - start) < 5000)
+	{
+		Sleep(1);
+	}
+	
+	EXPECT_TRUE(error == ERROR_SUCCESS && data_size == 6,
+		"pipe9x_write_result() returns ERROR_SUCCESS when polling a handle without an event");
+	
+	/* Wait for the read to finish. */
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS && data_size == 6 && memcmp(data, "polled", 6) == 0,
+		"pipe9x_read_result() can wait for completion on a handle without an event");
+	
+	/* The event is created on demand and should work from then on. */
+	
+	HANDLE read_event = pipe9x_read_event(prh);
+	
+	EXPECT_TRUE(read_event != NULL,
+		"pipe9x_read_event() creates an event object for a handle without one");
+	
+	EXPECT_TRUE(pipe9x_read_event(prh) == read_event,
+		"pipe9x_read_event() returns the same event object when called again");
+	
+	EXPECT_TRUE(WaitForSingleObject(read_event, 0) == WAIT_OBJECT_0,
+		"Event object created on demand is signalled when no read is pending");
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read after the event is created");
+	
+	EXPECT_TRUE(WaitForSingleObject(read_event, 0) == WAIT_TIMEOUT,
+		"Event object created on demand is unsignalled after initiating a read");
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "evented", 7) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() can initiate another write on a handle without an event");
+	
+	EXPECT_TRUE(WaitForSingleObject(read_event, 1000) == WAIT_OBJECT_0,
+		"Event object created on demand is signalled when read completes");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS && data_size == 7 && memcmp(data, "evented", 7) == 0,
+		"pipe9x_read_result() returns data after the event is created");
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS,
+		"pipe9x_write_result() can wait for completion on a handle without an event");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+struct WaitResult
+{
+	LONG volatile reads;
+	LONG volatile bytes;
+	DWORD error;
+	HANDLE done;
+};
+
+static void wait_read_callback(PipeReadHandle prh, DWORD error, void *data, size_t data_size, void *context)
+{
+	struct WaitResult *result = (struct WaitResult*)(context);
+	
+	InterlockedExchangeAdd(&(result->bytes), (LONG)(data_size));
+	
+	if(error != ERROR_SUCCESS)
+	{
+		result->error = error;
+	}
+	
+	if(InterlockedIncrement(&(result->reads)) == 2 || error != ERROR_SUCCESS)
+	{
+		/* Stop after the second read. */
+		pipe9x_read_unregister_wait(prh);
+		SetEvent(result->done);
+	}
+}
+
+static int test_register_wait(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 4096, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	struct WaitResult result = { 0, 0, ERROR_SUCCESS, CreateEvent(NULL, TRUE, FALSE, NULL) };
+	
+	DWORD error = pipe9x_read_register_wait(prh, &wait_read_callback, &result, PIPE9X_WAIT_REINITIATE);
+	
+	if(error == ERROR_CALL_NOT_IMPLEMENTED)
+	{
+		printf("Skipping pipe9x_read_register_wait() tests (not supported by system)\n");
+		
+		CloseHandle(result.done);
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		return num_failures;
+	}
+	
+	EXPECT_TRUE(error == ERROR_SUCCESS,
+		"pipe9x_read_register_wait() returns ERROR_SUCCESS");
+	
+	EXPECT_TRUE(pipe9x_read_register_wait(prh, &wait_read_callback, &result, 0) == ERROR_ALREADY_EXISTS,
+		"pipe9x_read_register_wait() returns ERROR_ALREADY_EXISTS when already registered");
+	
+	size_t data_written;
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "first", 5) == ERROR_IO_PENDING && pipe9x_write_result(pwh, &data_written, TRUE) == ERROR_SUCCESS,
+		"pipe9x_write_initiate() can write to a pipe with a registered read callback");
+	
+	/* Let the first read complete before writing the next, so they aren't
+	 * received together.
+	*/
+	Sleep(100);
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "second", 6) == ERROR_IO_PENDING && pipe9x_write_result(pwh, &data_written, TRUE) == ERROR_SUCCESS,
+		"pipe9x_write_initiate() can write to a pipe with a registered read callback");
+	
+	EXPECT_TRUE(WaitForSingleObject(result.done, 5000) == WAIT_OBJECT_0,
+		"Registered read callback is invoked for each read");
+	
+	EXPECT_TRUE(result.error == ERROR_SUCCESS && result.bytes == 11,
+		"Registered read callback receives the written data");
+	
+	/* The callback unregistered itself, so no further reads are started and
+	 * we can go back to using the handle directly.
+	*/
+	
+	void *data;
+	size_t data_size;
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read after the read callback is unregistered");
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "third", 5) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() can initiate a write after the read callback is unregistered");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS && data_size == 5 && memcmp(data, "third", 5) == 0,
+		"pipe9x_read_result() returns data after the read callback is unregistered");
+	
+	EXPECT_TRUE(result.reads == 2,
+		"Registered read callback isn't invoked after being unregistered");
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_written, TRUE) == ERROR_SUCCESS,
+		"pipe9x_write_result() returns ERROR_SUCCESS");
+	
+	CloseHandle(result.done);
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	/* A read started on an overlapped handle before it had an event can't be
+	 * waited on, so registering must be refused rather than leaving the
+	 * callback thread spinning on an event which is always signalled.
+	*/
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.flags = PIPE9X_NO_EVENT;
+	options.backend = PIPE9X_BACKEND_OVERLAPPED;
+	
+	ASSERT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options) == ERROR_SUCCESS,
+		"pipe9x_create_ex() returns ERROR_SUCCESS with PIPE9X_NO_EVENT");
+	
+	/* Stop after the first read. */
+	struct WaitResult no_event_result = { 1, 0, ERROR_SUCCESS, CreateEvent(NULL, TRUE, FALSE, NULL) };
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read on a handle without an event");
+	
+	EXPECT_TRUE(pipe9x_read_register_wait(prh, &wait_read_callback, &no_event_result, 0) == ERROR_IO_INCOMPLETE,
+		"pipe9x_read_register_wait() returns ERROR_IO_INCOMPLETE while a read without an event is pending");
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "early", 5) == ERROR_IO_PENDING && pipe9x_write_result(pwh, &data_written, TRUE) == ERROR_SUCCESS,
+		"pipe9x_write_initiate() can write to a pipe with a read pending");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS && data_size == 5 && memcmp(data, "early", 5) == 0,
+		"pipe9x_read_result() returns data after pipe9x_read_register_wait() is refused");
+	
+	/* With nothing pending, registering creates the event so later reads are
+	 * started with it attached.
+	*/
+	
+	EXPECT_TRUE(pipe9x_read_register_wait(prh, &wait_read_callback, &no_event_result, 0) == ERROR_SUCCESS,
+		"pipe9x_read_register_wait() returns ERROR_SUCCESS on a handle without an event when no read is pending");
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read with a registered read callback");
+	
+	EXPECT_TRUE(WaitForSingleObject(pipe9x_read_event(prh), 100) == WAIT_TIMEOUT,
+		"Event object created by pipe9x_read_register_wait() is unsignalled while a read is pending");
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "later", 5) == ERROR_IO_PENDING && pipe9x_write_result(pwh, &data_written, TRUE) == ERROR_SUCCESS,
+		"pipe9x_write_initiate() can write to a pipe with a registered read callback");
+	
+	EXPECT_TRUE(WaitForSingleObject(no_event_result.done, 5000) == WAIT_OBJECT_0 && no_event_result.error == ERROR_SUCCESS && no_event_result.bytes == 5,
+		"Registered read callback receives data on a handle without an event");
+	
+	CloseHandle(no_event_result.done);
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+static int test_write_buffer(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 1024, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	size_t buf_size;
+	char *buf = pipe9x_write_buffer(pwh, &buf_size);
+	
+	EXPECT_TRUE(buf != NULL && buf_size == 1024,
+		"pipe9x_write_buffer() returns the internal buffer of the write handle");
+	
+	memcpy(buf, "in place", 8);
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, buf, 8) == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() can write from the buffer returned by pipe9x_write_buffer()");
+	
+	void *data;
+	size_t data_size;
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING && pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+		&& data_size == 8 && memcmp(data, "in place", 8) == 0,
+		"Data written from the buffer returned by pipe9x_write_buffer() is read from the pipe");
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS && data_size == 8,
+		"pipe9x_write_result() returns ERROR_SUCCESS");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+static int test_nt_copy(void)
+{
+	int num_failures = 0;
+	
+	/* Copy every write using non-temporal stores (when supported), from
+	 * unaligned sources and with sizes which leave a tail after the 64 byte
+	 * blocks, and check every byte arrives.
+	*/
+	
+	static unsigned char source[4096 + 16];
+	for(size_t i = 0; i < sizeof(source); ++i)
+	{
+		source[i] = (unsigned char)((i * 7) + (i >> 8) + 3);
+	}
+	
+	static const size_t sizes[] = { 1, 15, 16, 17, 63, 64, 65, 100, 127, 1000, 4095, 4096 };
+	static const size_t offsets[] = { 0, 1, 3, 8, 15 };
+	
+	static const PipeBackend backends[] = { PIPE9X_BACKEND_OVERLAPPED, PIPE9X_BACKEND_THREADED };
+	
+	size_t old_threshold = pipe9x_set_nt_copy_threshold(0);
+	
+	for(size_t b = 0; b < (sizeof(backends) / sizeof(*backends)); ++b)
+	{
+		PipeReadHandle prh;
+		PipeWriteHandle pwh;
+		
+		PipeCreateOptions options;
+		memset(&options, 0, sizeof(options));
+		options.backend = backends[b];
+		
+		DWORD error = pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options);
+		
+		if(error == ERROR_CALL_NOT_IMPLEMENTED && backends[b] == PIPE9X_BACKEND_OVERLAPPED)
+		{
+			/* Windows 9x. */
+			continue;
+		}
+		
+		EXPECT_TRUE(error == ERROR_SUCCESS,
+			"pipe9x_create_ex() returns ERROR_SUCCESS");
+		
+		if(error != ERROR_SUCCESS)
+		{
+			continue;
+		}
+		
+		BOOL intact = TRUE;
+		
+		for(size_t s = 0; s < (sizeof(sizes) / sizeof(*sizes)); ++s)
+		{
+			for(size_t o = 0; o < (sizeof(offsets) / sizeof(*offsets)) && intact; ++o)
+			{
+				const unsigned char *src = source + offsets[o];
+				size_t size = sizes[s];
+				
+				intact = pipe9x_write_initiate(pwh, src, size) == ERROR_IO_PENDING;
+				
+				/* The write may arrive in more than one read. */
+				
+				for(size_t received = 0; received < size && intact;)
+				{
+					void *data;
+					size_t data_size = 0;
+					
+					intact = pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+						&& pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+						&& (received + data_size) <= size
+						&& memcmp(data, src + received, data_size) == 0;
+					
+					received += data_size;
+				}
+				
+				size_t data_written;
+				
+				intact = intact
+					&& pipe9x_write_result(pwh, &data_written, TRUE) == ERROR_SUCCESS
+					&& data_written == size;
+			}
+		}
+		
+		EXPECT_TRUE(intact,
+			"Data copied using non-temporal stores is read from the pipe intact");
+		
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+	}
+	
+	EXPECT_TRUE(pipe9x_set_nt_copy_threshold(old_threshold) == 0,
+		"pipe9x_set_nt_copy_threshold() returns the previous threshold");
+	
+	return num_failures;
+}
+
+struct AllocCounts
+{
+	int allocs;
+	int frees;
+};
+
+static void *counting_alloc(size_t size, void *context)
+{
+	struct AllocCounts *counts = (struct AllocCounts*)(context);
+	++(counts->allocs);
+	
+	return malloc(size);
+}
+
+static void counting_free(void *ptr, void *context)
+{
+	struct AllocCounts *counts = (struct AllocCounts*)(context);
+	++(counts->frees);
+	
+	free(ptr);
+}
+
+static int test_allocator(void)
+{
+	int num_failures = 0;
+	
+	struct AllocCounts counts = { 0, 0 };
+	PipeAllocator allocator = { &counting_alloc, &counting_free, NULL, &counts };
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.allocator = &allocator;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 1000, FALSE, &options) == ERROR_SUCCESS,
+		"pipe9x_create_ex() returns ERROR_SUCCESS with a custom allocator");
+	
+	EXPECT_TRUE(counts.allocs == 2 && counts.frees == 0,
+		"pipe9x_create_ex() allocates handles using the custom allocator");
+	
+	size_t buf_size;
+	void *buf = pipe9x_write_buffer(pwh, &buf_size);
+	
+	EXPECT_TRUE(counts.allocs == 3,
+		"pipe9x_write_buffer() allocates the buffer using the custom allocator");
+	
+	EXPECT_TRUE(((ULONG_PTR)(buf) % PIPE9X_BUFFER_ALIGNMENT) == 0 && buf_size == 1000,
+		"Buffer allocated using custom allocator without aligned_alloc is aligned");
+	
+	EXPECT_TRUE(!pipe9x_write_release_idle(pwh, 60000),
+		"pipe9x_write_release_idle() doesn't release a buffer used recently");
+	
+	EXPECT_TRUE(pipe9x_write_release_idle(pwh, 0) && counts.frees == 1,
+		"pipe9x_write_release_idle() releases an idle buffer");
+	
+	EXPECT_TRUE(pipe9x_write_buffer(pwh, &buf_size) != NULL && counts.allocs == 4,
+		"pipe9x_write_buffer() allocates a released buffer");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	/* Closed handles are kept for reuse... */
+	
+	ASSERT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 1000, FALSE, &options) == ERROR_SUCCESS,
+		"pipe9x_create_ex() returns ERROR_SUCCESS with a custom allocator");
+	
+	EXPECT_TRUE(counts.allocs == 4 && counts.frees == 1,
+		"pipe9x_create_ex() reuses closed handles");
+	
+	EXPECT_TRUE(WaitForSingleObject(pipe9x_read_event(prh), 0) == WAIT_OBJECT_0,
+		"Event object of reused handle is signalled");
+	
+	void *data;
+	size_t data_size;
+	
+	EXPECT_TRUE(pipe9x_write_initiate(pwh, "reused", 6) == ERROR_IO_PENDING
+		&& pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+		&& pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+		&& data_size == 6 && memcmp(data, "reused", 6) == 0
+		&& pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS,
+		"Reused handles can be read from and written to");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	/* ...until the free lists are flushed. */
+	
+	pipe9x_flush_free_lists();
+	
+	EXPECT_TRUE(counts.allocs == 5 && counts.frees == 5,
+		"Handles and buffers are freed using the custom allocator");
+	
+	return num_failures;
+}
+
+typedef SIZE_T (WINAPI *GetLargePageMinimum_t)(void);
+
+static int test_page_buffers(void)
+{
+	int num_failures = 0;
+	
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	
+	/* GetLargePageMinimum() doesn't exist before Windows Server 2003. */
+	GetLargePageMinimum_t GetLargePageMinimum_p = (GetLargePageMinimum_t)(GetProcAddress(GetModuleHandle("kernel32.dll"), "GetLargePageMinimum"));
+	SIZE_T large_page_size = GetLargePageMinimum_p != NULL ? GetLargePageMinimum_p() : 0;
+	
+	/* We don't enable SeLockMemoryPrivilege, so unless the process was
+	 * started with it enabled, large page buffers fall back to normal pages.
+	*/
+	
+	if(large_page_size > 0)
+	{
+		void *pages = VirtualAlloc(NULL, large_page_size, (MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES), PAGE_READWRITE);
+		
+		if(pages != NULL)
+		{
+			printf("Large pages are available, not testing fallback to normal pages\n");
+			VirtualFree(pages, 0, MEM_RELEASE);
+		}
+	}
+	
+	struct {
+		DWORD flags;
+		size_t write_size;
+		const char *msg;
+	} cases[] = {
+		{ PIPE9X_PAGE_BUFFERS, 100000, "PIPE9X_PAGE_BUFFERS" },
+		{ PIPE9X_LARGE_PAGES, (large_page_size > 0 ? large_page_size : (2 * 1024 * 1024)), "PIPE9X_LARGE_PAGES" },
+	};
+	
+	for(size_t i = 0; i < (sizeof(cases) / sizeof(*cases)); ++i)
+	{
+		fprintf(stderr, "Testing %s\n", cases[i].msg);
+		
+		/* The custom allocator shows the buffers don't come from it. */
+		
+		struct AllocCounts counts = { 0, 0 };
+		PipeAllocator allocator = { &counting_alloc, &counting_free, NULL, &counts };
+		
+		PipeCreateOptions options;
+		memset(&options, 0, sizeof(options));
+		options.flags = cases[i].flags;
+		options.allocator = &allocator;
+		
+		PipeReadHandle prh;
+		PipeWriteHandle pwh;
+		
+		ASSERT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, cases[i].write_size, FALSE, &options) == ERROR_SUCCESS,
+			"pipe9x_create_ex() returns ERROR_SUCCESS");
+		
+		size_t buf_size;
+		void *buf = pipe9x_write_buffer(pwh, &buf_size);
+		
+		EXPECT_TRUE(buf != NULL && buf_size == cases[i].write_size && ((ULONG_PTR)(buf) % si.dwPageSize) == 0,
+			"pipe9x_write_buffer() returns a page aligned buffer");
+		
+		EXPECT_TRUE(counts.allocs == 2,
+			"Buffer isn't allocated using the PipeAllocator");
+		
+		void *data;
+		size_t data_size;
+		
+		EXPECT_TRUE(pipe9x_write_initiate(pwh, "pages", 5) == ERROR_IO_PENDING
+			&& pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+			&& pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+			&& data_size == 5 && memcmp(data, "pages", 5) == 0
+			&& ((ULONG_PTR)(data) % si.dwPageSize) == 0
+			&& pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS,
+			"Handles with page buffers can be read from and written to");
+		
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		/* The handles are reused with their buffers... */
+		
+		ASSERT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, cases[i].write_size, FALSE, &options) == ERROR_SUCCESS,
+			"pipe9x_create_ex() returns ERROR_SUCCESS");
+		
+		EXPECT_TRUE(pipe9x_write_buffer(pwh, &buf_size) == buf && counts.allocs == 2,
+			"pipe9x_create_ex() reuses closed handles with page buffers");
+		
+		EXPECT_TRUE(pipe9x_write_initiate(pwh, "reused", 6) == ERROR_IO_PENDING
+			&& pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+			&& pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+			&& data_size == 6 && memcmp(data, "reused", 6) == 0
+			&& pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS,
+			"Reused handles with page buffers can be read from and written to");
+		
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		/* ...until the free lists are flushed. */
+		
+		pipe9x_flush_free_lists();
+		
+		EXPECT_TRUE(counts.frees == 2,
+			"Handles with page buffers are freed");
+		
+		ASSERT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, cases[i].write_size, FALSE, &options) == ERROR_SUCCESS,
+			"pipe9x_create_ex() returns ERROR_SUCCESS after flushing the free lists");
+		
+		EXPECT_TRUE(pipe9x_write_initiate(pwh, "fresh", 5) == ERROR_IO_PENDING
+			&& pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+			&& pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+			&& data_size == 5 && memcmp(data, "fresh", 5) == 0
+			&& pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS,
+			"New handles with page buffers can be read from and written to");
+		
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		pipe9x_flush_free_lists();
+	}
+	
+	return num_failures;
+}
+
+static int test_create_many(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh[4];
+	PipeWriteHandle pwh[4];
+	
+	PipeCreateSpec specs[4] = {
+		{ 4096, FALSE, 4096, FALSE },
+		{ 1024, FALSE, 512, TRUE },
+		{ 100, TRUE, 100, FALSE },
+		{ 8192, FALSE, 8192, FALSE },
+	};
+	
+	ASSERT_TRUE(pipe9x_create_many(prh, pwh, specs, 4, NULL) == ERROR_SUCCESS,
+		"pipe9x_create_many() returns ERROR_SUCCESS");
+	
+	for(int i = 0; i < 4; ++i)
+	{
+		char msg[16];
+		sprintf(msg, "pipe %d", i);
+		
+		void *data;
+		size_t data_size;
+		
+		EXPECT_TRUE(pipe9x_write_initiate(pwh[i], msg, strlen(msg)) == ERROR_IO_PENDING
+			&& pipe9x_read_initiate(prh[i]) == ERROR_IO_PENDING
+			&& pipe9x_read_result(prh[i], &data, &data_size, TRUE) == ERROR_SUCCESS
+			&& data_size == strlen(msg) && memcmp(data, msg, data_size) == 0
+			&& pipe9x_write_result(pwh[i], &data_size, TRUE) == ERROR_SUCCESS,
+			"Pipes created by pipe9x_create_many() are connected correctly");
+	}
+	
+	size_t buf_size;
+	pipe9x_write_buffer(pwh[1], &buf_size);
+	
+	EXPECT_TRUE(buf_size == 512,
+		"Pipes created by pipe9x_create_many() have the requested buffer sizes");
+	
+	/* Close in a different order to creation. */
+	
+	for(int i = 3; i >= 0; --i)
+	{
+		pipe9x_read_close(prh[i]);
+	}
+	
+	for(int i = 0; i < 4; ++i)
+	{
+		pipe9x_write_close(pwh[i]);
+	}
+	
+	return num_failures;
+}
+
+static int test_repeated_operations(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.flags = PIPE9X_NO_EVENT;
+	options.backend = PIPE9X_BACKEND_THREADED;
+	
+	ASSERT_TRUE(pipe9x_create_ex(&prh, 64, FALSE, &pwh, 64, FALSE, &options) == ERROR_SUCCESS,
+		"pipe9x_create_ex() returns ERROR_SUCCESS");
+	
+	/* Many operations on the same handles, alternating between polling and
+	 * waiting for the results, without the event objects being requested.
+	*/
+	
+	int ok = 1;
+	
+	for(int i = 0; i < 200 && ok; ++i)
+	{
+		char msg[16];
+		sprintf(msg, "op %d", i);
+		
+		void *data;
+		size_t data_size;
+		
+		ok = pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+			&& pipe9x_write_initiate(pwh, msg, strlen(msg)) == ERROR_IO_PENDING;
+		
+		DWORD error;
+		
+		if(i % 2)
+		{
+			while((error = pipe9x_read_result(prh, &data, &data_size, FALSE)) == ERROR_IO_INCOMPLETE) {}
+		}
+		else{
+			error = pipe9x_read_result(prh, &data, &data_size, TRUE);
+		}
+		
+		ok = ok
+			&& error == ERROR_SUCCESS
+			&& data_size == strlen(msg) && memcmp(data, msg, data_size) == 0
+			&& pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS;
+	}
+	
+	EXPECT_TRUE(ok, "Repeated reads and writes on the same handles complete correctly");
+	
+	/* Closing with a read still pending, which the write end closing fails. */
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() can initiate a read after repeated operations");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+struct WriteBehindReader
+{
+	PipeReadHandle prh;
+	size_t total;
+	int ok;
+};
+
+static DWORD WINAPI write_behind_reader(LPVOID lpParameter)
+{
+	struct WriteBehindReader *reader = (struct WriteBehindReader*)(lpParameter);
+	
+	while(reader->total < 1000)
+	{
+		void *data;
+		size_t data_size;
+		
+		if(pipe9x_read_initiate(reader->prh) != ERROR_IO_PENDING
+			|| pipe9x_read_result(reader->prh, &data, &data_size, TRUE) != ERROR_SUCCESS)
+		{
+			reader->ok = 0;
+			break;
+		}
+		
+		for(size_t i = 0; i < data_size; ++i)
+		{
+			if(((unsigned char*)(data))[i] != (unsigned char)((reader->total + i) % 251))
+			{
+				reader->ok = 0;
+			}
+		}
+		
+		reader->total += data_size;
+	}
+	
+	return 0;
+}
+
+static int test_write_behind(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.flags = PIPE9X_WRITE_BEHIND;
+	options.backend = PIPE9X_BACKEND_THREADED;
+	
+	EXPECT_TRUE(pipe9x_create_ex(&prh, 256, FALSE, &pwh, 100, FALSE, &options) == ERROR_INVALID_PARAMETER,
+		"pipe9x_create_ex() returns ERROR_INVALID_PARAMETER with PIPE9X_WRITE_BEHIND and a write size which isn't a power of two");
+	
+	ASSERT_TRUE(pipe9x_create_ex(&prh, 256, FALSE, &pwh, 64, FALSE, &options) == ERROR_SUCCESS,
+		"pipe9x_create_ex() returns ERROR_SUCCESS with PIPE9X_WRITE_BEHIND");
+	
+	struct WriteBehindReader reader = { prh, 0, 1 };
+	
+	DWORD reader_id;
+	HANDLE reader_thread = CreateThread(NULL, 0, &write_behind_reader, &reader, 0, &reader_id);
+	ASSERT_TRUE(reader_thread != NULL, "Created reader thread");
+	
+	/* Write 1000 bytes in small pieces through a 64 byte buffer. When a write
+	 * is refused, the event is signalled once there is room.
+	*/
+	
+	int ok = 1;
+	
+	for(size_t offset = 0; offset < 1000 && ok; offset += 10)
+	{
+		unsigned char chunk[10];
+		for(size_t i = 0; i < sizeof(chunk); ++i)
+		{
+			chunk[i] = (unsigned char)((offset + i) % 251);
+		}
+		
+		DWORD error;
+		size_t data_written;
+		
+		while((error = pipe9x_write_initiate(pwh, chunk, sizeof(chunk))) == ERROR_IO_INCOMPLETE)
+		{
+			WaitForSingleObject(pipe9x_write_event(pwh), INFINITE);
+			pipe9x_write_result(pwh, &data_written, FALSE);
+		}
+		
+		ok = (error == ERROR_IO_PENDING);
+	}
+	
+	EXPECT_TRUE(ok, "pipe9x_write_initiate() accepts all writes with PIPE9X_WRITE_BEHIND");
+	
+	size_t data_written;
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_written, TRUE) == ERROR_SUCCESS,
+		"pipe9x_write_result() can wait for buffered writes to finish");
+	
+	EXPECT_TRUE(WaitForSingleObject(reader_thread, 5000) == WAIT_OBJECT_0 && reader.ok && reader.total == 1000,
+		"Data written with PIPE9X_WRITE_BEHIND is read back in order");
+	
+	CloseHandle(reader_thread);
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+static int test_backends(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	
+	options.backend = (PipeBackend)(42);
+	
+	EXPECT_TRUE(pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options) == ERROR_INVALID_PARAMETER,
+		"pipe9x_create_ex() returns ERROR_INVALID_PARAMETER for an unknown backend");
+	
+	static const PipeBackend backends[] = { PIPE9X_BACKEND_OVERLAPPED, PIPE9X_BACKEND_THREADED };
+	
+	for(size_t i = 0; i < (sizeof(backends) / sizeof(*backends)); ++i)
+	{
+		options.backend = backends[i];
+		
+		DWORD error = pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options);
+		
+		if(error == ERROR_CALL_NOT_IMPLEMENTED && backends[i] == PIPE9X_BACKEND_OVERLAPPED)
+		{
+			/* Windows 9x. */
+			continue;
+		}
+		
+		ASSERT_TRUE(error == ERROR_SUCCESS,
+			"pipe9x_create_ex() returns ERROR_SUCCESS with an explicit backend");
+		
+		EXPECT_TRUE(pipe9x_read_backend(prh) == backends[i] && pipe9x_write_backend(pwh) == backends[i],
+			"pipe9x_read_backend() and pipe9x_write_backend() return the requested backend");
+		
+		void *data;
+		size_t data_size;
+		
+		EXPECT_TRUE(pipe9x_write_initiate(pwh, "backend", 7) == ERROR_IO_PENDING
+			&& pipe9x_read_initiate(prh) == ERROR_IO_PENDING
+			&& pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+			&& data_size == 7 && memcmp(data, "backend", 7) == 0
+			&& pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS,
+			"Pipes created with an explicit backend are connected correctly");
+		
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+	}
+	
+	return num_failures;
+}
+
+static int test_sync_completion(void)
+{
+	int num_failures = 0;
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	PipeCreateOptions options;
+	memset(&options, 0, sizeof(options));
+	options.flags = PIPE9X_SYNC_COMPLETION;
+	options.backend = PIPE9X_BACKEND_OVERLAPPED;
+	
+	DWORD error = pipe9x_create_ex(&prh, 4096, FALSE, &pwh, 4096, FALSE, &options);
+	
+	if(error == ERROR_CALL_NOT_IMPLEMENTED)
+	{
+		fprintf(stderr, "SKIP: PIPE9X_SYNC_COMPLETION tests (overlapped I/O not supported)\n");
+		return num_failures;
+	}
+	
+	ASSERT_TRUE(error == ERROR_SUCCESS,
+		"pipe9x_create_ex() returns ERROR_SUCCESS with PIPE9X_SYNC_COMPLETION");
+	
+	void *data;
+	size_t data_size;
+	
+	/* The write fits in the pipe and the read finds data already waiting, so
+	 * both should complete immediately, but either result is valid.
+	*/
+	
+	error = pipe9x_write_initiate(pwh, "inline", 6);
+	
+	EXPECT_TRUE(error == ERROR_SUCCESS || error == ERROR_IO_PENDING,
+		"pipe9x_write_initiate() returns ERROR_SUCCESS or ERROR_IO_PENDING with PIPE9X_SYNC_COMPLETION");
+	
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, (error == ERROR_IO_PENDING)) == ERROR_SUCCESS && data_size == 6,
+		"pipe9x_write_result() returns the result of a write which completed immediately");
+	
+	error = pipe9x_read_initiate(prh);
+	
+	EXPECT_TRUE(error == ERROR_SUCCESS || error == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() returns ERROR_SUCCESS or ERROR_IO_PENDING with PIPE9X_SYNC_COMPLETION");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, (error == ERROR_IO_PENDING)) == ERROR_SUCCESS
+		&& data_size == 6 && memcmp(data, "inline", 6) == 0,
+		"pipe9x_read_result() returns the result of a read which completed immediately");
+	
+	/* A read with nothing waiting still goes pending. */
+	
+	EXPECT_TRUE(pipe9x_read_initiate(prh) == ERROR_IO_PENDING,
+		"pipe9x_read_initiate() returns ERROR_IO_PENDING when no data is waiting");
+	
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, FALSE) == ERROR_IO_INCOMPLETE,
+		"pipe9x_read_result() returns ERROR_IO_INCOMPLETE when no data is waiting");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	return num_failures;
+}
+
+static int test_trace(void)
+{
+	int num_failures = 0;
+	
+	char path[MAX_PATH + 16];
+	DWORD path_len = GetTempPath(MAX_PATH, path);
+	
+	ASSERT_TRUE(path_len > 0 && path_len < MAX_PATH, "GetTempPath() succeeds");
+	strcpy(path + path_len, "pipe9x-test.trace");
+	
+	PipeTrace trace;
+	ASSERT_TRUE(pipe9x_trace_open(&trace, path, PIPE9X_TRACE_PAYLOAD) == ERROR_SUCCESS,
+		"pipe9x_trace_open() returns ERROR_SUCCESS");
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 4096, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	pipe9x_read_set_trace(prh, trace);
+	pipe9x_write_set_trace(pwh, trace);
+	
+	void *data;
+	size_t data_size;
+	
+	pipe9x_write_initiate(pwh, "traced", 6);
+	EXPECT_TRUE(pipe9x_write_result(pwh, &data_size, TRUE) == ERROR_SUCCESS,
+		"Writes complete on a traced handle");
+	
+	pipe9x_read_initiate(prh);
+	EXPECT_TRUE(pipe9x_read_result(prh, &data, &data_size, TRUE) == ERROR_SUCCESS
+		&& data_size == 6 && memcmp(data, "traced", 6) == 0,
+		"Reads complete on a traced handle");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	EXPECT_TRUE(pipe9x_trace_close(trace) == ERROR_SUCCESS,
+		"pipe9x_trace_close() returns ERROR_SUCCESS");
+	
+	/* Header, then the read handle attaching with ID 1 and its buffer size. */
+	
+	unsigned char buf[256];
+	size_t buf_size = 0;
+	
+	FILE *fh = fopen(path, "rb");
+	if(fh != NULL)
+	{
+		buf_size = fread(buf, 1, sizeof(buf), fh);
+		fclose(fh);
+	}
+	
+	DeleteFile(path);
+	
+	EXPECT_TRUE(buf_size > 24 && memcmp(buf, "P9XTRACE", 8) == 0 && buf[8] == 1,
+		"pipe9x_trace_open() writes the trace header");
+	
+	EXPECT_TRUE(buf_size > 24 && buf[24] == PIPE9X_TRACE_ATTACH_READ && buf[25] == 1,
+		"pipe9x_read_set_trace() records the handle attaching");
+	
+	/* The written data appears in the payload of a record. */
+	
+	BOOL found_payload = FALSE;
+	for(size_t i = 24; (i + 6) <= buf_size; ++i)
+	{
+		if(memcmp(buf + i, "traced", 6) == 0)
+		{
+			found_payload = TRUE;
+		}
+	}
+	
+	EXPECT_TRUE(found_payload, "PIPE9X_TRACE_PAYLOAD records the data");
+	
+	return num_failures;
+}
+
+static int test_metrics(void)
+{
+	int num_failures = 0;
+	
+	ASSERT_TRUE(pipe9x_metrics_open(4) == ERROR_SUCCESS,
+		"pipe9x_metrics_open() returns ERROR_SUCCESS");
+	
+	EXPECT_TRUE(pipe9x_metrics_open(4) == ERROR_ALREADY_EXISTS,
+		"pipe9x_metrics_open() returns ERROR_ALREADY_EXISTS when already publishing");
+	
+	char name[64];
+	snprintf(name, sizeof(name), "%s%lu", PIPE9X_METRICS_PREFIX, (unsigned long)(GetCurrentProcessId()));
+	
+	HANDLE mapping = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+	ASSERT_TRUE(mapping != NULL, "Metrics can be opened by name");
+	
+	const PipeMetricsHeader *header = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	ASSERT_TRUE(header != NULL, "Metrics can be mapped");
+	
+	EXPECT_TRUE(header->magic == PIPE9X_METRICS_MAGIC && header->num_slots == 4
+		&& header->process_id == GetCurrentProcessId(),
+		"pipe9x_metrics_open() initialises the header");
+	
+	const PipeMetricsSlot *slots = (const PipeMetricsSlot*)((const char*)(header) + header->header_size);
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	ASSERT_TRUE(pipe9x_create(&prh, 4096, FALSE, &pwh, 4096, FALSE) == ERROR_SUCCESS,
+		"pipe9x_create() returns ERROR_SUCCESS");
+	
+	void *data;
+	size_t data_size;
+	
+	pipe9x_write_initiate(pwh, "metrics", 7);
+	pipe9x_write_result(pwh, &data_size, TRUE);
+	
+	pipe9x_read_initiate(prh);
+	pipe9x_read_result(prh, &data, &data_size, TRUE);
+	
+	/* Nothing is updating the slots now, so they can be read directly. */
+	
+	EXPECT_TRUE(slots[0].handle_id != 0 && slots[0].type == PIPE9X_METRICS_READ
+		&& slots[0].ops == 1 && slots[0].bytes == 7 && !slots[0].pending && (slots[0].sequence % 2) == 0,
+		"Read handle metrics are published");
+	
+	EXPECT_TRUE(slots[1].handle_id != 0 && slots[1].type == PIPE9X_METRICS_WRITE
+		&& slots[1].ops == 1 && slots[1].bytes == 7 && slots[1].buf_size == 4096,
+		"Write handle metrics are published");
+	
+	pipe9x_read_initiate(prh);
+	
+	EXPECT_TRUE(slots[0].pending && slots[0].ops == 1,
+		"Pending reads are published");
+	
+	pipe9x_write_close(pwh);
+	pipe9x_read_close(prh);
+	
+	EXPECT_TRUE(slots[0].handle_id == 0 && slots[1].handle_id == 0,
+		"Slots are released when handles are closed");
+	
+	pipe9x_metrics_close();
+	
+	UnmapViewOfFile(header);
+	CloseHandle(mapping);
+	
+	return num_failures;
+}
+
 int main()
 {
 	int num_failures = 0;
@@ -306,6 +1656,23 @@ int main()
 	
 	EXPECT_TRUE(total_data_written == total_data_read, "No data is lost when pipe is filled");
 	
+	num_failures += test_connect();
+	num_failures += test_duplex();
+	num_failures += test_callbacks();
+	num_failures += test_no_event();
+	num_failures += test_register_wait();
+	num_failures += test_write_buffer();
+	num_failures += test_nt_copy();
+	num_failures += test_allocator();
+	num_failures += test_page_buffers();
+	num_failures += test_create_many();
+	num_failures += test_repeated_operations();
+	num_failures += test_backends();
+	num_failures += test_write_behind();
+	num_failures += test_sync_completion();
+	num_failures += test_trace();
+	num_failures += test_metrics();
+	
 	if(num_failures == 0)
 	{
 		fprintf(stderr, "\nAll tests passed!\n");
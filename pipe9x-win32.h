@@ -0,0 +1,74 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file pipe9x-win32.h
+ * @brief Win32 definitions used by pipe9x.h, for building elsewhere.
+ *
+ * Only the simulated backend (pipe9x-sim.c) can be built on systems other
+ * than Windows, this provides the handful of Win32 types and error codes it
+ * and pipe9x.h need, with the same values as on Windows.
+*/
+
+#ifndef PIPE9X_WIN32_H
+#define PIPE9X_WIN32_H
+
+#include <stddef.h>
+
+typedef int BOOL;
+typedef unsigned int DWORD;
+typedef int LONG;
+typedef unsigned long long ULONGLONG;
+typedef void *HANDLE;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(-1))
+
+#define ERROR_SUCCESS              0
+#define ERROR_OUTOFMEMORY          14
+#define ERROR_NOT_SUPPORTED        50
+#define ERROR_INVALID_PARAMETER    87
+#define ERROR_BROKEN_PIPE          109
+#define ERROR_CALL_NOT_IMPLEMENTED 120
+#define ERROR_FILE_TOO_LARGE       223
+#define ERROR_NO_DATA              232
+#define ERROR_MORE_DATA            234
+#define ERROR_IO_INCOMPLETE        996
+#define ERROR_IO_PENDING           997
+#define ERROR_POSSIBLE_DEADLOCK    1131
+
+#endif /* !PIPE9X_WIN32_H */
@@ -29,28 +29,148 @@
 */
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <windows.h>
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#include <emmintrin.h>
+#define PIPE9X_HAVE_SSE2_INTRINSICS
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include "pipe9x.h"
 
+/* Fields written by the I/O thread are aligned to a cache line of their own
+ * so that completing an operation doesn't invalidate the cache line(s) which
+ * the caller is polling, define PIPE9X_NO_CACHE_ALIGN to disable this (e.g.
+ * for comparing with pipe9x-bench).
+*/
+#if defined(PIPE9X_NO_CACHE_ALIGN)
+#define PIPE9X_CACHE_ALIGNED
+#elif defined(_MSC_VER)
+#define PIPE9X_CACHE_ALIGNED __declspec(align(64))
+#else
+#define PIPE9X_CACHE_ALIGNED __attribute__((aligned(64)))
+#endif
+
+#define PIPE9X_RING_SIZE 4  /* Slots in each worker ring, must be a power of two. */
+#define PIPE9X_RING_MASK (PIPE9X_RING_SIZE - 1)
+
+#define PIPE9X_REQUEST_IO   1  /* Perform the read/write for a pipe9x_*_initiate*() call. */
+#define PIPE9X_REQUEST_QUIT 2  /* Exit the worker thread. */
+
+/**
+ * @private
+ *
+ * Operation queued to the worker thread of a thread fallback handle.
+*/
+struct PipeRequest
+{
+	DWORD type;
+	DWORD size;  /* Bytes to write (write handles only). */
+	BOOL apc;    /* Deliver the completion by APC (pipe9x_*_initiate_ex()). */
+};
+
+/**
+ * @private
+*/
+struct PipeCompletion
+{
+	DWORD result;
+	DWORD bytes_transferred;
+};
+
 /**
  * @private
 */
 struct PipeData
 {
+	PipeAllocator allocator;  /* Allocator for this handle object and its buffer. */
+	struct PipeBlock *block;  /* Block this handle object is part of, if any. */
+	void *alloc_base;         /* Block this handle object was allocated within. */
+	
 	HANDLE pipe;
+	BOOL shared_pipe;         /* pipe was duplicated from/to another handle object. */
 	unsigned char *rw_buf;
+	void *rw_buf_base;        /* Block rw_buf was allocated within. */
+	BOOL rw_buf_pages;        /* rw_buf_base was allocated using _pipe9x_alloc_pages(). */
 	size_t rw_buf_size;
+	DWORD last_io_time;       /* GetTickCount() when last operation was started. */
+	PipeTrace trace;          /* Trace operations are recorded to, if any. */
+	DWORD trace_id;           /* ID of this handle within trace. */
+	PipeMetricsSlot *metrics; /* Slot metrics are published in, if any. */
 	OVERLAPPED overlapped;
 	BOOL pending;
+	DWORD flags;
+	BOOL op_has_event;  /* Event was attached to pending overlapped operation. */
+	BOOL op_inline;     /* Pending overlapped operation completed within ReadFile()/WriteFile(). */
+	BOOL modes_set;     /* _pipe9x_completion_modes() has been called. */
 	
 	BOOL use_thread_fallback;
-	HANDLE io_thread;
-	DWORD bytes_transferred;
-	DWORD io_result;
+	HANDLE io_thread;   /* Worker thread, started by the first operation. */
+	HANDLE work_event;  /* Auto-reset event the worker thread sleeps on. */
+	
+	/* Caller side of the worker rings, see _pipe9x_worker_push(). */
+	struct PipeRequest requests[PIPE9X_RING_SIZE];
+	LONG volatile request_head;     /* Next request slot to fill. */
+	LONG volatile completion_tail;  /* Next completion slot to consume. */
+	LONG volatile event_exported;   /* Event has been handed out by _pipe9x_event(). */
+	LONG volatile caller_waiting;   /* Caller is blocked in _pipe9x_worker_wait(). */
+	
+	DWORD bytes_transferred;  /* Result of overlapped ReadFile()/WriteFile(), valid if op_inline. */
+	
+	/* Caller side of the write-behind ring (PIPE9X_WRITE_BEHIND), which uses
+	 * rw_buf. Byte counts wrap around at 2^32.
+	*/
+	LONG volatile wb_head;   /* Total bytes appended. */
+	LONG volatile wb_want;   /* Room needed by a refused write, zero if none. */
+	DWORD wb_appended;       /* Bytes appended since last pipe9x_write_result(). */
+	HANDLE wb_drain_event;   /* Auto-reset event signalled once drained while caller_waiting. */
+	
+	BOOL callback_pending;  /* Pending operation will complete via a callback. */
+	BOOL closing;           /* Handle is being closed, don't invoke callbacks. */
+	HANDLE apc_thread;      /* Thread to queue callbacks to (thread fallback only). */
+	DWORD apc_thread_id;
+	
+	BOOL wait_lock_init;
+	CRITICAL_SECTION wait_lock;  /* Protects below members. */
+	BOOL wait_active;            /* Thread pool wait callback is registered. */
+	DWORD wait_flags;
+	HANDLE wait_handle;          /* Handle from RegisterWaitForSingleObject(), if armed. */
+	DWORD wait_thread_id;        /* Thread running the wait callback. */
+	
+	/* Worker side of the worker rings. The size of the structure is padded
+	 * out to a cache line after these, so nothing else shares the line.
+	*/
+	PIPE9X_CACHE_ALIGNED LONG volatile request_tail;  /* Next request slot to consume. */
+	struct PipeCompletion completions[PIPE9X_RING_SIZE];
+	LONG volatile completion_head;    /* Next completion slot to fill. */
+	LONG volatile worker_sleeping;    /* Worker is (about to be) waiting on work_event. */
+	LONG volatile worker_signalling;  /* Worker is publishing a completion. */
+	
+	LONG volatile wb_tail;  /* Total bytes written to the pipe (or discarded after an error). */
+	DWORD wb_error;         /* First error from WriteFile(), valid once wb_tail has been read. */
+};
+
+/**
+ * @private
+ *
+ * Header of a block of memory holding several handle objects and their
+ * buffers, allocated by pipe9x_create_many(). Freed once all of the handle
+ * objects have been closed.
+*/
+struct PipeBlock
+{
+	LONG volatile refs;
+	PipeAllocator allocator;
+	void *base;
+	BOOL pages;  /* base was allocated using _pipe9x_alloc_pages(). */
 };
 
 /**
@@ -59,6 +179,12 @@ struct PipeData
 struct _PipeReadHandle
 {
 	struct PipeData data;
+	
+	PipeReadCallback callback;
+	void *callback_context;
+	
+	PipeReadCallback wait_callback;
+	void *wait_context;
 };
 
 /**
@@ -67,469 +193,4145 @@ struct _PipeReadHandle
 struct _PipeWriteHandle
 {
 	struct PipeData data;
+	
+	PipeWriteCallback callback;
+	void *callback_context;
+	
+	PipeWriteCallback wait_callback;
+	void *wait_context;
 };
 
-DWORD pipe9x_create(
-	PipeReadHandle *prh_out,
-	size_t read_size,
-	BOOL read_inherit,
-	PipeWriteHandle *pwh_out,
-	size_t write_size,
-	BOOL write_inherit)
+typedef BOOL (WINAPI *CancelIoEx_t)(HANDLE, LPOVERLAPPED);
+typedef BOOL (WINAPI *CancelIo_t)(HANDLE);
+typedef DWORD (WINAPI *QueueUserAPC_t)(PAPCFUNC, HANDLE, ULONG_PTR);
+typedef BOOL (WINAPI *RegisterWaitForSingleObject_t)(PHANDLE, HANDLE, WAITORTIMERCALLBACK, PVOID, ULONG, ULONG);
+typedef BOOL (WINAPI *UnregisterWait_t)(HANDLE);
+typedef BOOL (WINAPI *UnregisterWaitEx_t)(HANDLE, HANDLE);
+typedef SIZE_T (WINAPI *GetLargePageMinimum_t)(void);
+typedef BOOL (WINAPI *IsProcessorFeaturePresent_t)(DWORD);
+typedef BOOL (WINAPI *SetFileCompletionNotificationModes_t)(HANDLE, UCHAR);
+
+#ifndef FILE_SKIP_COMPLETION_PORT_ON_SUCCESS
+#define FILE_SKIP_COMPLETION_PORT_ON_SUCCESS 0x1
+#endif
+
+#ifndef FILE_SKIP_SET_EVENT_ON_HANDLE
+#define FILE_SKIP_SET_EVENT_ON_HANDLE 0x2
+#endif
+
+static RegisterWaitForSingleObject_t RegisterWaitForSingleObject_p = NULL;
+static UnregisterWait_t UnregisterWait_p = NULL;
+static UnregisterWaitEx_t UnregisterWaitEx_p = NULL;
+
+/* Look up a kernel32 function which doesn't exist on all versions of Windows
+ * we support. Returns NULL if the function isn't available.
+*/
+static FARPROC _pipe9x_kernel32_proc(const char *name)
 {
-	*prh_out = NULL;
-	*pwh_out = NULL;
-	
-	PipeReadHandle prh  = malloc(sizeof(struct _PipeReadHandle));
-	PipeWriteHandle pwh = malloc(sizeof(struct _PipeWriteHandle));
+	HMODULE kernel32 = GetModuleHandle("kernel32.dll");
+	if(kernel32 == NULL)
+	{
+		return NULL;
+	}
 	
-	if(prh == NULL || pwh == NULL)
+	return GetProcAddress(kernel32, name);
+}
+
+#ifdef PIPE9X_FAULT_INJECTION
+
+static PipeFaultConfig _pipe9x_faults;
+static LONG volatile _pipe9x_fault_calls = 0;
+
+void pipe9x_set_faults(const PipeFaultConfig *config)
+{
+	if(config != NULL)
 	{
-		free(pwh);
-		free(prh);
-		
-		return ERROR_OUTOFMEMORY;
+		_pipe9x_faults = *config;
+	}
+	else{
+		memset(&_pipe9x_faults, 0, sizeof(_pipe9x_faults));
 	}
 	
-	prh->data.pipe = INVALID_HANDLE_VALUE;
-	prh->data.rw_buf = malloc(read_size);
-	prh->data.rw_buf_size = read_size;
-	prh->data.overlapped.hEvent = NULL;
-	prh->data.pending = FALSE;
-	prh->data.use_thread_fallback = FALSE;
-	prh->data.io_thread = NULL;
+	InterlockedExchange(&_pipe9x_fault_calls, 0);
+}
+
+/* Next pseudo-random number, hashed from the seed and a counter so that the
+ * I/O threads don't need a lock to share the sequence.
+*/
+static DWORD _pipe9x_fault_random(void)
+{
+	DWORD x = _pipe9x_faults.seed + (DWORD)(InterlockedIncrement(&_pipe9x_fault_calls)) * 0x9E3779B9u;
 	
-	pwh->data.pipe = INVALID_HANDLE_VALUE;
-	pwh->data.rw_buf = malloc(read_size);
-	pwh->data.rw_buf_size = read_size;
-	pwh->data.overlapped.hEvent = NULL;
-	pwh->data.pending = FALSE;
-	pwh->data.use_thread_fallback = FALSE;
-	pwh->data.io_thread = NULL;
+	x ^= x >> 16;
+	x *= 0x7FEB352Du;
+	x ^= x >> 15;
+	x *= 0x846CA68Bu;
+	x ^= x >> 16;
 	
-	if(prh->data.rw_buf == NULL || pwh->data.rw_buf == NULL)
+	return x;
+}
+
+static BOOL _pipe9x_fault(double probability)
+{
+	return probability > 0.0 && ((double)(_pipe9x_fault_random()) / 4294967296.0) < probability;
+}
+
+static void _pipe9x_fault_delay(void)
+{
+	if(_pipe9x_faults.max_delay_ms > 0 && _pipe9x_fault(_pipe9x_faults.delay))
 	{
-		pipe9x_write_close(pwh);
-		pipe9x_read_close(prh);
-		
-		return ERROR_OUTOFMEMORY;
+		Sleep(_pipe9x_fault_random() % (_pipe9x_faults.max_delay_ms + 1));
 	}
+}
+
+static BOOL WINAPI _pipe9x_read_file(HANDLE file, LPVOID buffer, DWORD size, LPDWORD read_out, LPOVERLAPPED overlapped)
+{
+	_pipe9x_fault_delay();
 	
-	/* Create event objects used to signal overlapped I/O completion. */
+	if(_pipe9x_fault(_pipe9x_faults.broken_pipe))
+	{
+		SetLastError(ERROR_BROKEN_PIPE);
+		return FALSE;
+	}
 	
-	prh->data.overlapped.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
-	if(prh->data.overlapped.hEvent == NULL)
+	if(size > 1 && _pipe9x_fault(_pipe9x_faults.short_read))
 	{
-		DWORD error = GetLastError();
-		
-		pipe9x_write_close(pwh);
-		pipe9x_read_close(prh);
-		
-		return error;
+		size = 1 + (_pipe9x_fault_random() % (size - 1));
 	}
 	
-	pwh->data.overlapped.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
-	if(pwh->data.overlapped.hEvent == NULL)
+	if(overlapped == NULL && size > 1 && _pipe9x_fault(_pipe9x_faults.more_data))
 	{
-		DWORD error = GetLastError();
+		/* As if the rest of a message on a message-mode pipe didn't fit. */
 		
-		pipe9x_write_close(pwh);
-		pipe9x_read_close(prh);
+		if(ReadFile(file, buffer, 1 + (_pipe9x_fault_random() % (size - 1)), read_out, NULL))
+		{
+			SetLastError(ERROR_MORE_DATA);
+		}
 		
-		return error;
+		return FALSE;
 	}
 	
-	/* Create named pipe to serve as the read end of the pipe.
-	 *
-	 * Anonymous pipes cannot be used for overlapped I/O, so we need to
-	 * create a named pipe with a random name and open it.
-	*/
+	return ReadFile(file, buffer, size, read_out, overlapped);
+}
+
+static BOOL WINAPI _pipe9x_write_file(HANDLE file, LPCVOID buffer, DWORD size, LPDWORD written_out, LPOVERLAPPED overlapped)
+{
+	_pipe9x_fault_delay();
 	
-	char pipename[32];
+	if(_pipe9x_fault(_pipe9x_faults.broken_pipe))
+	{
+		SetLastError(ERROR_BROKEN_PIPE);
+		return FALSE;
+	}
 	
-	while(prh->data.pipe == INVALID_HANDLE_VALUE)
+	if(size > 1 && _pipe9x_fault(_pipe9x_faults.short_write))
 	{
-		strcpy(pipename, "\\\\.\\pipe\\tmp_");
-		int pnlen = strlen(pipename);
-		
-		while(pnlen < (sizeof(pipename) - 1))
-		{
-			char rndchar = 'A' + (rand() % 26);
-			pipename[pnlen++] = rndchar;
-		}
-		
-		pipename[pnlen] = '\0';
-		
-		SECURITY_ATTRIBUTES r_secattrs = { sizeof(SECURITY_ATTRIBUTES), NULL, read_inherit };
-		
-		prh->data.pipe = CreateNamedPipe(
-			pipename,                                           /* lpName */
-			(PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED),       /* dwOpenMode */
-			(PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT),  /* dwPipeMode */
-			1,                                                  /* nMaxInstances */
-			read_size,                                          /* nOutBufferSize */
-			read_size,                                          /* nInBufferSize */
-			0,                                                  /* nDefaultTimeOut */
-			&r_secattrs);                                       /* lpSecurityAttributes */
-		
-		if(prh->data.pipe == INVALID_HANDLE_VALUE)
-		{
-			DWORD error = GetLastError();
-			
-			if(error == ERROR_FILE_EXISTS)
-			{
-				/* Name already in use, loop and try another. */
-			}
-			else if(error == ERROR_CALL_NOT_IMPLEMENTED)
-			{
-				/* Okay... named pipes only exist on Windows NT, so we have to
-				 * fall back to using anonymous pipes, which means we can't use
-				 * overlapped I/O and have to fall back to performing read/write
-				 * operations on a background thread instead.
-				 *
-				 * Wheeee.
-				*/
-				
-				if(!CreatePipe(&(prh->data.pipe), &(pwh->data.pipe), &r_secattrs, read_size))
-				{
-					error = GetLastError();
-					
-					pipe9x_write_close(pwh);
-					pipe9x_read_close(prh);
-					
-					return error;
-				}
-				
-				if(read_inherit != write_inherit)
-				{
-					HANDLE new_write_handle;
-					
-					if(!DuplicateHandle(
-						GetCurrentProcess(),
-						pwh->data.pipe,
-						GetCurrentProcess(),
-						&new_write_handle,
-						0,
-						write_inherit,
-						DUPLICATE_SAME_ACCESS))
-					{
-						error = GetLastError();
-						
-						pipe9x_write_close(pwh);
-						pipe9x_read_close(prh);
-						
-						return error;
-					}
-					
-					CloseHandle(pwh->data.pipe);
-					pwh->data.pipe = new_write_handle;
-				}
-				
-				prh->data.use_thread_fallback = TRUE;
-				pwh->data.use_thread_fallback = TRUE;
-				
-				*prh_out = prh;
-				*pwh_out = pwh;
-				
-				return ERROR_SUCCESS;
-			}
-			else{
-				pipe9x_write_close(pwh);
-				pipe9x_read_close(prh);
-				
-				return error;
-			}
-		}
+		size = 1 + (_pipe9x_fault_random() % (size - 1));
 	}
 	
-	if(!ConnectNamedPipe(prh->data.pipe, &(prh->data.overlapped)))
+	return WriteFile(file, buffer, size, written_out, overlapped);
+}
+
+static BOOL WINAPI _pipe9x_get_overlapped_result(HANDLE file, LPOVERLAPPED overlapped, LPDWORD transferred_out, BOOL wait)
+{
+	_pipe9x_fault_delay();
+	return GetOverlappedResult(file, overlapped, transferred_out, wait);
+}
+
+#else
+
+#define _pipe9x_read_file ReadFile
+#define _pipe9x_write_file WriteFile
+#define _pipe9x_get_overlapped_result GetOverlappedResult
+
+#endif
+
+/* Cancel the overlapped operation pending on a handle object. Closing the
+ * handle doesn't do this by itself if other handles to the same pipe are open.
+*/
+static void _pipe9x_cancel_io(struct PipeData *pd)
+{
+	static CancelIoEx_t CancelIoEx_p = NULL;
+	static CancelIo_t CancelIo_p = NULL;
+	
+	if(CancelIoEx_p == NULL)
 	{
-		DWORD error = GetLastError();
-		
-		if(error != ERROR_IO_PENDING)
-		{
-			pipe9x_write_close(pwh);
-			pipe9x_read_close(prh);
-			
-			return error;
-		}
+		CancelIoEx_p = (CancelIoEx_t)(_pipe9x_kernel32_proc("CancelIoEx"));
 	}
 	
-	/* Make a connection to the pipe to serve as the write end. */
+	if(CancelIoEx_p != NULL)
+	{
+		/* Only our own operation, a handle duplicated from ours shares its
+		 * file object and may have one pending too.
+		*/
+		CancelIoEx_p(pd->pipe, &(pd->overlapped));
+		return;
+	}
 	
-	SECURITY_ATTRIBUTES w_secattrs = { sizeof(SECURITY_ATTRIBUTES), NULL, write_inherit };
+	/* Pre-Vista, we can only cancel all I/O started by the calling thread on
+	 * the file object, which would include any from the handle object we share
+	 * it with, so the caller has to wait for the operation instead.
+	*/
 	
-	pwh->data.pipe = CreateFile(
-		pipename,              /* lpFileName */
-		GENERIC_WRITE,         /* dwDesiredAccess */
-		0,                     /* dwShareMode */
-		&w_secattrs,           /* lpSecurityAttributes */
-		OPEN_EXISTING,         /* dwCreationDisposition */
-		FILE_FLAG_OVERLAPPED,  /* dwFlagsAndAttributes */
-		NULL);                 /* hTemplateFile */
+	if(pd->shared_pipe)
+	{
+		return;
+	}
 	
-	if(pwh->data.pipe == INVALID_HANDLE_VALUE)
+	if(CancelIo_p == NULL)
 	{
-		DWORD error = GetLastError();
-		
-		pipe9x_write_close(pwh);
-		pipe9x_read_close(prh);
-		
-		return error;
+		CancelIo_p = (CancelIo_t)(_pipe9x_kernel32_proc("CancelIo"));
 	}
 	
-	/* Complete the connection on the read end. */
+	if(CancelIo_p != NULL)
+	{
+		CancelIo_p(pd->pipe);
+	}
+}
+
+/* Stop the system doing work to signal completion of overlapped operations
+ * which complete within ReadFile()/WriteFile() on a PIPE9X_SYNC_COMPLETION
+ * handle, where supported (Vista or later).
+*/
+static void _pipe9x_completion_modes(struct PipeData *pd)
+{
+	static SetFileCompletionNotificationModes_t SetFileCompletionNotificationModes_p = NULL;
 	
-	DWORD transferred_bytes;
-	if(!GetOverlappedResult(prh->data.pipe, &(prh->data.overlapped), &transferred_bytes, TRUE))
+	if(!(pd->flags & PIPE9X_SYNC_COMPLETION) || pd->modes_set)
 	{
-		DWORD error = GetLastError();
+		return;
+	}
+	
+	pd->modes_set = TRUE;
+	
+	if(SetFileCompletionNotificationModes_p == NULL)
+	{
+		SetFileCompletionNotificationModes_p = (SetFileCompletionNotificationModes_t)(_pipe9x_kernel32_proc("SetFileCompletionNotificationModes"));
+	}
+	
+	if(SetFileCompletionNotificationModes_p != NULL)
+	{
+		/* Without an event, completion is waited for on the pipe handle
+		 * itself (see _pipe9x_overlapped_wait()), so it must still be set.
+		*/
 		
-		pipe9x_write_close(pwh);
-		pipe9x_read_close(prh);
+		UCHAR modes = FILE_SKIP_COMPLETION_PORT_ON_SUCCESS;
+		if(!(pd->flags & PIPE9X_NO_EVENT))
+		{
+			modes |= FILE_SKIP_SET_EVENT_ON_HANDLE;
+		}
 		
-		return error;
+		SetFileCompletionNotificationModes_p(pd->pipe, modes);
 	}
+}
+
+static QueueUserAPC_t _pipe9x_QueueUserAPC(void)
+{
+	static QueueUserAPC_t QueueUserAPC_p = NULL;
 	
-	*prh_out = prh;
-	*pwh_out = pwh;
+	if(QueueUserAPC_p == NULL)
+	{
+		QueueUserAPC_p = (QueueUserAPC_t)(_pipe9x_kernel32_proc("QueueUserAPC"));
+	}
 	
-	return ERROR_SUCCESS;
+	return QueueUserAPC_p;
 }
 
-static void _pipe9x_cleanup(struct PipeData *pd)
+/* Queue an APC to the thread which last called _pipe9x_apc_prepare(). */
+static BOOL _pipe9x_apc_queue(struct PipeData *pd, PAPCFUNC func, void *param)
 {
-	if(pd->pipe != INVALID_HANDLE_VALUE)
+	QueueUserAPC_t QueueUserAPC_p = _pipe9x_QueueUserAPC();
+	return QueueUserAPC_p != NULL && QueueUserAPC_p(func, pd->apc_thread, (ULONG_PTR)(param));
+}
+
+/* Obtain a handle to the calling thread for queueing completion callbacks to
+ * from the background I/O thread.
+*/
+static DWORD _pipe9x_apc_prepare(struct PipeData *pd)
+{
+	if(_pipe9x_QueueUserAPC() == NULL)
 	{
-		CloseHandle(pd->pipe);
-		pd->pipe = NULL;
+		return ERROR_CALL_NOT_IMPLEMENTED;
 	}
 	
-	if(pd->pending)
+	DWORD thread_id = GetCurrentThreadId();
+	
+	if(pd->apc_thread != NULL && pd->apc_thread_id == thread_id)
 	{
-		if(pd->use_thread_fallback)
-		{
-			assert(pd->io_thread != NULL);
-			
-			WaitForSingleObject(pd->io_thread, INFINITE);
-			CloseHandle(pd->io_thread);
-			
-			pd->io_thread = NULL;
-		}
-		else{
-			assert(pd->overlapped.hEvent != NULL);
-			WaitForSingleObject(pd->overlapped.hEvent, INFINITE);
-		}
+		/* Same thread as last time. */
+		return ERROR_SUCCESS;
 	}
 	
-	if(pd->overlapped.hEvent != NULL)
+	if(pd->apc_thread != NULL)
 	{
-		CloseHandle(pd->overlapped.hEvent);
-		pd->overlapped.hEvent = NULL;
+		CloseHandle(pd->apc_thread);
+		pd->apc_thread = NULL;
 	}
 	
-	free(pd->rw_buf);
-	pd->rw_buf = NULL;
+	if(!DuplicateHandle(
+		GetCurrentProcess(),
+		GetCurrentThread(),
+		GetCurrentProcess(),
+		&(pd->apc_thread),
+		0,
+		FALSE,
+		DUPLICATE_SAME_ACCESS))
+	{
+		pd->apc_thread = NULL;
+		return GetLastError();
+	}
+	
+	pd->apc_thread_id = thread_id;
+	
+	return ERROR_SUCCESS;
 }
 
-void pipe9x_read_close(PipeReadHandle prh)
+#ifndef PIPE9X_CONNECT_MIN_BACKOFF
+#define PIPE9X_CONNECT_MIN_BACKOFF 1   /* Initial delay between connection attempts (ms). */
+#endif
+
+#ifndef PIPE9X_CONNECT_MAX_BACKOFF
+#define PIPE9X_CONNECT_MAX_BACKOFF 250 /* Upper bound on delay between connection attempts (ms). */
+#endif
+
+/* Look up the thread pool wait functions, which are new in Windows 2000.
+ * Returns FALSE if they aren't available.
+*/
+static BOOL _pipe9x_wait_api(void)
 {
-	if(prh == NULL)
+	if(RegisterWaitForSingleObject_p == NULL)
 	{
-		return;
+		UnregisterWait_p = (UnregisterWait_t)(_pipe9x_kernel32_proc("UnregisterWait"));
+		UnregisterWaitEx_p = (UnregisterWaitEx_t)(_pipe9x_kernel32_proc("UnregisterWaitEx"));
+		
+		if(UnregisterWait_p != NULL && UnregisterWaitEx_p != NULL)
+		{
+			RegisterWaitForSingleObject_p = (RegisterWaitForSingleObject_t)(_pipe9x_kernel32_proc("RegisterWaitForSingleObject"));
+		}
 	}
 	
-	_pipe9x_cleanup(&(prh->data));
-	free(prh);
+	return RegisterWaitForSingleObject_p != NULL;
 }
 
-static DWORD WINAPI _pipe9x_read_thread(LPVOID lpParameter)
+static const PipeCreateOptions _pipe9x_default_options = { 0 };
+
+static BOOL _pipe9x_valid_backend(PipeBackend backend)
 {
-	PipeReadHandle prh = (PipeReadHandle)(lpParameter);
+	return backend == PIPE9X_BACKEND_AUTO
+		|| backend == PIPE9X_BACKEND_OVERLAPPED
+		|| backend == PIPE9X_BACKEND_THREADED;
+}
+
+/* The write-behind ring is indexed by 32-bit byte counts modulo the buffer
+ * size, which only carry on from the same offset when they wrap around if
+ * the size is a power of two.
+*/
+static BOOL _pipe9x_valid_write_size(size_t write_size, const PipeCreateOptions *options)
+{
+	return !(options->flags & PIPE9X_WRITE_BEHIND)
+		|| (write_size > 0 && (write_size & (write_size - 1)) == 0);
+}
+
+static void *_pipe9x_default_alloc(size_t size, void *context)
+{
+	return malloc(size);
+}
+
+static void _pipe9x_default_free(void *ptr, void *context)
+{
+	free(ptr);
+}
+
+static PipeAllocator _pipe9x_allocator = { &_pipe9x_default_alloc, &_pipe9x_default_free, NULL, NULL };
+
+void pipe9x_set_allocator(const PipeAllocator *allocator)
+{
+	if(allocator != NULL)
+	{
+		_pipe9x_allocator = *allocator;
+	}
+	else{
+		_pipe9x_allocator.alloc = &_pipe9x_default_alloc;
+		_pipe9x_allocator.free = &_pipe9x_default_free;
+		_pipe9x_allocator.aligned_alloc = NULL;
+		_pipe9x_allocator.context = NULL;
+	}
+}
+
+#define PIPE9X_TRACE_BUF_SIZE (64 * 1024)
+#define PIPE9X_TRACE_RECORD_MAX (1 + (4 * 10))  /* Type byte and four LEB128 integers. */
+
+/**
+ * @private
+*/
+struct _PipeTrace
+{
+	PipeAllocator allocator;
+	CRITICAL_SECTION lock;
+	HANDLE file;
+	DWORD flags;
+	DWORD error;              /* First error from writing to file. */
+	LONG volatile next_id;
+	BOOL use_qpc;             /* Timed using QueryPerformanceCounter() rather than GetTickCount(). */
+	ULONGLONG last_ticks;     /* Time of the last record. */
+	
+	size_t buf_used;
+	unsigned char buf[PIPE9X_TRACE_BUF_SIZE];
+};
+
+static ULONGLONG _pipe9x_trace_ticks(PipeTrace trace)
+{
+	if(trace->use_qpc)
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		
+		return (ULONGLONG)(counter.QuadPart);
+	}
+	else{
+		return GetTickCount();
+	}
+}
+
+static void _pipe9x_trace_write(PipeTrace trace, const void *data, size_t size)
+{
+	DWORD written;
+	
+	if(trace->error == ERROR_SUCCESS && !WriteFile(trace->file, data, size, &written, NULL))
+	{
+		trace->error = GetLastError();
+	}
+}
+
+static void _pipe9x_trace_flush(PipeTrace trace)
+{
+	if(trace->buf_used > 0)
+	{
+		_pipe9x_trace_write(trace, trace->buf, trace->buf_used);
+		trace->buf_used = 0;
+	}
+}
+
+static unsigned char *_pipe9x_trace_leb128(unsigned char *p, ULONGLONG value)
+{
+	while(value >= 0x80)
+	{
+		*(p++) = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	
+	*(p++) = (unsigned char)(value);
+	
+	return p;
+}
+
+static unsigned char *_pipe9x_trace_le(unsigned char *p, ULONGLONG value, int bytes)
+{
+	for(int i = 0; i < bytes; ++i)
+	{
+		*(p++) = (unsigned char)(value >> (i * 8));
+	}
+	
+	return p;
+}
+
+/* Record an operation on a handle attached to a trace. The payload is only
+ * recorded for successful operations on a PIPE9X_TRACE_PAYLOAD trace.
+*/
+static void _pipe9x_trace(struct PipeData *pd, unsigned type, DWORD error, size_t size, const void *payload)
+{
+	PipeTrace trace = pd->trace;
+	
+	if(trace == NULL)
+	{
+		return;
+	}
+	
+	if(!(trace->flags & PIPE9X_TRACE_PAYLOAD) || error != ERROR_SUCCESS)
+	{
+		payload = NULL;
+	}
+	
+	EnterCriticalSection(&(trace->lock));
+	
+	/* Read the time within the lock so records are in time order. */
+	
+	ULONGLONG ticks = _pipe9x_trace_ticks(trace);
+	ULONGLONG elapsed = trace->use_qpc
+		? (ticks - trace->last_ticks)
+		: (DWORD)(ticks - trace->last_ticks);  /* GetTickCount() wraps. */
+	
+	trace->last_ticks = ticks;
+	
+	if((trace->buf_used + PIPE9X_TRACE_RECORD_MAX) > PIPE9X_TRACE_BUF_SIZE)
+	{
+		_pipe9x_trace_flush(trace);
+	}
+	
+	unsigned char *p = trace->buf + trace->buf_used;
+	
+	*(p++) = (unsigned char)(type);
+	p = _pipe9x_trace_leb128(p, pd->trace_id);
+	p = _pipe9x_trace_leb128(p, elapsed);
+	p = _pipe9x_trace_leb128(p, error);
+	p = _pipe9x_trace_leb128(p, size);
+	
+	trace->buf_used = p - trace->buf;
+	
+	if(payload != NULL)
+	{
+		if(size > (PIPE9X_TRACE_BUF_SIZE - trace->buf_used))
+		{
+			_pipe9x_trace_flush(trace);
+		}
+		
+		if(size >= PIPE9X_TRACE_BUF_SIZE)
+		{
+			_pipe9x_trace_write(trace, payload, size);
+		}
+		else{
+			memcpy(trace->buf + trace->buf_used, payload, size);
+			trace->buf_used += size;
+		}
+	}
+	
+	LeaveCriticalSection(&(trace->lock));
+}
+
+/* Record an operation being initiated, and its failure if it failed without
+ * going pending.
+*/
+static void _pipe9x_trace_initiate(struct PipeData *pd, unsigned type, DWORD error, size_t size, const void *payload)
+{
+	if(pd->trace == NULL || error == ERROR_IO_INCOMPLETE)
+	{
+		return;
+	}
+	
+	_pipe9x_trace(pd, type, ERROR_SUCCESS, size, payload);
+	
+	if(error != ERROR_IO_PENDING && error != ERROR_SUCCESS)
+	{
+		_pipe9x_trace(pd, (type + 1), error, 0, NULL);
+	}
+}
+
+static void _pipe9x_set_trace(struct PipeData *pd, PipeTrace trace, unsigned attach_type)
+{
+	_pipe9x_trace(pd, PIPE9X_TRACE_DETACH, ERROR_SUCCESS, 0, NULL);
+	
+	pd->trace = trace;
+	
+	if(trace != NULL)
+	{
+		pd->trace_id = (DWORD)(InterlockedIncrement(&(trace->next_id)));
+		_pipe9x_trace(pd, attach_type, ERROR_SUCCESS, pd->rw_buf_size, NULL);
+	}
+}
+
+DWORD pipe9x_trace_open(PipeTrace *trace_out, const char *path, DWORD flags)
+{
+	PipeTrace trace = _pipe9x_allocator.alloc(sizeof(struct _PipeTrace), _pipe9x_allocator.context);
+	if(trace == NULL)
+	{
+		return ERROR_OUTOFMEMORY;
+	}
+	
+	trace->allocator = _pipe9x_allocator;
+	
+	trace->file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(trace->file == INVALID_HANDLE_VALUE)
+	{
+		DWORD error = GetLastError();
+		
+		trace->allocator.free(trace, trace->allocator.context);
+		return error;
+	}
+	
+	LARGE_INTEGER frequency;
+	trace->use_qpc = QueryPerformanceFrequency(&frequency) && frequency.QuadPart != 0;
+	
+	trace->flags = flags;
+	trace->error = ERROR_SUCCESS;
+	trace->next_id = 0;
+	trace->last_ticks = _pipe9x_trace_ticks(trace);
+	
+	unsigned char *p = trace->buf;
+	
+	memcpy(p, "P9XTRACE", 8);
+	p = _pipe9x_trace_le((p + 8), 1, 4);
+	p = _pipe9x_trace_le(p, flags, 4);
+	p = _pipe9x_trace_le(p, (trace->use_qpc ? (ULONGLONG)(frequency.QuadPart) : 1000), 8);
+	
+	trace->buf_used = p - trace->buf;
+	
+	InitializeCriticalSection(&(trace->lock));
+	
+	*trace_out = trace;
+	
+	return ERROR_SUCCESS;
+}
+
+DWORD pipe9x_trace_close(PipeTrace trace)
+{
+	if(trace == NULL)
+	{
+		return ERROR_SUCCESS;
+	}
+	
+	_pipe9x_trace_flush(trace);
+	
+	DWORD error = trace->error;
+	
+	CloseHandle(trace->file);
+	DeleteCriticalSection(&(trace->lock));
+	
+	trace->allocator.free(trace, trace->allocator.context);
+	
+	return error;
+}
+
+/* Shared memory published by pipe9x_metrics_open(). The claimed flags of the
+ * slots are kept in private memory, so other processes can't corrupt them.
+*/
+static HANDLE _pipe9x_metrics_mapping = NULL;
+static PipeMetricsHeader *_pipe9x_metrics_header = NULL;
+static PipeMetricsSlot *_pipe9x_metrics_slots = NULL;
+static LONG volatile *_pipe9x_metrics_claimed = NULL;
+static DWORD _pipe9x_metrics_hint = 0;  /* Slot after the last one claimed. */
+static LONG volatile _pipe9x_metrics_next_id = 0;
+
+/* Claim a slot to publish the metrics of a new handle in, if there is one free.
+ * Only called when creating handles, so the search doesn't need to be quick.
+*/
+static void _pipe9x_metrics_register(struct PipeData *pd, DWORD type)
+{
+	pd->metrics = NULL;
+	
+	if(_pipe9x_metrics_slots == NULL)
+	{
+		return;
+	}
+	
+	DWORD num_slots = _pipe9x_metrics_header->num_slots;
+	DWORD hint = _pipe9x_metrics_hint;
+	
+	for(DWORD i = 0; i < num_slots; ++i)
+	{
+		DWORD index = (hint + i) % num_slots;
+		
+		if(InterlockedExchange(&(_pipe9x_metrics_claimed[index]), TRUE))
+		{
+			continue;
+		}
+		
+		_pipe9x_metrics_hint = index + 1;
+		
+		PipeMetricsSlot *slot = &(_pipe9x_metrics_slots[index]);
+		
+		InterlockedIncrement(&(slot->sequence));
+		
+		slot->handle_id = (DWORD)(InterlockedIncrement(&_pipe9x_metrics_next_id));
+		slot->type = type;
+		slot->backend = PIPE9X_BACKEND_AUTO;
+		slot->buf_size = (DWORD)(pd->rw_buf_size);
+		slot->pending = FALSE;
+		slot->queue_depth = 0;
+		slot->last_error = ERROR_SUCCESS;
+		slot->ops = 0;
+		slot->bytes = 0;
+		slot->errors = 0;
+		slot->stall_ms = 0;
+		
+		InterlockedIncrement(&(slot->sequence));
+		
+		pd->metrics = slot;
+		return;
+	}
+}
+
+static void _pipe9x_metrics_release(struct PipeData *pd)
+{
+	PipeMetricsSlot *slot = pd->metrics;
+	
+	if(slot == NULL)
+	{
+		return;
+	}
+	
+	InterlockedIncrement(&(slot->sequence));
+	slot->handle_id = 0;
+	InterlockedIncrement(&(slot->sequence));
+	
+	InterlockedExchange(&(_pipe9x_metrics_claimed[slot - _pipe9x_metrics_slots]), FALSE);
+	
+	pd->metrics = NULL;
+}
+
+/* Bytes accepted by writes which haven't reached the pipe yet, given the size
+ * of the pending write (if any).
+*/
+static DWORD _pipe9x_metrics_queued(struct PipeData *pd, size_t pending_size)
+{
+	if((pd->flags & PIPE9X_WRITE_BEHIND) && pd->use_thread_fallback)
+	{
+		/* Already counted in the write-behind ring, see _pipe9x_write_behind(). */
+		return (DWORD)(pd->wb_head - pd->wb_tail);
+	}
+	
+	return (DWORD)(pending_size);
+}
+
+/* Publish an operation being initiated. Each slot is only updated by whoever
+ * is currently driving operations on its handle, so the sequence lock never
+ * has to wait for another writer.
+*/
+static void _pipe9x_metrics_initiate(struct PipeData *pd, DWORD error, size_t size)
+{
+	PipeMetricsSlot *slot = pd->metrics;
+	
+	if(slot == NULL || error == ERROR_IO_INCOMPLETE)
+	{
+		return;
+	}
+	
+	InterlockedIncrement(&(slot->sequence));
+	
+	slot->backend = pd->use_thread_fallback ? PIPE9X_BACKEND_THREADED : PIPE9X_BACKEND_OVERLAPPED;
+	
+	if(error == ERROR_IO_PENDING || error == ERROR_SUCCESS)
+	{
+		slot->pending = TRUE;
+		slot->queue_depth = _pipe9x_metrics_queued(pd, size);
+	}
+	else{
+		++(slot->ops);
+		++(slot->errors);
+		slot->last_error = error;
+	}
+	
+	InterlockedIncrement(&(slot->sequence));
+}
+
+/* Publish an operation completing. */
+static void _pipe9x_metrics_complete(struct PipeData *pd, DWORD error, size_t size)
+{
+	PipeMetricsSlot *slot = pd->metrics;
+	
+	if(slot == NULL)
+	{
+		return;
+	}
+	
+	DWORD stall = GetTickCount() - pd->last_io_time;
+	
+	InterlockedIncrement(&(slot->sequence));
+	
+	slot->pending = FALSE;
+	slot->queue_depth = _pipe9x_metrics_queued(pd, 0);
+	slot->stall_ms += stall;
+	++(slot->ops);
+	
+	if(error == ERROR_SUCCESS)
+	{
+		slot->bytes += size;
+	}
+	else{
+		slot->last_error = error;
+		
+		if(error != ERROR_BROKEN_PIPE && error != ERROR_HANDLE_EOF)
+		{
+			++(slot->errors);
+		}
+	}
+	
+	InterlockedIncrement(&(slot->sequence));
+}
+
+DWORD pipe9x_metrics_open(DWORD num_slots)
+{
+	if(_pipe9x_metrics_mapping != NULL)
+	{
+		return ERROR_ALREADY_EXISTS;
+	}
+	
+	if(num_slots == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	
+	/* Name is the prefix and the process ID in decimal. */
+	
+	char name[sizeof(PIPE9X_METRICS_PREFIX) + 10];
+	strcpy(name, PIPE9X_METRICS_PREFIX);
+	
+	char digits[10];
+	int num_digits = 0;
+	
+	DWORD pid = GetCurrentProcessId();
+	while(pid > 0 || num_digits == 0)
+	{
+		digits[num_digits++] = '0' + (pid % 10);
+		pid /= 10;
+	}
+	
+	char *p = name + sizeof(PIPE9X_METRICS_PREFIX) - 1;
+	while(num_digits > 0)
+	{
+		*(p++) = digits[--num_digits];
+	}
+	
+	*p = '\0';
+	
+	DWORD size = sizeof(PipeMetricsHeader) + (num_slots * sizeof(PipeMetricsSlot));
+	
+	LONG volatile *claimed = _pipe9x_allocator.alloc((num_slots * sizeof(LONG)), _pipe9x_allocator.context);
+	if(claimed == NULL)
+	{
+		return ERROR_OUTOFMEMORY;
+	}
+	
+	HANDLE mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, name);
+	if(mapping == NULL)
+	{
+		DWORD error = GetLastError();
+		
+		_pipe9x_allocator.free((void*)(claimed), _pipe9x_allocator.context);
+		return error;
+	}
+	
+	PipeMetricsHeader *header = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+	if(header == NULL)
+	{
+		DWORD error = GetLastError();
+		
+		CloseHandle(mapping);
+		_pipe9x_allocator.free((void*)(claimed), _pipe9x_allocator.context);
+		
+		return error;
+	}
+	
+	/* The section may be left over from an earlier process with the same ID
+	 * if a reader still has it open.
+	*/
+	memset(header, 0, size);
+	
+	for(DWORD i = 0; i < num_slots; ++i)
+	{
+		claimed[i] = FALSE;
+	}
+	
+	header->version = PIPE9X_METRICS_VERSION;
+	header->header_size = sizeof(PipeMetricsHeader);
+	header->slot_size = sizeof(PipeMetricsSlot);
+	header->num_slots = num_slots;
+	header->process_id = GetCurrentProcessId();
+	
+	/* Written last, so a reader never sees a header with the magic number
+	 * and a partly filled in header.
+	*/
+	InterlockedExchange((LONG volatile*)(&(header->magic)), PIPE9X_METRICS_MAGIC);
+	
+	_pipe9x_metrics_claimed = claimed;
+	_pipe9x_metrics_hint = 0;
+	_pipe9x_metrics_slots = (PipeMetricsSlot*)(header + 1);
+	_pipe9x_metrics_header = header;
+	_pipe9x_metrics_mapping = mapping;
+	
+	return ERROR_SUCCESS;
+}
+
+void pipe9x_metrics_close(void)
+{
+	if(_pipe9x_metrics_mapping == NULL)
+	{
+		return;
+	}
+	
+	UnmapViewOfFile(_pipe9x_metrics_header);
+	CloseHandle(_pipe9x_metrics_mapping);
+	
+	_pipe9x_allocator.free((void*)(_pipe9x_metrics_claimed), _pipe9x_allocator.context);
+	
+	_pipe9x_metrics_slots = NULL;
+	_pipe9x_metrics_header = NULL;
+	_pipe9x_metrics_claimed = NULL;
+	_pipe9x_metrics_mapping = NULL;
+}
+
+static const PipeAllocator *_pipe9x_options_allocator(const PipeCreateOptions *options)
+{
+	return options->allocator != NULL ? options->allocator : &_pipe9x_allocator;
+}
+
+/* Allocate a buffer aligned to PIPE9X_BUFFER_ALIGNMENT, returning the block
+ * to be freed in *base_out.
+*/
+static void *_pipe9x_alloc_buffer(const PipeAllocator *allocator, size_t size, void **base_out)
+{
+	if(allocator->aligned_alloc != NULL)
+	{
+		*base_out = allocator->aligned_alloc(size, PIPE9X_BUFFER_ALIGNMENT, allocator->context);
+		return *base_out;
+	}
+	
+	/* No aligned allocator, over-allocate and align within the block. */
+	
+	*base_out = allocator->alloc(size + PIPE9X_BUFFER_ALIGNMENT - 1, allocator->context);
+	if(*base_out == NULL)
+	{
+		return NULL;
+	}
+	
+	return (void*)(((ULONG_PTR)(*base_out) + PIPE9X_BUFFER_ALIGNMENT - 1) & ~(ULONG_PTR)(PIPE9X_BUFFER_ALIGNMENT - 1));
+}
+
+/* Allocate whole pages directly from VirtualAlloc() if the flags ask for it,
+ * using large pages if requested and possible. Returns NULL if the flags
+ * don't ask for it or it fails, in which case the caller should fall back to
+ * _pipe9x_alloc_buffer().
+*/
+static void *_pipe9x_alloc_pages(size_t size, DWORD flags)
+{
+	if(!(flags & (PIPE9X_PAGE_BUFFERS | PIPE9X_LARGE_PAGES)) || size == 0)
+	{
+		return NULL;
+	}
+	
+	if(flags & PIPE9X_LARGE_PAGES)
+	{
+		/* Large pages need Windows Server 2003 or later and the
+		 * SeLockMemoryPrivilege privilege enabled, they also can't be
+		 * paged out, so only use them when the buffer fills at least one.
+		*/
+		
+		GetLargePageMinimum_t GetLargePageMinimum_p = (GetLargePageMinimum_t)(_pipe9x_kernel32_proc("GetLargePageMinimum"));
+		SIZE_T large_page_size = GetLargePageMinimum_p != NULL ? GetLargePageMinimum_p() : 0;
+		
+		if(large_page_size > 0 && size >= large_page_size)
+		{
+			size_t alloc_size = (size + large_page_size - 1) & ~(large_page_size - 1);
+			
+			void *pages = VirtualAlloc(NULL, alloc_size, (MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES), PAGE_READWRITE);
+			if(pages != NULL)
+			{
+				return pages;
+			}
+		}
+	}
+	
+	return VirtualAlloc(NULL, size, (MEM_COMMIT | MEM_RESERVE), PAGE_READWRITE);
+}
+
+/* Initialise the state of a new or recycled handle object, leaving the buffer
+ * and event object alone.
+*/
+static void _pipe9x_reset_data(struct PipeData *pd, DWORD flags)
+{
+	HANDLE event = pd->overlapped.hEvent;
+	
+	pd->pipe = INVALID_HANDLE_VALUE;
+	pd->shared_pipe = FALSE;
+	memset(&(pd->overlapped), 0, sizeof(pd->overlapped));
+	pd->overlapped.hEvent = event;
+	pd->pending = FALSE;
+	pd->flags = flags;
+	pd->last_io_time = GetTickCount();
+	pd->trace = NULL;
+	pd->trace_id = 0;
+	pd->metrics = NULL;
+	pd->op_has_event = FALSE;
+	pd->op_inline = FALSE;
+	pd->modes_set = FALSE;
+	pd->use_thread_fallback = FALSE;
+	pd->io_thread = NULL;
+	pd->work_event = NULL;
+	pd->request_head = 0;
+	pd->request_tail = 0;
+	pd->completion_head = 0;
+	pd->completion_tail = 0;
+	pd->event_exported = FALSE;
+	pd->caller_waiting = FALSE;
+	pd->worker_sleeping = FALSE;
+	pd->worker_signalling = FALSE;
+	pd->wb_head = 0;
+	pd->wb_want = 0;
+	pd->wb_appended = 0;
+	pd->wb_drain_event = NULL;
+	pd->wb_tail = 0;
+	pd->wb_error = ERROR_SUCCESS;
+	pd->callback_pending = FALSE;
+	pd->closing = FALSE;
+	pd->apc_thread = NULL;
+	pd->apc_thread_id = 0;
+	pd->wait_lock_init = FALSE;
+	pd->wait_active = FALSE;
+	pd->wait_flags = 0;
+	pd->wait_handle = NULL;
+	pd->wait_thread_id = 0;
+}
+
+/* Initialise a new handle object with its buffer (if any) already assigned. */
+static DWORD _pipe9x_init_data_with_buffer(struct PipeData *pd, const PipeCreateOptions *options)
+{
+	pd->overlapped.hEvent = NULL;
+	
+	_pipe9x_reset_data(pd, options->flags);
+	
+	if(pd->flags & PIPE9X_NO_EVENT)
+	{
+		/* Created on demand by _pipe9x_event(). */
+		return ERROR_SUCCESS;
+	}
+	
+	/* Create event object used to signal overlapped I/O completion. */
+	
+	pd->overlapped.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+	if(pd->overlapped.hEvent == NULL)
+	{
+		return GetLastError();
+	}
+	
+	return ERROR_SUCCESS;
+}
+
+static DWORD _pipe9x_init_data(struct PipeData *pd, size_t buf_size, const PipeCreateOptions *options)
+{
+	/* The buffer is allocated by _pipe9x_buffer() when first needed. */
+	
+	pd->block = NULL;
+	pd->rw_buf = NULL;
+	pd->rw_buf_base = NULL;
+	pd->rw_buf_pages = FALSE;
+	pd->rw_buf_size = buf_size;
+	
+	return _pipe9x_init_data_with_buffer(pd, options);
+}
+
+/* Free the buffer of a handle object (unless part of a PipeBlock). */
+static void _pipe9x_free_buffer(struct PipeData *pd)
+{
+	if(pd->rw_buf_base != NULL)
+	{
+		if(pd->rw_buf_pages)
+		{
+			VirtualFree(pd->rw_buf_base, 0, MEM_RELEASE);
+		}
+		else{
+			pd->allocator.free(pd->rw_buf_base, pd->allocator.context);
+		}
+	}
+	
+	pd->rw_buf = NULL;
+	pd->rw_buf_base = NULL;
+	pd->rw_buf_pages = FALSE;
+}
+
+/* Free the buffer and event object of a handle object after _pipe9x_cleanup()
+ * if it isn't going on a free list.
+*/
+static void _pipe9x_free_data(struct PipeData *pd)
+{
+	if(pd->overlapped.hEvent != NULL)
+	{
+		CloseHandle(pd->overlapped.hEvent);
+		pd->overlapped.hEvent = NULL;
+	}
+	
+	_pipe9x_free_buffer(pd);
+}
+
+/* Allocate the buffer of a handle object if it hasn't been already. */
+static DWORD _pipe9x_buffer(struct PipeData *pd)
+{
+	if(pd->rw_buf == NULL)
+	{
+		pd->rw_buf_base = _pipe9x_alloc_pages(pd->rw_buf_size, pd->flags);
+		
+		if(pd->rw_buf_base != NULL)
+		{
+			pd->rw_buf = pd->rw_buf_base;
+			pd->rw_buf_pages = TRUE;
+		}
+		else{
+			pd->rw_buf = _pipe9x_alloc_buffer(&(pd->allocator), pd->rw_buf_size, &(pd->rw_buf_base));
+			if(pd->rw_buf == NULL)
+			{
+				return ERROR_OUTOFMEMORY;
+			}
+		}
+	}
+	
+	pd->last_io_time = GetTickCount();
+	
+	return ERROR_SUCCESS;
+}
+
+/* Free the buffer of a handle object if it has been idle for quiet_ms. */
+static BOOL _pipe9x_release_idle(struct PipeData *pd, DWORD quiet_ms)
+{
+	if(pd->pending
+		|| pd->rw_buf_base == NULL  /* Not allocated, or part of a PipeBlock. */
+		|| (GetTickCount() - pd->last_io_time) < quiet_ms)
+	{
+		return FALSE;
+	}
+	
+	_pipe9x_free_buffer(pd);
+	
+	return TRUE;
+}
+
+/* Free a handle object after _pipe9x_free_data(). */
+static void _pipe9x_free_handle(struct PipeData *pd)
+{
+	struct PipeBlock *block = pd->block;
+	
+	if(block != NULL)
+	{
+		if(InterlockedDecrement(&(block->refs)) == 0)
+		{
+			if(block->pages)
+			{
+				VirtualFree(block->base, 0, MEM_RELEASE);
+			}
+			else{
+				PipeAllocator allocator = block->allocator;
+				allocator.free(block->base, allocator.context);
+			}
+		}
+	}
+	else{
+		PipeAllocator allocator = pd->allocator;
+		allocator.free(pd->alloc_base, allocator.context);
+	}
+}
+
+#ifndef PIPE9X_FREE_LIST_MAX
+#define PIPE9X_FREE_LIST_MAX 16  /* Maximum closed handle objects of each type kept for reuse. */
+#endif
+
+/**
+ * @private
+*/
+struct PipeFreeList
+{
+	LONG volatile lock;
+	unsigned int count;
+	struct PipeData *shells[PIPE9X_FREE_LIST_MAX];
+};
+
+static struct PipeFreeList _pipe9x_read_free_list;
+static struct PipeFreeList _pipe9x_write_free_list;
+
+static void _pipe9x_free_list_lock(struct PipeFreeList *list)
+{
+	/* Only held for a few instructions, so spin rather than needing a
+	 * CRITICAL_SECTION which would need initialising somewhere.
+	*/
+	while(InterlockedExchange(&(list->lock), TRUE))
+	{
+		Sleep(0);
+	}
+}
+
+static void _pipe9x_free_list_unlock(struct PipeFreeList *list)
+{
+	InterlockedExchange(&(list->lock), FALSE);
+}
+
+static BOOL _pipe9x_allocator_equal(const PipeAllocator *a, const PipeAllocator *b)
+{
+	return a->alloc == b->alloc
+		&& a->free == b->free
+		&& a->aligned_alloc == b->aligned_alloc
+		&& a->context == b->context;
+}
+
+/* Take a handle object matching the given buffer size and options from a free
+ * list. Returns NULL if there isn't one.
+*/
+static struct PipeData *_pipe9x_free_list_get(struct PipeFreeList *list, size_t buf_size, const PipeCreateOptions *options)
+{
+	const PipeAllocator *allocator = _pipe9x_options_allocator(options);
+	struct PipeData *pd = NULL;
+	
+	_pipe9x_free_list_lock(list);
+	
+	/* Search from the most recently closed handle, its memory is the most
+	 * likely to still be in the cache.
+	*/
+	for(unsigned int i = list->count; i > 0; --i)
+	{
+		struct PipeData *shell = list->shells[i - 1];
+		
+		if(shell->rw_buf_size == buf_size
+			&& shell->flags == options->flags
+			&& _pipe9x_allocator_equal(&(shell->allocator), allocator))
+		{
+			pd = shell;
+			list->shells[i - 1] = list->shells[--(list->count)];
+			
+			break;
+		}
+	}
+	
+	_pipe9x_free_list_unlock(list);
+	
+	return pd;
+}
+
+/* Put a closed handle object (after _pipe9x_cleanup()) on a free list for
+ * reuse. Returns FALSE if it can't be reused or the free list is full.
+*/
+static BOOL _pipe9x_free_list_put(struct PipeFreeList *list, struct PipeData *pd)
+{
+	if(pd->block != NULL)
+	{
+		/* Can't be freed individually. */
+		return FALSE;
+	}
+	
+	if(pd->flags & PIPE9X_NO_EVENT)
+	{
+		if(pd->overlapped.hEvent != NULL)
+		{
+			CloseHandle(pd->overlapped.hEvent);
+			pd->overlapped.hEvent = NULL;
+		}
+	}
+	else if(pd->overlapped.hEvent == NULL)
+	{
+		return FALSE;
+	}
+	else{
+		/* The event is signalled whenever no operation is pending. */
+		SetEvent(pd->overlapped.hEvent);
+	}
+	
+	BOOL stored = FALSE;
+	
+	_pipe9x_free_list_lock(list);
+	
+	if(list->count < PIPE9X_FREE_LIST_MAX)
+	{
+		list->shells[(list->count)++] = pd;
+		stored = TRUE;
+	}
+	
+	_pipe9x_free_list_unlock(list);
+	
+	return stored;
+}
+
+static DWORD _pipe9x_read_alloc(PipeReadHandle *prh_out, size_t read_size, const PipeCreateOptions *options)
+{
+	*prh_out = NULL;
+	
+	PipeReadHandle prh;
+	
+	struct PipeData *shell = _pipe9x_free_list_get(&_pipe9x_read_free_list, read_size, options);
+	if(shell != NULL)
+	{
+		prh = (PipeReadHandle)((char*)(shell) - offsetof(struct _PipeReadHandle, data));
+		_pipe9x_reset_data(&(prh->data), options->flags);
+	}
+	else{
+		const PipeAllocator *allocator = _pipe9x_options_allocator(options);
+		
+		/* Aligned so the I/O thread fields don't share a cache line with
+		 * anything else, see struct PipeData.
+		*/
+		void *alloc_base;
+		prh = _pipe9x_alloc_buffer(allocator, sizeof(struct _PipeReadHandle), &alloc_base);
+		if(prh == NULL)
+		{
+			return ERROR_OUTOFMEMORY;
+		}
+		
+		prh->data.alloc_base = alloc_base;
+		
+		/* Copied into the handle object, so the caller's PipeAllocator
+		 * doesn't need to outlive it.
+		*/
+		prh->data.allocator = *allocator;
+		
+		DWORD error = _pipe9x_init_data(&(prh->data), read_size, options);
+		if(error != ERROR_SUCCESS)
+		{
+			pipe9x_read_close(prh);
+			return error;
+		}
+	}
+	
+	prh->callback = NULL;
+	prh->callback_context = NULL;
+	prh->wait_callback = NULL;
+	prh->wait_context = NULL;
+	
+	_pipe9x_metrics_register(&(prh->data), PIPE9X_METRICS_READ);
+	
+	*prh_out = prh;
+	return ERROR_SUCCESS;
+}
+
+static DWORD _pipe9x_write_alloc(PipeWriteHandle *pwh_out, size_t write_size, const PipeCreateOptions *options)
+{
+	*pwh_out = NULL;
+	
+	PipeWriteHandle pwh;
+	
+	struct PipeData *shell = _pipe9x_free_list_get(&_pipe9x_write_free_list, write_size, options);
+	if(shell != NULL)
+	{
+		pwh = (PipeWriteHandle)((char*)(shell) - offsetof(struct _PipeWriteHandle, data));
+		_pipe9x_reset_data(&(pwh->data), options->flags);
+	}
+	else{
+		const PipeAllocator *allocator = _pipe9x_options_allocator(options);
+		
+		/* Aligned so the I/O thread fields don't share a cache line with
+		 * anything else, see struct PipeData.
+		*/
+		void *alloc_base;
+		pwh = _pipe9x_alloc_buffer(allocator, sizeof(struct _PipeWriteHandle), &alloc_base);
+		if(pwh == NULL)
+		{
+			return ERROR_OUTOFMEMORY;
+		}
+		
+		pwh->data.alloc_base = alloc_base;
+		
+		/* Copied into the handle object, so the caller's PipeAllocator
+		 * doesn't need to outlive it.
+		*/
+		pwh->data.allocator = *allocator;
+		
+		DWORD error = _pipe9x_init_data(&(pwh->data), write_size, options);
+		if(error != ERROR_SUCCESS)
+		{
+			pipe9x_write_close(pwh);
+			return error;
+		}
+	}
+	
+	pwh->callback = NULL;
+	pwh->callback_context = NULL;
+	pwh->wait_callback = NULL;
+	pwh->wait_context = NULL;
+	
+	_pipe9x_metrics_register(&(pwh->data), PIPE9X_METRICS_WRITE);
+	
+	*pwh_out = pwh;
+	return ERROR_SUCCESS;
+}
+
+static void _pipe9x_free_list_flush(struct PipeFreeList *list)
+{
+	_pipe9x_free_list_lock(list);
+	
+	while(list->count > 0)
+	{
+		struct PipeData *pd = list->shells[--(list->count)];
+		
+		_pipe9x_free_data(pd);
+		_pipe9x_free_handle(pd);
+	}
+	
+	_pipe9x_free_list_unlock(list);
+}
+
+void pipe9x_flush_free_lists(void)
+{
+	_pipe9x_free_list_flush(&_pipe9x_read_free_list);
+	_pipe9x_free_list_flush(&_pipe9x_write_free_list);
+}
+
+#define PIPE9X_PIPE_NAME_MAX 32
+
+/* Create a named pipe with a random name (written to name_out) and start an
+ * overlapped ConnectNamedPipe() on it using the given overlapped structure.
+ *
+ * Returns ERROR_CALL_NOT_IMPLEMENTED if the system doesn't do named pipes.
+*/
+static DWORD _pipe9x_named_pipe_listen(
+	HANDLE *server_out,
+	char *name_out,
+	DWORD server_mode,
+	BOOL server_inherit,
+	DWORD buf_size,
+	OVERLAPPED *overlapped)
+{
+	HANDLE server = INVALID_HANDLE_VALUE;
+	
+	while(server == INVALID_HANDLE_VALUE)
+	{
+		strcpy(name_out, "\\\\.\\pipe\\tmp_");
+		int pnlen = strlen(name_out);
+		
+		while(pnlen < (PIPE9X_PIPE_NAME_MAX - 1))
+		{
+			char rndchar = 'A' + (rand() % 26);
+			name_out[pnlen++] = rndchar;
+		}
+		
+		name_out[pnlen] = '\0';
+		
+		SECURITY_ATTRIBUTES s_secattrs = { sizeof(SECURITY_ATTRIBUTES), NULL, server_inherit };
+		
+		server = CreateNamedPipe(
+			name_out,                                           /* lpName */
+			(server_mode | FILE_FLAG_OVERLAPPED),               /* dwOpenMode */
+			(PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT),  /* dwPipeMode */
+			1,                                                  /* nMaxInstances */
+			buf_size,                                           /* nOutBufferSize */
+			buf_size,                                           /* nInBufferSize */
+			0,                                                  /* nDefaultTimeOut */
+			&s_secattrs);                                       /* lpSecurityAttributes */
+		
+		if(server == INVALID_HANDLE_VALUE)
+		{
+			DWORD error = GetLastError();
+			
+			if(error == ERROR_FILE_EXISTS)
+			{
+				/* Name already in use, loop and try another. */
+			}
+			else{
+				return error;
+			}
+		}
+	}
+	
+	if(!ConnectNamedPipe(server, overlapped))
+	{
+		DWORD error = GetLastError();
+		
+		if(error != ERROR_IO_PENDING)
+		{
+			CloseHandle(server);
+			return error;
+		}
+	}
+	
+	*server_out = server;
+	
+	return ERROR_SUCCESS;
+}
+
+/* Open the client end of a pipe created by _pipe9x_named_pipe_listen(). */
+static DWORD _pipe9x_named_pipe_open(
+	const char *name,
+	HANDLE *client_out,
+	DWORD client_access,
+	BOOL client_inherit)
+{
+	SECURITY_ATTRIBUTES c_secattrs = { sizeof(SECURITY_ATTRIBUTES), NULL, client_inherit };
+	
+	HANDLE client = CreateFile(
+		name,                  /* lpFileName */
+		client_access,         /* dwDesiredAccess */
+		0,                     /* dwShareMode */
+		&c_secattrs,           /* lpSecurityAttributes */
+		OPEN_EXISTING,         /* dwCreationDisposition */
+		FILE_FLAG_OVERLAPPED,  /* dwFlagsAndAttributes */
+		NULL);                 /* hTemplateFile */
+	
+	if(client == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+	
+	*client_out = client;
+	
+	return ERROR_SUCCESS;
+}
+
+/* Complete the connection on the server end once the client end is open. */
+static DWORD _pipe9x_named_pipe_accept(HANDLE server, OVERLAPPED *overlapped)
+{
+	DWORD transferred_bytes;
+	if(!GetOverlappedResult(server, overlapped, &transferred_bytes, TRUE))
+	{
+		return GetLastError();
+	}
+	
+	return ERROR_SUCCESS;
+}
+
+/* Close the server end of a pipe without completing the connection. */
+static void _pipe9x_named_pipe_abort(HANDLE server, OVERLAPPED *overlapped)
+{
+	/* Closing the server end cancels the pending connect, which still
+	 * writes to the overlapped structure, so wait for that before the
+	 * caller frees it.
+	*/
+	CloseHandle(server);
+	
+	while(!HasOverlappedIoCompleted(overlapped))
+	{
+		Sleep(1);
+	}
+}
+
+/* Just enough of the native API to create an unnamed pipe, see
+ * _pipe9x_nt_pipe_pair().
+*/
+
+struct PipeNtString
+{
+	USHORT Length;
+	USHORT MaximumLength;
+	WCHAR *Buffer;
+};
+
+struct PipeNtObjectAttributes
+{
+	ULONG Length;
+	HANDLE RootDirectory;
+	struct PipeNtString *ObjectName;
+	ULONG Attributes;
+	PVOID SecurityDescriptor;
+	PVOID SecurityQualityOfService;
+};
+
+struct PipeNtIoStatus
+{
+	ULONG_PTR Status;  /* NTSTATUS, padded to the size of a pointer. */
+	ULONG_PTR Information;
+};
+
+typedef LONG (WINAPI *NtCreateNamedPipeFile_t)(PHANDLE, ULONG, struct PipeNtObjectAttributes*, struct PipeNtIoStatus*, ULONG, ULONG, ULONG, ULONG, ULONG, ULONG, ULONG, ULONG, ULONG, LARGE_INTEGER*);
+typedef LONG (WINAPI *NtOpenFile_t)(PHANDLE, ULONG, struct PipeNtObjectAttributes*, struct PipeNtIoStatus*, ULONG, ULONG);
+
+#define PIPE9X_OBJ_INHERIT                   0x00000002
+#define PIPE9X_OBJ_CASE_INSENSITIVE          0x00000040
+#define PIPE9X_FILE_CREATE                   0x00000002
+#define PIPE9X_FILE_SYNCHRONOUS_IO_NONALERT  0x00000020
+#define PIPE9X_FILE_NON_DIRECTORY_FILE       0x00000040
+
+static NtCreateNamedPipeFile_t NtCreateNamedPipeFile_p = NULL;
+static NtOpenFile_t NtOpenFile_p = NULL;
+
+static HANDLE _pipe9x_nt_pipe_dir = NULL;
+static LONG volatile _pipe9x_nt_pipe_state = 0;  /* 0 = not tried, 1 = available, 2 = unavailable */
+static LONG volatile _pipe9x_nt_pipe_lock = FALSE;
+
+static void _pipe9x_nt_object_attributes(struct PipeNtObjectAttributes *attrs, HANDLE root, struct PipeNtString *name, BOOL inherit)
+{
+	attrs->Length = sizeof(*attrs);
+	attrs->RootDirectory = root;
+	attrs->ObjectName = name;
+	attrs->Attributes = PIPE9X_OBJ_CASE_INSENSITIVE | (inherit ? PIPE9X_OBJ_INHERIT : 0);
+	attrs->SecurityDescriptor = NULL;
+	attrs->SecurityQualityOfService = NULL;
+}
+
+/* Look up the native API functions and open the named pipe filesystem root,
+ * which unnamed pipes are created relative to, the first time through.
+*/
+static BOOL _pipe9x_nt_pipe_init(void)
+{
+	if(_pipe9x_nt_pipe_state != 0)
+	{
+		return _pipe9x_nt_pipe_state == 1;
+	}
+	
+	/* Spin rather than needing a CRITICAL_SECTION, as with the free lists. */
+	
+	while(InterlockedExchange(&_pipe9x_nt_pipe_lock, TRUE))
+	{
+		Sleep(0);
+	}
+	
+	if(_pipe9x_nt_pipe_state == 0)
+	{
+		HMODULE ntdll = GetModuleHandle("ntdll.dll");
+		
+		if(ntdll != NULL)
+		{
+			NtCreateNamedPipeFile_p = (NtCreateNamedPipeFile_t)(GetProcAddress(ntdll, "NtCreateNamedPipeFile"));
+			NtOpenFile_p = (NtOpenFile_t)(GetProcAddress(ntdll, "NtOpenFile"));
+		}
+		
+		if(NtCreateNamedPipeFile_p != NULL && NtOpenFile_p != NULL)
+		{
+			static WCHAR dir_path[] = L"\\Device\\NamedPipe\\";
+			struct PipeNtString dir_name = { sizeof(dir_path) - sizeof(WCHAR), sizeof(dir_path), dir_path };
+			
+			struct PipeNtObjectAttributes attrs;
+			_pipe9x_nt_object_attributes(&attrs, NULL, &dir_name, FALSE);
+			
+			struct PipeNtIoStatus iosb;
+			
+			if(NtOpenFile_p(
+				&_pipe9x_nt_pipe_dir,
+				(GENERIC_READ | SYNCHRONIZE),
+				&attrs,
+				&iosb,
+				(FILE_SHARE_READ | FILE_SHARE_WRITE),
+				PIPE9X_FILE_SYNCHRONOUS_IO_NONALERT) < 0)
+			{
+				_pipe9x_nt_pipe_dir = NULL;
+			}
+		}
+		
+		_pipe9x_nt_pipe_state = (_pipe9x_nt_pipe_dir != NULL) ? 1 : 2;
+	}
+	
+	InterlockedExchange(&_pipe9x_nt_pipe_lock, FALSE);
+	
+	return _pipe9x_nt_pipe_state == 1;
+}
+
+#define PIPE9X_STATUS_NO_MEMORY              ((LONG)(0xC0000017))
+#define PIPE9X_STATUS_QUOTA_EXCEEDED         ((LONG)(0xC0000044))
+#define PIPE9X_STATUS_INSUFFICIENT_RESOURCES ((LONG)(0xC000009A))
+#define PIPE9X_STATUS_TOO_MANY_OPENED_FILES  ((LONG)(0xC000011F))
+
+/* Handle NtCreateNamedPipeFile() or NtOpenFile() failing. The root directory
+ * opens fine on systems which can't create unnamed pipes, so that can only be
+ * found out by trying. Anything other than running out of resources means it
+ * isn't supported, so don't keep trying (and failing) for every new pipe.
+*/
+static DWORD _pipe9x_nt_pipe_failed(LONG status)
+{
+	if(status != PIPE9X_STATUS_NO_MEMORY
+		&& status != PIPE9X_STATUS_QUOTA_EXCEEDED
+		&& status != PIPE9X_STATUS_INSUFFICIENT_RESOURCES
+		&& status != PIPE9X_STATUS_TOO_MANY_OPENED_FILES)
+	{
+		InterlockedExchange(&_pipe9x_nt_pipe_state, 2);
+	}
+	
+	return ERROR_NOT_SUPPORTED;
+}
+
+/* Create a connected pipe pair for overlapped I/O directly through the native
+ * API, as CreatePipe() does on recent versions of Windows, without the name,
+ * CreateFile() path lookup or connection handshake of _pipe9x_named_pipe_pair().
+ *
+ * Returns ERROR_NOT_SUPPORTED if the system can't create unnamed pipes this way
+ * (anything before Windows 10), in which case the caller should fall back to
+ * creating a named pipe.
+*/
+static DWORD _pipe9x_nt_pipe_pair(
+	HANDLE *server_out,
+	DWORD server_mode,
+	BOOL server_inherit,
+	HANDLE *client_out,
+	DWORD client_access,
+	BOOL client_inherit,
+	DWORD buf_size)
+{
+	if(!_pipe9x_nt_pipe_init())
+	{
+		return ERROR_NOT_SUPPORTED;
+	}
+	
+	struct PipeNtString no_name = { 0, 0, NULL };
+	struct PipeNtObjectAttributes attrs;
+	struct PipeNtIoStatus iosb;
+	
+	ULONG server_access = SYNCHRONIZE | FILE_READ_ATTRIBUTES | FILE_WRITE_ATTRIBUTES;
+	if(server_mode & PIPE_ACCESS_INBOUND)
+	{
+		server_access |= GENERIC_READ;
+	}
+	
+	if(server_mode & PIPE_ACCESS_OUTBOUND)
+	{
+		server_access |= GENERIC_WRITE;
+	}
+	
+	LARGE_INTEGER timeout;
+	timeout.QuadPart = -1200000000;  /* 120 seconds, as CreatePipe() uses. */
+	
+	_pipe9x_nt_object_attributes(&attrs, _pipe9x_nt_pipe_dir, &no_name, server_inherit);
+	
+	/* No FILE_SYNCHRONOUS_IO_* option, so the handle does overlapped I/O. */
+	
+	HANDLE server;
+	LONG status = NtCreateNamedPipeFile_p(
+		&server,
+		server_access,
+		&attrs,
+		&iosb,
+		(FILE_SHARE_READ | FILE_SHARE_WRITE),
+		PIPE9X_FILE_CREATE,  /* CreateDisposition */
+		0,                   /* CreateOptions */
+		0,                   /* NamedPipeType (FILE_PIPE_BYTE_STREAM_TYPE) */
+		0,                   /* ReadMode (FILE_PIPE_BYTE_STREAM_MODE) */
+		0,                   /* CompletionMode (FILE_PIPE_QUEUE_OPERATION) */
+		1,                   /* MaximumInstances */
+		buf_size,            /* InboundQuota */
+		buf_size,            /* OutboundQuota */
+		&timeout);
+	
+	if(status < 0)
+	{
+		return _pipe9x_nt_pipe_failed(status);
+	}
+	
+	/* Opening the server end with an empty name opens (and connects) the
+	 * client end.
+	*/
+	
+	_pipe9x_nt_object_attributes(&attrs, server, &no_name, client_inherit);
+	
+	HANDLE client;
+	status = NtOpenFile_p(
+		&client,
+		(client_access | SYNCHRONIZE | FILE_READ_ATTRIBUTES),
+		&attrs,
+		&iosb,
+		(FILE_SHARE_READ | FILE_SHARE_WRITE),
+		PIPE9X_FILE_NON_DIRECTORY_FILE);
+	
+	if(status < 0)
+	{
+		CloseHandle(server);
+		return _pipe9x_nt_pipe_failed(status);
+	}
+	
+	*server_out = server;
+	*client_out = client;
+	
+	return ERROR_SUCCESS;
+}
+
+/* Create a named pipe with a random name and connect to it, giving the server
+ * end (opened with server_mode) and the client end (opened with client_access)
+ * in *server_out and *client_out. The overlapped structure is used to wait for
+ * the connection and is left signalled.
+ *
+ * An unnamed pipe is created instead where the system supports it, see
+ * _pipe9x_nt_pipe_pair().
+ *
+ * Returns ERROR_CALL_NOT_IMPLEMENTED if the system doesn't do named pipes.
+*/
+static DWORD _pipe9x_named_pipe_pair(
+	HANDLE *server_out,
+	DWORD server_mode,
+	BOOL server_inherit,
+	HANDLE *client_out,
+	DWORD client_access,
+	BOOL client_inherit,
+	DWORD buf_size,
+	OVERLAPPED *overlapped)
+{
+	if(_pipe9x_nt_pipe_pair(
+		server_out, server_mode, server_inherit,
+		client_out, client_access, client_inherit,
+		buf_size) == ERROR_SUCCESS)
+	{
+		return ERROR_SUCCESS;
+	}
+	
+	HANDLE server, client;
+	char pipename[PIPE9X_PIPE_NAME_MAX];
+	
+	DWORD error = _pipe9x_named_pipe_listen(&server, pipename, server_mode, server_inherit, buf_size, overlapped);
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	/* Make a connection to the pipe to serve as the client end. */
+	
+	error = _pipe9x_named_pipe_open(pipename, &client, client_access, client_inherit);
+	if(error != ERROR_SUCCESS)
+	{
+		_pipe9x_named_pipe_abort(server, overlapped);
+		return error;
+	}
+	
+	error = _pipe9x_named_pipe_accept(server, overlapped);
+	if(error != ERROR_SUCCESS)
+	{
+		CloseHandle(client);
+		CloseHandle(server);
+		
+		return error;
+	}
+	
+	*server_out = server;
+	*client_out = client;
+	
+	return ERROR_SUCCESS;
+}
+
+/* Create an anonymous pipe with (possibly) differing inheritability of each
+ * end.
+*/
+static DWORD _pipe9x_anon_pipe_pair(
+	HANDLE *read_out,
+	BOOL read_inherit,
+	HANDLE *write_out,
+	BOOL write_inherit,
+	DWORD buf_size)
+{
+	SECURITY_ATTRIBUTES r_secattrs = { sizeof(SECURITY_ATTRIBUTES), NULL, read_inherit };
+	
+	HANDLE read_pipe, write_pipe;
+	
+	if(!CreatePipe(&read_pipe, &write_pipe, &r_secattrs, buf_size))
+	{
+		return GetLastError();
+	}
+	
+	if(read_inherit != write_inherit)
+	{
+		HANDLE new_write_handle;
+		
+		if(!DuplicateHandle(
+			GetCurrentProcess(),
+			write_pipe,
+			GetCurrentProcess(),
+			&new_write_handle,
+			0,
+			write_inherit,
+			DUPLICATE_SAME_ACCESS))
+		{
+			DWORD error = GetLastError();
+			
+			CloseHandle(write_pipe);
+			CloseHandle(read_pipe);
+			
+			return error;
+		}
+		
+		CloseHandle(write_pipe);
+		write_pipe = new_write_handle;
+	}
+	
+	*read_out = read_pipe;
+	*write_out = write_pipe;
+	
+	return ERROR_SUCCESS;
+}
+
+DWORD pipe9x_create(
+	PipeReadHandle *prh_out,
+	size_t read_size,
+	BOOL read_inherit,
+	PipeWriteHandle *pwh_out,
+	size_t write_size,
+	BOOL write_inherit)
+{
+	return pipe9x_create_ex(prh_out, read_size, read_inherit, pwh_out, write_size, write_inherit, NULL);
+}
+
+DWORD pipe9x_create_ex(
+	PipeReadHandle *prh_out,
+	size_t read_size,
+	BOOL read_inherit,
+	PipeWriteHandle *pwh_out,
+	size_t write_size,
+	BOOL write_inherit,
+	const PipeCreateOptions *options)
+{
+	*prh_out = NULL;
+	*pwh_out = NULL;
+	
+	if(options == NULL)
+	{
+		options = &_pipe9x_default_options;
+	}
+	
+	if(options->backend == PIPE9X_BACKEND_SIMULATED)
+	{
+		/* Only provided by pipe9x-sim.c. */
+		return ERROR_CALL_NOT_IMPLEMENTED;
+	}
+	else if(!_pipe9x_valid_backend(options->backend)
+		|| !_pipe9x_valid_write_size(write_size, options))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	
+	PipeReadHandle prh;
+	PipeWriteHandle pwh;
+	
+	DWORD error = _pipe9x_read_alloc(&prh, read_size, options);
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	error = _pipe9x_write_alloc(&pwh, write_size, options);
+	if(error != ERROR_SUCCESS)
+	{
+		pipe9x_read_close(prh);
+		return error;
+	}
+	
+	/* Create named pipe to serve as the read end of the pipe.
+	 *
+	 * Anonymous pipes cannot be used for overlapped I/O, so we need to
+	 * create a named pipe with a random name and open it.
+	*/
+	
+	error = ERROR_CALL_NOT_IMPLEMENTED;
+	
+	if(options->backend != PIPE9X_BACKEND_THREADED)
+	{
+		error = _pipe9x_named_pipe_pair(
+			&(prh->data.pipe), PIPE_ACCESS_INBOUND, read_inherit,
+			&(pwh->data.pipe), GENERIC_WRITE, write_inherit,
+			read_size, &(prh->data.overlapped));
+	}
+	
+	if(error == ERROR_CALL_NOT_IMPLEMENTED && options->backend != PIPE9X_BACKEND_OVERLAPPED)
+	{
+		/* Okay... named pipes only exist on Windows NT, so we have to
+		 * fall back to using anonymous pipes, which means we can't use
+		 * overlapped I/O and have to fall back to performing read/write
+		 * operations on a background thread instead.
+		 *
+		 * Wheeee.
+		*/
+		
+		error = _pipe9x_anon_pipe_pair(
+			&(prh->data.pipe), read_inherit,
+			&(pwh->data.pipe), write_inherit,
+			read_size);
+		
+		prh->data.use_thread_fallback = TRUE;
+		pwh->data.use_thread_fallback = TRUE;
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		return error;
+	}
+	
+	*prh_out = prh;
+	*pwh_out = pwh;
+	
+	return ERROR_SUCCESS;
+}
+
+static size_t _pipe9x_align_size(size_t size)
+{
+	return (size + PIPE9X_BUFFER_ALIGNMENT - 1) & ~(size_t)(PIPE9X_BUFFER_ALIGNMENT - 1);
+}
+
+DWORD pipe9x_create_many(
+	PipeReadHandle *prh_out,
+	PipeWriteHandle *pwh_out,
+	const PipeCreateSpec *specs,
+	size_t count,
+	const PipeCreateOptions *options)
+{
+	for(size_t i = 0; i < count; ++i)
+	{
+		prh_out[i] = NULL;
+		pwh_out[i] = NULL;
+	}
+	
+	if(count == 0)
+	{
+		return ERROR_SUCCESS;
+	}
+	
+	if(options == NULL)
+	{
+		options = &_pipe9x_default_options;
+	}
+	
+	if(options->backend == PIPE9X_BACKEND_SIMULATED)
+	{
+		/* Only provided by pipe9x-sim.c. */
+		return ERROR_CALL_NOT_IMPLEMENTED;
+	}
+	else if(!_pipe9x_valid_backend(options->backend))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	
+	for(size_t i = 0; i < count; ++i)
+	{
+		if(!_pipe9x_valid_write_size(specs[i].write_size, options))
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+	
+	const PipeAllocator *allocator = _pipe9x_options_allocator(options);
+	
+	/* Allocate a single block holding all the handle objects and buffers,
+	 * each aligned to PIPE9X_BUFFER_ALIGNMENT.
+	*/
+	
+	size_t block_size = _pipe9x_align_size(sizeof(struct PipeBlock))
+		+ count * (_pipe9x_align_size(sizeof(struct _PipeReadHandle)) + _pipe9x_align_size(sizeof(struct _PipeWriteHandle)));
+	
+	for(size_t i = 0; i < count; ++i)
+	{
+		block_size += _pipe9x_align_size(specs[i].read_size) + _pipe9x_align_size(specs[i].write_size);
+	}
+	
+	void *block_base = _pipe9x_alloc_pages(block_size, options->flags);
+	BOOL block_pages = (block_base != NULL);
+	
+	unsigned char *block_ptr = block_base;
+	if(block_ptr == NULL)
+	{
+		block_ptr = _pipe9x_alloc_buffer(allocator, block_size, &block_base);
+		if(block_ptr == NULL)
+		{
+			return ERROR_OUTOFMEMORY;
+		}
+	}
+	
+	struct PipeBlock *block = (struct PipeBlock*)(block_ptr);
+	block->refs = 0;
+	block->allocator = *allocator;
+	block->base = block_base;
+	block->pages = block_pages;
+	
+	block_ptr += _pipe9x_align_size(sizeof(struct PipeBlock));
+	
+	unsigned char *buf_ptr = block_ptr + count * (_pipe9x_align_size(sizeof(struct _PipeReadHandle)) + _pipe9x_align_size(sizeof(struct _PipeWriteHandle)));
+	
+	DWORD error = ERROR_SUCCESS;
+	
+	for(size_t i = 0; i < count; ++i)
+	{
+		PipeReadHandle prh = (PipeReadHandle)(block_ptr);
+		block_ptr += _pipe9x_align_size(sizeof(struct _PipeReadHandle));
+		
+		PipeWriteHandle pwh = (PipeWriteHandle)(block_ptr);
+		block_ptr += _pipe9x_align_size(sizeof(struct _PipeWriteHandle));
+		
+		prh->data.allocator = *allocator;
+		prh->data.block = block;
+		prh->data.alloc_base = NULL;
+		prh->data.rw_buf = buf_ptr;
+		prh->data.rw_buf_base = NULL;
+		prh->data.rw_buf_pages = FALSE;
+		prh->data.rw_buf_size = specs[i].read_size;
+		prh->callback = NULL;
+		prh->callback_context = NULL;
+		prh->wait_callback = NULL;
+		prh->wait_context = NULL;
+		
+		buf_ptr += _pipe9x_align_size(specs[i].read_size);
+		
+		pwh->data.allocator = *allocator;
+		pwh->data.block = block;
+		pwh->data.alloc_base = NULL;
+		pwh->data.rw_buf = buf_ptr;
+		pwh->data.rw_buf_base = NULL;
+		pwh->data.rw_buf_pages = FALSE;
+		pwh->data.rw_buf_size = specs[i].write_size;
+		pwh->callback = NULL;
+		pwh->callback_context = NULL;
+		pwh->wait_callback = NULL;
+		pwh->wait_context = NULL;
+		
+		buf_ptr += _pipe9x_align_size(specs[i].write_size);
+		
+		/* Each handle object holds a reference to the block from here on, so
+		 * closing them all frees it.
+		*/
+		
+		block->refs += 2;
+		
+		prh_out[i] = prh;
+		pwh_out[i] = pwh;
+		
+		DWORD r_error = _pipe9x_init_data_with_buffer(&(prh->data), options);
+		DWORD w_error = _pipe9x_init_data_with_buffer(&(pwh->data), options);
+		
+		_pipe9x_metrics_register(&(prh->data), PIPE9X_METRICS_READ);
+		_pipe9x_metrics_register(&(pwh->data), PIPE9X_METRICS_WRITE);
+		
+		if(error == ERROR_SUCCESS)
+		{
+			error = (r_error != ERROR_SUCCESS ? r_error : w_error);
+		}
+	}
+	
+	/* Temporary storage for the pipe names between creating the pipes and
+	 * opening the client ends.
+	*/
+	
+	char *names = NULL;
+	
+	if(error == ERROR_SUCCESS)
+	{
+		names = allocator->alloc(count * PIPE9X_PIPE_NAME_MAX, allocator->context);
+		if(names == NULL)
+		{
+			error = ERROR_OUTOFMEMORY;
+		}
+	}
+	
+	size_t num_listening = 0;
+	BOOL use_thread_fallback = (options->backend == PIPE9X_BACKEND_THREADED);
+	
+	/* Unnamed pipes are connected as soon as they are created, where the
+	 * system supports them (see _pipe9x_nt_pipe_pair()).
+	*/
+	
+	while(error == ERROR_SUCCESS && !use_thread_fallback && num_listening < count
+		&& _pipe9x_nt_pipe_pair(
+			&(prh_out[num_listening]->data.pipe), PIPE_ACCESS_INBOUND, specs[num_listening].read_inherit,
+			&(pwh_out[num_listening]->data.pipe), GENERIC_WRITE, specs[num_listening].write_inherit,
+			specs[num_listening].read_size) == ERROR_SUCCESS)
+	{
+		++num_listening;
+	}
+	
+	size_t num_unnamed = num_listening;
+	
+	/* Create all the (remaining) pipes and start connecting to them before
+	 * opening any of the client ends, so the connections proceed in parallel.
+	*/
+	
+	while(error == ERROR_SUCCESS && !use_thread_fallback && num_listening < count)
+	{
+		PipeReadHandle prh = prh_out[num_listening];
+		
+		error = _pipe9x_named_pipe_listen(
+			&(prh->data.pipe), (names + num_listening * PIPE9X_PIPE_NAME_MAX),
+			PIPE_ACCESS_INBOUND, specs[num_listening].read_inherit,
+			specs[num_listening].read_size, &(prh->data.overlapped));
+		
+		if(error == ERROR_SUCCESS)
+		{
+			++num_listening;
+		}
+		else if(error == ERROR_CALL_NOT_IMPLEMENTED
+			&& num_listening == 0
+			&& options->backend != PIPE9X_BACKEND_OVERLAPPED)
+		{
+			/* No named pipes on Windows 9x, see pipe9x_create_ex(). */
+			use_thread_fallback = TRUE;
+			error = ERROR_SUCCESS;
+			
+			break;
+		}
+	}
+	
+	size_t num_open = num_unnamed;
+	
+	while(error == ERROR_SUCCESS && num_open < num_listening)
+	{
+		error = _pipe9x_named_pipe_open(
+			(names + num_open * PIPE9X_PIPE_NAME_MAX),
+			&(pwh_out[num_open]->data.pipe), GENERIC_WRITE, specs[num_open].write_inherit);
+		
+		if(error == ERROR_SUCCESS)
+		{
+			++num_open;
+		}
+	}
+	
+	size_t num_connected = num_unnamed;
+	
+	while(error == ERROR_SUCCESS && num_connected < num_open)
+	{
+		PipeReadHandle prh = prh_out[num_connected];
+		
+		error = _pipe9x_named_pipe_accept(prh->data.pipe, &(prh->data.overlapped));
+		if(error == ERROR_SUCCESS)
+		{
+			++num_connected;
+		}
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		/* Servers which haven't completed the connection still have a
+		 * ConnectNamedPipe() pending which needs cancelling before the
+		 * handle objects are freed.
+		*/
+		for(size_t i = num_connected; i < num_listening; ++i)
+		{
+			PipeReadHandle prh = prh_out[i];
+			
+			_pipe9x_named_pipe_abort(prh->data.pipe, &(prh->data.overlapped));
+			prh->data.pipe = INVALID_HANDLE_VALUE;
+		}
+	}
+	
+	for(size_t i = 0; use_thread_fallback && error == ERROR_SUCCESS && i < count; ++i)
+	{
+		prh_out[i]->data.use_thread_fallback = TRUE;
+		pwh_out[i]->data.use_thread_fallback = TRUE;
+		
+		error = _pipe9x_anon_pipe_pair(
+			&(prh_out[i]->data.pipe), specs[i].read_inherit,
+			&(pwh_out[i]->data.pipe), specs[i].write_inherit,
+			specs[i].read_size);
+	}
+	
+	if(names != NULL)
+	{
+		allocator->free(names, allocator->context);
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		for(size_t i = 0; i < count; ++i)
+		{
+			pipe9x_write_close(pwh_out[i]);
+			pwh_out[i] = NULL;
+			
+			pipe9x_read_close(prh_out[i]);
+			prh_out[i] = NULL;
+		}
+		
+		return error;
+	}
+	
+	return ERROR_SUCCESS;
+}
+
+static DWORD _pipe9x_duplex_alloc(PipeDuplexEnd *end, size_t buf_size)
+{
+	DWORD error = _pipe9x_read_alloc(&(end->read), buf_size, &_pipe9x_default_options);
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	return _pipe9x_write_alloc(&(end->write), buf_size, &_pipe9x_default_options);
+}
+
+DWORD pipe9x_create_duplex(
+	PipeDuplexEnd *a_out,
+	BOOL a_inherit,
+	PipeDuplexEnd *b_out,
+	BOOL b_inherit,
+	size_t buf_size)
+{
+	PipeDuplexEnd a = { NULL, NULL };
+	PipeDuplexEnd b = { NULL, NULL };
+	
+	*a_out = a;
+	*b_out = b;
+	
+	DWORD error = _pipe9x_duplex_alloc(&a, buf_size);
+	if(error == ERROR_SUCCESS)
+	{
+		error = _pipe9x_duplex_alloc(&b, buf_size);
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		pipe9x_duplex_close(&b);
+		pipe9x_duplex_close(&a);
+		
+		return error;
+	}
+	
+	/* A single duplex named pipe carries both directions, with the read and
+	 * write handle objects at each end holding their own HANDLE to it so
+	 * that concurrent overlapped reads and writes each have an OVERLAPPED
+	 * structure and event to themselves.
+	*/
+	
+	error = _pipe9x_named_pipe_pair(
+		&(a.read->data.pipe), PIPE_ACCESS_DUPLEX, a_inherit,
+		&(b.read->data.pipe), (GENERIC_READ | GENERIC_WRITE), b_inherit,
+		buf_size, &(a.read->data.overlapped));
+	
+	if(error == ERROR_SUCCESS)
+	{
+		if(!DuplicateHandle(
+				GetCurrentProcess(),
+				a.read->data.pipe,
+				GetCurrentProcess(),
+				&(a.write->data.pipe),
+				0,
+				a_inherit,
+				DUPLICATE_SAME_ACCESS)
+			|| !DuplicateHandle(
+				GetCurrentProcess(),
+				b.read->data.pipe,
+				GetCurrentProcess(),
+				&(b.write->data.pipe),
+				0,
+				b_inherit,
+				DUPLICATE_SAME_ACCESS))
+		{
+			error = GetLastError();
+		}
+		
+		a.read->data.shared_pipe = TRUE;
+		a.write->data.shared_pipe = TRUE;
+		b.read->data.shared_pipe = TRUE;
+		b.write->data.shared_pipe = TRUE;
+	}
+	else if(error == ERROR_CALL_NOT_IMPLEMENTED)
+	{
+		/* No named pipes on Windows 9x, so we need an anonymous pipe in each
+		 * direction instead.
+		*/
+		
+		error = _pipe9x_anon_pipe_pair(
+			&(b.read->data.pipe), b_inherit,
+			&(a.write->data.pipe), a_inherit,
+			buf_size);
+		
+		if(error == ERROR_SUCCESS)
+		{
+			error = _pipe9x_anon_pipe_pair(
+				&(a.read->data.pipe), a_inherit,
+				&(b.write->data.pipe), b_inherit,
+				buf_size);
+		}
+		
+		a.read->data.use_thread_fallback = TRUE;
+		a.write->data.use_thread_fallback = TRUE;
+		b.read->data.use_thread_fallback = TRUE;
+		b.write->data.use_thread_fallback = TRUE;
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		pipe9x_duplex_close(&b);
+		pipe9x_duplex_close(&a);
+		
+		return error;
+	}
+	
+	*a_out = a;
+	*b_out = b;
+	
+	return ERROR_SUCCESS;
+}
+
+void pipe9x_duplex_close(PipeDuplexEnd *end)
+{
+	if(end == NULL)
+	{
+		return;
+	}
+	
+	pipe9x_write_close(end->write);
+	end->write = NULL;
+	
+	pipe9x_read_close(end->read);
+	end->read = NULL;
+}
+
+DWORD pipe9x_connect(
+	const char *pipe_name,
+	DWORD timeout_ms,
+	PipeReadHandle *prh_out,
+	size_t read_size,
+	PipeWriteHandle *pwh_out,
+	size_t write_size,
+	BOOL inherit,
+	PipeConnectStats *stats_out)
+{
+	PipeConnectStats stats = { 0, 0, 0 };
+	
+	if(prh_out != NULL)
+	{
+		*prh_out = NULL;
+	}
+	
+	if(pwh_out != NULL)
+	{
+		*pwh_out = NULL;
+	}
+	
+	if(stats_out != NULL)
+	{
+		*stats_out = stats;
+	}
+	
+	if(prh_out == NULL && pwh_out == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	
+	/* Allocate the handle objects up front so we can't fail after grabbing
+	 * an instance of the server's pipe.
+	*/
+	
+	PipeReadHandle prh = NULL;
+	PipeWriteHandle pwh = NULL;
+	
+	DWORD error = ERROR_SUCCESS;
+	
+	if(prh_out != NULL)
+	{
+		error = _pipe9x_read_alloc(&prh, read_size, &_pipe9x_default_options);
+	}
+	
+	if(error == ERROR_SUCCESS && pwh_out != NULL)
+	{
+		error = _pipe9x_write_alloc(&pwh, write_size, &_pipe9x_default_options);
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		return error;
+	}
+	
+	/* Windows 9x can only open the client end of a named pipe for blocking
+	 * I/O, so we need the background thread there just like with anonymous
+	 * pipes.
+	*/
+	BOOL use_thread_fallback = (GetVersion() & 0x80000000) != 0;
+	
+	DWORD access = (prh != NULL ? GENERIC_READ : 0) | (pwh != NULL ? GENERIC_WRITE : 0);
+	SECURITY_ATTRIBUTES secattrs = { sizeof(SECURITY_ATTRIBUTES), NULL, inherit };
+	
+	DWORD start_time = GetTickCount();
+	DWORD backoff = PIPE9X_CONNECT_MIN_BACKOFF;
+	
+	HANDLE pipe;
+	
+	while(TRUE)
+	{
+		++(stats.attempts);
+		
+		pipe = CreateFile(
+			pipe_name,                                         /* lpFileName */
+			access,                                            /* dwDesiredAccess */
+			0,                                                 /* dwShareMode */
+			&secattrs,                                         /* lpSecurityAttributes */
+			OPEN_EXISTING,                                     /* dwCreationDisposition */
+			(use_thread_fallback ? 0 : FILE_FLAG_OVERLAPPED),  /* dwFlagsAndAttributes */
+			NULL);                                             /* hTemplateFile */
+		
+		if(pipe != INVALID_HANDLE_VALUE)
+		{
+			error = ERROR_SUCCESS;
+			break;
+		}
+		
+		error = GetLastError();
+		
+		/* ERROR_PIPE_BUSY means all instances of the pipe are connected to
+		 * other clients, ERROR_FILE_NOT_FOUND means the server hasn't created
+		 * it (yet/again). Anything else isn't going to fix itself.
+		*/
+		if(error != ERROR_PIPE_BUSY && error != ERROR_FILE_NOT_FOUND)
+		{
+			break;
+		}
+		
+		DWORD elapsed = GetTickCount() - start_time;
+		if(timeout_ms != INFINITE && elapsed >= timeout_ms)
+		{
+			break;
+		}
+		
+		DWORD delay = backoff;
+		if(timeout_ms != INFINITE && delay > (timeout_ms - elapsed))
+		{
+			delay = timeout_ms - elapsed;
+		}
+		
+		if(error == ERROR_PIPE_BUSY)
+		{
+			++(stats.busy_retries);
+			
+			/* WaitNamedPipe() returns as soon as an instance is free, in which
+			 * case we go straight back around without growing the backoff.
+			*/
+			if(WaitNamedPipe(pipe_name, delay))
+			{
+				continue;
+			}
+		}
+		else{
+			Sleep(delay);
+		}
+		
+		backoff *= 2;
+		if(backoff > PIPE9X_CONNECT_MAX_BACKOFF)
+		{
+			backoff = PIPE9X_CONNECT_MAX_BACKOFF;
+		}
+	}
+	
+	stats.elapsed_ms = GetTickCount() - start_time;
+	
+	if(stats_out != NULL)
+	{
+		*stats_out = stats;
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		pipe9x_write_close(pwh);
+		pipe9x_read_close(prh);
+		
+		return error;
+	}
+	
+	if(prh != NULL)
+	{
+		prh->data.pipe = pipe;
+		prh->data.use_thread_fallback = use_thread_fallback;
+	}
+	
+	if(pwh != NULL)
+	{
+		if(prh != NULL)
+		{
+			/* Each handle object owns its HANDLE, so the write end gets its
+			 * own handle to the same pipe.
+			*/
+			
+			if(!DuplicateHandle(
+				GetCurrentProcess(),
+				pipe,
+				GetCurrentProcess(),
+				&(pwh->data.pipe),
+				0,
+				inherit,
+				DUPLICATE_SAME_ACCESS))
+			{
+				error = GetLastError();
+				
+				pipe9x_write_close(pwh);
+				pipe9x_read_close(prh);
+				
+				return error;
+			}
+			
+			prh->data.shared_pipe = TRUE;
+			pwh->data.shared_pipe = TRUE;
+		}
+		else{
+			pwh->data.pipe = pipe;
+		}
+		
+		pwh->data.use_thread_fallback = use_thread_fallback;
+	}
+	
+	if(prh_out != NULL)
+	{
+		*prh_out = prh;
+	}
+	
+	if(pwh_out != NULL)
+	{
+		*pwh_out = pwh;
+	}
+	
+	return ERROR_SUCCESS;
+}
+
+/* Read a flag set using InterlockedExchange() with acquire semantics. This
+ * doesn't take ownership of the cache line like an interlocked operation
+ * would, so it can be polled cheaply.
+*/
+static LONG _pipe9x_load_acquire(LONG volatile *flag)
+{
+#if defined(__GNUC__)
+	return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+#elif defined(_M_IX86) || defined(_M_X64)
+	/* Loads aren't reordered with other loads on x86, just stop the
+	 * compiler from doing it.
+	*/
+	LONG value = *flag;
+	_ReadWriteBarrier();
+	
+	return value;
+#else
+	return InterlockedCompareExchange(flag, 0, 0);
+#endif
+}
+
+/* Counterpart to _pipe9x_load_acquire(), for when no full barrier is needed. */
+static void _pipe9x_store_release(LONG volatile *flag, LONG value)
+{
+#if defined(__GNUC__)
+	__atomic_store_n(flag, value, __ATOMIC_RELEASE);
+#elif defined(_M_IX86) || defined(_M_X64)
+	/* Stores aren't reordered with other stores on x86 either. */
+	_ReadWriteBarrier();
+	*flag = value;
+#else
+	InterlockedExchange(flag, value);
+#endif
+}
+
+/* The caller and the worker thread of a thread fallback handle hand over
+ * operations using a request ring and a completion ring. Each ring has one
+ * producer and one consumer which only write their own index, so neither side
+ * needs a lock, and finding an operation still in progress when polling needs
+ * no system calls at all.
+*/
+
+/* Check if the worker thread has completed the pending operation. */
+static BOOL _pipe9x_worker_done(struct PipeData *pd)
+{
+	return _pipe9x_load_acquire(&(pd->completion_head)) != pd->completion_tail;
+}
+
+/* Wait for the worker thread to finish signalling the last completion, so
+ * that a late SetEvent() doesn't undo resetting the event.
+*/
+static void _pipe9x_worker_signal_wait(struct PipeData *pd)
+{
+	while(_pipe9x_load_acquire(&(pd->worker_signalling)))
+	{
+		/* Only a few instructions away. Sleep(0) wouldn't let a worker with
+		 * a lower priority run on a single processor.
+		*/
+		Sleep(1);
+	}
+}
+
+/* Check if a handle is in write-behind mode (see PIPE9X_WRITE_BEHIND). */
+static BOOL _pipe9x_write_behind(struct PipeData *pd)
+{
+	return (pd->flags & PIPE9X_WRITE_BEHIND) && pd->use_thread_fallback;
+}
+
+/* Create the event object of a handle created with PIPE9X_NO_EVENT, if it
+ * doesn't have one already.
+*/
+static HANDLE _pipe9x_event_create(struct PipeData *pd)
+{
+	if(pd->overlapped.hEvent != NULL)
+	{
+		return pd->overlapped.hEvent;
+	}
+	
+	/* The event is signalled whenever no operation is pending, and also if an
+	 * overlapped operation is pending, since it can't be attached to that and
+	 * we don't want anyone waiting on it forever. _pipe9x_event() takes care
+	 * of the thread fallback.
+	*/
+	HANDLE event = CreateEvent(NULL, TRUE, TRUE, NULL);
+	if(event == NULL)
+	{
+		return NULL;
+	}
+	
+	InterlockedExchangePointer(&(pd->overlapped.hEvent), event);
+	
+	return event;
+}
+
+/* Get the event object of a handle to hand out, creating it if the handle was
+ * created with PIPE9X_NO_EVENT.
+ *
+ * The worker thread of a thread fallback handle only signals the event once
+ * it has been handed out or the caller is blocked on it, so its state is
+ * brought up to date the first time.
+*/
+static HANDLE _pipe9x_event(struct PipeData *pd)
+{
+	HANDLE event = _pipe9x_event_create(pd);
+	
+	if(event != NULL && pd->use_thread_fallback && !pd->event_exported)
+	{
+		/* Reset it before setting event_exported, so a completion after
+		 * that point is signalled by the worker and not lost by us.
+		*/
+		_pipe9x_worker_signal_wait(pd);
+		ResetEvent(event);
+		
+		InterlockedExchange(&(pd->event_exported), TRUE);
+		
+		/* wb_want is only set once the event has been handed out. */
+		if(_pipe9x_write_behind(pd)
+			|| !pd->pending
+			|| pd->callback_pending
+			|| _pipe9x_worker_done(pd))
+		{
+			SetEvent(event);
+		}
+	}
+	
+	return event;
+}
+
+/* Start the worker thread of a thread fallback handle, if not running. */
+static DWORD _pipe9x_worker_start(struct PipeData *pd, LPTHREAD_START_ROUTINE func, void *param)
+{
+	if(pd->io_thread != NULL)
+	{
+		return ERROR_SUCCESS;
+	}
+	
+	if(pd->work_event == NULL)
+	{
+		pd->work_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if(pd->work_event == NULL)
+		{
+			return GetLastError();
+		}
+	}
+	
+	DWORD io_thread_id;
+	pd->io_thread = CreateThread(NULL, 0, func, param, 0, &io_thread_id);
+	
+	if(pd->io_thread == NULL)
+	{
+		return GetLastError();
+	}
+	
+	return ERROR_SUCCESS;
+}
+
+/* Queue a request to the worker thread, waking it if it is asleep. */
+static void _pipe9x_worker_push(struct PipeData *pd, DWORD type, DWORD size, BOOL apc)
+{
+	LONG head = pd->request_head;
+	
+	/* There is never more than one operation and PIPE9X_REQUEST_QUIT queued. */
+	assert((head - _pipe9x_load_acquire(&(pd->request_tail))) < PIPE9X_RING_SIZE);
+	
+	struct PipeRequest *request = &(pd->requests[head & PIPE9X_RING_MASK]);
+	request->type = type;
+	request->size = size;
+	request->apc = apc;
+	
+	/* Publish the request before checking worker_sleeping, which the worker
+	 * sets before checking for requests, so one of us sees the other.
+	*/
+	InterlockedExchange(&(pd->request_head), head + 1);
+	
+	if(_pipe9x_load_acquire(&(pd->worker_sleeping)))
+	{
+		SetEvent(pd->work_event);
+	}
+}
+
+/* Take the next request off the ring (worker thread), sleeping until there is
+ * one. Returns FALSE if it is PIPE9X_REQUEST_QUIT.
+*/
+static BOOL _pipe9x_worker_next(struct PipeData *pd, struct PipeRequest *request_out)
+{
+	LONG tail = pd->request_tail;
+	
+	while(_pipe9x_load_acquire(&(pd->request_head)) == tail)
+	{
+		InterlockedExchange(&(pd->worker_sleeping), TRUE);
+		
+		if(_pipe9x_load_acquire(&(pd->request_head)) == tail)
+		{
+			/* May return early from a SetEvent() we didn't need. */
+			WaitForSingleObject(pd->work_event, INFINITE);
+		}
+		
+		_pipe9x_store_release(&(pd->worker_sleeping), FALSE);
+	}
+	
+	*request_out = pd->requests[tail & PIPE9X_RING_MASK];
+	_pipe9x_store_release(&(pd->request_tail), tail + 1);
+	
+	return request_out->type != PIPE9X_REQUEST_QUIT;
+}
+
+/* Publish the result of a request (worker thread) and notify the caller, by
+ * APC if the operation has a callback, otherwise by signalling the event if
+ * anybody could be waiting on it.
+*/
+static void _pipe9x_worker_complete(struct PipeData *pd, const struct PipeRequest *request, DWORD result, DWORD bytes_transferred, PAPCFUNC apc, void *apc_param)
+{
+	LONG head = pd->completion_head;
+	
+	assert((head - _pipe9x_load_acquire(&(pd->completion_tail))) < PIPE9X_RING_SIZE);
+	
+	pd->completions[head & PIPE9X_RING_MASK].result = result;
+	pd->completions[head & PIPE9X_RING_MASK].bytes_transferred = bytes_transferred;
+	
+	InterlockedExchange(&(pd->worker_signalling), TRUE);
+	InterlockedExchange(&(pd->completion_head), head + 1);
+	
+	if(request->apc)
+	{
+		if(!_pipe9x_apc_queue(pd, apc, apc_param))
+		{
+			/* QueueUserAPC() shouldn't fail here... */
+			abort();
+		}
+	}
+	else if(_pipe9x_load_acquire(&(pd->event_exported)) || _pipe9x_load_acquire(&(pd->caller_waiting)))
+	{
+		SetEvent(pd->overlapped.hEvent);
+	}
+	
+	_pipe9x_store_release(&(pd->worker_signalling), FALSE);
+}
+
+/* Wait for the worker thread to complete the pending operation. Returns FALSE
+ * if the operation is still in progress and wait is FALSE.
+*/
+static BOOL _pipe9x_worker_wait(struct PipeData *pd, BOOL wait)
+{
+	if(_pipe9x_worker_done(pd))
+	{
+		return TRUE;
+	}
+	
+	if(!wait)
+	{
+		return FALSE;
+	}
+	
+	HANDLE event = _pipe9x_event_create(pd);
+	if(event == NULL)
+	{
+		while(!_pipe9x_worker_done(pd))
+		{
+			Sleep(1);
+		}
+		
+		return TRUE;
+	}
+	
+	/* Set before checking for completion again, the worker checks it after
+	 * publishing the completion.
+	*/
+	InterlockedExchange(&(pd->caller_waiting), TRUE);
+	
+	while(!_pipe9x_worker_done(pd))
+	{
+		WaitForSingleObject(event, INFINITE);
+		
+		/* The event isn't reset when starting an operation unless it has
+		 * been handed out, so we may have been woken by a stale signal.
+		*/
+		if(!pd->event_exported && !_pipe9x_worker_done(pd))
+		{
+			ResetEvent(event);
+		}
+	}
+	
+	_pipe9x_store_release(&(pd->caller_waiting), FALSE);
+	
+	return TRUE;
+}
+
+/* Take the result of the completed operation off the completion ring. */
+static void _pipe9x_worker_reap(struct PipeData *pd, DWORD *result_out, DWORD *bytes_transferred_out)
+{
+	LONG tail = pd->completion_tail;
+	
+	assert(_pipe9x_load_acquire(&(pd->completion_head)) != tail);
+	
+	*result_out = pd->completions[tail & PIPE9X_RING_MASK].result;
+	*bytes_transferred_out = pd->completions[tail & PIPE9X_RING_MASK].bytes_transferred;
+	
+	_pipe9x_store_release(&(pd->completion_tail), tail + 1);
+}
+
+/* Reset the event before starting an operation on the worker thread, unless
+ * it hasn't been handed out, in which case nothing is looking at it.
+*/
+static void _pipe9x_worker_reset_event(struct PipeData *pd)
+{
+	if(pd->event_exported)
+	{
+		_pipe9x_worker_signal_wait(pd);
+		ResetEvent(pd->overlapped.hEvent);
+	}
+}
+
+/* Stop the worker thread once it has finished any pending operation. */
+static void _pipe9x_worker_stop(struct PipeData *pd)
+{
+	if(pd->io_thread != NULL)
+	{
+		_pipe9x_worker_push(pd, PIPE9X_REQUEST_QUIT, 0, FALSE);
+		
+		WaitForSingleObject(pd->io_thread, INFINITE);
+		CloseHandle(pd->io_thread);
+		
+		pd->io_thread = NULL;
+	}
+	
+	if(pd->work_event != NULL)
+	{
+		CloseHandle(pd->work_event);
+		pd->work_event = NULL;
+	}
+	
+	if(pd->wb_drain_event != NULL)
+	{
+		CloseHandle(pd->wb_drain_event);
+		pd->wb_drain_event = NULL;
+	}
+}
+
+#ifndef PIPE9X_SHARED_WAIT_MS
+#define PIPE9X_SHARED_WAIT_MS 10  /* Longest wait on a shared pipe handle before checking for completion again. */
+#endif
+
+/* Wait for the pending overlapped operation to complete. Returns FALSE if the
+ * operation is still in progress and wait is FALSE.
+*/
+static BOOL _pipe9x_overlapped_wait(struct PipeData *pd, BOOL wait)
+{
+	while(!HasOverlappedIoCompleted(&(pd->overlapped)))
+	{
+		if(!wait)
+		{
+			return FALSE;
+		}
+		
+		if(pd->op_has_event)
+		{
+			WaitForSingleObject(pd->overlapped.hEvent, INFINITE);
+		}
+		else{
+			/* Without an event, the pipe handle is signalled when I/O on it
+			 * completes... including I/O on any other handle to the same
+			 * pipe, so we may be woken before our operation is done.
+			 *
+			 * When the file object is shared with another handle object
+			 * (see shared_pipe), an operation started on that one after
+			 * ours completes resets the pipe handle, and we would sleep
+			 * until that one completes too, so don't wait indefinitely.
+			*/
+			
+			DWORD timeout = pd->shared_pipe ? PIPE9X_SHARED_WAIT_MS : INFINITE;
+			
+			if(WaitForSingleObject(pd->pipe, timeout) == WAIT_OBJECT_0
+				&& !HasOverlappedIoCompleted(&(pd->overlapped)))
+			{
+				Sleep(1);
+			}
+		}
+	}
+	
+	return TRUE;
+}
+
+/* Handle the result of starting an overlapped ReadFile()/WriteFile(). */
+static DWORD _pipe9x_overlapped_started(struct PipeData *pd, BOOL ok)
+{
+	DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+	
+	if(error == ERROR_SUCCESS || error == ERROR_MORE_DATA)
+	{
+		/* Completed without blocking (ERROR_MORE_DATA means part of a
+		 * message), keep the result so we don't have to ask for it again.
+		*/
+		
+		pd->op_inline = TRUE;
+		pd->bytes_transferred = (DWORD)(pd->overlapped.InternalHigh);
+		pd->pending = TRUE;
+		
+		/* A registered wait is only armed for ERROR_IO_PENDING. */
+		return ((pd->flags & PIPE9X_SYNC_COMPLETION) && !pd->wait_active)
+			? ERROR_SUCCESS
+			: ERROR_IO_PENDING;
+	}
+	else if(error == ERROR_IO_PENDING)
+	{
+		pd->pending = TRUE;
+		return ERROR_IO_PENDING;
+	}
+	else{
+		return error;
+	}
+}
+
+/* Arm a one-shot thread pool wait on the event of a handle with a wait
+ * callback registered.
+*/
+static DWORD _pipe9x_wait_arm(struct PipeData *pd, WAITORTIMERCALLBACK callback, void *param)
+{
+	DWORD error = ERROR_SUCCESS;
+	
+	EnterCriticalSection(&(pd->wait_lock));
+	
+	if(pd->wait_active && pd->wait_handle == NULL)
+	{
+		HANDLE event = _pipe9x_event(pd);
+		
+		if(event == NULL)
+		{
+			error = GetLastError();
+		}
+		else if(!RegisterWaitForSingleObject_p(&(pd->wait_handle), event, callback, param, INFINITE, WT_EXECUTEONLYONCE))
+		{
+			error = GetLastError();
+			pd->wait_handle = NULL;
+		}
+	}
+	
+	LeaveCriticalSection(&(pd->wait_lock));
+	
+	return error;
+}
+
+/* Called by a wait callback (with wait_lock held) when the wait has fired. */
+static void _pipe9x_wait_fired(struct PipeData *pd)
+{
+	pd->wait_thread_id = GetCurrentThreadId();
+	
+	if(pd->wait_handle != NULL)
+	{
+		/* One-shot waits still need unregistering. This doesn't wait for the
+		 * callback (i.e. us) to finish.
+		*/
+		UnregisterWait_p(pd->wait_handle);
+		pd->wait_handle = NULL;
+	}
+}
+
+/* Make sure the event of a handle about to have a wait registered will be
+ * signalled by its operations. An overlapped operation started without an
+ * event (see PIPE9X_NO_EVENT) can't be waited on; the event created for it
+ * stays signalled and the wait would keep firing until it completes.
+*/
+static DWORD _pipe9x_wait_prepare(struct PipeData *pd)
+{
+	if(pd->use_thread_fallback)
+	{
+		return ERROR_SUCCESS;
+	}
+	
+	if(pd->pending && !pd->op_inline && !pd->op_has_event)
+	{
+		return ERROR_IO_INCOMPLETE;
+	}
+	
+	if(_pipe9x_event_create(pd) == NULL)
+	{
+		return GetLastError();
+	}
+	
+	return ERROR_SUCCESS;
+}
+
+static void _pipe9x_wait_unregister(struct PipeData *pd)
+{
+	if(!pd->wait_lock_init)
+	{
+		return;
+	}
+	
+	EnterCriticalSection(&(pd->wait_lock));
+	
+	pd->wait_active = FALSE;
+	
+	HANDLE wait_handle = pd->wait_handle;
+	pd->wait_handle = NULL;
+	
+	BOOL in_callback = (pd->wait_thread_id == GetCurrentThreadId());
+	
+	LeaveCriticalSection(&(pd->wait_lock));
+	
+	if(wait_handle != NULL)
+	{
+		if(in_callback)
+		{
+			/* Waiting for callbacks to finish from within one would deadlock. */
+			UnregisterWait_p(wait_handle);
+		}
+		else{
+			UnregisterWaitEx_p(wait_handle, INVALID_HANDLE_VALUE);
+		}
+	}
+}
+
+static void _pipe9x_cleanup(struct PipeData *pd)
+{
+	if(pd->pipe != INVALID_HANDLE_VALUE)
+	{
+		if(pd->pending && !pd->use_thread_fallback)
+		{
+			/* Another handle to the same pipe (e.g. the other half of a
+			 * PipeDuplexEnd) would keep the operation pending after we
+			 * close ours.
+			*/
+			_pipe9x_cancel_io(pd);
+		}
+		
+		CloseHandle(pd->pipe);
+		pd->pipe = NULL;
+	}
+	
+	if(pd->pending)
+	{
+		if(pd->callback_pending)
+		{
+			/* The completion is delivered to this thread as an APC, which
+			 * has to run before the handle object goes away.
+			*/
+			
+			pd->closing = TRUE;
+			
+			while(pd->pending)
+			{
+				SleepEx(INFINITE, TRUE);
+			}
+		}
+		else if(!pd->use_thread_fallback)
+		{
+			/* The pipe handle is gone, so without an event all we can do
+			 * is poll until the cancelled operation has finished.
+			*/
+			
+			while(!HasOverlappedIoCompleted(&(pd->overlapped)))
+			{
+				if(pd->op_has_event)
+				{
+					WaitForSingleObject(pd->overlapped.hEvent, INFINITE);
+				}
+				else{
+					Sleep(1);
+				}
+			}
+		}
+	}
+	
+	/* Also waits for an operation pending on the worker thread, which fails
+	 * now that the pipe is closed.
+	*/
+	_pipe9x_worker_stop(pd);
+	
+	if(pd->apc_thread != NULL)
+	{
+		CloseHandle(pd->apc_thread);
+		pd->apc_thread = NULL;
+	}
+	
+	if(pd->wait_lock_init)
+	{
+		DeleteCriticalSection(&(pd->wait_lock));
+		pd->wait_lock_init = FALSE;
+	}
+}
+
+void pipe9x_read_close(PipeReadHandle prh)
+{
+	if(prh == NULL)
+	{
+		return;
+	}
+	
+	_pipe9x_set_trace(&(prh->data), NULL, 0);
+	_pipe9x_metrics_release(&(prh->data));
+	
+	_pipe9x_wait_unregister(&(prh->data));
+	_pipe9x_cleanup(&(prh->data));
+	
+	if(_pipe9x_free_list_put(&_pipe9x_read_free_list, &(prh->data)))
+	{
+		return;
+	}
+	
+	_pipe9x_free_data(&(prh->data));
+	_pipe9x_free_handle(&(prh->data));
+}
+
+static void _pipe9x_read_callback_done(PipeReadHandle prh, DWORD error, DWORD bytes_transferred)
+{
+	_pipe9x_trace(&(prh->data), PIPE9X_TRACE_READ_COMPLETE, error,
+		(error == ERROR_SUCCESS ? bytes_transferred : 0), prh->data.rw_buf);
+	_pipe9x_metrics_complete(&(prh->data), error, bytes_transferred);
+	
+	prh->data.pending = FALSE;
+	prh->data.callback_pending = FALSE;
+	
+	if(!prh->data.closing)
+	{
+		prh->callback(
+			prh,
+			error,
+			(error == ERROR_SUCCESS ? prh->data.rw_buf : NULL),
+			(error == ERROR_SUCCESS ? bytes_transferred : 0),
+			prh->callback_context);
+	}
+}
+
+/* Completion routine for ReadFileEx(). */
+static VOID WINAPI _pipe9x_read_completion(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered, LPOVERLAPPED lpOverlapped)
+{
+	PipeReadHandle prh = (PipeReadHandle)((char*)(lpOverlapped) - offsetof(struct _PipeReadHandle, data.overlapped));
+	
+	/* Part of a message from a message-mode pipe, the rest comes from the next read. */
+	if(dwErrorCode == ERROR_MORE_DATA)
+	{
+		dwErrorCode = ERROR_SUCCESS;
+	}
+	
+	_pipe9x_read_callback_done(prh, dwErrorCode, dwNumberOfBytesTransfered);
+}
+
+/* APC queued by the worker thread. */
+static VOID CALLBACK _pipe9x_read_apc(ULONG_PTR dwParam)
+{
+	PipeReadHandle prh = (PipeReadHandle)(dwParam);
+	
+	DWORD result, bytes_transferred;
+	_pipe9x_worker_reap(&(prh->data), &result, &bytes_transferred);
+	
+	_pipe9x_read_callback_done(prh, result, bytes_transferred);
+}
+
+static DWORD WINAPI _pipe9x_read_thread(LPVOID lpParameter)
+{
+	PipeReadHandle prh = (PipeReadHandle)(lpParameter);
+	struct PipeRequest request;
+	
+	while(_pipe9x_worker_next(&(prh->data), &request))
+	{
+		DWORD result = ERROR_SUCCESS;
+		DWORD bytes_transferred = 0;
+		
+		if(!_pipe9x_read_file(
+			prh->data.pipe,
+			prh->data.rw_buf,
+			prh->data.rw_buf_size,
+			&bytes_transferred,
+			NULL))
+		{
+			result = GetLastError();
+			
+			/* Part of a message from a message-mode pipe, the rest comes
+			 * from the next read.
+			*/
+			if(result == ERROR_MORE_DATA)
+			{
+				result = ERROR_SUCCESS;
+			}
+		}
+		
+		_pipe9x_worker_complete(&(prh->data), &request, result, bytes_transferred, &_pipe9x_read_apc, prh);
+	}
+	
+	return 0;
+}
+
+static DWORD _pipe9x_read_start(PipeReadHandle prh)
+{
+	assert(prh != NULL);
+	
+	if(prh->data.pending)
+	{
+		return ERROR_IO_INCOMPLETE;
+	}
+	
+	DWORD error = _pipe9x_buffer(&(prh->data));
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	if(prh->data.use_thread_fallback)
+	{
+		error = _pipe9x_worker_start(&(prh->data), &_pipe9x_read_thread, prh);
+		if(error != ERROR_SUCCESS)
+		{
+			return error;
+		}
+		
+		_pipe9x_worker_reset_event(&(prh->data));
+		_pipe9x_worker_push(&(prh->data), PIPE9X_REQUEST_IO, 0, FALSE);
+		
+		prh->data.pending = TRUE;
+		
+		return ERROR_IO_PENDING;
+	}
+	else{
+		_pipe9x_completion_modes(&(prh->data));
+		
+		prh->data.op_has_event = (prh->data.overlapped.hEvent != NULL);
+		
+		BOOL ok = _pipe9x_read_file(
+			prh->data.pipe,
+			prh->data.rw_buf,
+			prh->data.rw_buf_size,
+			&(prh->data.bytes_transferred),
+			&(prh->data.overlapped));
+		
+		return _pipe9x_overlapped_started(&(prh->data), ok);
+	}
+}
+
+static VOID CALLBACK _pipe9x_read_wait_callback(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
+{
+	PipeReadHandle prh = (PipeReadHandle)(lpParameter);
+	
+	EnterCriticalSection(&(prh->data.wait_lock));
+	_pipe9x_wait_fired(&(prh->data));
+	
+	if(prh->data.wait_active)
+	{
+		void *data = NULL;
+		size_t data_size = 0;
+		
+		DWORD error = pipe9x_read_result(prh, &data, &data_size, FALSE);
+		
+		if(error == ERROR_IO_INCOMPLETE)
+		{
+			/* Spurious wakeup, keep waiting. The event is always attached
+			 * to the operation (see _pipe9x_wait_prepare()), so this
+			 * can't spin.
+			*/
+			
+			_pipe9x_wait_arm(&(prh->data), &_pipe9x_read_wait_callback, prh);
+		}
+		else{
+			prh->wait_callback(prh, error, data, data_size, prh->wait_context);
+			
+			if(error == ERROR_SUCCESS
+				&& prh->data.wait_active
+				&& (prh->data.wait_flags & PIPE9X_WAIT_REINITIATE)
+				&& !prh->data.pending)
+			{
+				error = pipe9x_read_initiate(prh);
+				
+				if(error != ERROR_IO_PENDING && prh->data.wait_active)
+				{
+					prh->wait_callback(prh, error, NULL, 0, prh->wait_context);
+				}
+			}
+		}
+	}
+	
+	prh->data.wait_thread_id = 0;
+	LeaveCriticalSection(&(prh->data.wait_lock));
+}
+
+DWORD pipe9x_read_initiate(PipeReadHandle prh)
+{
+	DWORD error = _pipe9x_read_start(prh);
+	_pipe9x_trace_initiate(&(prh->data), PIPE9X_TRACE_READ_INITIATE, error, 0, NULL);
+	_pipe9x_metrics_initiate(&(prh->data), error, 0);
+	
+	if(error == ERROR_IO_PENDING && prh->data.wait_active)
+	{
+		DWORD wait_error = _pipe9x_wait_arm(&(prh->data), &_pipe9x_read_wait_callback, prh);
+		if(wait_error != ERROR_SUCCESS)
+		{
+			return wait_error;
+		}
+	}
+	
+	return error;
+}
+
+DWORD pipe9x_read_register_wait(PipeReadHandle prh, PipeReadCallback callback, void *context, DWORD flags)
+{
+	assert(prh != NULL);
+	assert(callback != NULL);
+	
+	if(!_pipe9x_wait_api())
+	{
+		return ERROR_CALL_NOT_IMPLEMENTED;
+	}
+	
+	if(prh->data.wait_active)
+	{
+		return ERROR_ALREADY_EXISTS;
+	}
+	
+	DWORD error = _pipe9x_wait_prepare(&(prh->data));
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	if(!prh->data.wait_lock_init)
+	{
+		InitializeCriticalSection(&(prh->data.wait_lock));
+		prh->data.wait_lock_init = TRUE;
+	}
+	
+	EnterCriticalSection(&(prh->data.wait_lock));
+	
+	prh->wait_callback = callback;
+	prh->wait_context = context;
+	prh->data.wait_flags = flags;
+	prh->data.wait_active = TRUE;
+	
+	if(prh->data.pending && !prh->data.callback_pending)
+	{
+		error = _pipe9x_wait_arm(&(prh->data), &_pipe9x_read_wait_callback, prh);
+	}
+	else if(!prh->data.pending && (flags & PIPE9X_WAIT_REINITIATE))
+	{
+		error = pipe9x_read_initiate(prh);
+		
+		if(error == ERROR_IO_PENDING)
+		{
+			error = ERROR_SUCCESS;
+		}
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		prh->data.wait_active = FALSE;
+	}
+	
+	LeaveCriticalSection(&(prh->data.wait_lock));
+	
+	return error;
+}
+
+void pipe9x_read_unregister_wait(PipeReadHandle prh)
+{
+	assert(prh != NULL);
+	_pipe9x_wait_unregister(&(prh->data));
+}
+
+DWORD pipe9x_read_initiate_ex(PipeReadHandle prh, PipeReadCallback callback, void *context)
+{
+	assert(prh != NULL);
+	assert(callback != NULL);
+	
+	if(prh->data.pending)
+	{
+		return ERROR_IO_INCOMPLETE;
+	}
+	
+	DWORD error = _pipe9x_buffer(&(prh->data));
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	prh->callback = callback;
+	prh->callback_context = context;
+	
+	if(prh->data.use_thread_fallback)
+	{
+		error = _pipe9x_apc_prepare(&(prh->data));
+		if(error != ERROR_SUCCESS)
+		{
+			return error;
+		}
+		
+		error = _pipe9x_worker_start(&(prh->data), &_pipe9x_read_thread, prh);
+		if(error != ERROR_SUCCESS)
+		{
+			return error;
+		}
+		
+		prh->data.callback_pending = TRUE;
+		_pipe9x_worker_push(&(prh->data), PIPE9X_REQUEST_IO, 0, TRUE);
+	}
+	else{
+		if(!ReadFileEx(
+			prh->data.pipe,
+			prh->data.rw_buf,
+			prh->data.rw_buf_size,
+			&(prh->data.overlapped),
+			&_pipe9x_read_completion))
+		{
+			return GetLastError();
+		}
+		
+		prh->data.callback_pending = TRUE;
+	}
+	
+	prh->data.pending = TRUE;
+	_pipe9x_trace(&(prh->data), PIPE9X_TRACE_READ_INITIATE, ERROR_SUCCESS, 0, NULL);
+	_pipe9x_metrics_initiate(&(prh->data), ERROR_IO_PENDING, 0);
+	
+	return ERROR_IO_PENDING;
+}
+
+static DWORD _pipe9x_read_result(PipeReadHandle prh, void **data_out, size_t *data_size_out, BOOL wait)
+{
+	assert(prh != NULL);
+	
+	if(!prh->data.pending || prh->data.callback_pending)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+	
+	if(prh->data.use_thread_fallback)
+	{
+		if(!_pipe9x_worker_wait(&(prh->data), wait))
+		{
+			return ERROR_IO_INCOMPLETE;
+		}
+		
+		DWORD result, bytes_transferred;
+		_pipe9x_worker_reap(&(prh->data), &result, &bytes_transferred);
+		
+		prh->data.pending = FALSE;
+		
+		if(result == ERROR_SUCCESS)
+		{
+			*data_out = prh->data.rw_buf;
+			*data_size_out = bytes_transferred;
+		}
+		
+		return result;
+	}
+	
+	if(prh->data.op_inline)
+	{
+		prh->data.op_inline = FALSE;
+		prh->data.pending = FALSE;
+		
+		*data_out = prh->data.rw_buf;
+		*data_size_out = prh->data.bytes_transferred;
+		
+		return ERROR_SUCCESS;
+	}
+	
+	/* Check for completion ourselves rather than letting GetOverlappedResult()
+	 * wait, so that we don't make a system call when the operation is still in
+	 * progress and can cope with not having an event.
+	*/
+	if(!_pipe9x_overlapped_wait(&(prh->data), wait))
+	{
+		return ERROR_IO_INCOMPLETE;
+	}
+	
+	/* ERROR_MORE_DATA means part of a message from a message-mode pipe. */
+	
+	DWORD bytes_transferred;
+	if(_pipe9x_get_overlapped_result(prh->data.pipe, &(prh->data.overlapped), &bytes_transferred, FALSE)
+		|| GetLastError() == ERROR_MORE_DATA)
+	{
+		prh->data.pending = FALSE;
+		
+		*data_out = prh->data.rw_buf;
+		*data_size_out = bytes_transferred;
+		
+		return ERROR_SUCCESS;
+	}
+	else{
+		DWORD error = GetLastError();
+		
+		/* Clear the pending flag if the operation has failed. */
+		if(error != ERROR_IO_INCOMPLETE)
+		{
+			prh->data.pending = FALSE;
+		}
+		
+		return error;
+	}
+}
+
+DWORD pipe9x_read_result(PipeReadHandle prh, void **data_out, size_t *data_size_out, BOOL wait)
+{
+	DWORD error = _pipe9x_read_result(prh, data_out, data_size_out, wait);
+	
+	if(error != ERROR_IO_INCOMPLETE && error != ERROR_INVALID_PARAMETER)
+	{
+		_pipe9x_trace(&(prh->data), PIPE9X_TRACE_READ_COMPLETE, error,
+			(error == ERROR_SUCCESS ? *data_size_out : 0), (error == ERROR_SUCCESS ? *data_out : NULL));
+		_pipe9x_metrics_complete(&(prh->data), error, (error == ERROR_SUCCESS ? *data_size_out : 0));
+	}
+	
+	return error;
+}
+
+BOOL pipe9x_read_pending(PipeReadHandle prh)
+{
+	assert(prh != NULL);
+	return prh->data.pending;
+}
+
+BOOL pipe9x_read_release_idle(PipeReadHandle prh, DWORD quiet_ms)
+{
+	assert(prh != NULL);
+	return _pipe9x_release_idle(&(prh->data), quiet_ms);
+}
+
+HANDLE pipe9x_read_pipe(PipeReadHandle prh)
+{
+	assert(prh != NULL);
+	return prh->data.pipe;
+}
+
+HANDLE pipe9x_read_event(PipeReadHandle prh)
+{
+	assert(prh != NULL);
+	return _pipe9x_event(&(prh->data));
+}
+
+PipeBackend pipe9x_read_backend(PipeReadHandle prh)
+{
+	assert(prh != NULL);
+	return prh->data.use_thread_fallback ? PIPE9X_BACKEND_THREADED : PIPE9X_BACKEND_OVERLAPPED;
+}
+
+void pipe9x_read_set_trace(PipeReadHandle prh, PipeTrace trace)
+{
+	assert(prh != NULL);
+	_pipe9x_set_trace(&(prh->data), trace, PIPE9X_TRACE_ATTACH_READ);
+}
+
+#ifndef PIPE9X_NT_COPY_THRESHOLD
+#define PIPE9X_NT_COPY_THRESHOLD (256 * 1024)  /* Default for pipe9x_set_nt_copy_threshold(). */
+#endif
+
+static size_t volatile _pipe9x_nt_copy_threshold = PIPE9X_NT_COPY_THRESHOLD;
+
+size_t pipe9x_set_nt_copy_threshold(size_t threshold)
+{
+	size_t old_threshold = _pipe9x_nt_copy_threshold;
+	_pipe9x_nt_copy_threshold = threshold;
+	
+	return old_threshold;
+}
+
+#ifdef PIPE9X_HAVE_SSE2_INTRINSICS
+
+/* 32-bit GCC doesn't enable SSE2 by default, but we check for it at runtime. */
+#ifdef __GNUC__
+#define PIPE9X_SSE2_TARGET __attribute__((target("sse2")))
+#else
+#define PIPE9X_SSE2_TARGET
+#endif
+
+static BOOL _pipe9x_have_sse2(void)
+{
+	static LONG volatile have_sse2 = -1;
+	
+	if(have_sse2 < 0)
+	{
+		/* IsProcessorFeaturePresent() doesn't exist on Windows 95. */
+		IsProcessorFeaturePresent_t IsProcessorFeaturePresent_p = (IsProcessorFeaturePresent_t)(_pipe9x_kernel32_proc("IsProcessorFeaturePresent"));
+		
+		have_sse2 = IsProcessorFeaturePresent_p != NULL
+			&& IsProcessorFeaturePresent_p(PF_XMMI64_INSTRUCTIONS_AVAILABLE);
+	}
+	
+	return have_sse2 > 0;
+}
+
+/* Copy using non-temporal stores, dst must be 16 byte aligned. */
+PIPE9X_SSE2_TARGET static void _pipe9x_nt_copy(void *dst, const void *src, size_t size)
+{
+	__m128i *d = (__m128i*)(dst);
+	const __m128i *s = (const __m128i*)(src);
+	
+	size_t blocks = size / 64;
+	
+	for(size_t i = 0; i < blocks; ++i, d += 4, s += 4)
+	{
+		__m128i a = _mm_loadu_si128(s);
+		__m128i b = _mm_loadu_si128(s + 1);
+		__m128i c = _mm_loadu_si128(s + 2);
+		__m128i e = _mm_loadu_si128(s + 3);
+		
+		_mm_stream_si128(d, a);
+		_mm_stream_si128(d + 1, b);
+		_mm_stream_si128(d + 2, c);
+		_mm_stream_si128(d + 3, e);
+	}
+	
+	/* Make the streamed data visible before WriteFile() or the I/O thread
+	 * reads it.
+	*/
+	_mm_sfence();
+	
+	memcpy(d, s, size % 64);
+}
+
+#endif /* PIPE9X_HAVE_SSE2_INTRINSICS */
+
+/* Copy data to be written into the buffer of a write handle. Large copies
+ * bypass the cache, since only the kernel will read the buffer and we don't
+ * want to evict the caller's data to make room for it.
+*/
+static void _pipe9x_stage_copy(void *dst, const void *src, size_t size)
+{
+#ifdef PIPE9X_HAVE_SSE2_INTRINSICS
+	if(size >= _pipe9x_nt_copy_threshold && _pipe9x_have_sse2())
+	{
+		_pipe9x_nt_copy(dst, src, size);
+		return;
+	}
+#endif
+
+	memcpy(dst, src, size);
+}
+
+static void _pipe9x_write_callback_done(PipeWriteHandle pwh, DWORD error, DWORD bytes_transferred)
+{
+	_pipe9x_trace(&(pwh->data), PIPE9X_TRACE_WRITE_COMPLETE, error,
+		(error == ERROR_SUCCESS ? bytes_transferred : 0), NULL);
+	_pipe9x_metrics_complete(&(pwh->data), error, bytes_transferred);
+	
+	pwh->data.pending = FALSE;
+	pwh->data.callback_pending = FALSE;
+	
+	if(!pwh->data.closing)
+	{
+		pwh->callback(
+			pwh,
+			error,
+			(error == ERROR_SUCCESS ? bytes_transferred : 0),
+			pwh->callback_context);
+	}
+}
+
+/* Completion routine for WriteFileEx(). */
+static VOID WINAPI _pipe9x_write_completion(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered, LPOVERLAPPED lpOverlapped)
+{
+	PipeWriteHandle pwh = (PipeWriteHandle)((char*)(lpOverlapped) - offsetof(struct _PipeWriteHandle, data.overlapped));
+	_pipe9x_write_callback_done(pwh, dwErrorCode, dwNumberOfBytesTransfered);
+}
+
+/* APC queued by the worker thread. */
+static VOID CALLBACK _pipe9x_write_apc(ULONG_PTR dwParam)
+{
+	PipeWriteHandle pwh = (PipeWriteHandle)(dwParam);
+	
+	DWORD result, bytes_transferred;
+	_pipe9x_worker_reap(&(pwh->data), &result, &bytes_transferred);
+	
+	_pipe9x_write_callback_done(pwh, result, bytes_transferred);
+}
+
+static DWORD WINAPI _pipe9x_write_thread(LPVOID lpParameter)
+{
+	PipeWriteHandle pwh = (PipeWriteHandle)(lpParameter);
+	struct PipeRequest request;
+	
+	while(_pipe9x_worker_next(&(pwh->data), &request))
+	{
+		DWORD result = ERROR_SUCCESS;
+		DWORD bytes_transferred = 0;
+		
+		if(!_pipe9x_write_file(
+			pwh->data.pipe,
+			pwh->data.rw_buf,
+			request.size,
+			&bytes_transferred,
+			NULL))
+		{
+			result = GetLastError();
+		}
+		
+		_pipe9x_worker_complete(&(pwh->data), &request, result, bytes_transferred, &_pipe9x_write_apc, pwh);
+	}
+	
+	return 0;
+}
+
+/* Check if all data appended to the write-behind ring has been written. */
+static BOOL _pipe9x_write_behind_drained(struct PipeData *pd)
+{
+	return _pipe9x_load_acquire(&(pd->wb_tail)) == pd->wb_head;
+}
+
+/* Wait for data to be appended to the write-behind ring (writer thread).
+ * Returns FALSE once PIPE9X_REQUEST_QUIT is queued, which is the only request
+ * queued to a writer thread.
+*/
+static BOOL _pipe9x_write_behind_next(struct PipeData *pd, DWORD tail)
+{
+	for(;;)
+	{
+		if((DWORD)(_pipe9x_load_acquire(&(pd->wb_head))) != tail)
+		{
+			return TRUE;
+		}
+		
+		if(_pipe9x_load_acquire(&(pd->request_head)) != pd->request_tail)
+		{
+			return FALSE;
+		}
+		
+		InterlockedExchange(&(pd->worker_sleeping), TRUE);
+		
+		if((DWORD)(_pipe9x_load_acquire(&(pd->wb_head))) == tail
+			&& _pipe9x_load_acquire(&(pd->request_head)) == pd->request_tail)
+		{
+			WaitForSingleObject(pd->work_event, INFINITE);
+		}
+		
+		_pipe9x_store_release(&(pd->worker_sleeping), FALSE);
+	}
+}
+
+/* Writer thread of a handle in write-behind mode. Writes out whatever has been
+ * appended to the ring, up to the end of the buffer, in one go.
+*/
+static DWORD WINAPI _pipe9x_write_behind_thread(LPVOID lpParameter)
+{
+	PipeWriteHandle pwh = (PipeWriteHandle)(lpParameter);
+	struct PipeData *pd = &(pwh->data);
+	
+	DWORD tail = (DWORD)(pd->wb_tail);
+	
+	while(_pipe9x_write_behind_next(pd, tail))
+	{
+		DWORD head = (DWORD)(_pipe9x_load_acquire(&(pd->wb_head)));
+		DWORD offset = tail % pd->rw_buf_size;
+		
+		DWORD chunk = head - tail;
+		if(chunk > (pd->rw_buf_size - offset))
+		{
+			chunk = pd->rw_buf_size - offset;
+		}
+		
+		/* After an error, buffered data is discarded. */
+		DWORD written = chunk;
+		
+		if(pd->wb_error == ERROR_SUCCESS
+			&& !_pipe9x_write_file(pd->pipe, pd->rw_buf + offset, chunk, &written, NULL))
+		{
+			pd->wb_error = GetLastError();
+			written = chunk;
+		}
+		
+		tail += written;
+		
+		InterlockedExchange(&(pd->worker_signalling), TRUE);
+		InterlockedExchange(&(pd->wb_tail), (LONG)(tail));
+		
+		/* Signal the event if a refused write now fits (or never will). The
+		 * caller only sets wb_want once the event has been handed out.
+		*/
+		
+		DWORD want = (DWORD)(_pipe9x_load_acquire(&(pd->wb_want)));
+		DWORD room = pd->rw_buf_size - ((DWORD)(_pipe9x_load_acquire(&(pd->wb_head))) - tail);
+		
+		if(want != 0
+			&& (room >= want || pd->wb_error != ERROR_SUCCESS)
+			&& InterlockedExchange(&(pd->wb_want), 0) != 0)
+		{
+			SetEvent(pd->overlapped.hEvent);
+		}
+		
+		if(_pipe9x_load_acquire(&(pd->caller_waiting)) && _pipe9x_write_behind_drained(pd))
+		{
+			SetEvent(pd->wb_drain_event);
+		}
+		
+		_pipe9x_store_release(&(pd->worker_signalling), FALSE);
+	}
+	
+	return 0;
+}
+
+/* Append data to the write-behind ring, starting the writer thread if it
+ * isn't running.
+*/
+static DWORD _pipe9x_write_behind_append(PipeWriteHandle pwh, const void *data, size_t data_size)
+{
+	struct PipeData *pd = &(pwh->data);
+	
+	if(data_size > pd->rw_buf_size)
+	{
+		return ERROR_FILE_TOO_LARGE;
+	}
+	
+	DWORD head = (DWORD)(pd->wb_head);
+	DWORD tail = (DWORD)(_pipe9x_load_acquire(&(pd->wb_tail)));
+	
+	if(pd->wb_error != ERROR_SUCCESS)
+	{
+		return pd->wb_error;
+	}
+	
+	if((pd->rw_buf_size - (head - tail)) < data_size)
+	{
+		/* No room. Only bother with the event if anyone can be waiting on
+		 * it, the writer thread signals it once there is room.
+		*/
+		
+		if(pd->event_exported)
+		{
+			_pipe9x_worker_signal_wait(pd);
+			ResetEvent(pd->overlapped.hEvent);
+			
+			InterlockedExchange(&(pd->wb_want), (LONG)(data_size));
+			
+			/* Catch the writer making room before it could see wb_want. */
+			tail = (DWORD)(_pipe9x_load_acquire(&(pd->wb_tail)));
+			
+			if(((pd->rw_buf_size - (head - tail)) >= data_size || pd->wb_error != ERROR_SUCCESS)
+				&& InterlockedExchange(&(pd->wb_want), 0) != 0)
+			{
+				SetEvent(pd->overlapped.hEvent);
+			}
+		}
+		
+		return ERROR_IO_INCOMPLETE;
+	}
+	
+	DWORD error = _pipe9x_buffer(pd);
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	error = _pipe9x_worker_start(pd, &_pipe9x_write_behind_thread, pwh);
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	/* Copy in up to two pieces, if the data wraps around the end. Plain
+	 * memcpy() rather than _pipe9x_stage_copy(), since the offset can be
+	 * anywhere and _pipe9x_nt_copy() needs an aligned destination.
+	*/
+	
+	DWORD offset = head % pd->rw_buf_size;
+	DWORD first = data_size;
+	
+	if(first > (pd->rw_buf_size - offset))
+	{
+		first = pd->rw_buf_size - offset;
+	}
+	
+	memcpy(pd->rw_buf + offset, data, first);
+	memcpy(pd->rw_buf, (const unsigned char*)(data) + first, data_size - first);
+	
+	pd->wb_appended += data_size;
+	pd->pending = TRUE;
+	
+	/* Publish before checking worker_sleeping, see _pipe9x_worker_push(). */
+	InterlockedExchange(&(pd->wb_head), (LONG)(head + data_size));
+	
+	if(_pipe9x_load_acquire(&(pd->worker_sleeping)))
+	{
+		SetEvent(pd->work_event);
+	}
+	
+	return ERROR_IO_PENDING;
+}
+
+/* Wait for the writer thread to drain the write-behind ring. Returns FALSE if
+ * there is still data to be written and wait is FALSE.
+*/
+static BOOL _pipe9x_write_behind_wait(struct PipeData *pd, BOOL wait)
+{
+	if(_pipe9x_write_behind_drained(pd))
+	{
+		return TRUE;
+	}
+	
+	if(!wait)
+	{
+		return FALSE;
+	}
+	
+	/* A separate event is used, since the event object is signalled when
+	 * there is room in the ring rather than when it is empty.
+	*/
+	
+	if(pd->wb_drain_event == NULL)
+	{
+		pd->wb_drain_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+	
+	if(pd->wb_drain_event == NULL)
+	{
+		while(!_pipe9x_write_behind_drained(pd))
+		{
+			Sleep(1);
+		}
+		
+		return TRUE;
+	}
+	
+	InterlockedExchange(&(pd->caller_waiting), TRUE);
+	
+	while(!_pipe9x_write_behind_drained(pd))
+	{
+		/* May be woken by a signal left over from last time, auto-reset
+		 * means only once.
+		*/
+		WaitForSingleObject(pd->wb_drain_event, INFINITE);
+	}
+	
+	_pipe9x_store_release(&(pd->caller_waiting), FALSE);
+	
+	return TRUE;
+}
+
+static DWORD _pipe9x_write_start(PipeWriteHandle pwh, const void *data, size_t data_size)
+{
+	assert(pwh != NULL);
+	
+	if(_pipe9x_write_behind(&(pwh->data)))
+	{
+		return _pipe9x_write_behind_append(pwh, data, data_size);
+	}
+	
+	if(pwh->data.pending)
+	{
+		return ERROR_IO_INCOMPLETE;
+	}
 	
-	if(ReadFile(
-		prh->data.pipe,
-		prh->data.rw_buf,
-		prh->data.rw_buf_size,
-		&(prh->data.bytes_transferred),
-		NULL))
+	if(data_size > pwh->data.rw_buf_size)
 	{
-		prh->data.io_result = ERROR_SUCCESS;
-	}
-	else{
-		prh->data.io_result = GetLastError();
+		return ERROR_FILE_TOO_LARGE;
 	}
 	
-	SetEvent(prh->data.overlapped.hEvent);
-	
-	return 0;
-}
-
-DWORD pipe9x_read_initiate(PipeReadHandle prh)
-{
-	assert(prh != NULL);
+	DWORD error = _pipe9x_buffer(&(pwh->data));
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
 	
-	if(prh->data.pending)
+	if(data != pwh->data.rw_buf)
 	{
-		return ERROR_IO_INCOMPLETE;
+		/* Not already filled in via pipe9x_write_buffer(). */
+		_pipe9x_stage_copy(pwh->data.rw_buf, data, data_size);
 	}
 	
-	if(prh->data.use_thread_fallback)
+	if(pwh->data.use_thread_fallback)
 	{
-		assert(prh->data.io_thread == NULL);
-		
-		ResetEvent(prh->data.overlapped.hEvent);
-		
-		DWORD io_thread_id;
-		prh->data.io_thread = CreateThread(NULL, 0, &_pipe9x_read_thread, prh, 0, &io_thread_id);
-		
-		if(prh->data.io_thread == NULL)
+		error = _pipe9x_worker_start(&(pwh->data), &_pipe9x_write_thread, pwh);
+		if(error != ERROR_SUCCESS)
 		{
-			return GetLastError();
+			return error;
 		}
 		
-		prh->data.pending = TRUE;
+		_pipe9x_worker_reset_event(&(pwh->data));
+		_pipe9x_worker_push(&(pwh->data), PIPE9X_REQUEST_IO, data_size, FALSE);
+		
+		pwh->data.pending = TRUE;
 		
 		return ERROR_IO_PENDING;
 	}
 	else{
-		if(ReadFile(
-			prh->data.pipe,
-			prh->data.rw_buf,
-			prh->data.rw_buf_size,
-			&(prh->data.bytes_transferred),
-			&(prh->data.overlapped)))
-		{
-			/* Not sure if this is actually a valid result for overlapped
-			 * operations, but lets assume it is...
-			*/
-			
-			prh->data.pending = TRUE;
-			return ERROR_IO_PENDING;
-		}
-		else{
-			DWORD error = GetLastError();
-			
-			if(error == ERROR_IO_PENDING)
-			{
-				prh->data.pending = TRUE;
-				return ERROR_IO_PENDING;
-			}
-			else{
-				return error;
-			}
-		}
+		_pipe9x_completion_modes(&(pwh->data));
+		
+		pwh->data.op_has_event = (pwh->data.overlapped.hEvent != NULL);
+		
+		BOOL ok = _pipe9x_write_file(
+			pwh->data.pipe,
+			pwh->data.rw_buf,
+			data_size,
+			&(pwh->data.bytes_transferred),
+			&(pwh->data.overlapped));
+		
+		return _pipe9x_overlapped_started(&(pwh->data), ok);
 	}
 }
 
-DWORD pipe9x_read_result(PipeReadHandle prh, void **data_out, size_t *data_size_out, BOOL wait)
+static VOID CALLBACK _pipe9x_write_wait_callback(PVOID lpParameter, BOOLEAN TimerOrWaitFired)
 {
-	assert(prh != NULL);
+	PipeWriteHandle pwh = (PipeWriteHandle)(lpParameter);
 	
-	if(!prh->data.pending)
-	{
-		return ERROR_INVALID_PARAMETER;
-	}
+	EnterCriticalSection(&(pwh->data.wait_lock));
+	_pipe9x_wait_fired(&(pwh->data));
 	
-	if(prh->data.use_thread_fallback)
+	if(pwh->data.wait_active)
 	{
-		assert(prh->data.io_thread != NULL);
+		size_t data_written = 0;
+		
+		DWORD error = pipe9x_write_result(pwh, &data_written, FALSE);
 		
-		DWORD wait_result = WaitForSingleObject(prh->data.overlapped.hEvent, (wait ? INFINITE : 0));
-		if(wait_result == WAIT_OBJECT_0)
+		if(error == ERROR_IO_INCOMPLETE)
 		{
-			wait_result = WaitForSingleObject(prh->data.io_thread, INFINITE);
-			assert(wait_result == WAIT_OBJECT_0);
-			
-			prh->data.pending = FALSE;
-			
-			CloseHandle(prh->data.io_thread);
-			prh->data.io_thread = NULL;
-			
-			if(prh->data.io_result == ERROR_SUCCESS)
-			{
-				*data_out = prh->data.rw_buf;
-				*data_size_out = prh->data.bytes_transferred;
-			}
+			/* Spurious wakeup, keep waiting. The event is always attached
+			 * to the operation (see _pipe9x_wait_prepare()), so this
+			 * can't spin.
+			*/
 			
-			return prh->data.io_result;
-		}
-		else if(wait_result == WAIT_TIMEOUT)
-		{
-			return ERROR_IO_INCOMPLETE;
+			_pipe9x_wait_arm(&(pwh->data), &_pipe9x_write_wait_callback, pwh);
 		}
 		else{
-			/* WaitForSingleObject() shouldn't fail here... */
-			abort();
+			pwh->wait_callback(pwh, error, data_written, pwh->wait_context);
 		}
 	}
 	
-	DWORD bytes_transferred;
-	if(GetOverlappedResult(prh->data.pipe, &(prh->data.overlapped), &bytes_transferred, wait))
+	pwh->data.wait_thread_id = 0;
+	LeaveCriticalSection(&(pwh->data.wait_lock));
+}
+
+DWORD pipe9x_write_initiate(PipeWriteHandle pwh, const void *data, size_t data_size)
+{
+	DWORD error = _pipe9x_write_start(pwh, data, data_size);
+	_pipe9x_trace_initiate(&(pwh->data), PIPE9X_TRACE_WRITE_INITIATE, error, data_size, data);
+	_pipe9x_metrics_initiate(&(pwh->data), error, data_size);
+	
+	if(error == ERROR_IO_PENDING && pwh->data.wait_active)
 	{
-		prh->data.pending = FALSE;
-		
-		*data_out = prh->data.rw_buf;
-		*data_size_out = bytes_transferred;
-		
-		return ERROR_SUCCESS;
-	}
-	else{
-		DWORD error = GetLastError();
-		
-		/* Clear the pending flag if the operation has failed. */
-		if(error != ERROR_IO_INCOMPLETE)
+		DWORD wait_error = _pipe9x_wait_arm(&(pwh->data), &_pipe9x_write_wait_callback, pwh);
+		if(wait_error != ERROR_SUCCESS)
 		{
-			prh->data.pending = FALSE;
+			return wait_error;
 		}
-		
-		return error;
 	}
+	
+	return error;
 }
 
-BOOL pipe9x_read_pending(PipeReadHandle prh)
-{
-	assert(prh != NULL);
-	return prh->data.pending;
-}
-
-HANDLE pipe9x_read_pipe(PipeReadHandle prh)
-{
-	assert(prh != NULL);
-	return prh->data.pipe;
-}
-
-HANDLE pipe9x_read_event(PipeReadHandle prh)
-{
-	assert(prh != NULL);
-	return prh->data.overlapped.hEvent;
-}
-
-static DWORD WINAPI _pipe9x_write_thread(LPVOID lpParameter)
+DWORD pipe9x_write_register_wait(PipeWriteHandle pwh, PipeWriteCallback callback, void *context)
 {
-	PipeWriteHandle pwh = (PipeWriteHandle)(lpParameter);
+	assert(pwh != NULL);
+	assert(callback != NULL);
 	
-	if(WriteFile(
-		pwh->data.pipe,
-		pwh->data.rw_buf,
-		pwh->data.bytes_transferred,
-		&(pwh->data.bytes_transferred),
-		NULL))
+	if(!_pipe9x_wait_api())
 	{
-		pwh->data.io_result = ERROR_SUCCESS;
+		return ERROR_CALL_NOT_IMPLEMENTED;
 	}
-	else{
-		pwh->data.io_result = GetLastError();
+	
+	if(_pipe9x_write_behind(&(pwh->data)))
+	{
+		return ERROR_NOT_SUPPORTED;
 	}
 	
-	SetEvent(pwh->data.overlapped.hEvent);
+	if(pwh->data.wait_active)
+	{
+		return ERROR_ALREADY_EXISTS;
+	}
 	
-	return 0;
+	DWORD error = _pipe9x_wait_prepare(&(pwh->data));
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	if(!pwh->data.wait_lock_init)
+	{
+		InitializeCriticalSection(&(pwh->data.wait_lock));
+		pwh->data.wait_lock_init = TRUE;
+	}
+	
+	EnterCriticalSection(&(pwh->data.wait_lock));
+	
+	pwh->wait_callback = callback;
+	pwh->wait_context = context;
+	pwh->data.wait_flags = 0;
+	pwh->data.wait_active = TRUE;
+	
+	if(pwh->data.pending && !pwh->data.callback_pending)
+	{
+		error = _pipe9x_wait_arm(&(pwh->data), &_pipe9x_write_wait_callback, pwh);
+	}
+	
+	if(error != ERROR_SUCCESS)
+	{
+		pwh->data.wait_active = FALSE;
+	}
+	
+	LeaveCriticalSection(&(pwh->data.wait_lock));
+	
+	return error;
 }
 
-DWORD pipe9x_write_initiate(PipeWriteHandle pwh, const void *data, size_t data_size)
+void pipe9x_write_unregister_wait(PipeWriteHandle pwh)
+{
+	assert(pwh != NULL);
+	_pipe9x_wait_unregister(&(pwh->data));
+}
+
+DWORD pipe9x_write_initiate_ex(PipeWriteHandle pwh, const void *data, size_t data_size, PipeWriteCallback callback, void *context)
 {
 	assert(pwh != NULL);
+	assert(callback != NULL);
+	
+	if(_pipe9x_write_behind(&(pwh->data)))
+	{
+		return ERROR_NOT_SUPPORTED;
+	}
 	
 	if(pwh->data.pending)
 	{
@@ -541,101 +4343,129 @@ DWORD pipe9x_write_initiate(PipeWriteHandle pwh, const void *data, size_t data_s
 		return ERROR_FILE_TOO_LARGE;
 	}
 	
-	memcpy(pwh->data.rw_buf, data, data_size);
+	DWORD error = _pipe9x_buffer(&(pwh->data));
+	if(error != ERROR_SUCCESS)
+	{
+		return error;
+	}
+	
+	if(data != pwh->data.rw_buf)
+	{
+		/* Not already filled in via pipe9x_write_buffer(). */
+		_pipe9x_stage_copy(pwh->data.rw_buf, data, data_size);
+	}
+	
+	pwh->callback = callback;
+	pwh->callback_context = context;
 	
 	if(pwh->data.use_thread_fallback)
 	{
-		assert(pwh->data.io_thread == NULL);
-		
-		ResetEvent(pwh->data.overlapped.hEvent);
-		
-		pwh->data.bytes_transferred = data_size;
-		
-		DWORD io_thread_id;
-		pwh->data.io_thread = CreateThread(NULL, 0, &_pipe9x_write_thread, pwh, 0, &io_thread_id);
-		
-		if(pwh->data.io_thread == NULL)
+		error = _pipe9x_apc_prepare(&(pwh->data));
+		if(error != ERROR_SUCCESS)
 		{
-			return GetLastError();
+			return error;
 		}
 		
-		pwh->data.pending = TRUE;
+		error = _pipe9x_worker_start(&(pwh->data), &_pipe9x_write_thread, pwh);
+		if(error != ERROR_SUCCESS)
+		{
+			return error;
+		}
 		
-		return ERROR_IO_PENDING;
+		pwh->data.callback_pending = TRUE;
+		_pipe9x_worker_push(&(pwh->data), PIPE9X_REQUEST_IO, data_size, TRUE);
 	}
 	else{
-		if(WriteFile(
+		if(!WriteFileEx(
 			pwh->data.pipe,
 			pwh->data.rw_buf,
 			data_size,
-			&(pwh->data.bytes_transferred),
-			&(pwh->data.overlapped)))
+			&(pwh->data.overlapped),
+			&_pipe9x_write_completion))
 		{
-			/* Not sure if this is actually a valid result for overlapped
-			 * operations, but lets assume it is...
-			*/
-			
-			pwh->data.pending = TRUE;
-			return ERROR_IO_PENDING;
-		}
-		else{
-			DWORD error = GetLastError();
-			
-			if(error == ERROR_IO_PENDING)
-			{
-				pwh->data.pending = TRUE;
-				return ERROR_IO_PENDING;
-			}
-			else{
-				return error;
-			}
+			return GetLastError();
 		}
+		
+		pwh->data.callback_pending = TRUE;
 	}
+	
+	pwh->data.pending = TRUE;
+	_pipe9x_trace(&(pwh->data), PIPE9X_TRACE_WRITE_INITIATE, ERROR_SUCCESS, data_size, data);
+	_pipe9x_metrics_initiate(&(pwh->data), ERROR_IO_PENDING, data_size);
+	
+	return ERROR_IO_PENDING;
 }
 
-DWORD pipe9x_write_result(PipeWriteHandle pwh, size_t *data_written_out, BOOL wait)
+static DWORD _pipe9x_write_result(PipeWriteHandle pwh, size_t *data_written_out, BOOL wait)
 {
 	assert(pwh != NULL);
 	
-	if(!pwh->data.pending)
+	if(!pwh->data.pending || pwh->data.callback_pending)
 	{
 		return ERROR_INVALID_PARAMETER;
 	}
 	
-	if(pwh->data.use_thread_fallback)
+	if(_pipe9x_write_behind(&(pwh->data)))
 	{
-		assert(pwh->data.io_thread != NULL);
+		if(!_pipe9x_write_behind_wait(&(pwh->data), wait))
+		{
+			return ERROR_IO_INCOMPLETE;
+		}
 		
-		DWORD wait_result = WaitForSingleObject(pwh->data.overlapped.hEvent, (wait ? INFINITE : 0));
-		if(wait_result == WAIT_OBJECT_0)
+		pwh->data.pending = FALSE;
+		
+		if(pwh->data.wb_error != ERROR_SUCCESS)
 		{
-			wait_result = WaitForSingleObject(pwh->data.io_thread, INFINITE);
-			assert(wait_result == WAIT_OBJECT_0);
-			
-			pwh->data.pending = FALSE;
-			
-			CloseHandle(pwh->data.io_thread);
-			pwh->data.io_thread = NULL;
-			
-			if(pwh->data.io_result == ERROR_SUCCESS)
-			{
-				*data_written_out = pwh->data.bytes_transferred;
-			}
-			
-			return pwh->data.io_result;
+			return pwh->data.wb_error;
 		}
-		else if(wait_result == WAIT_TIMEOUT)
+		
+		*data_written_out = pwh->data.wb_appended;
+		pwh->data.wb_appended = 0;
+		
+		return ERROR_SUCCESS;
+	}
+	
+	if(pwh->data.use_thread_fallback)
+	{
+		if(!_pipe9x_worker_wait(&(pwh->data), wait))
 		{
 			return ERROR_IO_INCOMPLETE;
 		}
-		else{
-			/* WaitForSingleObject() shouldn't fail here... */
-			abort();
+		
+		DWORD result, bytes_transferred;
+		_pipe9x_worker_reap(&(pwh->data), &result, &bytes_transferred);
+		
+		pwh->data.pending = FALSE;
+		
+		if(result == ERROR_SUCCESS)
+		{
+			*data_written_out = bytes_transferred;
 		}
+		
+		return result;
+	}
+	
+	if(pwh->data.op_inline)
+	{
+		pwh->data.op_inline = FALSE;
+		pwh->data.pending = FALSE;
+		
+		*data_written_out = pwh->data.bytes_transferred;
+		
+		return ERROR_SUCCESS;
+	}
+	
+	/* Check for completion ourselves rather than letting GetOverlappedResult()
+	 * wait, so that we don't make a system call when the operation is still in
+	 * progress and can cope with not having an event.
+	*/
+	if(!_pipe9x_overlapped_wait(&(pwh->data), wait))
+	{
+		return ERROR_IO_INCOMPLETE;
 	}
 	
 	DWORD bytes_transferred;
-	if(GetOverlappedResult(pwh->data.pipe, &(pwh->data.overlapped), &bytes_transferred, wait))
+	if(_pipe9x_get_overlapped_result(pwh->data.pipe, &(pwh->data.overlapped), &bytes_transferred, FALSE))
 	{
 		pwh->data.pending = FALSE;
 		
@@ -663,8 +4493,33 @@ void pipe9x_write_close(PipeWriteHandle pwh)
 		return;
 	}
 	
+	_pipe9x_set_trace(&(pwh->data), NULL, 0);
+	_pipe9x_metrics_release(&(pwh->data));
+	
+	_pipe9x_wait_unregister(&(pwh->data));
 	_pipe9x_cleanup(&(pwh->data));
-	free(pwh);
+	
+	if(_pipe9x_free_list_put(&_pipe9x_write_free_list, &(pwh->data)))
+	{
+		return;
+	}
+	
+	_pipe9x_free_data(&(pwh->data));
+	_pipe9x_free_handle(&(pwh->data));
+}
+
+DWORD pipe9x_write_result(PipeWriteHandle pwh, size_t *data_written_out, BOOL wait)
+{
+	DWORD error = _pipe9x_write_result(pwh, data_written_out, wait);
+	
+	if(error != ERROR_IO_INCOMPLETE && error != ERROR_INVALID_PARAMETER)
+	{
+		_pipe9x_trace(&(pwh->data), PIPE9X_TRACE_WRITE_COMPLETE, error,
+			(error == ERROR_SUCCESS ? *data_written_out : 0), NULL);
+		_pipe9x_metrics_complete(&(pwh->data), error, (error == ERROR_SUCCESS ? *data_written_out : 0));
+	}
+	
+	return error;
 }
 
 BOOL pipe9x_write_pending(PipeWriteHandle pwh)
@@ -673,6 +4528,35 @@ BOOL pipe9x_write_pending(PipeWriteHandle pwh)
 	return pwh->data.pending;
 }
 
+void *pipe9x_write_buffer(PipeWriteHandle pwh, size_t *size_out)
+{
+	assert(pwh != NULL);
+	
+	if(size_out != NULL)
+	{
+		*size_out = pwh->data.rw_buf_size;
+	}
+	
+	if(_pipe9x_write_behind(&(pwh->data)))
+	{
+		/* The buffer is a ring which the writer thread owns part of. */
+		return NULL;
+	}
+	
+	if(_pipe9x_buffer(&(pwh->data)) != ERROR_SUCCESS)
+	{
+		return NULL;
+	}
+	
+	return pwh->data.rw_buf;
+}
+
+BOOL pipe9x_write_release_idle(PipeWriteHandle pwh, DWORD quiet_ms)
+{
+	assert(pwh != NULL);
+	return _pipe9x_release_idle(&(pwh->data), quiet_ms);
+}
+
 HANDLE pipe9x_write_pipe(PipeWriteHandle pwh)
 {
 	assert(pwh != NULL);
@@ -682,5 +4566,17 @@ HANDLE pipe9x_write_pipe(PipeWriteHandle pwh)
 HANDLE pipe9x_write_event(PipeWriteHandle pwh)
 {
 	assert(pwh != NULL);
-	return pwh->data.overlapped.hEvent;
+	return _pipe9x_event(&(pwh->data));
+}
+
+PipeBackend pipe9x_write_backend(PipeWriteHandle pwh)
+{
+	assert(pwh != NULL);
+	return pwh->data.use_thread_fallback ? PIPE9X_BACKEND_THREADED : PIPE9X_BACKEND_OVERLAPPED;
+}
+
+void pipe9x_write_set_trace(PipeWriteHandle pwh, PipeTrace trace)
+{
+	assert(pwh != NULL);
+	_pipe9x_set_trace(&(pwh->data), trace, PIPE9X_TRACE_ATTACH_WRITE);
 }
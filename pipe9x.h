@@ -35,7 +35,11 @@
 #ifndef PIPE9X_H
 #define PIPE9X_H
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include "pipe9x-win32.h"
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -43,6 +47,255 @@ extern "C" {
 
 typedef struct _PipeWriteHandle *PipeWriteHandle;
 typedef struct _PipeReadHandle *PipeReadHandle;
+typedef struct _PipeTrace *PipeTrace;
+
+/**
+ * @brief Callback invoked when a read started by pipe9x_read_initiate_ex() completes.
+ *
+ * @param prh        PipeReadHandle the read was performed on.
+ * @param error      ERROR_SUCCESS, or a win32 error code.
+ * @param data       Pointer to read data (NULL on error).
+ * @param data_size  Number of bytes read (zero on error).
+ * @param context    Context pointer passed to pipe9x_read_initiate_ex().
+ *
+ * The data remains valid until the PipeReadHandle object is destroyed or
+ * another read is initiated, which may be done from within the callback.
+*/
+typedef void (*PipeReadCallback)(PipeReadHandle prh, DWORD error, void *data, size_t data_size, void *context);
+
+/**
+ * @brief Callback invoked when a write started by pipe9x_write_initiate_ex() completes.
+ *
+ * @param pwh           PipeWriteHandle the write was performed on.
+ * @param error         ERROR_SUCCESS, or a win32 error code.
+ * @param data_written  Number of bytes written (zero on error).
+ * @param context       Context pointer passed to pipe9x_write_initiate_ex().
+*/
+typedef void (*PipeWriteCallback)(PipeWriteHandle pwh, DWORD error, size_t data_written, void *context);
+
+/**
+ * @brief Don't create event objects for the handles up front.
+ *
+ * Handles created with this flag have no event object until one is requested
+ * using pipe9x_read_event() or pipe9x_write_event(), saving a kernel object
+ * per handle when completion is only ever detected by polling (i.e. calling
+ * pipe9x_read_result() or pipe9x_write_result() with wait set to FALSE) or
+ * through callbacks (see pipe9x_read_initiate_ex() and
+ * pipe9x_write_initiate_ex()).
+ *
+ * Waiting for completion is still possible, on Windows NT the pipe handle is
+ * waited on instead, on Windows 9x the background thread is waited on.
+ * The read and write handles of pipe9x_create_duplex() and pipe9x_connect()
+ * share a pipe handle, so waits on those wake up periodically to check whether
+ * the operation has completed.
+ *
+ * If the event is requested while an overlapped operation is already pending
+ * on Windows NT, the event will be signalled straight away rather than when
+ * that operation completes. It behaves normally from the next operation.
+*/
+#define PIPE9X_NO_EVENT 0x00000001
+
+/**
+ * @brief Allocate buffers directly from VirtualAlloc().
+ *
+ * Buffers of handles created with this flag are allocated as whole pages
+ * using VirtualAlloc() rather than from the PipeAllocator, so they are page
+ * aligned and don't share pages with any other data. This is worthwhile for
+ * buffers of hundreds of kilobytes or more.
+ *
+ * Falls back to the PipeAllocator if VirtualAlloc() fails.
+*/
+#define PIPE9X_PAGE_BUFFERS 0x00000002
+
+/**
+ * @brief Allocate buffers using large pages where possible.
+ *
+ * Like PIPE9X_PAGE_BUFFERS, but buffers at least as big as a large page (see
+ * GetLargePageMinimum()) are allocated using large pages, reducing TLB misses
+ * when transferring multi-megabyte blocks of data.
+ *
+ * Large pages are only available on Windows Server 2003 or later, and only if
+ * the calling process has the SeLockMemoryPrivilege privilege enabled (see
+ * AdjustTokenPrivileges()), otherwise normal pages are used.
+*/
+#define PIPE9X_LARGE_PAGES 0x00000004
+
+/**
+ * @brief Buffer writes and write them to the pipe from a continuous thread.
+ *
+ * On Windows 9x, pipe9x_write_initiate() on a handle created with this flag
+ * appends the data to the internal buffer (used as a ring buffer) and returns
+ * ERROR_IO_PENDING without waiting for earlier writes to be harvested. A
+ * background thread writes the buffered data to the pipe in the largest
+ * chunks possible.
+ *
+ * If there isn't room in the buffer for the data, ERROR_IO_INCOMPLETE is
+ * returned and the event object returned by pipe9x_write_event() stays
+ * unsignalled until there is room for it.
+ *
+ * pipe9x_write_result() waits for all buffered data to be written to the pipe
+ * (or polls, when wait is FALSE) and returns the number of bytes appended
+ * since it was last called. If writing to the pipe fails, the error is
+ * returned by pipe9x_write_result() and all further calls to
+ * pipe9x_write_initiate(). Any data still buffered when the handle is closed
+ * is discarded.
+ *
+ * pipe9x_write_initiate_ex() and pipe9x_write_register_wait() return
+ * ERROR_NOT_SUPPORTED and pipe9x_write_buffer() returns NULL for handles in
+ * write-behind mode.
+ *
+ * The write buffer size must be a power of two when using this flag, or
+ * creating the pipe fails with ERROR_INVALID_PARAMETER.
+ *
+ * This flag has no effect on Windows NT, or on read handles.
+*/
+#define PIPE9X_WRITE_BEHIND 0x00000008
+
+/**
+ * @brief Report operations which complete immediately as ERROR_SUCCESS.
+ *
+ * On Windows NT, an overlapped read or write will often complete before
+ * ReadFile() or WriteFile() returns, for example when data is already waiting
+ * in the pipe. pipe9x_read_initiate() and pipe9x_write_initiate() on a handle
+ * created with this flag return ERROR_SUCCESS rather than ERROR_IO_PENDING in
+ * that case, so the caller can call pipe9x_read_result() or
+ * pipe9x_write_result() straight away rather than waiting on the event.
+ *
+ * Either way, the result of such an operation is returned by the next call to
+ * pipe9x_read_result() or pipe9x_write_result() without asking the system for
+ * it again.
+ *
+ * On Windows Vista or later, this flag also tells the system not to post to
+ * an I/O completion port associated with the pipe handle when an operation
+ * completes immediately (see SetFileCompletionNotificationModes()), so don't
+ * use it with pipe handles associated with a completion port by the caller
+ * unless the caller is prepared for that.
+ *
+ * ERROR_IO_PENDING is still returned while a wait is registered using
+ * pipe9x_read_register_wait() or pipe9x_write_register_wait(), so that the
+ * callback is called as normal.
+ *
+ * This flag has no effect on Windows 9x.
+*/
+#define PIPE9X_SYNC_COMPLETION 0x00000010
+
+/**
+ * @brief Alignment of the internal read/write buffers.
+*/
+#define PIPE9X_BUFFER_ALIGNMENT 64
+
+/**
+ * @brief Memory allocation functions used by pipe9x.
+ *
+ * All memory allocated by pipe9x for handle objects and their buffers is
+ * obtained using these functions, see pipe9x_set_allocator().
+*/
+typedef struct PipeAllocator
+{
+	/**
+	 * @brief Allocate size bytes, returning NULL on failure.
+	*/
+	void *(*alloc)(size_t size, void *context);
+	
+	/**
+	 * @brief Free memory obtained from alloc or aligned_alloc.
+	*/
+	void (*free)(void *ptr, void *context);
+	
+	/**
+	 * @brief Allocate size bytes aligned to alignment, returning NULL on failure (optional).
+	 *
+	 * If NULL, aligned buffers are allocated by over-allocating using alloc.
+	*/
+	void *(*aligned_alloc)(size_t size, size_t alignment, void *context);
+	
+	void *context;  /**< Context pointer passed to the above functions. */
+} PipeAllocator;
+
+/**
+ * @brief Set the default allocator.
+ *
+ * @param allocator  Pointer to PipeAllocator (NULL to restore malloc/free).
+ *
+ * Sets the allocator used by handles created from now on, unless overridden
+ * by PipeCreateOptions. The PipeAllocator structure is copied, but its
+ * functions must remain usable until all handles created with it have been
+ * closed and pipe9x_flush_free_lists() has been called.
+ *
+ * This function is not thread safe and should be called before any pipes are
+ * created.
+*/
+void pipe9x_set_allocator(const PipeAllocator *allocator);
+
+/**
+ * @brief Free any closed handle objects kept for reuse.
+ *
+ * Closed handle objects are kept (up to a limit) with their buffer and event
+ * object, and reused by pipes subsequently created with the same buffer size,
+ * flags and allocator, saving on allocations and kernel objects for programs
+ * which create and close many pipes.
+ *
+ * This function frees them, for example before unloading a custom allocator
+ * or checking for leaks.
+*/
+void pipe9x_flush_free_lists(void);
+
+/**
+ * @brief Mechanism used to perform I/O on a pipe.
+*/
+typedef enum PipeBackend
+{
+	/**
+	 * @brief Use PIPE9X_BACKEND_OVERLAPPED if available, otherwise PIPE9X_BACKEND_THREADED.
+	*/
+	PIPE9X_BACKEND_AUTO = 0,
+	
+	/**
+	 * @brief Overlapped I/O on a named pipe.
+	 *
+	 * Only available on Windows NT, ERROR_CALL_NOT_IMPLEMENTED is returned
+	 * when creating a pipe elsewhere.
+	*/
+	PIPE9X_BACKEND_OVERLAPPED = 1,
+	
+	/**
+	 * @brief Blocking I/O from a background thread, on an anonymous pipe.
+	 *
+	 * This is what Windows 9x uses, selecting it explicitly allows testing
+	 * and benchmarking it on Windows NT (or Wine).
+	*/
+	PIPE9X_BACKEND_THREADED = 2,
+	
+	/**
+	 * @brief Simulated pipes with a virtual clock, see pipe9x-sim.h.
+	 *
+	 * Only available when pipe9x-sim.c is built in place of pipe9x.c,
+	 * ERROR_CALL_NOT_IMPLEMENTED is returned when creating a pipe otherwise.
+	*/
+	PIPE9X_BACKEND_SIMULATED = 3,
+} PipeBackend;
+
+/**
+ * @brief Extra options for pipe9x_create_ex().
+*/
+typedef struct PipeCreateOptions
+{
+	DWORD flags;  /**< Bitwise OR of PIPE9X_* flags. */
+	
+	/**
+	 * @brief Allocator for the created handles (NULL to use the default).
+	 *
+	 * The PipeAllocator structure is copied into each handle.
+	*/
+	const PipeAllocator *allocator;
+	
+	/**
+	 * @brief Backend to use for the created handles (PIPE9X_BACKEND_AUTO by default).
+	 *
+	 * ERROR_INVALID_PARAMETER is returned for unknown backends.
+	*/
+	PipeBackend backend;
+} PipeCreateOptions;
 
 /**
  * @brief Create a pair of connected pipe handles.
@@ -67,6 +320,9 @@ typedef struct _PipeReadHandle *PipeReadHandle;
  *
  * The buffer size parameters specify the size of the internal read/write
  * buffers to allocate and set the upper size limit for read/write operations.
+ * The buffers aren't allocated until the first read/write operation is
+ * initiated, so pipes which are never used don't consume the memory (and
+ * running out of memory may be reported when initiating an operation).
 */
 DWORD pipe9x_create(
 	PipeReadHandle *prh_out,
@@ -76,6 +332,183 @@ DWORD pipe9x_create(
 	size_t write_size,
 	BOOL write_inherit);
 
+/**
+ * @brief Create a pair of connected pipe handles with extra options.
+ *
+ * @param prh_out        Pointer to PipeReadHandle to receive read handle.
+ * @param read_size      Size of pipe read buffer.
+ * @param read_inherit   Whether the pipe read handle is inherited by new processes.
+ * @param pwh_out        Pointer to PipeWriteHandle to receive write handle.
+ * @param write_size     Size of pipe write buffer.
+ * @param write_inherit  Whether the pipe write handle is inherited by new processes.
+ * @param options        Pointer to PipeCreateOptions structure (may be NULL).
+ *
+ * @return ERROR_SUCCESS, or another win32 error code.
+ *
+ * This function behaves the same as pipe9x_create(), except the created
+ * handles are configured using the given PipeCreateOptions structure. Passing
+ * NULL is equivalent to pipe9x_create().
+*/
+DWORD pipe9x_create_ex(
+	PipeReadHandle *prh_out,
+	size_t read_size,
+	BOOL read_inherit,
+	PipeWriteHandle *pwh_out,
+	size_t write_size,
+	BOOL write_inherit,
+	const PipeCreateOptions *options);
+
+/**
+ * @brief Parameters of one pipe to create using pipe9x_create_many().
+*/
+typedef struct PipeCreateSpec
+{
+	size_t read_size;     /**< Size of pipe read buffer. */
+	BOOL read_inherit;    /**< Whether the pipe read handle is inherited by new processes. */
+	size_t write_size;    /**< Size of pipe write buffer. */
+	BOOL write_inherit;   /**< Whether the pipe write handle is inherited by new processes. */
+} PipeCreateSpec;
+
+/**
+ * @brief Create several pairs of connected pipe handles at once.
+ *
+ * @param prh_out  Array of count PipeReadHandles to receive read handles.
+ * @param pwh_out  Array of count PipeWriteHandles to receive write handles.
+ * @param specs    Array of count PipeCreateSpec structures describing each pipe.
+ * @param count    Number of pipes to create.
+ * @param options  Pointer to PipeCreateOptions structure (may be NULL).
+ *
+ * @return ERROR_SUCCESS, or another win32 error code.
+ *
+ * This function creates count pipes, as if by calling pipe9x_create_ex() for
+ * each element of specs, but faster: all the pipes are created and waiting for
+ * their connections before the client ends are opened, and the handle objects
+ * and buffers are allocated in a single block which is freed once all the
+ * handles have been closed.
+ *
+ * The handles are closed individually using pipe9x_read_close() and
+ * pipe9x_write_close() as usual, but are not kept for reuse afterwards (see
+ * pipe9x_flush_free_lists()).
+ *
+ * On error, no pipes are created and every element of prh_out and pwh_out is
+ * initialised to NULL.
+*/
+DWORD pipe9x_create_many(
+	PipeReadHandle *prh_out,
+	PipeWriteHandle *pwh_out,
+	const PipeCreateSpec *specs,
+	size_t count,
+	const PipeCreateOptions *options);
+
+/**
+ * @brief One end of a bidirectional pipe created by pipe9x_create_duplex().
+*/
+typedef struct PipeDuplexEnd
+{
+	PipeReadHandle read;    /**< Handle for reading data sent from the other end. */
+	PipeWriteHandle write;  /**< Handle for writing data to the other end. */
+} PipeDuplexEnd;
+
+/**
+ * @brief Create a bidirectional pipe.
+ *
+ * @param a_out      Pointer to PipeDuplexEnd to receive the first end.
+ * @param a_inherit  Whether the first end is inherited by new processes.
+ * @param b_out      Pointer to PipeDuplexEnd to receive the second end.
+ * @param b_inherit  Whether the second end is inherited by new processes.
+ * @param buf_size   Size of the read and write buffers of each end.
+ *
+ * @return ERROR_SUCCESS, or another win32 error code.
+ *
+ * This function creates a pair of connected pipe ends, anything written using
+ * the write handle of one end can be read using the read handle of the other.
+ * The read and write handles of each end are used exactly like those returned
+ * by pipe9x_create() and may be closed independently. Before Windows Vista,
+ * closing one of the handles while an operation is pending on it waits for the
+ * operation to complete, as it can't be cancelled without also cancelling any
+ * operation pending on the other handle.
+ *
+ * On Windows NT, a single duplex named pipe is used for both directions, so
+ * pipe9x_read_pipe() and pipe9x_write_pipe() return handles to the same pipe
+ * and either may be passed to another process as a bidirectional handle. On
+ * Windows 9x, two anonymous pipes are used instead.
+ *
+ * On error, a win32 error code is returned and the handles in *a_out and
+ * *b_out are all initialised to NULL.
+*/
+DWORD pipe9x_create_duplex(
+	PipeDuplexEnd *a_out,
+	BOOL a_inherit,
+	PipeDuplexEnd *b_out,
+	BOOL b_inherit,
+	size_t buf_size);
+
+/**
+ * @brief Closes both handles of a PipeDuplexEnd.
+ *
+ * @param end  PipeDuplexEnd to close (may be NULL).
+ *
+ * This is equivalent to calling pipe9x_read_close() and pipe9x_write_close()
+ * on the handles in the PipeDuplexEnd, which are then set to NULL.
+*/
+void pipe9x_duplex_close(PipeDuplexEnd *end);
+
+/**
+ * @brief Statistics about a pipe9x_connect() call.
+*/
+typedef struct PipeConnectStats
+{
+	DWORD attempts;      /**< Number of times opening the pipe was attempted. */
+	DWORD busy_retries;  /**< Number of attempts which failed with ERROR_PIPE_BUSY. */
+	DWORD elapsed_ms;    /**< Time taken to connect (or give up), in milliseconds. */
+} PipeConnectStats;
+
+/**
+ * @brief Connect to an existing named pipe.
+ *
+ * @param pipe_name   Name of the pipe to connect to (e.g. "\\.\pipe\foo").
+ * @param timeout_ms  Maximum time to spend retrying, in milliseconds (may be INFINITE).
+ * @param prh_out     Pointer to PipeReadHandle to receive read handle (may be NULL).
+ * @param read_size   Size of pipe read buffer.
+ * @param pwh_out     Pointer to PipeWriteHandle to receive write handle (may be NULL).
+ * @param write_size  Size of pipe write buffer.
+ * @param inherit     Whether the pipe handles are inherited by new processes.
+ * @param stats_out   Pointer to PipeConnectStats to receive statistics (may be NULL).
+ *
+ * @return ERROR_SUCCESS, or another win32 error code.
+ *
+ * This function opens the client end of a named pipe created by another
+ * process (or this one) and wraps it in a PipeReadHandle and/or
+ * PipeWriteHandle object, which are used exactly like those returned by
+ * pipe9x_create(). The pipe is opened for reading if prh_out is non-NULL and
+ * for writing if pwh_out is non-NULL, at least one must be provided.
+ *
+ * If the pipe is busy (ERROR_PIPE_BUSY) or doesn't exist yet
+ * (ERROR_FILE_NOT_FOUND), the connection is retried with an exponentially
+ * increasing delay, using WaitNamedPipe() to wake up as soon as a busy pipe
+ * becomes available. Retrying stops once timeout_ms has elapsed, at which
+ * point the error from the last attempt is returned. A timeout of zero makes
+ * a single attempt.
+ *
+ * If stats_out is non-NULL, it is initialised with the number of attempts
+ * made and the time taken, whether the connection succeeded or not.
+ *
+ * On Windows NT, the pipe is opened for overlapped I/O, on Windows 9x, reads
+ * and writes are performed in a background thread instead.
+ *
+ * When both handles are requested, they may be closed independently, with the
+ * same caveat before Windows Vista as pipe9x_create_duplex().
+*/
+DWORD pipe9x_connect(
+	const char *pipe_name,
+	DWORD timeout_ms,
+	PipeReadHandle *prh_out,
+	size_t read_size,
+	PipeWriteHandle *pwh_out,
+	size_t write_size,
+	BOOL inherit,
+	PipeConnectStats *stats_out);
+
 /**
  * @brief Closes the read end of a pipe created by pipe9x_create().
  *
@@ -92,7 +525,8 @@ void pipe9x_read_close(PipeReadHandle prh);
  * On success, this function returns ERROR_IO_PENDING (for consistensy with
  * Win32 API functions) and completion can be polled using the
  * pipe9x_read_result() function or waited on using the event object returned
- * by pipe9x_read_event().
+ * by pipe9x_read_event(). ERROR_SUCCESS may be returned instead if the handle
+ * was created with the PIPE9X_SYNC_COMPLETION flag.
  *
  * Only one read operation can be pending at a time, attempting to start a
  * second read before the first one is completed using pipe9x_read_result()
@@ -103,6 +537,96 @@ void pipe9x_read_close(PipeReadHandle prh);
 */
 DWORD pipe9x_read_initiate(PipeReadHandle prh);
 
+/**
+ * @brief Start a read in the background with a completion callback.
+ *
+ * @param prh       PipeReadHandle to read from.
+ * @param callback  Function to call when the read completes.
+ * @param context   Context pointer to pass to callback.
+ *
+ * This function will initiate an asynchronous read from the pipe into the
+ * internal buffer of the PipeReadHandle object, like pipe9x_read_initiate(),
+ * except the result is passed to the callback function rather than being
+ * obtained using pipe9x_read_result() and the event object is not used.
+ *
+ * The callback is invoked on the thread which called this function, from
+ * within an alertable wait (e.g. SleepEx() or WaitForSingleObjectEx() with
+ * bAlertable set to TRUE). The read is no longer pending by the time the
+ * callback is invoked, so the callback may initiate another one.
+ *
+ * On success, this function returns ERROR_IO_PENDING. On error, a win32 error
+ * code is returned and the callback will not be invoked.
+ *
+ * On Windows NT, this function uses ReadFileEx(). On Windows 9x, a blocking
+ * read is performed in a background thread which queues the callback to the
+ * initiating thread using QueueUserAPC(). ERROR_CALL_NOT_IMPLEMENTED is
+ * returned if QueueUserAPC() is unavailable.
+ *
+ * If the PipeReadHandle is closed while a callback read is pending, it must
+ * be closed from the thread which initiated the read. The read is cancelled
+ * and the callback is not invoked.
+*/
+DWORD pipe9x_read_initiate_ex(PipeReadHandle prh, PipeReadCallback callback, void *context);
+
+/**
+ * @brief Automatically start another read after each one completes.
+ *
+ * Flag for pipe9x_read_register_wait().
+*/
+#define PIPE9X_WAIT_REINITIATE 0x00000001
+
+/**
+ * @brief Deliver read results to a callback on the system thread pool.
+ *
+ * @param prh       PipeReadHandle to register callback for.
+ * @param callback  Function to call when a read completes.
+ * @param context   Context pointer to pass to callback.
+ * @param flags     Bitwise OR of flags (PIPE9X_WAIT_REINITIATE).
+ *
+ * @return ERROR_SUCCESS, or another win32 error code.
+ *
+ * This function registers a callback which is invoked on a thread pool thread
+ * with the result of each read started using pipe9x_read_initiate() for as
+ * long as it remains registered, so no thread needs to be dedicated to waiting
+ * on the event object. The result is obtained using pipe9x_read_result()
+ * before the callback is invoked, with the same meaning of the parameters as
+ * for callbacks passed to pipe9x_read_initiate_ex().
+ *
+ * If the PIPE9X_WAIT_REINITIATE flag is given, a new read is started after
+ * the callback returns if the read succeeded and the callback didn't start one
+ * itself, and a read is started straight away if none is pending. Any error
+ * starting a read is passed to the callback.
+ *
+ * If a read is already pending, its result is delivered to the callback. The
+ * PipeReadHandle must not be otherwise used from other threads while a read
+ * is pending.
+ *
+ * The wait is implemented using RegisterWaitForSingleObject(), if that is
+ * unavailable (Windows 9x/NT4), ERROR_CALL_NOT_IMPLEMENTED is returned.
+ * ERROR_ALREADY_EXISTS is returned if a callback is already registered.
+ *
+ * If the handle was created with the PIPE9X_NO_EVENT flag, its event object
+ * is created by this function. ERROR_IO_INCOMPLETE is returned if a read
+ * started before the event object existed is still pending on an overlapped
+ * handle, since there is nothing to wait on; collect its result first.
+*/
+DWORD pipe9x_read_register_wait(PipeReadHandle prh, PipeReadCallback callback, void *context, DWORD flags);
+
+/**
+ * @brief Unregister a callback registered by pipe9x_read_register_wait().
+ *
+ * @param prh  PipeReadHandle to unregister callback from.
+ *
+ * Once this function returns, the callback is not running and won't be
+ * invoked again. This function may be called from within the callback, in
+ * which case the callback won't be invoked again once it returns. Any
+ * pending read is left pending for completing with pipe9x_read_result().
+ *
+ * A registered callback is unregistered automatically when the
+ * PipeReadHandle is closed, which must not be done from within the callback.
+*/
+void pipe9x_read_unregister_wait(PipeReadHandle prh);
+
 /**
  * @brief Get the result from a read operation.
  *
@@ -122,6 +646,12 @@ DWORD pipe9x_read_initiate(PipeReadHandle prh);
  * If no data has been read yet, and wait is FALSE, ERROR_IO_INCOMPLETE will be
  * returned.
  *
+ * ERROR_INVALID_PARAMETER is returned if no read is pending, or if the pending
+ * read was started using pipe9x_read_initiate_ex().
+ *
+ * A message from a message-mode pipe which doesn't fit in the buffer is
+ * returned in pieces by successive reads rather than as ERROR_MORE_DATA.
+ *
  * If any other error occurs, the relevant Win32 error code is returned.
 */
 DWORD pipe9x_read_result(PipeReadHandle prh, void **data_out, size_t *data_size_out, BOOL wait);
@@ -135,6 +665,22 @@ DWORD pipe9x_read_result(PipeReadHandle prh, void **data_out, size_t *data_size_
 */
 BOOL pipe9x_read_pending(PipeReadHandle prh);
 
+/**
+ * @brief Free the internal buffer of an idle PipeReadHandle.
+ *
+ * @param prh       PipeReadHandle to release buffer of.
+ * @param quiet_ms  How long since a read was last initiated (in milliseconds).
+ *
+ * @return TRUE if the buffer was released.
+ *
+ * Frees the internal buffer if no read is pending and none has been initiated
+ * within quiet_ms, it is allocated again when the next read is initiated.
+ * Any data returned by the last read is no longer valid once released.
+ *
+ * Buffers of handles created by pipe9x_create_many() are never released.
+*/
+BOOL pipe9x_read_release_idle(PipeReadHandle prh, DWORD quiet_ms);
+
 /**
  * @brief Get the underlying Windows HANDLE of the pipe.
  *
@@ -154,9 +700,21 @@ HANDLE pipe9x_read_pipe(PipeReadHandle prh);
  *
  * The returned handle may be waited on, but must not be manually reset, set or
  * otherwise altered.
+ *
+ * If the handle was created with the PIPE9X_NO_EVENT flag, the event object
+ * is created by the first call to this function. NULL is returned if the
+ * event object could not be created.
 */
 HANDLE pipe9x_read_event(PipeReadHandle prh);
 
+/**
+ * @brief Get the backend used for I/O on a PipeReadHandle.
+ *
+ * Returns PIPE9X_BACKEND_OVERLAPPED or PIPE9X_BACKEND_THREADED, never
+ * PIPE9X_BACKEND_AUTO.
+*/
+PipeBackend pipe9x_read_backend(PipeReadHandle prh);
+
 /**
  * @brief Closes the write end of a pipe created by pipe9x_create().
  *
@@ -178,17 +736,78 @@ void pipe9x_write_close(PipeWriteHandle pwh);
  * On success, this function returns ERROR_IO_PENDING (for consistensy with
  * Win32 API functions) and completion can be polled using the
  * pipe9x_write_result() function or waited on using the event object returned
- * by pipe9x_write_event().
+ * by pipe9x_write_event(). ERROR_SUCCESS may be returned instead if the handle
+ * was created with the PIPE9X_SYNC_COMPLETION flag.
  *
  * Only one write operation can be pending at a time, attempting to start a
  * second write before the first one is completed using pipe9x_write_result()
- * will return ERROR_IO_INCOMPLETE.
+ * will return ERROR_IO_INCOMPLETE (see PIPE9X_WRITE_BEHIND for an exception).
  *
  * On Windows NT, this function uses overlapped I/O, on Windows 9x, a blocking
  * write is performed in a background thread instead.
 */
 DWORD pipe9x_write_initiate(PipeWriteHandle prh, const void *data, size_t data_size);
 
+/**
+ * @brief Start a write in the background with a completion callback.
+ *
+ * @param pwh        PipeWriteHandle to write to.
+ * @param data       Pointer to data buffer.
+ * @param data_size  Size of data buffer.
+ * @param callback   Function to call when the write completes.
+ * @param context    Context pointer to pass to callback.
+ *
+ * This function will initiate an asynchronous write to the pipe, like
+ * pipe9x_write_initiate(), except the result is passed to the callback
+ * function rather than being obtained using pipe9x_write_result() and the
+ * event object is not used.
+ *
+ * The callback is invoked on the thread which called this function, from
+ * within an alertable wait (e.g. SleepEx() or WaitForSingleObjectEx() with
+ * bAlertable set to TRUE). The write is no longer pending by the time the
+ * callback is invoked, so the callback may initiate another one.
+ *
+ * On success, this function returns ERROR_IO_PENDING. On error, a win32 error
+ * code is returned and the callback will not be invoked.
+ *
+ * On Windows NT, this function uses WriteFileEx(). On Windows 9x, a blocking
+ * write is performed in a background thread which queues the callback to the
+ * initiating thread using QueueUserAPC(). ERROR_CALL_NOT_IMPLEMENTED is
+ * returned if QueueUserAPC() is unavailable.
+ *
+ * If the PipeWriteHandle is closed while a callback write is pending, it must
+ * be closed from the thread which initiated the write. The write is cancelled
+ * and the callback is not invoked.
+*/
+DWORD pipe9x_write_initiate_ex(PipeWriteHandle pwh, const void *data, size_t data_size, PipeWriteCallback callback, void *context);
+
+/**
+ * @brief Deliver write results to a callback on the system thread pool.
+ *
+ * @param pwh       PipeWriteHandle to register callback for.
+ * @param callback  Function to call when a write completes.
+ * @param context   Context pointer to pass to callback.
+ *
+ * @return ERROR_SUCCESS, or another win32 error code.
+ *
+ * This function registers a callback which is invoked on a thread pool thread
+ * with the result of each write started using pipe9x_write_initiate() for as
+ * long as it remains registered. The result is obtained using
+ * pipe9x_write_result() before the callback is invoked.
+ *
+ * See pipe9x_read_register_wait() for more details.
+*/
+DWORD pipe9x_write_register_wait(PipeWriteHandle pwh, PipeWriteCallback callback, void *context);
+
+/**
+ * @brief Unregister a callback registered by pipe9x_write_register_wait().
+ *
+ * @param pwh  PipeWriteHandle to unregister callback from.
+ *
+ * See pipe9x_read_unregister_wait() for details.
+*/
+void pipe9x_write_unregister_wait(PipeWriteHandle pwh);
+
 /**
  * @brief Get the result from a write operation.
  *
@@ -206,6 +825,9 @@ DWORD pipe9x_write_initiate(PipeWriteHandle prh, const void *data, size_t data_s
  * If the write is still in progress and wait is FALSE, ERROR_IO_INCOMPLETE
  * will be returned.
  *
+ * ERROR_INVALID_PARAMETER is returned if no write is pending, or if the
+ * pending write was started using pipe9x_write_initiate_ex().
+ *
  * If any other error occurs, the relevant Win32 error code is returned.
 */
 DWORD pipe9x_write_result(PipeWriteHandle pwh, size_t *data_written_out, BOOL wait);
@@ -219,6 +841,55 @@ DWORD pipe9x_write_result(PipeWriteHandle pwh, size_t *data_written_out, BOOL wa
 */
 BOOL pipe9x_write_pending(PipeWriteHandle pwh);
 
+/**
+ * @brief Free the internal buffer of an idle PipeWriteHandle.
+ *
+ * @param pwh       PipeWriteHandle to release buffer of.
+ * @param quiet_ms  How long since a write was last initiated (in milliseconds).
+ *
+ * @return TRUE if the buffer was released.
+ *
+ * See pipe9x_read_release_idle(). Any pointer previously returned by
+ * pipe9x_write_buffer() is no longer valid once released.
+*/
+BOOL pipe9x_write_release_idle(PipeWriteHandle pwh, DWORD quiet_ms);
+
+/**
+ * @brief Set the size above which written data is copied using non-temporal stores.
+ *
+ * @param threshold  Size in bytes ((size_t)(-1) to disable).
+ *
+ * @return The previous threshold.
+ *
+ * pipe9x_write_initiate() and pipe9x_write_initiate_ex() copy the data into
+ * the internal buffer of the PipeWriteHandle. When the data is at least this
+ * big and the CPU supports SSE2, the copy is done using non-temporal stores
+ * which bypass the CPU cache, so writing large blocks of data doesn't evict
+ * the rest of the program's working set from it.
+ *
+ * The default is 256KiB, or PIPE9X_NT_COPY_THRESHOLD if defined when building
+ * pipe9x.c. This is a process-wide setting.
+*/
+size_t pipe9x_set_nt_copy_threshold(size_t threshold);
+
+/**
+ * @brief Get the internal buffer of a PipeWriteHandle.
+ *
+ * @param pwh       PipeWriteHandle to get buffer of.
+ * @param size_out  Pointer to size_t to receive the size of the buffer (optional).
+ *
+ * @return Pointer to the buffer.
+ *
+ * Data can be placed directly into the buffer returned by this function and
+ * then written by passing the buffer to pipe9x_write_initiate() or
+ * pipe9x_write_initiate_ex(), saving the copy those functions would otherwise
+ * make. The buffer must not be modified while a write is pending.
+ *
+ * The buffer is allocated if it hasn't been yet, NULL is returned if that
+ * fails.
+*/
+void *pipe9x_write_buffer(PipeWriteHandle pwh, size_t *size_out);
+
 /**
  * @brief Get the underlying Windows HANDLE of the pipe.
  *
@@ -238,9 +909,222 @@ HANDLE pipe9x_write_pipe(PipeWriteHandle pwh);
  *
  * The returned handle may be waited on, but must not be manually reset, set or
  * otherwise altered.
+ *
+ * If the handle was created with the PIPE9X_NO_EVENT flag, the event object
+ * is created by the first call to this function. NULL is returned if the
+ * event object could not be created.
 */
 HANDLE pipe9x_write_event(PipeWriteHandle prh);
 
+/**
+ * @brief Get the backend used for I/O on a PipeWriteHandle.
+ *
+ * See pipe9x_read_backend().
+*/
+PipeBackend pipe9x_write_backend(PipeWriteHandle pwh);
+
+/**
+ * @brief Include the data read and written in a trace.
+*/
+#define PIPE9X_TRACE_PAYLOAD 0x00000001
+
+/**
+ * @name Trace file record types
+ * @{
+*/
+#define PIPE9X_TRACE_ATTACH_READ    1  /**< Read handle attached, size is its buffer size. */
+#define PIPE9X_TRACE_ATTACH_WRITE   2  /**< Write handle attached, size is its buffer size. */
+#define PIPE9X_TRACE_READ_INITIATE  3  /**< Read initiated. */
+#define PIPE9X_TRACE_READ_COMPLETE  4  /**< Read completed, size is the bytes read, followed by them with PIPE9X_TRACE_PAYLOAD. */
+#define PIPE9X_TRACE_WRITE_INITIATE 5  /**< Write initiated, size is the bytes to write, followed by them with PIPE9X_TRACE_PAYLOAD. */
+#define PIPE9X_TRACE_WRITE_COMPLETE 6  /**< Write completed, size is the bytes written. */
+#define PIPE9X_TRACE_DETACH         7  /**< Handle detached or closed. */
+/** @} */
+
+/**
+ * @brief Start recording a trace of operations to a file.
+ *
+ * @param trace_out  Receives the PipeTrace object.
+ * @param path       Path of the trace file to create (or replace).
+ * @param flags      Bitwise OR of PIPE9X_TRACE_* flags.
+ *
+ * @return ERROR_SUCCESS, or another win32 error code.
+ *
+ * Operations on handles attached to the trace using pipe9x_read_set_trace()
+ * or pipe9x_write_set_trace() are recorded with their timing and sizes, and
+ * optionally their data, for replaying with pipe9x-replay to benchmark
+ * changes against real traffic.
+ *
+ * Records are buffered in memory and written out in large blocks, so the
+ * cost of recording is a timer read and a few bytes of copying per
+ * operation (plus copying the data when PIPE9X_TRACE_PAYLOAD is used).
+ * A trace may be shared by handles used from different threads.
+ *
+ * The file starts with the 8 characters "P9XTRACE", followed by the format
+ * version (1) and the flags as 32-bit little endian values, and the timer
+ * frequency in ticks per second as a 64-bit little endian value. Each record
+ * is then a PIPE9X_TRACE_* type byte followed by the handle ID, the timer
+ * ticks since the previous record, the error code (ERROR_SUCCESS when the
+ * operation succeeded) and the size, each as an unsigned LEB128 integer,
+ * followed by size bytes of data where noted above. Handle IDs are assigned
+ * when handles are attached, starting from 1.
+*/
+DWORD pipe9x_trace_open(PipeTrace *trace_out, const char *path, DWORD flags);
+
+/**
+ * @brief Finish recording a trace.
+ *
+ * @param trace  PipeTrace object to destroy (may be NULL).
+ *
+ * @return ERROR_SUCCESS, or the first error from writing the trace file.
+ *
+ * Any handles still attached to the trace must be detached or closed first.
+*/
+DWORD pipe9x_trace_close(PipeTrace trace);
+
+/**
+ * @brief Attach a read handle to a trace.
+ *
+ * @param prh    PipeReadHandle to record operations on.
+ * @param trace  PipeTrace to record to, NULL to stop recording.
+ *
+ * Must not be called while an operation is pending on the handle.
+*/
+void pipe9x_read_set_trace(PipeReadHandle prh, PipeTrace trace);
+
+/**
+ * @brief Attach a write handle to a trace.
+ *
+ * @param pwh    PipeWriteHandle to record operations on.
+ * @param trace  PipeTrace to record to, NULL to stop recording.
+ *
+ * Must not be called while an operation is pending on the handle.
+*/
+void pipe9x_write_set_trace(PipeWriteHandle pwh, PipeTrace trace);
+
+/**
+ * @brief Prefix of the name of the shared memory published by pipe9x_metrics_open().
+ *
+ * The process ID is appended in decimal.
+*/
+#define PIPE9X_METRICS_PREFIX "pipe9x-metrics-"
+
+#define PIPE9X_METRICS_MAGIC   0x4D583950  /**< "P9XM" as a little endian value. */
+#define PIPE9X_METRICS_VERSION 1
+
+/**
+ * @brief Header at the start of the shared memory published by pipe9x_metrics_open().
+ *
+ * Followed by num_slots PipeMetricsSlot structures, each slot_size bytes
+ * apart, starting header_size bytes from the start.
+*/
+typedef struct PipeMetricsHeader
+{
+	DWORD magic;        /**< PIPE9X_METRICS_MAGIC. */
+	DWORD version;      /**< PIPE9X_METRICS_VERSION. */
+	DWORD header_size;  /**< Offset of the first slot. */
+	DWORD slot_size;    /**< Distance between slots. */
+	DWORD num_slots;    /**< Number of slots. */
+	DWORD process_id;   /**< Process publishing the metrics. */
+	
+	DWORD reserved[10];
+} PipeMetricsHeader;
+
+/**
+ * @brief Metrics of one handle, published by pipe9x_metrics_open().
+ *
+ * Slots are updated using a sequence lock: sequence is odd while the slot is
+ * being updated, so a reader must read sequence, copy the slot and then read
+ * sequence again, retrying if it was odd or has changed.
+ *
+ * Counters are cumulative over the life of the handle. A slot is reused when
+ * its handle is closed, which a reader can spot from handle_id changing.
+*/
+typedef struct PipeMetricsSlot
+{
+	LONG volatile sequence;  /**< Odd while the slot is being updated. */
+	DWORD handle_id;         /**< Unique ID of the handle, zero if the slot is unused. */
+	DWORD type;              /**< PIPE9X_METRICS_READ or PIPE9X_METRICS_WRITE. */
+	DWORD backend;           /**< PipeBackend of the last operation. */
+	DWORD buf_size;          /**< Size of the handle's buffer. */
+	DWORD pending;           /**< Non-zero while an operation is pending. */
+	DWORD queue_depth;       /**< Bytes accepted by writes but not yet written to the pipe. */
+	DWORD last_error;        /**< Error from the last failed operation. */
+	
+	ULONGLONG ops;       /**< Completed operations. */
+	ULONGLONG bytes;     /**< Bytes read or written. */
+	ULONGLONG errors;    /**< Failed operations, except for reaching the end of the pipe. */
+	ULONGLONG stall_ms;  /**< Total milliseconds operations were pending for. */
+} PipeMetricsSlot;
+
+#define PIPE9X_METRICS_READ  1  /**< PipeMetricsSlot of a PipeReadHandle. */
+#define PIPE9X_METRICS_WRITE 2  /**< PipeMetricsSlot of a PipeWriteHandle. */
+
+/**
+ * @brief Start publishing metrics of handles in shared memory.
+ *
+ * @param num_slots  Maximum number of handles to publish.
+ *
+ * @return ERROR_SUCCESS, or another win32 error code.
+ *
+ * Creates a named shared memory section called PIPE9X_METRICS_PREFIX and the
+ * process ID, which other processes (such as pipe9x-metrics) can map to
+ * sample the metrics of every handle created from here on while they are
+ * open, without any cooperation from this process. Handles created once all
+ * slots are in use aren't published.
+ *
+ * Publishing adds a pair of interlocked increments and a few stores to the
+ * start and the end of each operation, neither of which ever waits.
+ *
+ * Returns ERROR_ALREADY_EXISTS if metrics are already being published.
+*/
+DWORD pipe9x_metrics_open(DWORD num_slots);
+
+/**
+ * @brief Stop publishing metrics of handles.
+ *
+ * Any handles created since pipe9x_metrics_open() must be closed first.
+*/
+void pipe9x_metrics_close(void);
+
+#ifdef PIPE9X_FAULT_INJECTION
+
+/**
+ * @brief Faults to inject into I/O (PIPE9X_FAULT_INJECTION builds only).
+ *
+ * Each probability (0.0 to 1.0) applies to every ReadFile(), WriteFile() or
+ * GetOverlappedResult() call made to perform I/O on a pipe.
+*/
+typedef struct PipeFaultConfig
+{
+	DWORD seed;  /**< Seed for the pseudo-random sequence deciding which calls fail. */
+	
+	double short_read;   /**< Read fewer bytes than the buffer has room for. */
+	double short_write;  /**< Write fewer bytes than requested. */
+	double more_data;    /**< Fail a blocking read with ERROR_MORE_DATA after reading part of the data. */
+	double broken_pipe;  /**< Fail a read or write with ERROR_BROKEN_PIPE without performing it. */
+	
+	double delay;        /**< Sleep before the call... */
+	DWORD max_delay_ms;  /**< ...for up to this long. */
+} PipeFaultConfig;
+
+/**
+ * @brief Set the faults to inject into I/O (PIPE9X_FAULT_INJECTION builds only).
+ *
+ * @param config  Faults to inject, NULL to stop injecting faults.
+ *
+ * Defining PIPE9X_FAULT_INJECTION when building pipe9x.c (and anything using
+ * this function) routes the ReadFile(), WriteFile() and GetOverlappedResult()
+ * calls used for I/O through a layer which injects conditions that are rare
+ * in practice, for testing code which has to cope with them. The pseudo-random
+ * sequence is restarted from the seed by each call to this function.
+ *
+ * This is a process-wide setting.
+*/
+void pipe9x_set_faults(const PipeFaultConfig *config);
+
+#endif
+
 #ifdef __cplusplus
 }
 #endif
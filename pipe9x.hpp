@@ -0,0 +1,435 @@
+/* Pipe9X - Anonymous pipes with overlapped I/O semantics on Windows 9x
+ * Copyright (C) 2024 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS “AS IS”
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * @file pipe9x.hpp
+ *
+ * C++ wrapper for pipe9x.
+ *
+ * The read_pipe and write_pipe classes own a PipeReadHandle/PipeWriteHandle
+ * and close it when destroyed. Errors are returned as std::error_code values
+ * in std::system_category(), with the ERROR_IO_PENDING returned by the C API
+ * when an operation is started mapped to success.
+ *
+ * Everything is inline and forwards directly to the C API, nothing is
+ * allocated beyond what it allocates.
+*/
+
+#ifndef PIPE9X_HPP
+#define PIPE9X_HPP
+
+#include <cstddef>
+#include <span>
+#include <system_error>
+
+#include "pipe9x.h"
+
+namespace pipe9x
+{
+	/**
+	 * @brief Convert a win32 error code to a std::error_code.
+	*/
+	inline std::error_code make_error_code(DWORD error) noexcept
+	{
+		return std::error_code((int)(error), std::system_category());
+	}
+	
+	/**
+	 * @brief Result of a read operation.
+	*/
+	struct read_result
+	{
+		std::error_code error;       /**< Error from the operation, if any. */
+		std::span<std::byte> data;   /**< Read data (empty on error). */
+	};
+	
+	/**
+	 * @brief Result of a write operation.
+	*/
+	struct write_result
+	{
+		std::error_code error;  /**< Error from the operation, if any. */
+		size_t data_written;    /**< Number of bytes written (zero on error). */
+	};
+	
+	/**
+	 * @brief Owning wrapper around a PipeReadHandle.
+	*/
+	class read_pipe
+	{
+		private:
+			PipeReadHandle prh;
+		
+		public:
+			read_pipe() noexcept: prh(NULL) {}
+			
+			/**
+			 * @brief Take ownership of a PipeReadHandle.
+			*/
+			explicit read_pipe(PipeReadHandle prh) noexcept: prh(prh) {}
+			
+			read_pipe(read_pipe &&src) noexcept: prh(src.prh)
+			{
+				src.prh = NULL;
+			}
+			
+			read_pipe &operator=(read_pipe &&src) noexcept
+			{
+				if(this != &src)
+				{
+					reset(src.prh);
+					src.prh = NULL;
+				}
+				
+				return *this;
+			}
+			
+			read_pipe(const read_pipe&) = delete;
+			read_pipe &operator=(const read_pipe&) = delete;
+			
+			~read_pipe()
+			{
+				pipe9x_read_close(prh);
+			}
+			
+			/**
+			 * @brief Get the underlying PipeReadHandle.
+			*/
+			PipeReadHandle get() const noexcept
+			{
+				return prh;
+			}
+			
+			/**
+			 * @brief Give up ownership of the PipeReadHandle without closing it.
+			*/
+			PipeReadHandle release() noexcept
+			{
+				PipeReadHandle released = prh;
+				prh = NULL;
+				
+				return released;
+			}
+			
+			/**
+			 * @brief Close the PipeReadHandle and (optionally) take ownership of another.
+			*/
+			void reset(PipeReadHandle new_prh = NULL) noexcept
+			{
+				PipeReadHandle old_prh = prh;
+				prh = new_prh;
+				
+				pipe9x_read_close(old_prh);
+			}
+			
+			explicit operator bool() const noexcept
+			{
+				return prh != NULL;
+			}
+			
+			/**
+			 * @brief Start a read in the background, see pipe9x_read_initiate().
+			*/
+			std::error_code initiate() noexcept
+			{
+				DWORD error = pipe9x_read_initiate(prh);
+				return make_error_code(error == ERROR_IO_PENDING ? ERROR_SUCCESS : error);
+			}
+			
+			/**
+			 * @brief Get the result from a read operation, see pipe9x_read_result().
+			 *
+			 * The returned span points into the internal buffer of the
+			 * PipeReadHandle and remains valid until the handle is closed or
+			 * another read is initiated.
+			*/
+			read_result result(bool wait) noexcept
+			{
+				void *data;
+				size_t data_size;
+				
+				DWORD error = pipe9x_read_result(prh, &data, &data_size, wait);
+				if(error != ERROR_SUCCESS)
+				{
+					return read_result{ make_error_code(error), std::span<std::byte>() };
+				}
+				
+				return read_result{ std::error_code(), std::span<std::byte>((std::byte*)(data), data_size) };
+			}
+			
+			/**
+			 * @brief Check if a read operation is pending, see pipe9x_read_pending().
+			*/
+			bool pending() const noexcept
+			{
+				return pipe9x_read_pending(prh);
+			}
+			
+			/**
+			 * @brief Get the underlying pipe HANDLE, see pipe9x_read_pipe().
+			*/
+			HANDLE pipe() const noexcept
+			{
+				return pipe9x_read_pipe(prh);
+			}
+			
+			/**
+			 * @brief Get the event object, see pipe9x_read_event().
+			*/
+			HANDLE event() const noexcept
+			{
+				return pipe9x_read_event(prh);
+			}
+			
+			/**
+			 * @brief Get the backend in use, see pipe9x_read_backend().
+			*/
+			PipeBackend backend() const noexcept
+			{
+				return pipe9x_read_backend(prh);
+			}
+	};
+	
+	/**
+	 * @brief Owning wrapper around a PipeWriteHandle.
+	*/
+	class write_pipe
+	{
+		private:
+			PipeWriteHandle pwh;
+		
+		public:
+			write_pipe() noexcept: pwh(NULL) {}
+			
+			/**
+			 * @brief Take ownership of a PipeWriteHandle.
+			*/
+			explicit write_pipe(PipeWriteHandle pwh) noexcept: pwh(pwh) {}
+			
+			write_pipe(write_pipe &&src) noexcept: pwh(src.pwh)
+			{
+				src.pwh = NULL;
+			}
+			
+			write_pipe &operator=(write_pipe &&src) noexcept
+			{
+				if(this != &src)
+				{
+					reset(src.pwh);
+					src.pwh = NULL;
+				}
+				
+				return *this;
+			}
+			
+			write_pipe(const write_pipe&) = delete;
+			write_pipe &operator=(const write_pipe&) = delete;
+			
+			~write_pipe()
+			{
+				pipe9x_write_close(pwh);
+			}
+			
+			/**
+			 * @brief Get the underlying PipeWriteHandle.
+			*/
+			PipeWriteHandle get() const noexcept
+			{
+				return pwh;
+			}
+			
+			/**
+			 * @brief Give up ownership of the PipeWriteHandle without closing it.
+			*/
+			PipeWriteHandle release() noexcept
+			{
+				PipeWriteHandle released = pwh;
+				pwh = NULL;
+				
+				return released;
+			}
+			
+			/**
+			 * @brief Close the PipeWriteHandle and (optionally) take ownership of another.
+			*/
+			void reset(PipeWriteHandle new_pwh = NULL) noexcept
+			{
+				PipeWriteHandle old_pwh = pwh;
+				pwh = new_pwh;
+				
+				pipe9x_write_close(old_pwh);
+			}
+			
+			explicit operator bool() const noexcept
+			{
+				return pwh != NULL;
+			}
+			
+			/**
+			 * @brief Start a write in the background, see pipe9x_write_initiate().
+			*/
+			std::error_code initiate(std::span<const std::byte> data) noexcept
+			{
+				DWORD error = pipe9x_write_initiate(pwh, data.data(), data.size());
+				return make_error_code(error == ERROR_IO_PENDING ? ERROR_SUCCESS : error);
+			}
+			
+			/**
+			 * @brief Start a write in the background, see pipe9x_write_initiate().
+			*/
+			std::error_code initiate(const void *data, size_t data_size) noexcept
+			{
+				DWORD error = pipe9x_write_initiate(pwh, data, data_size);
+				return make_error_code(error == ERROR_IO_PENDING ? ERROR_SUCCESS : error);
+			}
+			
+			/**
+			 * @brief Get the result from a write operation, see pipe9x_write_result().
+			*/
+			write_result result(bool wait) noexcept
+			{
+				size_t data_written;
+				
+				DWORD error = pipe9x_write_result(pwh, &data_written, wait);
+				if(error != ERROR_SUCCESS)
+				{
+					return write_result{ make_error_code(error), 0 };
+				}
+				
+				return write_result{ std::error_code(), data_written };
+			}
+			
+			/**
+			 * @brief Check if a write operation is pending, see pipe9x_write_pending().
+			*/
+			bool pending() const noexcept
+			{
+				return pipe9x_write_pending(pwh);
+			}
+			
+			/**
+			 * @brief Get the underlying pipe HANDLE, see pipe9x_write_pipe().
+			*/
+			HANDLE pipe() const noexcept
+			{
+				return pipe9x_write_pipe(pwh);
+			}
+			
+			/**
+			 * @brief Get the event object, see pipe9x_write_event().
+			*/
+			HANDLE event() const noexcept
+			{
+				return pipe9x_write_event(pwh);
+			}
+			
+			/**
+			 * @brief Get the backend in use, see pipe9x_write_backend().
+			*/
+			PipeBackend backend() const noexcept
+			{
+				return pipe9x_write_backend(pwh);
+			}
+	};
+	
+	/**
+	 * @brief Create a pipe, see pipe9x_create_ex().
+	 *
+	 * Any handles already owned by read_out or write_out are closed.
+	*/
+	inline std::error_code create(
+		read_pipe &read_out,
+		size_t read_size,
+		bool read_inherit,
+		write_pipe &write_out,
+		size_t write_size,
+		bool write_inherit,
+		const PipeCreateOptions *options = NULL) noexcept
+	{
+		PipeReadHandle prh;
+		PipeWriteHandle pwh;
+		
+		DWORD error = pipe9x_create_ex(&prh, read_size, read_inherit, &pwh, write_size, write_inherit, options);
+		if(error != ERROR_SUCCESS)
+		{
+			return make_error_code(error);
+		}
+		
+		read_out.reset(prh);
+		write_out.reset(pwh);
+		
+		return std::error_code();
+	}
+	
+	/**
+	 * @brief Connect to a named pipe server, see pipe9x_connect().
+	 *
+	 * Either read_out or write_out may be NULL if that direction isn't wanted.
+	 * Any handles already owned by read_out or write_out are closed.
+	*/
+	inline std::error_code connect(
+		const char *pipe_name,
+		DWORD timeout_ms,
+		read_pipe *read_out,
+		size_t read_size,
+		write_pipe *write_out,
+		size_t write_size,
+		bool inherit,
+		PipeConnectStats *stats_out = NULL) noexcept
+	{
+		PipeReadHandle prh;
+		PipeWriteHandle pwh;
+		
+		DWORD error = pipe9x_connect(
+			pipe_name, timeout_ms,
+			(read_out != NULL ? &prh : NULL), read_size,
+			(write_out != NULL ? &pwh : NULL), write_size,
+			inherit, stats_out);
+		
+		if(error != ERROR_SUCCESS)
+		{
+			return make_error_code(error);
+		}
+		
+		if(read_out != NULL)
+		{
+			read_out->reset(prh);
+		}
+		
+		if(write_out != NULL)
+		{
+			write_out->reset(pwh);
+		}
+		
+		return std::error_code();
+	}
+}
+
+#endif /* !PIPE9X_HPP */